@@ -0,0 +1,2414 @@
+//
+// Thermal_Printer Linux host benchmark
+// Renders and encodes typical print jobs into a capture transport
+// to measure the encoder throughput and the bytes sent to the printer
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <malloc.h>
+#define PROGMEM
+#include "Thermal_Printer.h"
+#include "tp_capture.h"
+#include "tp_blesim.h"
+#include "tp_tcp.h"
+#include "tp_serial.h"
+#include "tp_loop.h"
+#include "tp_spool.h"
+#include "tp_shm.h"
+#include "tp_advsim.h"
+#include "../examples/custom_font/FreeSerif12pt7b.h"
+
+static uint8_t ucBackBuffer[72 * 1024]; // 576 x 1024 pixels
+static TP_CAPTURE cap;
+static const char *szTypes[PRINTER_COUNT] = {"MTP2", "MTP3", "CAT", "PERIPAGEPLUS", "PERIPAGE", "FOMEMO"};
+
+static long long MicroTime(void)
+{
+struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+} /* MicroTime() */
+//
+// Draw a 'photo' into the back buffer (dense pattern + some lines and text)
+//
+static void DrawPage(int iWidth, int iHeight)
+{
+int x, y;
+
+   tpSetBackBuffer(ucBackBuffer, iWidth, iHeight);
+   tpFill(0);
+   for (y=0; y<iHeight/2; y++) { // dithered gradient
+      for (x=0; x<iWidth; x++) {
+         if (((x * 7 + y * 13) & 0xff) < (x * 256 / iWidth))
+            tpSetPixel(x, y, 1);
+      }
+   }
+   for (x=0; x<iWidth; x+=16)
+      tpDrawLine(x, iHeight/2, iWidth-1-x, iHeight-1, 1);
+   tpDrawText(0, iHeight-40, (char *)"Thermal_Printer host build", FONT_LARGE, 0);
+} /* DrawPage() */
+
+static void Receipt(void)
+{
+int i;
+char szTemp[64];
+
+   tpAlign(ALIGN_CENTER);
+   tpSetFont(FONT_12x24, 0, 1, 1, 1);
+   tpPrintLine((char *)"BITBANK CAFE");
+   tpSetFont(FONT_9x17, 0, 0, 0, 0);
+   tpAlign(ALIGN_LEFT);
+   for (i=0; i<12; i++) {
+      sprintf(szTemp, "Item %02d                  %3d.%02d", i, i * 3, (i * 17) % 100);
+      tpPrintLine(szTemp);
+   }
+   tpPrintCustomText((GFXfont *)&FreeSerif12pt7b, 0, (char *)"Total: 123.45");
+   tpAlign(ALIGN_CENTER);
+   tpQRCode((char *)"https://bitbanksoftware.com");
+   tp1DBarcode(BARCODE_CODE128, 64, (char *)"123456789", BARCODE_TEXT_BELOW);
+   tpFeed(32);
+} /* Receipt() */
+
+static void RunTest(const char *szName, void (*pfnTest)(void), int iCount)
+{
+long long llStart, llTime;
+int i;
+
+   tpCaptureReset(&cap);
+   llStart = MicroTime();
+   for (i=0; i<iCount; i++)
+      (*pfnTest)();
+   tpFlush();
+   llTime = MicroTime() - llStart;
+   if (llTime == 0) llTime = 1;
+   printf("%-12s %6d runs, %8.1f us/run, %8.2f MB/s encoded\n", szName, iCount,
+          (double)llTime / iCount, (double)cap.llBytes / (double)llTime);
+   tpCapturePrintStats(&cap, "  wire");
+} /* RunTest() */
+
+static void TestBuffer(void) { tpPrintBuffer(); }
+static void TestBufferSide(void) { tpPrintBufferSide(); }
+static void TestCustomText(void)
+{
+   tpPrintCustomText((GFXfont *)&FreeSerif12pt7b, 0, (char *)"The quick brown fox jumps over the lazy dog");
+}
+static void TestFeed(void) { tpFeed(100); }
+
+//
+// Print a short raster job with the model pacing into a simulated printer
+// which consumes the scanlines at iLinesPerSec (0 = the model speed)
+// returns 0 if the printer's buffer never overflowed
+//
+static int TestPacing(int iLinesPerSec, int bFlow, int iBand)
+{
+TP_PACING pacing;
+long long llStart, llTime;
+int iPitch = (tpGetWidth() + 7) >> 3;
+int iLines = 240, iOK;
+
+   if (tpGetName() != NULL && strcmp(tpGetName(), "CAT") == 0)
+      iPitch += 8; // each scanline is wrapped in a command
+   tpSetPacing(NULL); // model defaults
+   tpGetPacing(&pacing);
+   if (iLinesPerSec == 0)
+      iLinesPerSec = pacing.iLinesPerSec;
+   printf("Pacing: %d bytes/s, %d lines/s, %d byte buffer; printer drains %d lines/s\n",
+          pacing.iBytesPerSec, pacing.iLinesPerSec, pacing.iBufferBytes, iLinesPerSec);
+   tpCaptureSetDrain(&cap, pacing.iBufferBytes, iLinesPerSec * iPitch);
+   tpCaptureSetFlowControl(&cap, bFlow);
+   tpCaptureSetStatus(&cap, iBand > 0);
+   tpSetStatusFlowControl(iBand);
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), iLines);
+   llStart = MicroTime();
+   tpPrintBuffer();
+   tpFlush();
+   llTime = MicroTime() - llStart;
+   printf("%-12s %d lines in %.1f ms (%.1f lines/s)\n", "Paced", iLines, llTime / 1000.0,
+          iLines * 1000000.0 / llTime);
+   tpCapturePrintStats(&cap, "  wire");
+   iOK = (cap.llSimOverflow == 0);
+   printf("%-12s %lld bytes didn't fit in the printer: %s\n", "Overflow", cap.llSimOverflow, iOK ? "OK" : "FAILED");
+   tpCaptureSetDrain(&cap, 0, 0);
+   tpCaptureSetFlowControl(&cap, 0);
+   tpCaptureSetStatus(&cap, 0);
+   tpSetStatusFlowControl(0);
+   return iOK ? 0 : -1;
+} /* TestPacing() */
+
+//
+// Print a long receipt (iMetres of paper at 8 lines/mm) with the model
+// pacing into a simulated printer on a virtual clock. The job runs as fast
+// as it can be encoded and the virtual clock shows how long it would keep
+// a real printer busy
+// returns 0 if the printer's buffer never overflowed
+//
+static int TestVirtual(int iMetres, int iLinesPerSec, int bFlow, int iBand)
+{
+TP_VCLOCK vclock;
+TP_PACING pacing;
+long long llStart, llTime, llVStart, llVTime, llDone;
+int iPitch = (tpGetWidth() + 7) >> 3;
+int iLines, iTotal = iMetres * 1000 * 8, iPage = 1024, iOK;
+
+   if (tpGetName() != NULL && strcmp(tpGetName(), "CAT") == 0)
+      iPitch += 8; // each scanline is wrapped in a command
+   tpVClockInit(&vclock);
+   tpCaptureSetClock(&cap, &vclock);
+   tpSetClock(&vclock.clock);
+   tpSetPacing(NULL); // model defaults
+   tpGetPacing(&pacing);
+   if (iLinesPerSec <= 0)
+      iLinesPerSec = pacing.iLinesPerSec;
+   printf("Virtual clock: %d m receipt (%d lines), %d lines/s pacing, printer drains %d lines/s\n",
+          iMetres, iTotal, pacing.iLinesPerSec, iLinesPerSec);
+   tpCaptureSetDrain(&cap, pacing.iBufferBytes, iLinesPerSec * iPitch);
+   tpCaptureSetFlowControl(&cap, bFlow);
+   tpCaptureSetStatus(&cap, iBand > 0);
+   tpSetStatusFlowControl(iBand);
+   llStart = MicroTime();
+   llVStart = tpVClockNow(&vclock);
+   for (iLines=0; iLines<iTotal; iLines+=iPage) {
+      tpSetBackBuffer(ucBackBuffer, tpGetWidth(), (iTotal - iLines < iPage) ? iTotal - iLines : iPage);
+      tpPrintBuffer();
+   }
+   tpFlush();
+   llTime = MicroTime() - llStart;
+   llVTime = tpVClockNow(&vclock) - llVStart;
+   // the printer is done once it has drained what it had after the last write
+   llDone = cap.llSimLast - llVStart + (long long)(cap.dSimFill * 1000000.0 / (iLinesPerSec * iPitch));
+   if (llTime == 0) llTime = 1;
+   printf("%-12s sent in %.1f s, printed in %.1f s (%.1f lines/s); ran in %.1f ms (%.0fx), %lld waits\n", "Virtual",
+          llVTime / 1000000.0, llDone / 1000000.0, iTotal * 1000000.0 / llDone, llTime / 1000.0,
+          (double)llDone / (double)llTime, vclock.llWaits);
+   tpCapturePrintStats(&cap, "  wire");
+   iOK = (cap.llSimOverflow == 0);
+   printf("%-12s %lld bytes didn't fit in the printer: %s\n", "Overflow", cap.llSimOverflow, iOK ? "OK" : "FAILED");
+   tpCaptureSetDrain(&cap, 0, 0);
+   tpCaptureSetFlowControl(&cap, 0);
+   tpCaptureSetStatus(&cap, 0);
+   tpSetStatusFlowControl(0);
+   tpSetClock(NULL);
+   tpCaptureSetClock(&cap, NULL);
+   return iOK ? 0 : -1;
+} /* TestVirtual() */
+
+//
+// Send the test page and the receipt through the BLE link and printer
+// simulator with a few packet sizes, with and without the model pacing,
+// and report what the printer achieves
+//
+static TP_BLESIM blesim;
+static void TestBleSim(int iType, int iInterval, int iMTU, int iLoss, int iQueue, int bFlow, int iBand)
+{
+TP_VCLOCK vclock;
+TP_BLESIM_CONFIG config;
+TP_PACING pacing, nopacing = {0, 0, 0};
+static const int iSizes[] = {20, 64, 0};
+int iSize, iJob, bPaced, iWidth;
+char szLabel[64];
+
+   tpSetPacing(NULL); // model defaults
+   tpGetPacing(&pacing);
+   tpBleSimDefaults(&config, iType, pacing.iLinesPerSec, pacing.iBufferBytes);
+   config.iConnInterval = iInterval;
+   if (iMTU > 0) config.iMTU = iMTU;
+   if (iQueue > 0) config.iQueueDepth = iQueue;
+   config.iLossPercent = iLoss;
+   config.bFlowControl = bFlow;
+   printf("BLE sim: interval %.2f ms, MTU %d, %d packets/event, queue %d, loss %d%%, printer buffer %d, %d-%d us/line\n",
+          config.iConnInterval / 1000.0, config.iMTU, config.iPacketsPerEvent, config.iQueueDepth,
+          config.iLossPercent, config.iBufferSize, config.iBlankLineMicros, config.iBlackLineMicros);
+   for (iJob=0; iJob<2; iJob++) {
+      for (bPaced=1; bPaced>=0; bPaced--) {
+         for (iSize=0; iSize<(int)(sizeof(iSizes)/sizeof(int)); iSize++) {
+            if (iSizes[iSize] != 0 && iSizes[iSize] >= config.iMTU - 3)
+               continue; // same as the largest
+            tpVClockInit(&vclock);
+            tpSetClock(&vclock.clock);
+            tpBleSimInit(&blesim, &vclock, &config);
+            tpSetTransport(&blesim.transport, iType, szTypes[iType]);
+            tpSetMaxPacketSize(iSizes[iSize]);
+            tpSetPacing(bPaced ? NULL : &nopacing);
+            tpSetStatusFlowControl(iBand);
+            iWidth = tpGetWidth();
+            if (iJob == 0) {
+               DrawPage(iWidth, 1024);
+               tpPrintBuffer();
+            } else {
+               Receipt();
+            }
+            tpFlush();
+            tpBleSimFinish(&blesim);
+            sprintf(szLabel, "%-7s %3d byte packets, %s", iJob ? "Receipt" : "Page", tpGetPacketSize(),
+                    bPaced ? "paced" : "not paced");
+            tpBleSimPrintStats(&blesim, szLabel);
+            tpDisconnect();
+            tpSetClock(NULL);
+         }
+      }
+   }
+   tpSetMaxPacketSize(0);
+   tpSetStatusFlowControl(0);
+} /* TestBleSim() */
+
+//
+// A local listener standing in for a network printer; it records the stream
+//
+typedef struct tagLISTENER
+{
+  int fd;
+  uint8_t *pBuf;
+  int iSize, iLen;
+} LISTENER;
+
+static int ListenerOpen(LISTENER *pL, int iPort)
+{
+struct sockaddr_in addr;
+socklen_t len = sizeof(addr);
+int i = 1;
+
+   pL->iLen = 0;
+   pL->fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (pL->fd < 0)
+      return -1;
+   setsockopt(pL->fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = htons(iPort);
+   if (bind(pL->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(pL->fd, 1) < 0 ||
+       getsockname(pL->fd, (struct sockaddr *)&addr, &len) < 0) {
+      close(pL->fd);
+      return -1;
+   }
+   return ntohs(addr.sin_port);
+} /* ListenerOpen() */
+
+static void * ListenerThread(void *pArg)
+{
+LISTENER *pL = (LISTENER *)pArg;
+uint8_t ucTemp[4096];
+int fd, i;
+
+   fd = accept(pL->fd, NULL, NULL);
+   close(pL->fd);
+   if (fd < 0)
+      return NULL;
+   while ((i = (int)recv(fd, ucTemp, sizeof(ucTemp), 0)) > 0) {
+      if (pL->iLen + i > pL->iSize)
+         i = pL->iSize - pL->iLen; // keep what fits
+      memcpy(&pL->pBuf[pL->iLen], ucTemp, i);
+      pL->iLen += i;
+   }
+   close(fd);
+   return NULL;
+} /* ListenerThread() */
+
+static void TcpJobs(int iCount)
+{
+int i;
+
+   for (i=0; i<iCount; i++) {
+      tpSetBackBuffer(ucBackBuffer, tpGetWidth(), 1024);
+      tpPrintBuffer();
+      Receipt();
+   }
+   tpFlush();
+} /* TcpJobs() */
+//
+// Send the test page and the receipt over TCP to a local listener
+// with each batching mode and check that it records the same stream
+// as the capture transport
+//
+static int TestTcp(int iType, int iPort, int iCount)
+{
+static const struct { const char *szName; int bNoDelay, iWindow; } modes[] = {
+   {"Nagle", 0, 0}, {"NoDelay", 1, 0}, {"NoDelay+win", 1, 16384}};
+TP_PACING nopacing = {0, 0, 0};
+LISTENER listener;
+TP_TCP tcp;
+pthread_t tid;
+uint8_t *pRef;
+int i, iRefLen, iSize = 16 * 1024 * 1024, iErrors = 0;
+long long llTime;
+
+   pRef = (uint8_t *)malloc(iSize);
+   listener.pBuf = (uint8_t *)malloc(iSize);
+   listener.iSize = iSize;
+   cap.pBuf = pRef; cap.iBufSize = iSize; // the expected stream
+   tpSetPacing(&nopacing);
+   tpCaptureReset(&cap);
+   TcpJobs(iCount);
+   iRefLen = cap.iBufLen;
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   for (i=0; i<(int)(sizeof(modes)/sizeof(modes[0])); i++) {
+      iPort = ListenerOpen(&listener, iPort);
+      if (iPort < 0) {
+         printf("Error opening the listener\n");
+         iErrors++;
+         break;
+      }
+      pthread_create(&tid, NULL, ListenerThread, &listener);
+      tpTcpInit(&tcp);
+      tpTcpSetNoDelay(&tcp, modes[i].bNoDelay);
+      tpTcpSetWindow(&tcp, modes[i].iWindow);
+      if (!tpTcpOpen(&tcp, "127.0.0.1", iPort)) {
+         printf("Error connecting to port %d\n", iPort);
+         close(listener.fd);
+         pthread_cancel(tid);
+         pthread_join(tid, NULL);
+         iErrors++;
+         break;
+      }
+      tpSetTransport(&tcp.transport, iType, szTypes[iType]); // not paced (TCP flow control)
+      llTime = MicroTime();
+      TcpJobs(iCount);
+      llTime = MicroTime() - llTime;
+      tpDisconnect();
+      tpTcpClose(&tcp);
+      pthread_join(tid, NULL);
+      if (llTime == 0) llTime = 1;
+      if (listener.iLen != iRefLen || memcmp(listener.pBuf, pRef, iRefLen) != 0)
+         iErrors++;
+      printf("%-12s %d jobs in %.1f ms, %.2f MB/s, port %d received %d of %d bytes: %s\n", modes[i].szName, iCount * 2,
+             llTime / 1000.0, (double)tcp.llBytes / (double)llTime, iPort, listener.iLen, iRefLen,
+             (listener.iLen == iRefLen && memcmp(listener.pBuf, pRef, iRefLen) == 0) ? "same" : "DIFFERENT");
+      tpTcpPrintStats(&tcp, "  tcp");
+   }
+   tpSetTransport(&cap.transport, iType, szTypes[iType]);
+   free(pRef);
+   free(listener.pBuf);
+   return iErrors;
+} /* TestTcp() */
+//
+// Many loopback printers served by one thread; connection i on
+// listener i counts its bytes in llBytes[i]
+//
+typedef struct tagSINK
+{
+  int epfd, iCount, iClosed;
+  int fdListen[TP_LOOP_MAX];
+  long long llBytes[TP_LOOP_MAX];
+} SINK;
+static SINK sink;
+static TP_LOOP_PRINTER loopPrinters[TP_LOOP_MAX];
+
+static void * SinkThread(void *pArg)
+{
+SINK *pS = (SINK *)pArg;
+struct epoll_event ev, events[64];
+uint8_t ucTemp[65536];
+int i, j, n, fd, iIdle = 0;
+
+   while (pS->iClosed < pS->iCount && iIdle < 20) {
+      n = epoll_wait(pS->epfd, events, 64, 100);
+      iIdle = (n == 0) ? iIdle + 1 : 0; // give up on printers which never connect
+      for (i=0; i<n; i++) {
+         j = (int)events[i].data.u64;
+         if (j < TP_LOOP_MAX) { // a listener
+            fd = accept4(pS->fdListen[j], NULL, NULL, SOCK_NONBLOCK);
+            close(pS->fdListen[j]);
+            if (fd < 0) {
+               pS->iClosed++;
+               continue;
+            }
+            ev.events = EPOLLIN;
+            ev.data.u64 = j + TP_LOOP_MAX;
+            epoll_ctl(pS->epfd, EPOLL_CTL_ADD, fd, &ev);
+            pS->fdListen[j] = fd;
+            continue;
+         }
+         j -= TP_LOOP_MAX;
+         while ((fd = (int)recv(pS->fdListen[j], ucTemp, sizeof(ucTemp), 0)) > 0)
+            pS->llBytes[j] += fd;
+         if (fd == 0) {
+            close(pS->fdListen[j]);
+            pS->iClosed++;
+         }
+      }
+   }
+   return NULL;
+} /* SinkThread() */
+
+static int SinkOpen(SINK *pS, int iCount, int *pPorts)
+{
+struct epoll_event ev;
+LISTENER l;
+int i;
+
+   pS->epfd = epoll_create1(0);
+   pS->iCount = iCount;
+   pS->iClosed = 0;
+   for (i=0; i<iCount; i++) {
+      pS->llBytes[i] = 0;
+      pPorts[i] = ListenerOpen(&l, 0);
+      if (pPorts[i] < 0)
+         return 0;
+      pS->fdListen[i] = l.fd;
+      ev.events = EPOLLIN;
+      ev.data.u64 = i;
+      epoll_ctl(pS->epfd, EPOLL_CTL_ADD, l.fd, &ev);
+   }
+   return 1;
+} /* SinkOpen() */
+
+static long long ThreadCPU(void)
+{
+struct rusage ru;
+   getrusage(RUSAGE_THREAD, &ru);
+   return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+} /* ThreadCPU() */
+//
+// Send iJobs copies of a job to iCount loopback printers from this
+// thread, each paced at iRate bytes/s (0 = not paced)
+// returns the number of printers which didn't receive all of the data
+//
+static int LoopRun(const char *szName, int iCount, uint8_t *pJob, int iLen, int iJobs, int iRate)
+{
+static int iPorts[TP_LOOP_MAX];
+TP_LOOP loop;
+pthread_t tid;
+long long llStart, llTime, llCPU, llBytes = 0, llLate = 0, llIdeal;
+int i, j, iErrors = 0, iLow = 100, iHigh = 0, bSampled = 0;
+
+   if (!SinkOpen(&sink, iCount, iPorts) || !tpLoopInit(&loop)) {
+      printf("Error opening %d listeners\n", iCount);
+      return iCount;
+   }
+   pthread_create(&tid, NULL, SinkThread, &sink);
+   llStart = MicroTime();
+   llCPU = ThreadCPU();
+   for (i=0; i<iCount; i++) {
+      if (!tpLoopAddPrinter(&loop, &loopPrinters[i], "127.0.0.1", iPorts[i]))
+         continue;
+      tpLoopSetPacing(&loopPrinters[i], iRate, 1024);
+      for (j=0; j<iJobs; j++)
+         tpLoopQueue(&loop, &loopPrinters[i], pJob, iLen, NULL);
+   }
+   llIdeal = (iRate > 0) ? (((long long)iLen * iJobs - 1024) * 1000000LL) / iRate : 0;
+   while (tpLoopRun(&loop, 1000) > 0) {
+      if (iRate > 0 && !bSampled && MicroTime() - llStart >= llIdeal / 2) { // progress half way
+         bSampled = 1;
+         for (i=0; i<iCount; i++) {
+            j = tpLoopProgress(&loopPrinters[i]);
+            if (j < iLow) iLow = j;
+            if (j > iHigh) iHigh = j;
+         }
+      }
+   }
+   llTime = MicroTime() - llStart;
+   llCPU = ThreadCPU() - llCPU;
+   for (i=0; i<iCount; i++) {
+      llBytes += loopPrinters[i].llSent;
+      if (loopPrinters[i].llLastJob - llStart - llIdeal > llLate)
+         llLate = loopPrinters[i].llLastJob - llStart - llIdeal;
+   }
+   tpLoopPrintStats(&loop, "  loop");
+   tpLoopFree(&loop);
+   pthread_join(tid, NULL);
+   close(sink.epfd);
+   for (i=0; i<iCount; i++) {
+      if (sink.llBytes[i] != (long long)iLen * iJobs)
+         iErrors++;
+   }
+   if (llTime == 0) llTime = 1;
+   if (iRate > 0)
+      printf("%-8s %4d printers at %d bytes/s: %.1f ms (ideal %.1f), latest +%.1f ms, half way %d-%d%%, loop CPU %.1f%% (~%lld printers/core)%s\n",
+             szName, iCount, iRate, llTime / 1000.0, llIdeal / 1000.0, llLate / 1000.0, iLow, iHigh,
+             (llCPU * 100.0) / llTime, llCPU ? (iCount * llTime) / llCPU : 0LL, iErrors ? ", DATA LOST" : "");
+   else
+      printf("%-8s %4d printers x %d jobs: %lld bytes in %.1f ms, %.2f MB/s, loop CPU %.1f%%%s\n",
+             szName, iCount, iJobs, llBytes, llTime / 1000.0, (double)llBytes / (double)llTime,
+             (llCPU * 100.0) / llTime, iErrors ? ", DATA LOST" : "");
+   return iErrors;
+} /* LoopRun() */
+//
+// Drive up to iPrinters loopback printers from one thread: as fast as
+// they take the data, then paced at the model's print speed with more
+// and more printers to see how many one core keeps busy
+//
+static int TestLoop(int iType, int iPrinters)
+{
+static const int iCounts[] = {1, 16, 64, 256, 1024};
+TP_PACING pacing, nopacing = {0, 0, 0};
+uint8_t *pJob, *pImage;
+int i, iJobLen, iImageLen, iRate, iErrors = 0, iSize = 1024 * 1024;
+
+   if (iPrinters > TP_LOOP_MAX) iPrinters = TP_LOOP_MAX;
+   pJob = (uint8_t *)malloc(iSize);
+   pImage = (uint8_t *)malloc(iSize);
+   tpSetPacing(NULL);
+   tpGetPacing(&pacing);
+   iRate = pacing.iLinesPerSec * (((tpGetWidth() + 7) >> 3) + ((iType == PRINTER_CAT) ? 8 : 0));
+   tpSetPacing(&nopacing);
+   cap.pBuf = pJob; cap.iBufSize = iSize; // the page and the receipt
+   tpCaptureReset(&cap);
+   TcpJobs(1);
+   iJobLen = cap.iBufLen;
+   cap.pBuf = pImage; // a short image for the paced runs
+   tpCaptureReset(&cap);
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), 256);
+   tpPrintBuffer();
+   tpFlush();
+   iImageLen = cap.iBufLen;
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   iErrors += LoopRun("unpaced", iPrinters, pJob, iJobLen, 8, 0);
+   for (i=0; i<(int)(sizeof(iCounts)/sizeof(iCounts[0])) && iCounts[i] < iPrinters; i++)
+      iErrors += LoopRun("paced", iCounts[i], pImage, iImageLen, 1, iRate);
+   iErrors += LoopRun("paced", iPrinters, pImage, iImageLen, 1, iRate);
+   free(pJob);
+   free(pImage);
+   return iErrors;
+} /* TestLoop() */
+//
+// Spooler test: clients on several threads submit jobs for two capture
+// printers while another client dies in the middle of a job
+//
+typedef struct tagSPOOLJOB
+{
+  int iPrinter, iJob, iJobType;
+} SPOOLJOB;
+static TP_SPOOL spool;
+static TP_CAPTURE spoolCaps[2];
+static const char *szSpoolPrinters[2] = {"front", "back"};
+static char szSpoolSocket[80];
+static uint8_t *pSpoolData[TP_SPOOL_TYPES];
+static int iSpoolLen[TP_SPOOL_TYPES];
+static SPOOLJOB spoolJobs[4096];
+static int iSpoolJobs, iSpoolRefused;
+static long long llSpoolLatency, llSpoolWorst;
+static pthread_mutex_t spoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void * SpoolThread(void *pArg)
+{
+   tpSpoolRun((TP_SPOOL *)pArg);
+   return NULL;
+} /* SpoolThread() */
+
+static void SpoolSubmit(int iPrinter, int iJobType)
+{
+static const char *szJobTypes[TP_SPOOL_TYPES] = {"pbm", "text", "qr", "barcode"};
+long long llTime;
+int iJob;
+
+   llTime = MicroTime();
+   iJob = tpSpoolSubmit(szSpoolSocket, szSpoolPrinters[iPrinter], szJobTypes[iJobType], pSpoolData[iJobType], iSpoolLen[iJobType]);
+   llTime = MicroTime() - llTime;
+   pthread_mutex_lock(&spoolMutex);
+   if (iJob < 0) {
+      iSpoolRefused++;
+   } else if (iSpoolJobs < (int)(sizeof(spoolJobs)/sizeof(spoolJobs[0]))) {
+      spoolJobs[iSpoolJobs].iPrinter = iPrinter;
+      spoolJobs[iSpoolJobs].iJob = iJob;
+      spoolJobs[iSpoolJobs++].iJobType = iJobType;
+   }
+   llSpoolLatency += llTime;
+   if (llTime > llSpoolWorst) llSpoolWorst = llTime;
+   pthread_mutex_unlock(&spoolMutex);
+} /* SpoolSubmit() */
+
+static void * SpoolClientThread(void *pArg)
+{
+int i, iClient = (int)(intptr_t)pArg;
+
+   for (i=0; i<16; i++)
+      SpoolSubmit((iClient + i) & 1, (iClient + (i >> 1)) % TP_SPOOL_TYPES);
+   return NULL;
+} /* SpoolClientThread() */
+//
+// A client which sends half of a job and exits
+//
+static void SpoolCrashClient(void)
+{
+struct sockaddr_un addr;
+char szTemp[64];
+int fd;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, szSpoolSocket);
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      if (fd >= 0) close(fd);
+      return;
+   }
+   sprintf(szTemp, "JOB front pbm %d\n", iSpoolLen[TP_SPOOL_PBM]);
+   if (write(fd, szTemp, strlen(szTemp)) > 0 && write(fd, pSpoolData[TP_SPOOL_PBM], iSpoolLen[TP_SPOOL_PBM] / 2) > 0)
+      usleep(1000);
+   close(fd);
+} /* SpoolCrashClient() */
+
+static int SpoolCompareJobs(const void *p1, const void *p2)
+{
+   return ((const SPOOLJOB *)p1)->iJob - ((const SPOOLJOB *)p2)->iJob;
+} /* SpoolCompareJobs() */
+//
+// Print the jobs each printer was sent, in the order they were spooled,
+// and compare with what the printers received
+//
+static int SpoolCheck(int *pTypes, uint8_t *pRef, int iRefSize)
+{
+TP_CAPTURE ref;
+int i, iPrinter, iErrors = 0;
+
+   qsort(spoolJobs, iSpoolJobs, sizeof(SPOOLJOB), SpoolCompareJobs);
+   for (iPrinter=0; iPrinter<2; iPrinter++) {
+      tpCaptureInit(&ref, -1, pRef, iRefSize);
+      ref.transport.iFlags |= TP_TRANSPORT_NO_PACING;
+      for (i=0; i<iSpoolJobs; i++) {
+         if (spoolJobs[i].iPrinter != iPrinter)
+            continue;
+         tpSetTransport(&ref.transport, pTypes[iPrinter], szSpoolPrinters[iPrinter]);
+         tpSpoolPrintJob(spoolJobs[i].iJobType, pSpoolData[spoolJobs[i].iJobType], iSpoolLen[spoolJobs[i].iJobType]);
+         tpFlush();
+         tpDisconnect();
+      }
+      if (ref.iBufLen != spoolCaps[iPrinter].iBufLen || memcmp(pRef, spoolCaps[iPrinter].pBuf, ref.iBufLen) != 0)
+         iErrors++;
+      printf("  %-6s received %d of %d bytes: %s\n", szSpoolPrinters[iPrinter], spoolCaps[iPrinter].iBufLen, ref.iBufLen,
+             (ref.iBufLen == spoolCaps[iPrinter].iBufLen && memcmp(pRef, spoolCaps[iPrinter].pBuf, ref.iBufLen) == 0) ? "same" : "DIFFERENT");
+   }
+   return iErrors;
+} /* SpoolCheck() */
+
+static int TestSpool(int iType, int iClients)
+{
+static const char *szQR = "https://bitbanksoftware.com";
+static const char *szBarcode = "code128 123456789";
+int iTypes[2] = {iType, (iType == PRINTER_MTP2) ? PRINTER_MTP3 : PRINTER_MTP2};
+char szDir[64], szReply[1024], szText[1024];
+pthread_t tid, tids[64];
+uint8_t *pRef;
+int i, iPitch, iErrors = 0, iSize = 8 * 1024 * 1024, iLen;
+long long llTime;
+
+   sprintf(szDir, "/tmp/tpbench-spool-%d", (int)getpid());
+   sprintf(szSpoolSocket, "%s.sock", szDir);
+   // one job of each kind
+   DrawPage(384, 300);
+   iPitch = 384 / 8;
+   pSpoolData[TP_SPOOL_PBM] = (uint8_t *)malloc(32 + iPitch * 300);
+   iLen = sprintf((char *)pSpoolData[TP_SPOOL_PBM], "P4\n# test page\n384 300\n");
+   memcpy(&pSpoolData[TP_SPOOL_PBM][iLen], ucBackBuffer, iPitch * 300);
+   iSpoolLen[TP_SPOOL_PBM] = iLen + iPitch * 300;
+   iLen = 0;
+   for (i=0; i<12; i++)
+      iLen += sprintf(&szText[iLen], "Item %02d                  %3d.%02d\r\n", i, i * 3, (i * 17) % 100);
+   pSpoolData[TP_SPOOL_TEXT] = (uint8_t *)szText;
+   iSpoolLen[TP_SPOOL_TEXT] = iLen;
+   pSpoolData[TP_SPOOL_QR] = (uint8_t *)szQR;
+   iSpoolLen[TP_SPOOL_QR] = (int)strlen(szQR);
+   pSpoolData[TP_SPOOL_BARCODE] = (uint8_t *)szBarcode;
+   iSpoolLen[TP_SPOOL_BARCODE] = (int)strlen(szBarcode);
+   pRef = (uint8_t *)malloc(iSize);
+   for (i=0; i<2; i++) {
+      tpCaptureInit(&spoolCaps[i], -1, (uint8_t *)malloc(iSize), iSize);
+      spoolCaps[i].transport.iFlags |= TP_TRANSPORT_NO_PACING;
+   }
+   if (iClients > 64) iClients = 64;
+   if (!tpSpoolInit(&spool, szSpoolSocket, szDir) || !tpSpoolAddPrinter(&spool, "front", iTypes[0], &spoolCaps[0].transport) ||
+       !tpSpoolAddPrinter(&spool, "back", iTypes[1], &spoolCaps[1].transport)) {
+      printf("Error creating the spooler in %s\n", szDir);
+      return 1;
+   }
+   pthread_create(&tid, NULL, SpoolThread, &spool);
+   while (!tpSpoolCommand(szSpoolSocket, "STATUS", szReply, sizeof(szReply)))
+      usleep(1000);
+   // many clients at once, one which dies and one which asks for a printer we don't have
+   llTime = MicroTime();
+   for (i=0; i<iClients; i++)
+      pthread_create(&tids[i], NULL, SpoolClientThread, (void *)(intptr_t)i);
+   SpoolCrashClient();
+   if (tpSpoolSubmit(szSpoolSocket, "nobody", "text", (uint8_t *)szText, 10) >= 0)
+      iErrors++;
+   for (i=0; i<iClients; i++)
+      pthread_join(tids[i], NULL);
+   tpSpoolCommand(szSpoolSocket, "WAIT", szReply, sizeof(szReply));
+   llTime = MicroTime() - llTime;
+   printf("Spooler: %d clients submitted %d jobs (%d refused), %.1f us per submission (worst %lld), all printed in %.1f ms\n",
+          iClients, iSpoolJobs, iSpoolRefused, (double)llSpoolLatency / (iSpoolJobs + iSpoolRefused),
+          llSpoolWorst, llTime / 1000.0);
+   tpSpoolCommand(szSpoolSocket, "STATUS", szReply, sizeof(szReply));
+   printf("%s", szReply);
+   if (iSpoolRefused != 0 || spool.llAborted != 1)
+      iErrors++;
+   printf("  a client which died in the middle of a job: %lld abandoned job(s)\n", spool.llAborted);
+   iErrors += SpoolCheck(iTypes, pRef, iSize);
+   // stop the spooler with jobs waiting (the back printer is paced) and start it again
+   spoolCaps[1].transport.iFlags &= ~TP_TRANSPORT_NO_PACING;
+   for (i=0; i<6; i++)
+      SpoolSubmit(1, TP_SPOOL_PBM);
+   tpSpoolCommand(szSpoolSocket, "SHUTDOWN", szReply, sizeof(szReply));
+   pthread_join(tid, NULL);
+   spoolCaps[1].transport.iFlags |= TP_TRANSPORT_NO_PACING;
+   if (!tpSpoolInit(&spool, szSpoolSocket, szDir) || !tpSpoolAddPrinter(&spool, "front", iTypes[0], &spoolCaps[0].transport) ||
+       !tpSpoolAddPrinter(&spool, "back", iTypes[1], &spoolCaps[1].transport)) {
+      printf("Error restarting the spooler\n");
+      return iErrors + 1;
+   }
+   printf("Restarted with %d job(s) left in the spool directory\n", spool.printers[1].iCount);
+   if (spool.printers[1].iCount == 0)
+      iErrors++;
+   pthread_create(&tid, NULL, SpoolThread, &spool);
+   while (!tpSpoolCommand(szSpoolSocket, "WAIT", szReply, sizeof(szReply)))
+      usleep(1000);
+   iErrors += SpoolCheck(iTypes, pRef, iSize);
+   tpSpoolCommand(szSpoolSocket, "SHUTDOWN", szReply, sizeof(szReply));
+   pthread_join(tid, NULL);
+   for (i=0; i<2; i++) {
+      sprintf(szText, "%s/%s", szDir, szSpoolPrinters[i]);
+      rmdir(szText);
+      free(spoolCaps[i].pBuf);
+   }
+   rmdir(szDir);
+   free(pRef);
+   free(pSpoolData[TP_SPOOL_PBM]);
+   tpSetTransport(&cap.transport, iType, szTypes[iType]);
+   return iErrors;
+} /* TestSpool() */
+
+//
+// A printer on the other end of a pseudo-terminal; what's queued in the
+// pty stands in for the sender's UART, which the printer reads at iRate
+// bytes/s (the line speed) into a buffer of iBufferSize bytes that it
+// prints at iDrain bytes/s. With XON/XOFF it sends XOFF when the buffer
+// is 3/4 full; that stops the sender's tty and the line (nothing more is
+// read) until it sends XON at 1/4 full
+//
+typedef struct tagPTYPRINTER
+{
+  int fd;  // pty master
+  int iRate, iBufferSize, iDrain, bXonXoff;
+  volatile int bRun;
+  uint8_t *pBuf;
+  int iSize, iLen;
+  double dFill;
+  long long llOverflow, llXOffs, llDone;
+  int iPeak;
+} PTYPRINTER;
+
+static void * PtyPrinterThread(void *pArg)
+{
+PTYPRINTER *pP = (PTYPRINTER *)pArg;
+uint8_t ucTemp[1024], ucXOff = 0x13, ucXOn = 0x11;
+long long llLast = MicroTime(), llNow;
+double dCredit = 0.0; // bytes the line could have carried
+int i, iRoom, bStopped = 0;
+
+   while (1) {
+      usleep(200);
+      llNow = MicroTime();
+      pP->dFill -= (llNow - llLast) * (double)pP->iDrain / 1000000.0;
+      if (pP->dFill < 0.0) pP->dFill = 0.0;
+      if (!bStopped) {
+         dCredit += (llNow - llLast) * (double)pP->iRate / 1000000.0;
+         if (dCredit > 16.0) dCredit = 16.0; // the UART FIFO
+      }
+      llLast = llNow;
+      i = 0;
+      if (!bStopped && dCredit >= 1.0) {
+         i = (int)read(pP->fd, ucTemp, (int)dCredit);
+         if (i > 0) {
+            dCredit -= i;
+            if (pP->iLen + i <= pP->iSize) {
+               memcpy(&pP->pBuf[pP->iLen], ucTemp, i);
+               pP->iLen += i;
+            }
+            iRoom = pP->iBufferSize - (int)pP->dFill;
+            if (i > iRoom) { // the rest is lost
+               pP->llOverflow += i - iRoom;
+               pP->dFill = pP->iBufferSize;
+            } else {
+               pP->dFill += i;
+            }
+            if ((int)pP->dFill > pP->iPeak) pP->iPeak = (int)pP->dFill;
+         } else if (!pP->bRun) {
+            break; // the port was closed and everything has been read
+         }
+      }
+      if (pP->bXonXoff && !bStopped && pP->dFill > (pP->iBufferSize * 3) / 4) {
+         bStopped = 1;
+         pP->llXOffs++;
+         i = (int)write(pP->fd, &ucXOff, 1);
+      } else if (bStopped && pP->dFill < pP->iBufferSize / 4) {
+         bStopped = 0;
+         i = (int)write(pP->fd, &ucXOn, 1); // fails once the port is closed
+      }
+   }
+   // when it will have printed what's left
+   pP->llDone = llLast + (long long)(pP->dFill * 1000000.0 / pP->iDrain);
+   return NULL;
+} /* PtyPrinterThread() */
+
+static void SerialJob(void)
+{
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), 512);
+   tpPrintBuffer();
+   tpFlush();
+} /* SerialJob() */
+//
+// Send an image over a pseudo-terminal to a printer which prints at the
+// model speed (raster only, so its bytes/s match the model's lines/s):
+// paced with no flow control, with XON/XOFF and no pacing, and with
+// neither (to show the overflow when the line is faster than the head)
+//
+static int TestSerial(int iType, int iBaud)
+{
+static const struct { const char *szName; int iFlow, bPaced; } modes[] = {
+   {"paced", TP_SERIAL_FLOW_NONE, 1}, {"XON/XOFF", TP_SERIAL_FLOW_XONXOFF, 0}, {"no flow", TP_SERIAL_FLOW_NONE, 0}};
+TP_PACING pacing, nopacing = {0, 0, 0};
+TP_SERIAL serial;
+PTYPRINTER printer;
+pthread_t tid;
+uint8_t *pRef;
+int i, iRefLen, iSize = 1024 * 1024, iErrors = 0, iPitch;
+long long llStart, llSent;
+char *szSlave;
+
+   pRef = (uint8_t *)malloc(iSize);
+   printer.pBuf = (uint8_t *)malloc(iSize);
+   printer.iSize = iSize;
+   tpSetPacing(NULL);
+   tpGetPacing(&pacing);
+   iPitch = (tpGetWidth() + 7) >> 3;
+   if (iType == PRINTER_CAT) iPitch += 8;
+   cap.pBuf = pRef; cap.iBufSize = iSize; // the expected stream
+   tpSetPacing(&nopacing);
+   tpCaptureReset(&cap);
+   SerialJob();
+   iRefLen = cap.iBufLen;
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   printf("Serial: %d baud, printer buffer %d bytes, prints %d bytes/s\n", iBaud, pacing.iBufferBytes, pacing.iLinesPerSec * iPitch);
+   for (i=0; i<(int)(sizeof(modes)/sizeof(modes[0])); i++) {
+      printer.fd = posix_openpt(O_RDWR | O_NOCTTY);
+      if (printer.fd < 0 || grantpt(printer.fd) < 0 || unlockpt(printer.fd) < 0 || (szSlave = ptsname(printer.fd)) == NULL) {
+         printf("Error creating a pseudo-terminal\n");
+         iErrors++;
+         break;
+      }
+      tpSerialInit(&serial);
+      if (!tpSerialOpen(&serial, szSlave, iBaud, modes[i].iFlow)) {
+         printf("Error opening %s\n", szSlave);
+         close(printer.fd);
+         iErrors++;
+         break;
+      }
+      fcntl(printer.fd, F_SETFL, O_NONBLOCK);
+      printer.iRate = iBaud / 10;
+      printer.iBufferSize = pacing.iBufferBytes;
+      printer.iDrain = pacing.iLinesPerSec * iPitch;
+      printer.bXonXoff = (modes[i].iFlow == TP_SERIAL_FLOW_XONXOFF);
+      printer.bRun = 1;
+      printer.iLen = printer.iPeak = 0;
+      printer.dFill = 0.0;
+      printer.llOverflow = printer.llXOffs = 0;
+      pthread_create(&tid, NULL, PtyPrinterThread, &printer);
+      tpSetTransport(&serial.transport, iType, szTypes[iType]);
+      tpSetPacing(modes[i].bPaced ? NULL : &nopacing);
+      llStart = MicroTime();
+      SerialJob();
+      llSent = MicroTime() - llStart;
+      tpDisconnect();
+      tpSerialClose(&serial);
+      printer.bRun = 0;
+      pthread_join(tid, NULL);
+      close(printer.fd);
+      if (printer.iLen != iRefLen || memcmp(printer.pBuf, pRef, iRefLen) != 0)
+         iErrors++;
+      printf("%-10s sent in %.1f ms, printed in %.1f ms, buffer peak %d, overflow %lld bytes, %lld XOFFs, stream %s\n",
+             modes[i].szName, llSent / 1000.0, (printer.llDone - llStart) / 1000.0, printer.iPeak,
+             printer.llOverflow, printer.llXOffs,
+             (printer.iLen == iRefLen && memcmp(printer.pBuf, pRef, iRefLen) == 0) ? "same" : "DIFFERENT");
+      tpSerialPrintStats(&serial, "  serial");
+   }
+   tpSetTransport(&cap.transport, iType, szTypes[iType]);
+   free(pRef);
+   free(printer.pBuf);
+   return iErrors;
+} /* TestSerial() */
+
+//
+// Compare the write modes against a transport which acknowledges
+// each write with response after iLatency microseconds
+//
+static void TestWindow(int iLatency)
+{
+static const int iWindows[] = {2, 4, 8, 16};
+long long llStart, llTime;
+int i, iLines = 120;
+
+   printf("Ack latency %d us, %d line job\n", iLatency, iLines);
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), iLines);
+   for (i=-1; i<4; i++) {
+      if (i < 0) {
+         tpSetWriteMode(MODE_WITH_RESPONSE);
+      } else {
+         tpSetWriteMode(MODE_WINDOWED);
+         tpSetWriteWindow(iWindows[i]);
+      }
+      tpCaptureReset(&cap);
+      llStart = MicroTime();
+      tpPrintBuffer();
+      tpFlush(); // wait for the last acks
+      llTime = MicroTime() - llStart;
+      printf("%s window %2d: %8.1f ms, %lld writes, in flight after flush %d\n",
+             (i < 0) ? "with response" : "windowed     ", (i < 0) ? 1 : tpGetWriteWindow(),
+             llTime / 1000.0, cap.llWrites, tpGetInFlight());
+   }
+   tpSetWriteMode(MODE_WITHOUT_RESPONSE);
+} /* TestWindow() */
+
+//
+// Print a paced job a step at a time like a loop() based program
+// which has other work to do between the steps
+//
+static void TestStep(int iBudget, int bFlow)
+{
+TP_PACING pacing;
+long long llStart, llTime, llT, llStep, llMax = 0, llInStep = 0;
+int iSteps = 0, iLines = 240, iPitch = (tpGetWidth() + 7) >> 3;
+
+   if (tpGetName() != NULL && strcmp(tpGetName(), "CAT") == 0)
+      iPitch += 8;
+   tpSetPacing(NULL);
+   tpGetPacing(&pacing);
+   tpCaptureSetDrain(&cap, pacing.iBufferBytes, pacing.iLinesPerSec * iPitch);
+   tpCaptureSetFlowControl(&cap, bFlow);
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), iLines);
+   printf("Step budget %d us, %d line job + text + feed\n", iBudget, iLines);
+   llStart = MicroTime();
+   tpPrintBegin();
+   for (int iJob=0; iJob<3; iJob++) {
+      if (iJob == 1) tpPrintBegin((GFXfont *)&FreeSerif12pt7b, 0, (char *)"Step-wise printing");
+      if (iJob == 2) tpPrintBeginFeed(32);
+      while (!tpPrintIsDone()) {
+         llT = MicroTime();
+         tpPrintStep(iBudget);
+         llStep = MicroTime() - llT;
+         llInStep += llStep;
+         if (llStep > llMax) llMax = llStep;
+         iSteps++;
+         usleep(500); // the rest of loop()
+      }
+   }
+   tpFlush();
+   llTime = MicroTime() - llStart;
+   printf("%-12s %.1f ms total, %d steps, %.1f ms in steps, longest step %lld us\n",
+          "Stepped", llTime / 1000.0, iSteps, llInStep / 1000.0, llMax);
+   tpCapturePrintStats(&cap, "  wire");
+   tpCaptureSetDrain(&cap, 0, 0);
+   tpCaptureSetFlowControl(&cap, 0);
+} /* TestStep() */
+//
+// Render receipts into 2 buffers while the job queue prints them
+// against a simulated printer running at the model speed
+//
+static volatile int bBufferBusy[2];
+static void JobDone(int iJob, int iResult, void *pUser)
+{
+   (void)iJob; (void)iResult;
+   __atomic_store_n(&bBufferBusy[(int)(intptr_t)pUser], 0, __ATOMIC_RELEASE);
+} /* JobDone() */
+
+static void TestQueue(int iJobs)
+{
+TP_PACING pacing;
+long long llStart, llTime, llRender = 0, llBlocked = 0, llT;
+int i, iBuf, iWidth = tpGetWidth(), iLines = 120, iMaxDepth = 0;
+int iPitch = (iWidth + 7) >> 3;
+
+   if (tpGetName() != NULL && strcmp(tpGetName(), "CAT") == 0)
+      iPitch += 8;
+   tpSetPacing(NULL);
+   tpGetPacing(&pacing);
+   tpCaptureSetDrain(&cap, pacing.iBufferBytes, pacing.iLinesPerSec * iPitch);
+   tpStartQueue();
+   printf("Queue: %d jobs of %d lines, 2 render buffers\n", iJobs, iLines);
+   llStart = MicroTime();
+   for (i=0; i<iJobs; i++) {
+      iBuf = i & 1;
+      llT = MicroTime();
+      while (__atomic_load_n(&bBufferBusy[iBuf], __ATOMIC_ACQUIRE)) // the printer still owns this buffer
+         usleep(100);
+      llBlocked += MicroTime() - llT;
+      llT = MicroTime();
+      DrawPage(iWidth, iLines);
+      memcpy(&ucBackBuffer[(iBuf + 1) * iPitch * iLines], ucBackBuffer, iPitch * iLines);
+      llRender += MicroTime() - llT;
+      bBufferBusy[iBuf] = 1;
+      tpQueueBuffer(&ucBackBuffer[(iBuf + 1) * iPitch * iLines], iWidth, iLines, JobDone, (void *)(intptr_t)iBuf);
+      tpQueueFeed(8, NULL, NULL);
+      if (tpGetQueueDepth() > iMaxDepth) iMaxDepth = tpGetQueueDepth();
+   }
+   tpWaitQueue(-1);
+   llTime = MicroTime() - llStart;
+   tpStopQueue();
+   printf("%-12s %.1f ms total, producer rendering %.1f ms, waiting for a buffer %.1f ms, max depth %d\n",
+          "Queued", llTime / 1000.0, llRender / 1000.0, llBlocked / 1000.0, iMaxDepth);
+   tpCapturePrintStats(&cap, "  wire");
+   tpCaptureSetDrain(&cap, 0, 0);
+} /* TestQueue() */
+
+//
+// Stress test the transmit ring: encode the jobs on this thread while
+// the ring's transmit thread sends them, and check that the byte stream
+// is the same as sending directly. The packet size is changed on each
+// pass so that the packets and the ring wrap fall in different places
+//
+static uint8_t ucRing[65536];
+static void RunRingJobs(int iPass)
+{
+   tpSetMaxPacketSize(20 + (iPass * 37) % 490);
+   Receipt();
+   tpPrintBuffer();
+   tpPrintCustomText((GFXfont *)&FreeSerif12pt7b, 0, (char *)"The quick brown fox");
+   tpFeed(16);
+   tpFlush();
+} /* RunRingJobs() */
+
+static int TestRing(int iSize, int iCount, int iLatency)
+{
+TP_RING_STATS stats, total;
+uint8_t *pDirect, *pRinged;
+long long llStart, llDirect = 0, llRing = 0;
+int i, iLen, iErrors = 0, iBufSize = 4 * 1024 * 1024;
+
+   if (iSize > (int)sizeof(ucRing)) iSize = (int)sizeof(ucRing);
+   pDirect = (uint8_t *)malloc(iBufSize);
+   pRinged = (uint8_t *)malloc(iBufSize);
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), 256);
+   if (iLatency > 0) // every write waits for its ack
+      tpSetWriteMode(MODE_WITH_RESPONSE);
+   memset(&total, 0, sizeof(total));
+   printf("Ring %d bytes, %d passes, ack latency %d us\n", iSize, iCount, iLatency);
+   for (i=0; i<iCount; i++) {
+      cap.pBuf = pDirect; cap.iBufSize = iBufSize;
+      tpCaptureReset(&cap);
+      llStart = MicroTime();
+      RunRingJobs(i);
+      llDirect += MicroTime() - llStart;
+      iLen = cap.iBufLen;
+
+      cap.pBuf = pRinged;
+      tpCaptureReset(&cap);
+      if (!tpStartRing(ucRing, iSize)) {
+         printf("tpStartRing failed\n");
+         return -1;
+      }
+      llStart = MicroTime();
+      RunRingJobs(i);
+      llRing += MicroTime() - llStart;
+      tpStopRing();
+      tpGetRingStats(&stats, 1);
+      if (stats.iHighWater > total.iHighWater) total.iHighWater = stats.iHighWater;
+      total.iFullStalls += stats.iFullStalls;
+      total.iEmptyStalls += stats.iEmptyStalls;
+      if (cap.iBufLen != iLen || memcmp(pDirect, pRinged, iLen) != 0) {
+         printf("pass %d: ring output differs (%d vs %d bytes)\n", i, cap.iBufLen, iLen);
+         iErrors++;
+      }
+   }
+   printf("%-12s direct %.1f ms, ring %.1f ms, %d mismatches\n", "Ring", llDirect / 1000.0, llRing / 1000.0, iErrors);
+   printf("  ring: high water %d, encoder stalls (full) %d, transmitter stalls (empty) %d\n",
+          total.iHighWater, total.iFullStalls, total.iEmptyStalls);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   tpSetWriteMode(MODE_WITHOUT_RESPONSE);
+   tpSetMaxPacketSize(0);
+   free(pDirect);
+   free(pRinged);
+   return iErrors;
+} /* TestRing() */
+
+//
+// Print an image whose scanlines are numbered over a link which drops
+// every iDrop bytes, then decode the captured stream the way the printer
+// would and check that every scanline was printed, in order, with at
+// most the resumed band printed twice. The printer keeps its parser
+// state when the link drops, so a band cut short swallows whatever
+// comes next until it has all of its rows (blank rows are the library
+// finishing it), and a cat command with a bad trailer is ignored
+//
+static int CheckResume(uint8_t *pStream, int iLen, int bCat, int iPitch, int iHeight, int *pDuplicates, int *pBlanks)
+{
+int i = 0, j, iLine, iLines, iNext = 0, iZeros;
+uint8_t ucLine[80];
+
+   *pDuplicates = *pBlanks = 0;
+   while (i < iLen) {
+      iLines = 0;
+      if (bCat) { // 0x51 0x78 cmd 0 len 0 <data> crc 0xff
+         if (pStream[i] != 0x51 || i+8 > iLen || i+8+pStream[i+4] > iLen || pStream[i+7+pStream[i+4]] != 0xff) { i++; continue; }
+         if (pStream[i+2] == 0xa2) {
+            for (j=0; j<pStream[i+4]; j++) { // undo the bit reversal
+               uint8_t c = pStream[i+6+j], r = 0;
+               for (int k=0; k<8; k++) r |= ((c >> k) & 1) << (7-k);
+               ucLine[j] = r;
+            }
+            iLines = 1;
+         }
+         i += 8 + pStream[i+4];
+      } else { // GS v 0 header followed by the rows
+         if (i+8 > iLen || pStream[i] != 0x1d || pStream[i+1] != 'v' || pStream[i+2] != '0') { i++; continue; }
+         iLines = pStream[i+6] | (pStream[i+7] << 8);
+         i += 8;
+      }
+      for (j=0; j<iLines; j++) {
+         if (!bCat) {
+            if (i + iPitch > iLen) { i = iLen; break; }
+            memcpy(ucLine, &pStream[i], iPitch);
+            i += iPitch;
+         }
+         for (iZeros=iPitch; iZeros>0 && ucLine[iZeros-1] == 0; iZeros--) {};
+         if (iNext < iHeight && memcmp(ucLine, &ucBackBuffer[iNext * iPitch], iPitch) != 0 &&
+             memcmp(ucLine, &ucBackBuffer[iNext * iPitch], iZeros) == 0 && (iZeros < iPitch || iZeros == 0)) {
+            (*pBlanks)++; // the rest of a band which was cut short (and the row it was cut in)
+            continue;
+         }
+         iLine = (ucLine[0] << 8) | ucLine[1];
+         if (iLine < iNext) { // resumed from an earlier band
+            *pDuplicates += iNext - iLine;
+            iNext = iLine;
+         }
+         if (iLine != iNext || memcmp(ucLine, &ucBackBuffer[iLine * iPitch], iPitch) != 0) {
+            printf("scanline %d printed where %d was expected\n", iLine, iNext);
+            return 0;
+         }
+         iNext++;
+      }
+   }
+   if (iNext != iHeight)
+      printf("only %d of %d scanlines printed\n", iNext, iHeight);
+   return (iNext == iHeight);
+} /* CheckResume() */
+
+static int TestResume(int iDrop, int iType)
+{
+uint8_t *pStream;
+int x, y, iOK, iDup, iBlank, iWidth = tpGetWidth(), iHeight = 1000, iPitch = (iWidth + 7) >> 3;
+int iBufSize = 1024 * 1024;
+
+   for (y=0; y<iHeight; y++) { // number each scanline
+      ucBackBuffer[y * iPitch] = (uint8_t)(y >> 8);
+      ucBackBuffer[y * iPitch + 1] = (uint8_t)y;
+      for (x=2; x<iPitch; x++)
+         ucBackBuffer[y * iPitch + x] = (uint8_t)(x * 7 + y * 13);
+   }
+   tpSetBackBuffer(ucBackBuffer, iWidth, iHeight);
+   pStream = (uint8_t *)malloc(iBufSize);
+   cap.pBuf = pStream; cap.iBufSize = iBufSize;
+   tpCaptureReset(&cap);
+   tpCaptureSetDrop(&cap, iDrop);
+   tpSetAutoReconnect(3);
+   tpPrintBuffer();
+   tpFlush();
+   iOK = CheckResume(pStream, cap.iBufLen, iType == PRINTER_CAT, iPitch, iHeight, &iDup, &iBlank);
+   printf("%-12s link dropped %d times, %d resumes, %d bytes sent, %d scanlines printed twice, %d blank: %s\n",
+          "Resume", cap.iDrops, tpGetResumeCount(), cap.iBufLen, iDup, iBlank, iOK ? "OK" : "FAILED");
+   tpCaptureSetDrop(&cap, 0);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   free(pStream);
+   return iOK ? 0 : -1;
+} /* TestResume() */
+
+//
+// Hand a raster of iMB megabytes from a producer process to this one
+// through the shared memory ring, and (the baseline) through a socket
+// into an image buffer which is then printed. Both must give the same
+// printer stream.
+//
+#define SHM_SLOTS 1024 // rows in the ring
+#define SHM_CHUNK 64   // rows per send() for the socket
+static void ShmRow(uint8_t *pRow, int iPitch, uint32_t u32Row)
+{
+   memset(pRow, 0, iPitch);
+   pRow[0] = (uint8_t)(u32Row >> 16); // number each scanline
+   pRow[1] = (uint8_t)(u32Row >> 8);
+   pRow[2] = (uint8_t)u32Row;
+   pRow[3 + (u32Row % (iPitch - 3))] = 0xff; // and draw a diagonal
+} /* ShmRow() */
+
+static int ShmProducer(int fdSocket, int iWidth, int iHeight)
+{
+TP_SHM shm;
+uint8_t *pRows;
+uint32_t u32Row = 0;
+int i, iCount, iPitch = (iWidth + 7) >> 3;
+
+   if (!tpShmCreate(&shm, iWidth, iHeight, SHM_SLOTS) || !tpShmSend(&shm, fdSocket))
+      return 0;
+   while ((pRows = tpShmGetRows(&shm, &iCount)) != NULL) { // render straight into the ring
+      for (i=0; i<iCount; i++)
+         ShmRow(&pRows[i * iPitch], iPitch, u32Row++);
+      tpShmCommit(&shm, iCount);
+   }
+   tpShmPrintStats(&shm, "  producer");
+   tpShmClose(&shm);
+   return (u32Row == (uint32_t)iHeight);
+} /* ShmProducer() */
+
+static int SocketProducer(int fdSocket, int iWidth, int iHeight)
+{
+uint8_t ucRows[SHM_CHUNK * 72];
+int i, j, iLen, iPitch = (iWidth + 7) >> 3;
+uint32_t u32Row = 0;
+
+   while (u32Row < (uint32_t)iHeight) {
+      for (i=0; i<SHM_CHUNK && u32Row < (uint32_t)iHeight; i++)
+         ShmRow(&ucRows[i * iPitch], iPitch, u32Row++);
+      iLen = i * iPitch;
+      for (i=0; i<iLen; i+=j) {
+         j = (int)send(fdSocket, &ucRows[i], iLen - i, MSG_NOSIGNAL);
+         if (j <= 0)
+            return 0;
+      }
+   }
+   return 1;
+} /* SocketProducer() */
+//
+// Run a producer in a child process connected by a socket pair
+//
+static pid_t ShmFork(int (*pfnProducer)(int, int, int), int iWidth, int iHeight, int *pfd)
+{
+int i, fds[2];
+pid_t pid;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+      return -1;
+   fflush(stdout);
+   pid = fork();
+   if (pid == 0) {
+      close(fds[0]);
+      i = (*pfnProducer)(fds[1], iWidth, iHeight);
+      fflush(stdout);
+      _exit(i ? 0 : 1);
+   }
+   close(fds[1]);
+   *pfd = fds[0];
+   return pid;
+} /* ShmFork() */
+
+static int ShmReap(pid_t pid)
+{
+int iStatus;
+
+   if (pid <= 0 || waitpid(pid, &iStatus, 0) != pid)
+      return 0;
+   return (WIFEXITED(iStatus) && WEXITSTATUS(iStatus) == 0);
+} /* ShmReap() */
+
+static int TestShm(int iMB)
+{
+TP_PACING nopacing = {0, 0, 0};
+TP_SHM shm;
+uint8_t *pImage, *pRef;
+int i, j, fd, iOK, iRefLen, iErrors = 0, iWidth = tpGetWidth(), iPitch = (iWidth + 7) >> 3;
+int iHeight, iBufSize;
+long long llSize, llTime;
+pid_t pid;
+
+   if (iMB > 256) iMB = 256;
+   iHeight = (int)(((long long)iMB * 1024 * 1024) / iPitch);
+   iBufSize = (iPitch + 8) * iHeight + 64 * 1024; // room for the cat printer framing
+   llSize = (long long)iPitch * iHeight;
+   printf("Raster %d x %d (%.1f MB), shared memory ring of %d rows\n", iWidth, iHeight, llSize / 1048576.0, SHM_SLOTS);
+   tpSetPacing(&nopacing); // measure the hand over, not the printer speed
+   pRef = (uint8_t *)malloc(iBufSize);
+   cap.pBuf = (uint8_t *)malloc(iBufSize); cap.iBufSize = iBufSize;
+   pImage = (uint8_t *)malloc(llSize);
+   if (pRef == NULL || cap.pBuf == NULL || pImage == NULL) {
+      printf("Not enough memory\n");
+      free(pRef); free(cap.pBuf); free(pImage);
+      cap.pBuf = NULL; cap.iBufSize = 0;
+      return -1;
+   }
+   // baseline: the rows are copied into the socket, out of it into an
+   // image buffer and then printed from there
+   tpCaptureReset(&cap);
+   llTime = MicroTime();
+   pid = ShmFork(SocketProducer, iWidth, iHeight, &fd);
+   for (i=0; i<llSize; i+=j) {
+      j = (int)recv(fd, &pImage[i], ((llSize - i) > 1048576) ? 1048576 : (int)(llSize - i), 0);
+      if (j <= 0)
+         break;
+   }
+   iOK = (i == llSize);
+   if (iOK) {
+      tpSetBackBuffer(pImage, iWidth, iHeight);
+      tpPrintBuffer();
+      tpFlush();
+   }
+   llTime = MicroTime() - llTime;
+   close(fd);
+   iOK &= ShmReap(pid);
+   iErrors += !iOK;
+   iRefLen = cap.iBufLen;
+   memcpy(pRef, cap.pBuf, iRefLen);
+   printf("%-12s %.1f ms, %.1f MB/s, %lld payload bytes copied between the processes, %lld KB held by the printer side: %s\n",
+          "Socket", llTime / 1000.0, llSize / (double)llTime, llSize * 2, llSize / 1024, iOK ? "OK" : "FAILED");
+   tpSetBackBuffer(ucBackBuffer, iWidth, 1024);
+   free(pImage);
+
+   // the printer encodes straight out of the producer's ring
+   tpCaptureReset(&cap);
+   llTime = MicroTime();
+   pid = ShmFork(ShmProducer, iWidth, iHeight, &fd);
+   iOK = tpShmReceive(&shm, fd);
+   close(fd);
+   if (iOK) {
+      iOK = tpShmPrint(&shm);
+      tpFlush();
+   }
+   llTime = MicroTime() - llTime;
+   iOK &= ShmReap(pid); // (the producer's statistics)
+   iOK &= (cap.iBufLen == iRefLen && memcmp(cap.pBuf, pRef, iRefLen) == 0);
+   iErrors += !iOK;
+   printf("%-12s %.1f ms, %.1f MB/s, 0 payload bytes copied between the processes, %lld KB held by the printer side: %s\n",
+          "SharedMem", llTime / 1000.0, llSize / (double)llTime, (long long)shm.size / 1024,
+          iOK ? "same stream" : "DIFFERENT");
+   if (shm.pRing != NULL) {
+      tpShmPrintStats(&shm, "  printer");
+      tpShmClose(&shm);
+   }
+   tpCapturePrintStats(&cap, "  wire");
+   free(cap.pBuf);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   free(pRef);
+   return iErrors;
+} /* TestShm() */
+
+//
+// Record the receipt into a file for -R
+//
+static int WriteRecording(const char *szFile)
+{
+uint8_t *pData;
+int iLen, iSize = 1024 * 1024;
+FILE *f;
+
+   pData = (uint8_t *)malloc(iSize);
+   tpCaptureReset(&cap);
+   tpRecordBegin(pData, iSize);
+   Receipt();
+   tpFlush();
+   iLen = tpRecordEnd();
+   f = fopen(szFile, "wb");
+   if (iLen < 0 || f == NULL || (int)fwrite(pData, 1, iLen, f) != iLen) {
+      printf("Error writing the recording to %s\n", szFile);
+      if (f != NULL) fclose(f);
+      free(pData);
+      return -1;
+   }
+   fclose(f);
+   printf("Recorded the receipt into %s: %d bytes for %lld bytes of printer data, %u scanlines paced\n",
+          szFile, iLen, cap.llBytes, pData[12] | (pData[13] << 8) | (pData[14] << 16) | ((uint32_t)pData[15] << 24));
+   free(pData);
+   return 0;
+} /* WriteRecording() */
+//
+// The printer data in a recording (the tags are described in Thermal_Printer.cpp)
+// returns its length or -1 if the recording is damaged
+//
+static int RecordingData(uint8_t *pData, int iLen, uint8_t *pOut)
+{
+int i = 16, iRun, iOut = 0;
+
+   while (i < iLen) {
+      iRun = pData[i++];
+      if (iRun & 0x80) // pace or flush
+         continue;
+      if (iRun == 0) {
+         if (i + 2 > iLen) return -1;
+         iRun = pData[i] | (pData[i+1] << 8);
+         i += 2;
+      }
+      if (i + iRun > iLen) return -1;
+      memcpy(&pOut[iOut], &pData[i], iRun);
+      iOut += iRun;
+      i += iRun;
+   }
+   return iOut;
+} /* RecordingData() */
+
+static uint8_t *pReplay;
+static int iReplayLen;
+static void TestReplayRun(void) { tpReplay(pReplay, iReplayLen); }
+//
+// Replay a recording unpaced to measure it against rendering the receipt
+// again, then paced into a simulated printer at the model speed, once
+// as the recording and once as the receipt it was made from
+//
+static int TestReplay(const char *szFile, int iCount)
+{
+TP_PACING pacing, nopacing = {0, 0, 0};
+uint8_t *pRef;
+long long llTime;
+int i, iType, iRefLen, iOK, iPitch, iSize = 16 * 1024 * 1024;
+FILE *f;
+
+   pReplay = (uint8_t *)malloc(iSize);
+   pRef = (uint8_t *)malloc(iSize);
+   f = fopen(szFile, "rb");
+   iReplayLen = (f != NULL) ? (int)fread(pReplay, 1, iSize, f) : 0;
+   if (f != NULL) fclose(f);
+   iType = (iReplayLen >= 16) ? pReplay[5] : -1;
+   iRefLen = RecordingData(pReplay, iReplayLen, pRef);
+   if (iType < 0 || iType >= PRINTER_COUNT || iRefLen < 0) {
+      printf("%s is not a recording\n", szFile);
+      free(pReplay); free(pRef);
+      return -1;
+   }
+   tpSetTransport(&cap.transport, iType, szTypes[iType]);
+   printf("Replaying %s: %d bytes, printer type %s, %d pixels wide\n", szFile, iReplayLen, szTypes[iType],
+          pReplay[6] | (pReplay[7] << 8));
+   tpSetPacing(&nopacing); // measure the replay, not the printer speed
+   RunTest("Replay", TestReplayRun, iCount);
+   RunTest("Receipt", Receipt, iCount);
+   cap.pBuf = (uint8_t *)malloc(iSize); cap.iBufSize = iSize;
+   tpCaptureReset(&cap);
+   iOK = tpReplay(pReplay, iReplayLen);
+   tpFlush();
+   iOK &= (cap.iBufLen == iRefLen && memcmp(cap.pBuf, pRef, iRefLen) == 0);
+   printf("%-12s %d bytes sent: %s\n", "Replayed", cap.iBufLen, iOK ? "same as recorded" : "DIFFERENT");
+   free(cap.pBuf);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+
+   iPitch = ((tpGetWidth() + 7) >> 3) + ((iType == PRINTER_CAT) ? 8 : 0);
+   tpSetPacing(NULL); // model defaults
+   tpGetPacing(&pacing);
+   printf("Pacing: %d bytes/s, %d lines/s, %d byte buffer\n", pacing.iBytesPerSec, pacing.iLinesPerSec, pacing.iBufferBytes);
+   for (i=0; i<2; i++) {
+      tpSetPacing(NULL); // start each with an empty printer
+      tpCaptureSetDrain(&cap, pacing.iBufferBytes, pacing.iLinesPerSec * iPitch);
+      tpCaptureReset(&cap);
+      llTime = MicroTime();
+      if (i == 0)
+         tpReplay(pReplay, iReplayLen);
+      else
+         Receipt();
+      tpFlush();
+      llTime = MicroTime() - llTime;
+      printf("%-12s %.1f ms paced\n", (i == 0) ? "Replay" : "Receipt", llTime / 1000.0);
+      tpCapturePrintStats(&cap, "  wire");
+   }
+   tpCaptureSetDrain(&cap, 0, 0);
+   free(pReplay);
+   free(pRef);
+   return iOK ? 0 : -1;
+} /* TestReplay() */
+
+//
+// Cancel jobs while they're printing (from another thread, or between
+// steps) and check that the printer is left ready: every raster block is
+// complete (ESC/POS) or the image was ended and text mode restored (cat),
+// and the next job follows unchanged
+//
+static volatile long long llCancelAt;
+static void * CancelThread(void *pArg)
+{
+   usleep((int)(intptr_t)pArg * 1000);
+   llCancelAt = MicroTime();
+   tpCancel();
+   return NULL;
+} /* CancelThread() */
+
+static void CancelNextJob(void)
+{
+   tpSetFont(FONT_12x24, 0, 0, 0, 0);
+   tpPrintLine((char *)"NEXT JOB");
+   tpFlush();
+} /* CancelNextJob() */
+
+static int CheckCancel(uint8_t *pStream, int iLen, int bCat, int *pRows)
+{
+static const uint8_t ucTextMode[] = {0x51, 0x78, 0xbe, 0x00, 0x01, 0x00, 0x01};
+int i = 0, iW, iH, iEnd = -1;
+
+   *pRows = 0;
+   while (i < iLen) {
+      if (bCat) {
+         if (pStream[i] != 0x51 || i + 8 > iLen || i + 8 + pStream[i+4] > iLen) { i++; continue; }
+         if (pStream[i+2] == 0xa2)
+            (*pRows)++;
+         else if (pStream[i+2] == 0xa6 && iEnd < 0 && i + 8 + pStream[i+4] + (int)sizeof(ucTextMode) <= iLen &&
+                  memcmp(&pStream[i + 8 + pStream[i+4]], ucTextMode, sizeof(ucTextMode)) == 0)
+            iEnd = *pRows; // lattice end, then text mode
+         i += 8 + pStream[i+4];
+      } else if (i + 8 <= iLen && pStream[i] == 0x1d && pStream[i+1] == 'v' && pStream[i+2] == '0') {
+         iW = pStream[i+4] | (pStream[i+5] << 8);
+         iH = pStream[i+6] | (pStream[i+7] << 8);
+         if (i + 8 + iW * iH > iLen)
+            return 0; // the printer would still be waiting for rows
+         if (iW > 1)
+            *pRows += iH;
+         i += 8 + iW * iH;
+      } else {
+         i++;
+      }
+   }
+   return (!bCat || iEnd >= 0);
+} /* CheckCancel() */
+
+static int TestCancel(int iType, int iMs)
+{
+static const struct { const char *szName; int iBand, bStep; } jobs[] = {
+   {"Whole", 0, 0}, {"Buffer", TP_RESUME_BAND, 0}, {"Text/step", TP_RESUME_BAND, 1}};
+TP_PACING pacing;
+pthread_t tid;
+uint8_t *pStream, *pNext;
+long long llTime;
+int i, iOK, iRows, iJobLen, iNextLen, iErrors = 0, iSize = 1024 * 1024, iPitch;
+
+   iPitch = ((tpGetWidth() + 7) >> 3) + ((iType == PRINTER_CAT) ? 8 : 0);
+   pStream = (uint8_t *)malloc(iSize);
+   pNext = (uint8_t *)malloc(iSize);
+   cap.pBuf = pNext; cap.iBufSize = iSize;
+   tpCaptureReset(&cap);
+   CancelNextJob(); // what the next job should look like
+   iNextLen = cap.iBufLen;
+   cap.pBuf = pStream;
+   tpSetBackBuffer(ucBackBuffer, tpGetWidth(), 1024);
+   for (i=0; i<(int)(sizeof(jobs)/sizeof(jobs[0])); i++) {
+      tpSetPacing(NULL); // the model speed
+      tpGetPacing(&pacing);
+      tpCaptureSetDrain(&cap, pacing.iBufferBytes, pacing.iLinesPerSec * iPitch);
+      tpCaptureReset(&cap);
+      tpSetRasterBand(jobs[i].iBand);
+      if (jobs[i].bStep) { // cancelled by the program between two steps
+         tpPrintBegin((GFXfont *)&FreeSerif12pt7b, 0, (char *)"Cancelled");
+         llCancelAt = MicroTime();
+         tpCancel();
+         while (!tpPrintStep(1000000)) {};
+      } else {
+         pthread_create(&tid, NULL, CancelThread, (void *)(intptr_t)iMs);
+         tpPrintBuffer();
+         pthread_join(tid, NULL);
+      }
+      tpFlush();
+      llTime = MicroTime();
+      iJobLen = cap.iBufLen;
+      CancelNextJob();
+      iOK = CheckCancel(pStream, iJobLen, iType == PRINTER_CAT, &iRows);
+      iOK &= (cap.iBufLen - iJobLen == iNextLen && memcmp(&pStream[iJobLen], pNext, iNextLen) == 0);
+      iErrors += !iOK;
+      printf("%-12s cancelled after %d ms, printer free %.1f ms later, %d scanlines sent: %s\n", jobs[i].szName,
+             jobs[i].bStep ? 0 : iMs, (llTime > llCancelAt) ? (llTime - llCancelAt) / 1000.0 : 0.0, iRows,
+             iOK ? "OK" : "FAILED");
+   }
+   printf("%d jobs cut short\n", tpGetCancelCount());
+   tpSetRasterBand(TP_RESUME_BAND);
+   tpCaptureSetDrain(&cap, 0, 0);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   free(pStream);
+   free(pNext);
+   return iErrors;
+} /* TestCancel() */
+
+//
+// Queue a long low priority photo, then a high priority ticket while
+// it's printing, and measure how long the ticket waits compared to the
+// plain queue order. The stream is decoded the way the printer would:
+// every raster block must be complete, the ticket must arrive whole
+// between two bands and the photo's scanlines must all be there in order
+//
+static volatile long long llJobDone[2];
+static void PriorityDone(int iJob, int iResult, void *pUser)
+{
+   (void)iJob; (void)iResult;
+   llJobDone[(int)(intptr_t)pUser] = MicroTime();
+} /* PriorityDone() */
+//
+// Collect the raster rows of a stream (iPitch bytes each)
+// returns the number of rows or -1 if a block was cut short
+//
+static int PriorityRows(uint8_t *pStream, int iLen, int bCat, int iPitch, uint8_t *pRows, int iMaxRows)
+{
+int i = 0, j, k, iW, iH, iRows = 0;
+
+   while (i < iLen) {
+      if (bCat) {
+         if (pStream[i] != 0x51 || i + 8 > iLen || i + 8 + pStream[i+4] > iLen) { i++; continue; }
+         if (pStream[i+2] == 0xa2 && iRows < iMaxRows) {
+            memset(&pRows[iRows * iPitch], 0, iPitch);
+            for (j=0; j<pStream[i+4] && j<iPitch; j++) { // undo the bit reversal
+               uint8_t c = pStream[i+6+j], r = 0;
+               for (k=0; k<8; k++) r |= ((c >> k) & 1) << (7-k);
+               pRows[iRows * iPitch + j] = r;
+            }
+            iRows++;
+         }
+         i += 8 + pStream[i+4];
+      } else if (i + 8 <= iLen && pStream[i] == 0x1d && pStream[i+1] == 'v' && pStream[i+2] == '0') {
+         iW = pStream[i+4] | (pStream[i+5] << 8);
+         iH = pStream[i+6] | (pStream[i+7] << 8);
+         if (i + 8 + iW * iH > iLen)
+            return -1; // the printer would still be waiting for rows
+         i += 8;
+         for (j=0; j<iH && iRows < iMaxRows; j++) {
+            memcpy(&pRows[iRows * iPitch], &pStream[i + j * iW], (iW < iPitch) ? iW : iPitch);
+            iRows++;
+         }
+         i += iW * iH;
+      } else {
+         i++;
+      }
+   }
+   return iRows;
+} /* PriorityRows() */
+
+static int TestPriority(int iType, int iMs)
+{
+static const char *szTicket = "Ticket 42";
+TP_PACING pacing;
+uint8_t *pStream, *pRows, *pTicket;
+long long llStart, llQueued;
+int i, x, y, iOK, iRows, iTicketRows, iAt, iErrors = 0, iSize = 4 * 1024 * 1024;
+int iWidth = tpGetWidth(), iHeight = 1024, iPitch = (iWidth + 7) >> 3, iWire;
+int bCat = (iType == PRINTER_CAT);
+
+   for (y=0; y<iHeight; y++) { // number each scanline
+      ucBackBuffer[y * iPitch] = (uint8_t)(y >> 8);
+      ucBackBuffer[y * iPitch + 1] = (uint8_t)y;
+      for (x=2; x<iPitch; x++)
+         ucBackBuffer[y * iPitch + x] = (uint8_t)(x * 7 + y * 13);
+   }
+   pStream = (uint8_t *)malloc(iSize);
+   pRows = (uint8_t *)malloc(2 * iHeight * iPitch);
+   pTicket = (uint8_t *)malloc(iHeight * iPitch);
+   cap.pBuf = pStream; cap.iBufSize = iSize;
+   tpSetPacing(NULL); // the model speed
+   tpGetPacing(&pacing);
+   iWire = iPitch + (bCat ? 8 : 0);
+   tpCaptureReset(&cap);
+   tpPrintCustomText((GFXfont *)&FreeSerif12pt7b, 0, (char *)szTicket); // what the ticket looks like
+   tpFlush();
+   iTicketRows = PriorityRows(pStream, cap.iBufLen, bCat, iPitch, pTicket, iHeight);
+   tpStartQueue();
+   for (i=0; i<2; i++) { // plain queue order, then with priorities
+      tpSetPacing(NULL);
+      tpCaptureSetDrain(&cap, pacing.iBufferBytes, pacing.iLinesPerSec * iWire);
+      tpCaptureReset(&cap);
+      llJobDone[0] = llJobDone[1] = 0;
+      llStart = MicroTime();
+      tpQueueBuffer(ucBackBuffer, iWidth, iHeight, PriorityDone, (void *)0, i ? TP_PRIORITY_LOW : TP_PRIORITY_NORMAL);
+      usleep(iMs * 1000);
+      llQueued = MicroTime();
+      tpQueueCustomText((GFXfont *)&FreeSerif12pt7b, 0, szTicket, PriorityDone, (void *)1, i ? TP_PRIORITY_HIGH : TP_PRIORITY_NORMAL);
+      tpWaitQueue(-1);
+      // the photo's rows, with the ticket's rows somewhere in between
+      iRows = PriorityRows(pStream, cap.iBufLen, bCat, iPitch, pRows, 2 * iHeight);
+      iOK = (iRows == iHeight + iTicketRows);
+      for (iAt=0; iOK && iAt<iHeight && memcmp(&pRows[iAt * iPitch], &ucBackBuffer[iAt * iPitch], iPitch) == 0; iAt++) {};
+      iOK = iOK && memcmp(&pRows[iAt * iPitch], pTicket, iTicketRows * iPitch) == 0 &&
+            memcmp(&pRows[(iAt + iTicketRows) * iPitch], &ucBackBuffer[iAt * iPitch], (iHeight - iAt) * iPitch) == 0;
+      iErrors += !iOK;
+      printf("%-12s ticket sent %.1f ms after it was queued, photo done after %.1f ms (ticket after scanline %d), %d bytes: %s\n",
+             i ? "Priority" : "In order", (llJobDone[1] - llQueued) / 1000.0, (llJobDone[0] - llStart) / 1000.0,
+             iAt, cap.iBufLen, iOK ? "OK" : "FAILED");
+   }
+   tpStopQueue();
+   printf("%d jobs gave way\n", tpGetPreemptCount());
+   tpCaptureSetDrain(&cap, 0, 0);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   free(pStream);
+   free(pRows);
+   free(pTicket);
+   return iErrors;
+} /* TestPriority() */
+
+//
+// Keep the printer's identity in a file the first time, and connect from
+// it on later runs (what a board does with flash between power cycles).
+// A damaged copy must be refused.
+//
+static int TestIdentity(const char *szFile)
+{
+TP_IDENTITY id, bad;
+FILE *f;
+long long llTime;
+int iOK;
+
+   f = fopen(szFile, "rb");
+   if (f == NULL) {
+      if (!tpGetIdentity(&id) || (f = fopen(szFile, "wb")) == NULL)
+         return -1;
+      iOK = (fwrite(&id, 1, sizeof(id), f) == sizeof(id));
+      fclose(f);
+      printf("Identity of %s (%s) saved in %s, %d bytes\n", tpGetName(), szTypes[id.ucType], szFile, (int)sizeof(id));
+      return iOK ? 0 : -1;
+   }
+   iOK = (fread(&id, 1, sizeof(id), f) == sizeof(id));
+   fclose(f);
+   memcpy(&bad, &id, sizeof(id));
+   bad.ucType ^= 1;
+   iOK = iOK && !tpConnectIdentity(&bad);
+   llTime = MicroTime();
+   iOK = iOK && tpConnectIdentity(&id);
+   llTime = MicroTime() - llTime;
+   printf("Connected to %s (%s) from %s in %lld us, damaged copy refused: %s\n", tpGetName(),
+          tpGetName() ? szTypes[id.ucType] : "-", szFile, llTime, iOK ? "OK" : "FAILED");
+   if (iOK)
+      Receipt();
+   return iOK ? 0 : -1;
+} /* TestIdentity() */
+
+//
+// Scan a simulated room (on a virtual clock) with tpScanAll() and check
+// the results against what the simulator sent: every printer heard is
+// listed with its type and strongest signal, nearest first; a listed
+// address ends the scan early. Then measure the matching and ranking
+// on a crowded feed, without the time spent simulating it.
+//
+#define DISC_MAX 16
+static TP_ADVERT *pFeed; // a recorded feed (to time tpScanAll without the simulator)
+static int iFeedLen, iFeedPos;
+static int FeedStart(void *pUser) { (void)pUser; iFeedPos = 0; return 1; }
+static void FeedStop(void *pUser) { (void)pUser; }
+static int FeedNext(void *pUser, TP_ADVERT *pAdvert, int iWait)
+{
+   if (iFeedPos >= iFeedLen) { // the end of the recording ends the scan
+      tpVClockAdvance((TP_VCLOCK *)pUser, iWait * 1000LL);
+      return 0;
+   }
+   memcpy(pAdvert, &pFeed[iFeedPos++], sizeof(TP_ADVERT));
+   return 1;
+} /* FeedNext() */
+//
+// Printers which were pushed off a full list and heard again start
+// counting from scratch, so only an upper bound can be checked for them
+//
+static int CheckDiscovery(TP_ADVSIM *pSim, TP_FOUND *pFound, int iCount)
+{
+char szName[32];
+int i, iDev, iHeard = 0, bFull;
+
+   for (i=0; i<pSim->iDevices; i++)
+      iHeard += (pSim->devices[i].bPrinter && pSim->devices[i].iSent > 0);
+   if (iCount != ((iHeard < DISC_MAX) ? iHeard : DISC_MAX)) {
+      printf("%d printers found, %d were heard\n", iCount, iHeard);
+      return 0;
+   }
+   bFull = (iHeard > DISC_MAX);
+   for (i=0; i<iCount; i++) {
+      iDev = tpAdvSimFind(pSim, pFound[i].ucAddress);
+      strcpy(szName, pFound[i].szName);
+      szName[9] = 0;
+      if (iDev < 0 || !pSim->devices[iDev].bPrinter || pFound[i].cRSSI > pSim->devices[iDev].iStrongest ||
+          pFound[i].usSeen > pSim->devices[iDev].iSent || strncmp(szName, pSim->devices[iDev].szName, 9) != 0 ||
+          (!bFull && (pFound[i].cRSSI != pSim->devices[iDev].iStrongest || pFound[i].usSeen != pSim->devices[iDev].iSent)) ||
+          (i > 0 && !pFound[i-1].bListed && pFound[i].cRSSI > pFound[i-1].cRSSI)) {
+         printf("result %d (%s) doesn't match what was sent\n", i, pFound[i].szName);
+         return 0;
+      }
+   }
+   return 1;
+} /* CheckDiscovery() */
+
+static int TestDiscovery(int iDevices)
+{
+static TP_ADVSIM sim;
+TP_VCLOCK vclock;
+TP_FOUND found[DISC_MAX];
+long long llStart, llTime, llFeed;
+int i, iCount, iOK, iRank, iErrors = 0, iPrinters = (iDevices + 3) / 4;
+
+   tpVClockInit(&vclock);
+   tpSetClock(&vclock.clock);
+   tpAdvSimInit(&sim, &vclock, 1234);
+   tpAdvSimRoom(&sim, iDevices, iPrinters);
+   sim.iNoise = 6;
+   sim.iLossPercent = 10;
+   tpSetDiscovery(&sim.discovery);
+   // listen for 5 seconds
+   llStart = tpVClockNow(&vclock);
+   iCount = tpScanAll(found, DISC_MAX, 5000, NULL, 0);
+   llTime = tpVClockNow(&vclock) - llStart;
+   iOK = CheckDiscovery(&sim, found, iCount);
+   iErrors += !iOK;
+   printf("%-12s %d devices, %d printers, %lld adverts heard in %.1f s, %d printers found: %s\n", "Scan all",
+          iDevices, iPrinters, sim.llAdverts, llTime / 1000000.0, iCount, iOK ? "OK" : "FAILED");
+   for (i=0; i<iCount && i<3; i++)
+      printf("  %d: %-14s %-12s %02x:%02x:%02x:%02x:%02x:%02x %4d dBm, heard %d times\n", i+1, found[i].szName, szTypes[found[i].ucType],
+             found[i].ucAddress[0], found[i].ucAddress[1], found[i].ucAddress[2], found[i].ucAddress[3],
+             found[i].ucAddress[4], found[i].ucAddress[5], found[i].cRSSI, found[i].usSeen);
+   if (sim.iFirstPrinter >= 0) { // what stopping at the first printer would have picked
+      for (iRank=0; iRank<iCount && tpAdvSimFind(&sim, found[iRank].ucAddress) != sim.iFirstPrinter; iRank++) {};
+      printf("  tpScan() would have taken %s (%d dBm), number %d by signal\n", sim.devices[sim.iFirstPrinter].szName,
+             sim.devices[sim.iFirstPrinter].iStrongest, iRank + 1);
+   }
+   if (iCount > 1) { // a known printer ends the scan as soon as it's heard
+      uint8_t ucList[6];
+      memcpy(ucList, found[iCount-1].ucAddress, 6);
+      llStart = tpVClockNow(&vclock);
+      iCount = tpScanAll(found, DISC_MAX, 5000, ucList, 1);
+      llTime = tpVClockNow(&vclock) - llStart;
+      iOK = (iCount > 0 && found[0].bListed && memcmp(found[0].ucAddress, ucList, 6) == 0 && llTime < 5000000);
+      iErrors += !iOK;
+      printf("%-12s listed printer heard after %.1f ms, %d printers found: %s\n", "Known", llTime / 1000.0, iCount, iOK ? "OK" : "FAILED");
+      i = tpConnectFound(&found[0]); // with the capture transport this sets the printer model
+      printf("  connected to %s (%s): %s\n", tpGetName(), szTypes[found[0].ucType], i ? "OK" : "FAILED");
+      iErrors += !i;
+   }
+   // a crowded room: record a minute of it, then time tpScanAll on the recording
+   tpAdvSimInit(&sim, &vclock, 5678);
+   tpAdvSimRoom(&sim, TP_ADVSIM_DEVICES, TP_ADVSIM_DEVICES / 4);
+   iFeedLen = 0;
+   pFeed = (TP_ADVERT *)malloc(1000000 * sizeof(TP_ADVERT));
+   (*sim.discovery.pfnStart)(&sim);
+   llStart = tpVClockNow(&vclock);
+   while (iFeedLen < 1000000 && tpVClockNow(&vclock) - llStart < 60000000LL)
+      iFeedLen += (*sim.discovery.pfnNext)(&sim, &pFeed[iFeedLen], 100);
+   TP_DISCOVERY feed = {FeedStart, FeedNext, FeedStop, &vclock};
+   tpSetDiscovery(&feed);
+   llTime = 0;
+   for (i=0; i<5; i++) { // the best of 5
+      llStart = MicroTime();
+      iCount = tpScanAll(found, DISC_MAX, 60000, NULL, 0);
+      llFeed = MicroTime() - llStart;
+      if (i == 0 || llFeed < llTime) llTime = llFeed;
+   }
+   printf("%-12s %d adverts from %d devices in a minute, %.1f ns each to match and rank, %d printers found\n", "Crowded",
+          iFeedLen, TP_ADVSIM_DEVICES, llTime * 1000.0 / iFeedLen, iCount);
+   free(pFeed);
+   tpSetDiscovery(NULL);
+   tpSetClock(NULL);
+   return iErrors;
+} /* TestDiscovery() */
+//
+// Count the heap allocations made while bCountAllocs is set (the glibc
+// functions do the work)
+//
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+}
+static volatile int bCountAllocs;
+static long long llAllocs;
+extern "C" void *malloc(size_t size)
+{
+   if (bCountAllocs) __atomic_add_fetch(&llAllocs, 1, __ATOMIC_RELAXED);
+   return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size)
+{
+   if (bCountAllocs) __atomic_add_fetch(&llAllocs, 1, __ATOMIC_RELAXED);
+   return __libc_calloc(n, size);
+}
+extern "C" void *realloc(void *p, size_t size)
+{
+   if (bCountAllocs) __atomic_add_fetch(&llAllocs, 1, __ATOMIC_RELAXED);
+   return __libc_realloc(p, size);
+}
+extern "C" void free(void *p) { __libc_free(p); }
+//
+// Scan a simulated room, connect to the nearest printer and print a
+// ticket, over and over (a kiosk which reconnects all day). None of it
+// should touch the heap after the first cycle.
+//
+static void HeapCycle(TP_FOUND *pFound)
+{
+   if (tpScanAll(pFound, DISC_MAX, 2000, NULL, 0) > 0 && tpConnectFound(&pFound[0])) {
+      tpPrint((char *)"Ticket 42\r");
+      tpFeed(16);
+      tpDisconnect();
+   }
+} /* HeapCycle() */
+
+static int TestHeap(int iCycles)
+{
+static TP_ADVSIM sim;
+TP_VCLOCK vclock;
+TP_FOUND found[DISC_MAX];
+TP_SCAN_STATS start, end;
+size_t heapStart, heapEnd;
+long long llTime;
+int i, iOK;
+
+   tpVClockInit(&vclock);
+   tpSetClock(&vclock.clock);
+   tpAdvSimInit(&sim, &vclock, 4321);
+   tpAdvSimRoom(&sim, 40, 10);
+   tpSetDiscovery(&sim.discovery);
+   HeapCycle(found); // the first one may set things up
+   tpGetScanStats(&start);
+   heapStart = mallinfo2().uordblks;
+   llAllocs = 0;
+   bCountAllocs = 1;
+   llTime = MicroTime();
+   for (i=0; i<iCycles; i++)
+      HeapCycle(found);
+   llTime = MicroTime() - llTime;
+   bCountAllocs = 0;
+   heapEnd = mallinfo2().uordblks;
+   tpGetScanStats(&end);
+   iOK = (llAllocs == 0 && heapEnd == heapStart && end.iScans - start.iScans == iCycles &&
+          end.iConnects - start.iConnects == iCycles);
+   printf("%-12s %d scan/connect/print cycles in %.1f ms, %d scans, %d connections, %lld allocations, heap in use %zu -> %zu bytes: %s\n",
+          "Heap", iCycles, llTime / 1000.0, end.iScans - start.iScans, end.iConnects - start.iConnects,
+          llAllocs, heapStart, heapEnd, iOK ? "OK" : "FAILED");
+   tpSetDiscovery(NULL);
+   tpSetClock(NULL);
+   return iOK ? 0 : -1;
+} /* TestHeap() */
+//
+// Wake up and print a ticket on a printer which takes iMs to connect
+// (drawing it takes a third of that, about what a small board needs):
+// connecting first, then rendering and sending (blocking), against
+// rendering and encoding into a pending buffer while tpConnectAsync()
+// or tpScanAsync() bring the link up. Reports the time from waking up
+// to the first byte reaching the printer and checks that the printer
+// gets the same bytes each way. A printer which can't be reached must
+// fail the jobs which were waiting for it.
+//
+typedef struct tagSLOWLINK
+{
+   TP_TRANSPORT transport; // forwards to the capture transport
+   int iConnectMs;         // time to open the link
+   int bUnreachable;
+   long long llStart;      // the scan started
+   long long llFirst;      // first byte written
+} SLOWLINK;
+static SLOWLINK slow;
+static const char *szAdvertNames[PRINTER_COUNT] = {"MTP-2", "MPT-3", "GB01", "PeriPage+A7", "PeriPage_A7", "T02"};
+static int iAsyncType;
+static volatile int bAsyncDone, iAsyncResult, iAsyncJobs, iAsyncFailed;
+static uint8_t ucPending[96 * 1024];
+
+static int SlowWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse)
+{
+   (void)pUser;
+   if (slow.llFirst == 0)
+      slow.llFirst = MicroTime();
+   return (*cap.transport.pfnWrite)(cap.transport.pUser, pData, iLen, bWithResponse);
+} /* SlowWrite() */
+
+static int SlowReconnect(void *pUser)
+{
+   (void)pUser;
+   usleep((slow.llStart ? slow.iConnectMs / 2 : slow.iConnectMs) * 1000); // after a scan, half of it
+   return !slow.bUnreachable;
+} /* SlowReconnect() */
+//
+// Discovery backend: the printer is heard half way through the
+// connection time (the link takes the other half)
+//
+static int SlowScanStart(void *pUser) { (void)pUser; slow.llStart = MicroTime(); return 1; }
+static void SlowScanStop(void *pUser) { (void)pUser; }
+static int SlowScanNext(void *pUser, TP_ADVERT *pAdvert, int iWait)
+{
+long long llLeft = slow.llStart + slow.iConnectMs * 500LL - MicroTime();
+
+   (void)pUser;
+   if (llLeft > 0) {
+      usleep((llLeft < iWait * 1000LL) ? llLeft : iWait * 1000LL);
+      return 0;
+   }
+   memset(pAdvert, 0, sizeof(TP_ADVERT));
+   pAdvert->ucAddress[5] = 1;
+   pAdvert->cRSSI = -50;
+   strcpy(pAdvert->szName, szAdvertNames[iAsyncType]);
+   return 1;
+} /* SlowScanNext() */
+
+static void AsyncDone(int iResult, void *pUser)
+{
+   (void)pUser;
+   iAsyncResult = iResult;
+   __atomic_store_n(&bAsyncDone, 1, __ATOMIC_RELEASE);
+} /* AsyncDone() */
+
+static void AsyncJobDone(int iJob, int iResult, void *pUser)
+{
+   (void)iJob; (void)pUser;
+   iAsyncJobs++;
+   iAsyncFailed += (iResult != 0);
+} /* AsyncJobDone() */
+//
+// What happens after waking up: render the ticket and queue it
+//
+static long long AsyncTicket(int iWidth, int iDrawMs)
+{
+long long llTime = MicroTime();
+
+   DrawPage(iWidth, 400);
+   usleep(iDrawMs * 1000); // the board is slower at it
+   tpQueueBuffer(ucBackBuffer, iWidth, 400, AsyncJobDone, NULL);
+   tpQueueCustomText((GFXfont *)&FreeSerif12pt7b, 0, "Ticket 42", AsyncJobDone, NULL);
+   tpQueueFeed(32, AsyncJobDone, NULL);
+   return MicroTime() - llTime;
+} /* AsyncTicket() */
+
+static int TestAsync(int iType, int iMs)
+{
+static const char *szModes[] = {"Blocking", "Async", "Scan async", "Unreachable"};
+TP_PACING nopacing = {0, 0, 0};
+TP_DISCOVERY discovery = {SlowScanStart, SlowScanNext, SlowScanStop, NULL};
+TP_IDENTITY id;
+uint8_t *pRef;
+long long llWake, llRender, llTime;
+int i, iOK, iRefLen = 0, iErrors = 0, iSize = 1024 * 1024, iWidth = tpGetWidth();
+
+   memset(&slow, 0, sizeof(slow));
+   slow.transport.pfnWrite = SlowWrite;
+   slow.transport.pfnReconnect = SlowReconnect;
+   slow.iConnectMs = iMs;
+   iAsyncType = iType;
+   pRef = (uint8_t *)malloc(iSize);
+   cap.pBuf = (uint8_t *)malloc(iSize); cap.iBufSize = iSize;
+   tpSetTransport(&slow.transport, iType, szAdvertNames[iType]);
+   tpGetIdentity(&id); // what a board keeps from the last time
+   tpSetPacing(&nopacing);
+   tpSetPendingBuffer(ucPending, sizeof(ucPending));
+   tpSetDiscovery(&discovery);
+   tpStartQueue();
+   for (i=0; i<4; i++) {
+      tpDisconnect(); // asleep
+      tpCaptureReset(&cap);
+      slow.llFirst = slow.llStart = 0;
+      slow.bUnreachable = (i == 3);
+      bAsyncDone = iAsyncResult = iAsyncJobs = iAsyncFailed = 0;
+      llWake = MicroTime();
+      if (i == 0) {
+         SlowReconnect(&slow); // tpConnect()
+         tpSetTransport(&slow.transport, iType, szAdvertNames[iType]);
+         bAsyncDone = 1;
+      } else if (i == 2) {
+         tpScanAsync("", 5, iType, AsyncDone, NULL);
+      } else {
+         tpConnectAsync(&id, AsyncDone, NULL);
+      }
+      llRender = AsyncTicket(iWidth, iMs / 3);
+      while (!__atomic_load_n(&bAsyncDone, __ATOMIC_ACQUIRE))
+         usleep(100);
+      tpWaitQueue(-1);
+      llTime = MicroTime() - llWake;
+      if (i == 0) {
+         memcpy(pRef, cap.pBuf, cap.iBufLen);
+         iRefLen = cap.iBufLen;
+      }
+      if (i < 3) {
+         iOK = (iAsyncResult == 0 && iAsyncJobs == 3 && iAsyncFailed == 0 && slow.llFirst != 0 &&
+                cap.iBufLen == iRefLen && memcmp(cap.pBuf, pRef, iRefLen) == 0);
+         printf("%-12s first byte %.1f ms after waking up (connecting %d ms, rendering %.1f ms), done after %.1f ms, %d bytes: %s\n",
+                szModes[i], (slow.llFirst - llWake) / 1000.0, iMs, llRender / 1000.0, llTime / 1000.0, cap.iBufLen, iOK ? "OK" : "FAILED");
+      } else {
+         iOK = (iAsyncResult == -1 && iAsyncJobs == 3 && iAsyncFailed == 3 && cap.iBufLen == 0 && !tpIsConnected());
+         printf("%-12s gave up after %.1f ms, %d of %d jobs failed: %s\n", szModes[i], llTime / 1000.0, iAsyncFailed, iAsyncJobs, iOK ? "OK" : "FAILED");
+      }
+      iErrors += !iOK;
+   }
+   tpStopQueue();
+   tpSetDiscovery(NULL);
+   tpSetPendingBuffer(NULL, 0);
+   tpSetTransport(&cap.transport, iType, szTypes[iType]);
+   free(cap.pBuf);
+   cap.pBuf = NULL; cap.iBufSize = 0;
+   free(pRef);
+   return iErrors;
+} /* TestAsync() */
+
+static void ShowHelp(void)
+{
+   printf("Usage: tpbench [-t <printer type 0-%d>] [-n <iterations>] [-m <MTU>] [-p <lines/sec>] [-x] [-s <band lines>] [-a <ack us>] [-c] [-q <jobs>] [-S <step us>] [-r <ring size>] [-d <bytes>] [-v <metres>]\n"
+          "              [-b <interval us> [-L <loss %%>] [-Q <queue depth>]] [-T <port>] [-U <baud>] [-E <printers>] [-J <clients>] [-Z <MB>]\n"
+          "              [-W <recording>] [-R <recording>] [-C <ms>] [-P <ms>] [-I <identity>] [-D <devices>] [-H <cycles>]\n"
+          "              [-A <connect ms>]\n"
+          "              [-o <output file>]\n", PRINTER_COUNT-1);
+   printf("  Encodes typical jobs into a capture transport and reports\n");
+   printf("  the encode speed and the bytes which would go on the wire\n");
+   printf("  -m sets the link MTU reported by the capture transport (default unknown)\n");
+   printf("  -p runs a paced job against a simulated printer draining at the given\n");
+   printf("     speed (0 = the model speed) instead of the encoding tests\n");
+   printf("  -x the simulated printer sends XOff/XOn (cat printers)\n");
+   printf("  -s the simulated printer answers status queries (ESC/POS), sent\n");
+   printf("     every <band lines> scanlines\n");
+   printf("  -a compares the write modes against acks which take the given time\n");
+   printf("  -c lets consecutive calls share packets (auto flush off)\n");
+   printf("  -q queues the given number of jobs from a producer rendering\n");
+   printf("     into 2 buffers while a background thread prints them\n");
+   printf("  -S prints a paced job with tpPrintStep() and the given time budget\n");
+   printf("  -r checks that encoding into a transmit ring of the given size on one\n");
+   printf("     thread while another sends gives the same output (with -a, each\n");
+   printf("     write waits for its ack so the encoding overlaps the sending)\n");
+   printf("  -d drops the link every <bytes> bytes and checks that the job resumes\n");
+   printf("  -v prints a receipt of the given length on a virtual clock (with -p,\n");
+   printf("     -x or -s for the simulated printer) and reports the printer time\n");
+   printf("  -b sends the jobs through a simulated BLE link with the given connection\n");
+   printf("     interval to a simulated printer (-m MTU, -L packet loss, -Q stack\n");
+   printf("     queue depth, -x and -s for the flow control)\n");
+   printf("  -T sends the jobs over TCP to a local listener on the given port\n");
+   printf("     (0 = any) with each batching mode and checks the recorded stream\n");
+   printf("  -U sends the jobs at the given baud rate through a pseudo-terminal to a\n");
+   printf("     simulated printer, paced and with XON/XOFF flow control\n");
+   printf("  -E drives that many loopback printers from one thread (epoll), unpaced\n");
+   printf("     and paced at the model's print speed\n");
+   printf("  -J runs the print spooler with that many clients submitting jobs\n");
+   printf("  -Z hands a raster of that many megabytes from another process through\n");
+   printf("     shared memory and, to compare, through a socket\n");
+   printf("  -W records the receipt into a file, -R replays a recording (unpaced,\n");
+   printf("     then paced next to rendering the receipt again)\n");
+   printf("  -C cancels jobs that many ms after they start and checks that the\n");
+   printf("     printer is left ready for the next one\n");
+   printf("  -P queues a high priority ticket that many ms after a long low\n");
+   printf("     priority photo and reports how long it waits\n");
+   printf("  -I saves the printer identity in a file, or connects from it if the\n");
+   printf("     file exists (then prints the receipt)\n");
+   printf("  -D scans a simulated room with that many BLE devices for all of the\n");
+   printf("     printers and checks the ranking\n");
+   printf("  -H scans, connects and prints a ticket that many times and checks\n");
+   printf("     that the heap isn't touched\n");
+   printf("  -A prints a ticket right after waking up on a printer which takes that\n");
+   printf("     many ms to connect, rendering it after connecting and then while\n");
+   printf("     connecting (tpConnectAsync, tpScanAsync)\n");
+   printf("  -o writes the captured byte stream to a file (or - for stdout)\n");
+} /* ShowHelp() */
+
+int main(int argc, char *argv[])
+{
+int i, iType = PRINTER_MTP3, iCount = 20, fd = -1, iMTU = 0, iDrain = -1, iLatency = 0;
+int bFlow = 0, iBand = 0, bCoalesce = 0, iJobs = 0, iStep = -1, iRing = 0, iDrop = 0, iMetres = 0;
+int iInterval = 0, iLoss = 0, iQueue = 0, iTcpPort = -1, iBaud = 0, iLoop = 0, iSpoolClients = 0;
+int iShmMB = 0, iCancel = 0, iPriority = -1, iDevices = 0, iHeapCycles = 0, iConnectMs = -1;
+const char *szRecord = NULL, *szReplay = NULL, *szIdentity = NULL;
+TP_PACING nopacing = {0, 0, 0};
+int iWidth;
+
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+         iType = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+         iCount = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) {
+         iDrain = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+         iBand = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-q") == 0 && i+1 < argc) {
+         iJobs = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-S") == 0 && i+1 < argc) {
+         iStep = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+         iRing = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+         iDrop = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-b") == 0 && i+1 < argc) {
+         iInterval = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-A") == 0 && i+1 < argc) {
+         iConnectMs = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-H") == 0 && i+1 < argc) {
+         iHeapCycles = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-D") == 0 && i+1 < argc) {
+         iDevices = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-I") == 0 && i+1 < argc) {
+         szIdentity = argv[++i];
+      } else if (strcmp(argv[i], "-P") == 0 && i+1 < argc) {
+         iPriority = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-C") == 0 && i+1 < argc) {
+         iCancel = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-W") == 0 && i+1 < argc) {
+         szRecord = argv[++i];
+      } else if (strcmp(argv[i], "-R") == 0 && i+1 < argc) {
+         szReplay = argv[++i];
+      } else if (strcmp(argv[i], "-Z") == 0 && i+1 < argc) {
+         iShmMB = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-J") == 0 && i+1 < argc) {
+         iSpoolClients = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-E") == 0 && i+1 < argc) {
+         iLoop = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-U") == 0 && i+1 < argc) {
+         iBaud = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-T") == 0 && i+1 < argc) {
+         iTcpPort = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-L") == 0 && i+1 < argc) {
+         iLoss = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-Q") == 0 && i+1 < argc) {
+         iQueue = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-v") == 0 && i+1 < argc) {
+         iMetres = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-c") == 0) {
+         bCoalesce = 1;
+      } else if (strcmp(argv[i], "-x") == 0) {
+         bFlow = 1;
+      } else if (strcmp(argv[i], "-a") == 0 && i+1 < argc) {
+         iLatency = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-m") == 0 && i+1 < argc) {
+         iMTU = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+         i++;
+         if (strcmp(argv[i], "-") == 0)
+            fd = STDOUT_FILENO;
+         else
+            fd = open(argv[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         if (fd < 0) {
+            fprintf(stderr, "Error opening %s\n", argv[i]);
+            return -1;
+         }
+      } else {
+         ShowHelp();
+         return 0;
+      }
+   }
+   if (iType < 0 || iType >= PRINTER_COUNT || iCount < 1) {
+      ShowHelp();
+      return -1;
+   }
+   tpCaptureInit(&cap, fd, NULL, 0);
+   cap.iMTU = iMTU;
+   tpSetTransport(&cap.transport, iType, szTypes[iType]);
+   iWidth = tpGetWidth();
+   tpSetAutoFlush(!bCoalesce);
+   printf("Printer type %s, %d pixels wide, MTU %d, packet size %d\n", szTypes[iType], iWidth, iMTU, tpGetPacketSize());
+   DrawPage(iWidth, 1024);
+   if (iConnectMs >= 0) {
+      i = TestAsync(iType, iConnectMs);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iHeapCycles > 0) {
+      i = TestHeap(iHeapCycles);
+      tpDisconnect();
+      return i;
+   }
+   if (iDevices > 0) {
+      i = TestDiscovery(iDevices);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (szIdentity != NULL) {
+      i = TestIdentity(szIdentity);
+      tpDisconnect();
+      return i;
+   }
+   if (iPriority >= 0) {
+      i = TestPriority(iType, iPriority);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iCancel > 0) {
+      i = TestCancel(iType, iCancel);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (szRecord != NULL) {
+      i = WriteRecording(szRecord);
+      tpDisconnect();
+      return i;
+   }
+   if (szReplay != NULL) {
+      i = TestReplay(szReplay, iCount);
+      tpDisconnect();
+      return i;
+   }
+   if (iShmMB > 0) {
+      i = TestShm(iShmMB);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iSpoolClients > 0) {
+      i = TestSpool(iType, iSpoolClients);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iLoop > 0) {
+      i = TestLoop(iType, iLoop);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iBaud > 0) {
+      i = TestSerial(iType, iBaud);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iTcpPort >= 0) {
+      i = TestTcp(iType, iTcpPort, iCount);
+      tpDisconnect();
+      return (i == 0) ? 0 : -1;
+   }
+   if (iInterval > 0) {
+      TestBleSim(iType, iInterval, iMTU, iLoss, iQueue, bFlow, iBand);
+      return 0;
+   }
+   if (iMetres > 0) {
+      i = TestVirtual(iMetres, iDrain, bFlow, iBand);
+      tpDisconnect();
+      return i;
+   }
+   if (iDrop > 0) {
+      tpSetPacing(&nopacing);
+      i = TestResume(iDrop, iType);
+      tpDisconnect();
+      return i;
+   }
+   if (iRing > 0) {
+      tpSetPacing(&nopacing);
+      if (iLatency > 0) {
+         tpCaptureSetAckLatency(&cap, iLatency);
+         tpSetTransport(&cap.transport, iType, szTypes[iType]);
+      }
+      i = TestRing(iRing, iCount, iLatency);
+      tpDisconnect();
+      tpCaptureSetAckLatency(&cap, 0);
+      return (i == 0) ? 0 : -1;
+   }
+   if (iLatency > 0) {
+      tpCaptureSetAckLatency(&cap, iLatency);
+      TestWindow(iLatency);
+      tpDisconnect();
+      tpCaptureSetAckLatency(&cap, 0);
+      return 0;
+   }
+   if (iStep >= 0) {
+      TestStep(iStep, bFlow);
+      tpDisconnect();
+      return 0;
+   }
+   if (iJobs > 0) {
+      TestQueue(iJobs);
+      tpDisconnect();
+      return 0;
+   }
+   if (iDrain >= 0) {
+      i = TestPacing(iDrain, bFlow, iBand);
+      tpDisconnect();
+      return i;
+   }
+   tpSetPacing(&nopacing); // measure the encoder, not the printer speed
+   RunTest("PrintBuffer", TestBuffer, iCount);
+   tpSetBackBuffer(ucBackBuffer, iWidth, iWidth); // rotated output must be square
+   RunTest("BufferSide", TestBufferSide, iCount);
+   RunTest("CustomText", TestCustomText, iCount * 10);
+   RunTest("Feed", TestFeed, iCount);
+   RunTest("Receipt", Receipt, iCount);
+   tpDisconnect();
+   if (fd > STDOUT_FILENO)
+      close(fd);
+   return 0;
+} /* main() */
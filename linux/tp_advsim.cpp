@@ -0,0 +1,158 @@
+//
+// Simulated BLE advertisements for the Linux host build
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tp_advsim.h"
+
+#define ADV_DELAY 10000 // BLE adds up to 10ms to each interval (us)
+
+static const char *szPrinterNames[] = {"MPT-II", "MTP-2", "MPT-3", "GB01", "GB02", "GT01", "YHK-A133",
+                                       "PeriPage+", "PeriPage_", "T02", "MX06", "MX10"};
+static const char *szOtherNames[] = {"", "iPhone", "Galaxy S10", "JBL Flip 5", "Mi Band 4", "LE-Bose QC35",
+                                     "Tile", "[TV] Samsung", "MX Master 3", "GB", "MPT", "Peri"};
+
+static int AdvSimStart(void *pUser)
+{
+TP_ADVSIM *pSim = (TP_ADVSIM *)pUser;
+long long llNow = tpVClockNow(pSim->pClock);
+int i;
+
+   for (i=0; i<pSim->iDevices; i++) { // each one is somewhere in its interval
+      pSim->devices[i].llNext = llNow + (rand_r(&pSim->uiSeed) % (pSim->devices[i].iInterval * 1000));
+      pSim->devices[i].iSent = 0;
+      pSim->devices[i].iStrongest = -128;
+   }
+   pSim->iFirstPrinter = -1;
+   return (pSim->iDevices > 0);
+} /* AdvSimStart() */
+
+static int AdvSimNext(void *pUser, TP_ADVERT *pAdvert, int iWait)
+{
+TP_ADVSIM *pSim = (TP_ADVSIM *)pUser;
+TP_ADVSIM_DEVICE *pDev;
+long long llNow = tpVClockNow(pSim->pClock), llEnd = llNow + iWait * 1000LL;
+int i, iNext, iRSSI;
+
+   while (1) {
+      iNext = 0;
+      for (i=1; i<pSim->iDevices; i++) {
+         if (pSim->devices[i].llNext < pSim->devices[iNext].llNext)
+            iNext = i;
+      }
+      pDev = &pSim->devices[iNext];
+      if (pDev->llNext > llEnd) { // nothing heard in time
+         tpVClockAdvance(pSim->pClock, llEnd - llNow);
+         return 0;
+      }
+      if (pDev->llNext > llNow) {
+         tpVClockAdvance(pSim->pClock, pDev->llNext - llNow);
+         llNow = pDev->llNext;
+      }
+      pDev->llNext += pDev->iInterval * 1000LL + rand_r(&pSim->uiSeed) % ADV_DELAY;
+      if (pSim->iLossPercent > 0 && (int)(rand_r(&pSim->uiSeed) % 100) < pSim->iLossPercent)
+         continue; // missed it
+      iRSSI = pDev->iRSSI;
+      if (pSim->iNoise > 0)
+         iRSSI += (int)(rand_r(&pSim->uiSeed) % (2 * pSim->iNoise + 1)) - pSim->iNoise;
+      if (iRSSI > -20) iRSSI = -20;
+      if (iRSSI < -127) iRSSI = -127;
+      memcpy(pAdvert->ucAddress, pDev->ucAddress, 6);
+      pAdvert->bRandom = 0;
+      pAdvert->cRSSI = (int8_t)iRSSI;
+      strcpy(pAdvert->szName, pDev->szName);
+      pDev->iSent++;
+      if (iRSSI > pDev->iStrongest)
+         pDev->iStrongest = iRSSI;
+      if (pDev->bPrinter && pSim->iFirstPrinter < 0)
+         pSim->iFirstPrinter = iNext;
+      pSim->llAdverts++;
+      return 1;
+   }
+} /* AdvSimNext() */
+
+static void AdvSimStop(void *pUser)
+{
+   (void)pUser;
+} /* AdvSimStop() */
+
+void tpAdvSimInit(TP_ADVSIM *pSim, TP_VCLOCK *pClock, unsigned int uiSeed)
+{
+   memset(pSim, 0, sizeof(TP_ADVSIM));
+   pSim->discovery.pfnStart = AdvSimStart;
+   pSim->discovery.pfnNext = AdvSimNext;
+   pSim->discovery.pfnStop = AdvSimStop;
+   pSim->discovery.pUser = pSim;
+   pSim->pClock = pClock;
+   pSim->uiSeed = uiSeed;
+   pSim->iFirstPrinter = -1;
+} /* tpAdvSimInit() */
+
+int tpAdvSimAdd(TP_ADVSIM *pSim, const char *szName, int iRSSI, int iInterval)
+{
+TP_ADVSIM_DEVICE *pDev;
+int i;
+
+   if (pSim->iDevices >= TP_ADVSIM_DEVICES || iInterval < 1)
+      return -1;
+   pDev = &pSim->devices[pSim->iDevices];
+   memset(pDev, 0, sizeof(TP_ADVSIM_DEVICE));
+   do {
+      for (i=0; i<6; i++)
+         pDev->ucAddress[i] = (uint8_t)rand_r(&pSim->uiSeed);
+   } while (tpAdvSimFind(pSim, pDev->ucAddress) >= 0);
+   strncpy(pDev->szName, szName, sizeof(pDev->szName)-1);
+   pDev->iRSSI = iRSSI;
+   pDev->iInterval = iInterval;
+   pDev->iStrongest = -128;
+   return pSim->iDevices++;
+} /* tpAdvSimAdd() */
+
+void tpAdvSimRoom(TP_ADVSIM *pSim, int iDevices, int iPrinters)
+{
+static const int iIntervals[] = {20, 100, 152, 318, 500, 1000};
+char szName[32];
+int i, iDev;
+
+   for (i=0; i<iDevices; i++) {
+      if (i < iPrinters) {
+         strcpy(szName, szPrinterNames[rand_r(&pSim->uiSeed) % (sizeof(szPrinterNames) / sizeof(char *))]);
+         if (strncmp(szName, "PeriPage", 8) == 0) // these have 2 bytes of the address after the name
+            sprintf(&szName[9], "%02X%02X", rand_r(&pSim->uiSeed) & 0xff, rand_r(&pSim->uiSeed) & 0xff);
+         iDev = tpAdvSimAdd(pSim, szName, -40 - (int)(rand_r(&pSim->uiSeed) % 55), iIntervals[1 + rand_r(&pSim->uiSeed) % 5]);
+      } else {
+         strcpy(szName, szOtherNames[rand_r(&pSim->uiSeed) % (sizeof(szOtherNames) / sizeof(char *))]);
+         iDev = tpAdvSimAdd(pSim, szName, -30 - (int)(rand_r(&pSim->uiSeed) % 70), iIntervals[rand_r(&pSim->uiSeed) % 6]);
+      }
+      if (iDev >= 0)
+         pSim->devices[iDev].bPrinter = (i < iPrinters);
+   }
+} /* tpAdvSimRoom() */
+
+int tpAdvSimFind(TP_ADVSIM *pSim, const uint8_t *pAddress)
+{
+int i;
+
+   for (i=0; i<pSim->iDevices; i++) {
+      if (memcmp(pSim->devices[i].ucAddress, pAddress, 6) == 0)
+         return i;
+   }
+   return -1;
+} /* tpAdvSimFind() */
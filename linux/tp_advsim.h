@@ -0,0 +1,81 @@
+//
+// Simulated BLE advertisements for the Linux host build
+// A discovery backend (see tpSetDiscovery) which runs on a virtual
+// clock (tp_vclock.h) and plays a room full of devices advertising at
+// their own intervals: supported printers mixed in with phones, watches
+// and speakers. Each advertisement has a signal strength which varies
+// around the device's own level, and some are missed the way a real
+// radio misses them. The simulator remembers what it sent so that the
+// results of tpScanAll() can be checked.
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_ADVSIM_H__
+#define __TP_ADVSIM_H__
+
+#include "Thermal_Printer.h"
+#include "tp_vclock.h"
+
+#define TP_ADVSIM_DEVICES 1024
+
+typedef struct tagTP_ADVSIM_DEVICE
+{
+  uint8_t ucAddress[6];
+  char szName[32];
+  int bPrinter;      // one of the supported printers
+  int iRSSI;         // average signal strength (dBm)
+  int iInterval;     // advertising interval (ms)
+  long long llNext;  // when it advertises next (virtual us)
+  // what was sent
+  int iSent;         // advertisements heard by the scanner
+  int iStrongest;    // strongest RSSI heard
+} TP_ADVSIM_DEVICE;
+
+typedef struct tagTP_ADVSIM
+{
+  TP_DISCOVERY discovery; // pass &sim.discovery to tpSetDiscovery()
+  TP_VCLOCK *pClock;
+  int iDevices;
+  int iNoise;        // the RSSI of each advertisement varies by up to +/- this
+  int iLossPercent;  // chance (0-100) that an advertisement is missed
+  unsigned int uiSeed;
+  int iFirstPrinter; // the first printer heard since the scan started (-1 = none)
+  long long llAdverts; // advertisements delivered
+  TP_ADVSIM_DEVICE devices[TP_ADVSIM_DEVICES];
+} TP_ADVSIM;
+
+//
+// Prepare an empty room on a virtual clock
+//
+void tpAdvSimInit(TP_ADVSIM *pSim, TP_VCLOCK *pClock, unsigned int uiSeed);
+//
+// Add a device with a random address
+// returns its index or -1 if the room is full
+//
+int tpAdvSimAdd(TP_ADVSIM *pSim, const char *szName, int iRSSI, int iInterval);
+//
+// Fill the room with iDevices devices, iPrinters of them supported
+// printers, at random distances and intervals
+//
+void tpAdvSimRoom(TP_ADVSIM *pSim, int iDevices, int iPrinters);
+//
+// Returns the index of the device with this address or -1
+//
+int tpAdvSimFind(TP_ADVSIM *pSim, const uint8_t *pAddress);
+
+#endif // __TP_ADVSIM_H__
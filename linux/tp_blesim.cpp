@@ -0,0 +1,493 @@
+//
+// BLE link and printer simulator for the Linux host build
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tp_blesim.h"
+
+// decoder states
+enum {
+  SIM_IDLE=0, // text or the start of a command
+  SIM_CMD,    // command header
+  SIM_RASTER, // GS v 0 image data
+  SIM_BLOCK,  // data of a known length (GS ( k, GS k, cat commands)
+  SIM_NUL     // NUL terminated barcode data
+};
+#define SIM_CAT_DOTS 384 // width of the cat printers' head
+#define SIM_TEXT_DENSITY 10 // % of the dots which are black in a line of text
+#define SIM_CODE_DENSITY 50 // same for barcodes and QR codes
+#define SIM_QR_LINES 100
+
+static uint8_t ucXOff[] = {0x51, 0x78, 0xAE, 0x01, 0x01, 0x00, 0x10, 0x70, 0xFF};
+static uint8_t ucXOn[] = {0x51, 0x78, 0xAE, 0x01, 0x01, 0x00, 0x00, 0x00, 0xFF};
+static void SimKick(TP_BLESIM *pSim);
+
+//
+// Free the buffer space of printed data
+//
+static void SimFree(TP_BLESIM *pSim, int iBytes)
+{
+   pSim->dFill -= iBytes;
+   if (pSim->dFill < 0.0) // the bytes lost to an overflow were decoded too
+      pSim->dFill = 0.0;
+   if (pSim->bXOff && pSim->dFill <= pSim->config.iBufferSize / 4) {
+      pSim->bXOff = 0;
+      pSim->bXOnPending = 1;
+   }
+} /* SimFree() */
+//
+// The print head finished the item at the head of the queue
+//
+static void SimHeadDone(void *pArg)
+{
+TP_BLESIM *pSim = (TP_BLESIM *)pArg;
+TP_BLESIM_ITEM *pItem = &pSim->items[pSim->iItemHead];
+
+   SimFree(pSim, pItem->iBytes);
+   pSim->llLines += pItem->iLines;
+   pSim->llLast = tpVClockNow(pSim->pClock);
+   pSim->iItemHead = (pSim->iItemHead + 1) % TP_BLESIM_ITEMS;
+   pSim->iItems--;
+   pSim->bHeadBusy = 0;
+   SimKick(pSim);
+} /* SimHeadDone() */
+//
+// Start the print head on the next item (if it's idle)
+//
+static void SimKick(TP_BLESIM *pSim)
+{
+TP_BLESIM_ITEM *pItem;
+long long llNow = tpVClockNow(pSim->pClock);
+
+   while (!pSim->bHeadBusy && pSim->iItems > 0) {
+      pItem = &pSim->items[pSim->iItemHead];
+      if (pItem->bStatus && pSim->config.bStatus) { // everything before it has printed
+         pSim->iStatusPending++;
+         pSim->llStatus++;
+      }
+      if (pItem->iMicros == 0) { // commands take no time
+         SimFree(pSim, pItem->iBytes);
+         pSim->iItemHead = (pSim->iItemHead + 1) % TP_BLESIM_ITEMS;
+         pSim->iItems--;
+         continue;
+      }
+      if (pSim->llIdleFrom != 0) { // the head was waiting for data
+         pSim->llIdle += llNow - pSim->llIdleFrom;
+         pSim->llIdleFrom = 0;
+      }
+      if (pSim->llFirst == 0)
+         pSim->llFirst = llNow;
+      pSim->bHeadBusy = 1;
+      tpVClockSchedule(pSim->pClock, llNow + pItem->iMicros, SimHeadDone, pSim);
+   }
+   if (!pSim->bHeadBusy && pSim->llFirst != 0 && pSim->llIdleFrom == 0)
+      pSim->llIdleFrom = llNow;
+} /* SimKick() */
+//
+// Queue the decoded work for the print head; iLines scanlines
+// with iDots of every iWidth dots black
+//
+static void SimAddItem(TP_BLESIM *pSim, int iLines, int iDots, int iWidth, int bStatus)
+{
+TP_BLESIM_ITEM *pItem;
+int iMicros = 0;
+
+   if (iLines > 0) {
+      iMicros = pSim->config.iBlankLineMicros;
+      if (iWidth > 0)
+         iMicros += (int)(((long long)(pSim->config.iBlackLineMicros - pSim->config.iBlankLineMicros) * iDots) / iWidth);
+      iMicros *= iLines;
+   }
+   if (iMicros == 0 && !bStatus && pSim->iItems > 0) { // merge the commands which take no time
+      pItem = &pSim->items[(pSim->iItemTail + TP_BLESIM_ITEMS - 1) % TP_BLESIM_ITEMS];
+      if (pItem->iMicros == 0 && !pItem->bStatus) {
+         pItem->iBytes += pSim->iItemBytes;
+         pSim->iItemBytes = 0;
+         return;
+      }
+   }
+   if (pSim->iItems >= TP_BLESIM_ITEMS) { // way past an overflow
+      pSim->llLostItems++;
+      SimFree(pSim, pSim->iItemBytes);
+      pSim->iItemBytes = 0;
+      return;
+   }
+   pItem = &pSim->items[pSim->iItemTail];
+   pItem->iBytes = pSim->iItemBytes;
+   pItem->iLines = iLines;
+   pItem->iMicros = iMicros;
+   pItem->bStatus = bStatus;
+   pSim->iItemBytes = 0;
+   pSim->iItemTail = (pSim->iItemTail + 1) % TP_BLESIM_ITEMS;
+   pSim->iItems++;
+   SimKick(pSim);
+} /* SimAddItem() */
+//
+// Decode the header of an ESC/POS command
+//
+static void SimEscPosCmd(TP_BLESIM *pSim)
+{
+uint8_t *p = pSim->ucCmd;
+int n = pSim->iCmdLen;
+
+   if (p[0] == 0x10) { // PeriPage command prefix (10 ff fe 01)
+      if (n == 4 || p[n-1] != (uint8_t)"\x10\xff\xfe\x01"[n-1])
+         pSim->iState = SIM_IDLE;
+      return;
+   }
+   if (p[0] == 0x1b) { // ESC
+      if (n == 2 && p[1] == '@') { // reset
+         pSim->iTextLines = 30;
+         pSim->iState = SIM_IDLE;
+      } else if (n == 2 && strchr("a!E-dJ3", p[1]) == NULL) {
+         pSim->iState = SIM_IDLE; // unknown
+      } else if (n == 3) {
+         if (p[1] == 'd') // feed n lines of text
+            SimAddItem(pSim, p[2] * pSim->iTextLines, 0, 1, 0);
+         else if (p[1] == 'J') // feed n dots
+            SimAddItem(pSim, p[2], 0, 1, 0);
+         else if (p[1] == '!') // font, 9x17 or 12x24 (+ spacing), maybe double tall
+            pSim->iTextLines = (((p[2] & 1) ? 17 : 24) * ((p[2] & 0x10) ? 2 : 1)) + 6;
+         pSim->iState = SIM_IDLE;
+      }
+      return;
+   }
+   // GS
+   if (n == 2) {
+      if (strchr("v(krhHw!", p[1]) == NULL)
+         pSim->iState = SIM_IDLE; // unknown
+      return;
+   }
+   switch (p[1]) {
+      case 'v': // GS v 0 m xL xH yL yH <data>
+         if (n == 8) {
+            pSim->iRowBytes = p[4] | (p[5] << 8);
+            pSim->iRows = p[6] | (p[7] << 8);
+            pSim->iRowLeft = pSim->iRowBytes;
+            pSim->iRowDots = 0;
+            pSim->iState = (pSim->iRows > 0 && pSim->iRowBytes > 0) ? SIM_RASTER : SIM_IDLE;
+         }
+         break;
+      case '(': // GS ( k pL pH <data> (QR code)
+         if (n == 5) {
+            pSim->iDataLeft = p[3] | (p[4] << 8);
+            pSim->iBlockFn = pSim->iBlockPos = 0;
+            pSim->iState = (pSim->iDataLeft > 0) ? SIM_BLOCK : SIM_IDLE;
+         }
+         break;
+      case 'k': // GS k m <data> NUL or GS k m n <data>
+         if (n == 3 && p[2] <= 6) {
+            pSim->iState = SIM_NUL;
+         } else if (n == 4) {
+            pSim->iDataLeft = p[3];
+            pSim->iBlockFn = 'k';
+            pSim->iState = SIM_BLOCK;
+            if (p[3] == 0) {
+               SimAddItem(pSim, pSim->iBarHeight, SIM_CODE_DENSITY, 100, 0);
+               pSim->iState = SIM_IDLE;
+            }
+         }
+         break;
+      default: // 1 byte parameter
+         if (p[1] == 'r') // status query
+            SimAddItem(pSim, 0, 0, 1, 1);
+         else if (p[1] == 'h') // barcode height
+            pSim->iBarHeight = p[2];
+         pSim->iState = SIM_IDLE;
+         break;
+   }
+} /* SimEscPosCmd() */
+//
+// Decode one byte of ESC/POS data
+//
+static void SimEscPos(TP_BLESIM *pSim, uint8_t c)
+{
+   pSim->iItemBytes++;
+   switch (pSim->iState) {
+      case SIM_IDLE:
+         if (c == 0x1b || c == 0x1d || c == 0x10) {
+            pSim->ucCmd[0] = c;
+            pSim->iCmdLen = 1;
+            pSim->iState = SIM_CMD;
+         } else if (c == 0x0a) { // print the line of text
+            SimAddItem(pSim, pSim->iTextLines, SIM_TEXT_DENSITY, 100, 0);
+         }
+         break;
+      case SIM_CMD:
+         pSim->ucCmd[pSim->iCmdLen++] = c;
+         SimEscPosCmd(pSim);
+         break;
+      case SIM_RASTER:
+         pSim->iRowDots += __builtin_popcount(c);
+         if (--pSim->iRowLeft == 0) { // print the scanline
+            SimAddItem(pSim, 1, pSim->iRowDots, pSim->iRowBytes * 8, 0);
+            pSim->iRowDots = 0;
+            pSim->iRowLeft = pSim->iRowBytes;
+            if (--pSim->iRows == 0)
+               pSim->iState = SIM_IDLE;
+         }
+         break;
+      case SIM_BLOCK:
+         if (pSim->iBlockFn != 'k' && pSim->iBlockPos++ == 1)
+            pSim->iBlockFn = c; // GS ( k cn fn
+         if (--pSim->iDataLeft == 0) {
+            if (pSim->iBlockFn == 0x51) // print the QR code
+               SimAddItem(pSim, SIM_QR_LINES, SIM_CODE_DENSITY, 100, 0);
+            else if (pSim->iBlockFn == 'k')
+               SimAddItem(pSim, pSim->iBarHeight, SIM_CODE_DENSITY, 100, 0);
+            pSim->iState = SIM_IDLE;
+         }
+         break;
+      case SIM_NUL:
+         if (c == 0) {
+            SimAddItem(pSim, pSim->iBarHeight, SIM_CODE_DENSITY, 100, 0);
+            pSim->iState = SIM_IDLE;
+         }
+         break;
+   }
+} /* SimEscPos() */
+//
+// Decode one byte of cat printer data
+// 51 78 cmd 00 lenL lenH <data> crc ff
+//
+static void SimCat(TP_BLESIM *pSim, uint8_t c)
+{
+   pSim->iItemBytes++;
+   if (pSim->iState != SIM_BLOCK) { // header
+      pSim->ucCmd[pSim->iCmdLen++] = c;
+      if ((pSim->iCmdLen == 1 && c != 0x51) || (pSim->iCmdLen == 2 && c != 0x78)) {
+         pSim->iCmdLen = 0; // not in step; look for the next command
+      } else if (pSim->iCmdLen == 6) {
+         pSim->iRowBytes = pSim->ucCmd[4] | (pSim->ucCmd[5] << 8);
+         pSim->iDataLeft = pSim->iRowBytes + 2; // + crc and ff
+         pSim->iBlockPos = pSim->iRowDots = 0;
+         pSim->iState = SIM_BLOCK;
+      }
+      return;
+   }
+   if (pSim->iBlockPos < pSim->iRowBytes) {
+      if (pSim->ucCmd[2] == 0xa2) // scanline
+         pSim->iRowDots += __builtin_popcount(c);
+      else if (pSim->ucCmd[2] == 0xa1 && pSim->iBlockPos < 2) // feed (8 or 16 bits)
+         pSim->iRowDots |= c << (8 * pSim->iBlockPos);
+   }
+   pSim->iBlockPos++;
+   if (--pSim->iDataLeft == 0) {
+      if (pSim->ucCmd[2] == 0xa2)
+         SimAddItem(pSim, 1, pSim->iRowDots, SIM_CAT_DOTS, 0);
+      else if (pSim->ucCmd[2] == 0xa1)
+         SimAddItem(pSim, pSim->iRowDots, 0, 1, 0);
+      pSim->iCmdLen = 0;
+      pSim->iState = SIM_IDLE;
+   }
+} /* SimCat() */
+//
+// A packet reached the printer
+//
+static void SimReceive(TP_BLESIM *pSim, uint8_t *pData, int iLen)
+{
+int i, iRoom;
+
+   iRoom = pSim->config.iBufferSize - (int)pSim->dFill;
+   if (iLen > iRoom) { // the rest is lost
+      pSim->llOverflow += iLen - iRoom;
+      pSim->dFill = pSim->config.iBufferSize;
+   } else {
+      pSim->dFill += iLen;
+   }
+   if ((int)pSim->dFill > pSim->iPeak)
+      pSim->iPeak = (int)pSim->dFill;
+   for (i=0; i<iLen; i++) {
+      if (pSim->config.iPrinterType == PRINTER_CAT)
+         SimCat(pSim, pData[i]);
+      else
+         SimEscPos(pSim, pData[i]);
+   }
+   if (pSim->config.bFlowControl && !pSim->bXOff && pSim->dFill > (pSim->config.iBufferSize * 3) / 4) {
+      pSim->bXOff = 1;
+      pSim->bXOnPending = 0;
+      pSim->llXOffs++;
+      tpNotify(ucXOff, sizeof(ucXOff)); // goes back in the same connection event
+   }
+} /* SimReceive() */
+//
+// A connection event; send the queued packets which fit and
+// bring back the printer's notifications
+//
+static void SimConnEvent(void *pArg)
+{
+TP_BLESIM *pSim = (TP_BLESIM *)pArg;
+uint8_t ucStatus = 0; // paper present
+int i;
+
+   pSim->llEvents++;
+   for (i=0; i<pSim->config.iPacketsPerEvent && pSim->iQueued > 0; i++) {
+      if (pSim->config.iLossPercent > 0 && (int)(rand_r(&pSim->config.uiSeed) % 100) < pSim->config.iLossPercent) {
+         pSim->llResends++; // no ack; the event ends and the packet goes again
+         break;
+      }
+      SimReceive(pSim, pSim->ucQueue[pSim->iQueueTail], pSim->iQueueLen[pSim->iQueueTail]);
+      pSim->iQueueTail = (pSim->iQueueTail + 1) % TP_BLESIM_QUEUE;
+      pSim->iQueued--;
+      pSim->llDelivered++;
+   }
+   if (pSim->bXOnPending) {
+      pSim->bXOnPending = 0;
+      tpNotify(ucXOn, sizeof(ucXOn));
+   }
+   while (pSim->iStatusPending > 0) {
+      pSim->iStatusPending--;
+      tpNotify(&ucStatus, 1);
+   }
+   pSim->llNextEvent += pSim->config.iConnInterval;
+   tpVClockSchedule(pSim->pClock, pSim->llNextEvent, SimConnEvent, pSim);
+} /* SimConnEvent() */
+//
+// Let the clock run to the next connection event
+//
+static void SimWaitEvent(TP_BLESIM *pSim)
+{
+long long llWait = pSim->llNextEvent - tpVClockNow(pSim->pClock);
+
+   tpVClockAdvance(pSim->pClock, (llWait > 0) ? llWait : 1);
+} /* SimWaitEvent() */
+
+static int SimWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse)
+{
+TP_BLESIM *pSim = (TP_BLESIM *)pUser;
+long long llStart, llPacket;
+
+   if (iLen > pSim->config.iMTU - 3 || iLen > TP_BLESIM_PAYLOAD) {
+      pSim->llOversize++; // the stack rejects it
+      return -1;
+   }
+   if (pSim->iQueued >= pSim->config.iQueueDepth) { // the stack blocks until there's room
+      llStart = tpVClockNow(pSim->pClock);
+      pSim->llStalls++;
+      while (pSim->iQueued >= pSim->config.iQueueDepth)
+         SimWaitEvent(pSim);
+      pSim->llStallTime += tpVClockNow(pSim->pClock) - llStart;
+   }
+   memcpy(pSim->ucQueue[pSim->iQueueHead], pData, iLen);
+   pSim->iQueueLen[pSim->iQueueHead] = iLen;
+   pSim->iQueueHead = (pSim->iQueueHead + 1) % TP_BLESIM_QUEUE;
+   pSim->iQueued++;
+   pSim->llSent++;
+   pSim->llBytes += iLen;
+   pSim->llWrites++;
+   if (bWithResponse) { // wait for the packet to go and the response to come back
+      llPacket = pSim->llSent;
+      while (pSim->llDelivered < llPacket)
+         SimWaitEvent(pSim);
+      SimWaitEvent(pSim);
+   }
+   return iLen;
+} /* SimWrite() */
+
+static int SimGetMTU(void *pUser)
+{
+   return ((TP_BLESIM *)pUser)->config.iMTU;
+} /* SimGetMTU() */
+
+void tpBleSimDefaults(TP_BLESIM_CONFIG *pConfig, int iPrinterType, int iLinesPerSec, int iBufferSize)
+{
+int iLineMicros;
+
+   memset(pConfig, 0, sizeof(TP_BLESIM_CONFIG));
+   pConfig->iPrinterType = iPrinterType;
+   pConfig->iConnInterval = 15000;
+   pConfig->iMTU = 185;
+   pConfig->iPacketsPerEvent = 4;
+   pConfig->iQueueDepth = 10;
+   pConfig->uiSeed = 1;
+   pConfig->iBufferSize = iBufferSize;
+   // a line with 1/3 of the dots black prints at iLinesPerSec
+   iLineMicros = (iLinesPerSec > 0) ? 1000000 / iLinesPerSec : 0;
+   pConfig->iBlankLineMicros = iLineMicros / 2;
+   pConfig->iBlackLineMicros = iLineMicros * 2;
+   pConfig->bFlowControl = (iPrinterType == PRINTER_CAT);
+   pConfig->bStatus = (iPrinterType != PRINTER_CAT);
+} /* tpBleSimDefaults() */
+
+void tpBleSimReset(TP_BLESIM *pSim)
+{
+   pSim->llBytes = pSim->llWrites = pSim->llEvents = pSim->llResends = 0;
+   pSim->llStalls = pSim->llStallTime = pSim->llOversize = 0;
+   pSim->llLines = pSim->llOverflow = pSim->llIdle = pSim->llXOffs = 0;
+   pSim->llStatus = pSim->llLostItems = 0;
+   pSim->llFirst = pSim->llLast = pSim->llIdleFrom = 0;
+   pSim->iPeak = 0;
+} /* tpBleSimReset() */
+
+void tpBleSimInit(TP_BLESIM *pSim, TP_VCLOCK *pClock, const TP_BLESIM_CONFIG *pConfig)
+{
+   memset(pSim, 0, sizeof(TP_BLESIM));
+   pSim->config = *pConfig;
+   if (pSim->config.iQueueDepth > TP_BLESIM_QUEUE)
+      pSim->config.iQueueDepth = TP_BLESIM_QUEUE;
+   if (pSim->config.iQueueDepth < 1)
+      pSim->config.iQueueDepth = 1;
+   if (pSim->config.iPacketsPerEvent < 1)
+      pSim->config.iPacketsPerEvent = 1;
+   pSim->pClock = pClock;
+   pSim->iTextLines = 30; // 12x24 font + line spacing
+   pSim->iBarHeight = 162; // ESC/POS default
+   pSim->transport.pfnWrite = SimWrite;
+   pSim->transport.pfnGetMTU = SimGetMTU;
+   pSim->transport.pUser = (void *)pSim;
+   pSim->llNextEvent = tpVClockNow(pClock) + pSim->config.iConnInterval;
+   tpVClockSchedule(pClock, pSim->llNextEvent, SimConnEvent, pSim);
+} /* tpBleSimInit() */
+
+void tpBleSimFinish(TP_BLESIM *pSim)
+{
+int i;
+
+   // give up after a simulated hour (e.g. the printer is stuck in a command)
+   for (i=0; i<3600000000LL / pSim->config.iConnInterval; i++) {
+      if (pSim->iQueued == 0 && pSim->iItems == 0 && !pSim->bHeadBusy)
+         break;
+      SimWaitEvent(pSim);
+   }
+} /* tpBleSimFinish() */
+
+double tpBleSimLinesPerSec(TP_BLESIM *pSim)
+{
+   if (pSim->llLast <= pSim->llFirst)
+      return 0.0;
+   return pSim->llLines * 1000000.0 / (double)(pSim->llLast - pSim->llFirst);
+} /* tpBleSimLinesPerSec() */
+
+void tpBleSimPrintStats(TP_BLESIM *pSim, const char *szLabel)
+{
+   printf("%s: %.1f lines/s (%lld lines in %.2f s), overflow %lld bytes, head idle %.1f ms, buffer peak %d of %d\n",
+          szLabel, tpBleSimLinesPerSec(pSim), pSim->llLines, (pSim->llLast - pSim->llFirst) / 1000000.0,
+          pSim->llOverflow, pSim->llIdle / 1000.0, pSim->iPeak, pSim->config.iBufferSize);
+   printf("  link: %lld bytes in %lld writes, %lld events (%.2f packets/event), %lld resends, %lld queue stalls (%.1f ms)",
+          pSim->llBytes, pSim->llWrites, pSim->llEvents,
+          pSim->llEvents ? (double)pSim->llWrites / (double)pSim->llEvents : 0.0,
+          pSim->llResends, pSim->llStalls, pSim->llStallTime / 1000.0);
+   if (pSim->llOversize)
+      printf(", %lld oversize writes", pSim->llOversize);
+   printf("\n");
+   if (pSim->llXOffs || pSim->llStatus)
+      printf("  printer: %lld XOffs, %lld status replies\n", pSim->llXOffs, pSim->llStatus);
+} /* tpBleSimPrintStats() */
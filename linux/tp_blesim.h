@@ -0,0 +1,132 @@
+//
+// BLE link and printer simulator for the Linux host build
+// A transport which runs on a virtual clock (tp_vclock.h) and models
+// the parts of a BLE printer which decide how fast a job prints:
+// - the link: connection interval, ATT MTU, packets per connection event,
+//   the depth of the stack's write without response queue and packet
+//   loss (a lost packet is resent at the next connection event)
+// - the printer: a finite input buffer and a print head which takes
+//   longer on dark lines than on blank ones. The printer decodes the
+//   ESC/POS or cat printer stream to find the scanlines and answers
+//   status queries (GS r 1) and sends XOff/XOn (cat) like the real ones
+// It reports the lines/second achieved, buffer overflows and the time
+// the print head was starved for data.
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_BLESIM_H__
+#define __TP_BLESIM_H__
+
+#include "Thermal_Printer.h"
+#include "tp_vclock.h"
+
+#define TP_BLESIM_QUEUE 64   // most packets the stack queue can hold
+#define TP_BLESIM_PAYLOAD 512 // largest packet
+#define TP_BLESIM_ITEMS 4096  // decoded printer work waiting in the buffer
+
+typedef struct tagTP_BLESIM_CONFIG
+{
+  int iPrinterType;    // PRINTER_xxx (selects the command decoder)
+  // link
+  int iConnInterval;   // connection interval (us)
+  int iMTU;            // ATT MTU; packets carry up to MTU-3 bytes
+  int iPacketsPerEvent; // packets sent in each connection event
+  int iQueueDepth;     // write without response packets the stack holds
+  int iLossPercent;    // chance (0-100) that a packet has to be resent
+  unsigned int uiSeed; // for the packet loss
+  // printer
+  int iBufferSize;     // input buffer (bytes)
+  int iBlankLineMicros; // time to print a blank scanline
+  int iBlackLineMicros; // time to print an all black scanline
+  int bFlowControl;    // send XOff at 3/4 full and XOn at 1/4 (cat printers)
+  int bStatus;         // answer status queries (GS r 1)
+} TP_BLESIM_CONFIG;
+
+typedef struct tagTP_BLESIM_ITEM
+{
+  int iBytes;  // buffer bytes it occupies
+  int iLines;  // scanlines printed or fed
+  int iMicros; // print time
+  int bStatus; // status query
+} TP_BLESIM_ITEM;
+
+typedef struct tagTP_BLESIM
+{
+  TP_TRANSPORT transport; // pass &sim.transport to tpSetTransport()
+  TP_BLESIM_CONFIG config;
+  TP_VCLOCK *pClock;
+  // link
+  uint8_t ucQueue[TP_BLESIM_QUEUE][TP_BLESIM_PAYLOAD];
+  int iQueueLen[TP_BLESIM_QUEUE];
+  int iQueueHead, iQueueTail, iQueued;
+  long long llSent;      // packets accepted from the library
+  long long llDelivered; // packets which reached the printer
+  long long llNextEvent; // time of the next connection event
+  int bXOnPending, iStatusPending; // notifications for the next event
+  // printer decoder
+  int iState;
+  uint8_t ucCmd[8];
+  int iCmdLen;
+  int iDataLeft, iRowBytes, iRows, iRowLeft, iRowDots, iBlockFn, iBlockPos;
+  int iItemBytes;      // bytes decoded towards the next work item
+  int iTextLines;      // scanlines per line of text (ESC !)
+  int iBarHeight;      // barcode height (GS h)
+  // printer buffer and head
+  TP_BLESIM_ITEM items[TP_BLESIM_ITEMS];
+  int iItemHead, iItemTail, iItems;
+  double dFill;        // bytes in the buffer
+  int bHeadBusy, bXOff;
+  long long llIdleFrom; // the head ran out of work at this time (0 = busy or not started)
+  long long llFirst, llLast; // first line started, last line finished
+  // statistics
+  long long llBytes, llWrites, llEvents, llResends;
+  long long llStalls;    // writes which waited for room in the stack queue
+  long long llStallTime; // us
+  long long llOversize;  // writes larger than MTU-3 (rejected)
+  long long llLines, llOverflow, llIdle, llXOffs, llStatus, llLostItems;
+  int iPeak;
+} TP_BLESIM;
+
+//
+// Fill in typical link values and a printer which consumes iLinesPerSec
+// scanlines of average density and has an input buffer of iBufferSize bytes
+//
+void tpBleSimDefaults(TP_BLESIM_CONFIG *pConfig, int iPrinterType, int iLinesPerSec, int iBufferSize);
+//
+// Prepare a simulator running on the given virtual clock
+// (set the same clock with tpSetClock)
+//
+void tpBleSimInit(TP_BLESIM *pSim, TP_VCLOCK *pClock, const TP_BLESIM_CONFIG *pConfig);
+//
+// Run the clock until everything sent so far has been printed
+//
+void tpBleSimFinish(TP_BLESIM *pSim);
+//
+// Clear the statistics
+//
+void tpBleSimReset(TP_BLESIM *pSim);
+//
+// Achieved scanlines per second between the first and the last line
+//
+double tpBleSimLinesPerSec(TP_BLESIM *pSim);
+//
+// Print the statistics to stdout
+//
+void tpBleSimPrintStats(TP_BLESIM *pSim, const char *szLabel);
+
+#endif // __TP_BLESIM_H__
@@ -0,0 +1,351 @@
+//
+// Capture transport for the Linux host build
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include "tp_capture.h"
+
+static long long CaptureTime(TP_CAPTURE *pCap)
+{
+struct timespec ts;
+   if (pCap->pClock != NULL)
+      return tpVClockNow(pCap->pClock);
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+} /* CaptureTime() */
+static uint8_t ucXOff[] = {0x51, 0x78, 0xAE, 0x01, 0x01, 0x00, 0x10, 0x70, 0xFF};
+static uint8_t ucXOn[] = {0x51, 0x78, 0xAE, 0x01, 0x01, 0x00, 0x00, 0x00, 0xFF};
+//
+// Time (us) until the simulated buffer has drained to 1/4
+//
+static double CaptureXOnDelay(TP_CAPTURE *pCap)
+{
+double dUs;
+
+   dUs = (pCap->dSimFill - pCap->iSimBufferSize / 4) * 1000000.0 / pCap->iSimDrainRate;
+   return (dUs > 0.0) ? dUs : 0.0;
+} /* CaptureXOnDelay() */
+static void CaptureXOnEvent(void *pArg)
+{
+   ((TP_CAPTURE *)pArg)->bSimXOff = 0;
+   tpNotify(ucXOn, sizeof(ucXOn));
+} /* CaptureXOnEvent() */
+//
+// Send XOn once the simulated buffer has drained to 1/4
+//
+static void * CaptureXOnThread(void *pArg)
+{
+   usleep((useconds_t)CaptureXOnDelay((TP_CAPTURE *)pArg));
+   CaptureXOnEvent(pArg);
+   return NULL;
+} /* CaptureXOnThread() */
+static void CaptureStatusEvent(void *pArg)
+{
+uint8_t ucStatus = 0; // paper present
+
+   (void)pArg;
+   tpNotify(&ucStatus, 1);
+} /* CaptureStatusEvent() */
+//
+// Send a status reply after the given number of microseconds
+//
+static void * CaptureStatusThread(void *pArg)
+{
+   usleep((useconds_t)(intptr_t)pArg);
+   CaptureStatusEvent(NULL);
+   return NULL;
+} /* CaptureStatusThread() */
+static void CaptureAckEvent(void *pArg)
+{
+   (void)pArg;
+   tpWriteAck(1);
+} /* CaptureAckEvent() */
+//
+// Drain the simulated printer buffer and add the new data
+//
+static void CaptureSimulate(TP_CAPTURE *pCap, uint8_t *pData, int iLen)
+{
+long long llNow = CaptureTime(pCap);
+double dDrain;
+
+   if (pCap->llSimLast != 0) {
+      dDrain = (double)(llNow - pCap->llSimLast) * pCap->iSimDrainRate / 1000000.0;
+      if (dDrain > pCap->dSimFill) { // the printer ran out of data
+         pCap->llSimIdle += (long long)((dDrain - pCap->dSimFill) * 1000000.0 / pCap->iSimDrainRate);
+         pCap->dSimFill = 0.0;
+      } else {
+         pCap->dSimFill -= dDrain;
+      }
+   }
+   pCap->llSimLast = llNow;
+   pCap->dSimFill += iLen;
+   if (pCap->dSimFill > pCap->iSimBufferSize) {
+      pCap->llSimOverflow += (long long)(pCap->dSimFill - pCap->iSimBufferSize);
+      pCap->dSimFill = pCap->iSimBufferSize;
+   }
+   if ((int)pCap->dSimFill > pCap->iSimPeak)
+      pCap->iSimPeak = (int)pCap->dSimFill;
+   if (pCap->bSimStatus) { // answer GS r 1 when the data before it has printed
+      int i;
+      for (i=0; i+2<iLen; i++) {
+         if (pData[i] == 0x1d && pData[i+1] == 'r' && pData[i+2] == 1) {
+            pthread_t tid;
+            double dUs = (pCap->dSimFill - (iLen - i)) * 1000000.0 / pCap->iSimDrainRate;
+            if (dUs < 0.0) dUs = 0.0;
+            pCap->llSimStatus++;
+            if (pCap->pClock != NULL) {
+               tpVClockSchedule(pCap->pClock, llNow + (long long)dUs, CaptureStatusEvent, NULL);
+            } else {
+               pthread_create(&tid, NULL, CaptureStatusThread, (void *)(intptr_t)dUs);
+               pthread_detach(tid);
+            }
+         }
+      }
+   }
+   if (pCap->bSimFlow && !pCap->bSimXOff && pCap->dSimFill > (pCap->iSimBufferSize * 3) / 4) {
+      pthread_t tid;
+      pCap->bSimXOff = 1;
+      pCap->llSimXOff++;
+      tpNotify(ucXOff, sizeof(ucXOff));
+      if (pCap->pClock != NULL) {
+         tpVClockSchedule(pCap->pClock, llNow + (long long)CaptureXOnDelay(pCap), CaptureXOnEvent, pCap);
+      } else {
+         pthread_create(&tid, NULL, CaptureXOnThread, pCap);
+         pthread_detach(tid);
+      }
+   }
+} /* CaptureSimulate() */
+
+static const int iHistLimits[8] = {20, 32, 64, 128, 182, 244, 256, 512};
+
+//
+// Thread which delivers the acks of writes with response
+//
+static void * CaptureAckThread(void *pArg)
+{
+TP_CAPTURE *pCap = (TP_CAPTURE *)pArg;
+long long llDue, llNow;
+
+   pthread_mutex_lock(&pCap->ackMutex);
+   while (pCap->bAckRun) {
+      if (pCap->iAckHead == pCap->iAckTail) {
+         pthread_cond_wait(&pCap->ackCond, &pCap->ackMutex);
+         continue;
+      }
+      llDue = pCap->llAckDue[pCap->iAckTail];
+      pthread_mutex_unlock(&pCap->ackMutex);
+      llNow = CaptureTime(pCap);
+      if (llDue > llNow)
+         usleep((useconds_t)(llDue - llNow));
+      tpWriteAck(1);
+      pthread_mutex_lock(&pCap->ackMutex);
+      pCap->iAckTail = (pCap->iAckTail + 1) & 255;
+   }
+   pthread_mutex_unlock(&pCap->ackMutex);
+   return NULL;
+} /* CaptureAckThread() */
+
+static int CaptureWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse)
+{
+TP_CAPTURE *pCap = (TP_CAPTURE *)pUser;
+int i, iOff, bDrop = 0;
+
+   if (pCap->bDropped)
+      return -1;
+   if (pCap->iDropEvery > 0 && pCap->llBytes + iLen > pCap->llDropNext) {
+      iLen = (int)(pCap->llDropNext - pCap->llBytes); // only part of it arrives
+      bDrop = 1;
+   }
+   if (bWithResponse) {
+      pCap->llAcks++;
+      if (pCap->iAckLatency > 0 && pCap->pClock != NULL) {
+         tpVClockSchedule(pCap->pClock, CaptureTime(pCap) + pCap->iAckLatency, CaptureAckEvent, NULL);
+      } else if (pCap->iAckLatency > 0) { // queue the ack
+         pthread_mutex_lock(&pCap->ackMutex);
+         pCap->llAckDue[pCap->iAckHead] = CaptureTime(pCap) + pCap->iAckLatency;
+         pCap->iAckHead = (pCap->iAckHead + 1) & 255;
+         pthread_cond_signal(&pCap->ackCond);
+         pthread_mutex_unlock(&pCap->ackMutex);
+      }
+   }
+   if (pCap->fd >= 0) {
+      iOff = 0;
+      while (iOff < iLen) {
+         i = (int)write(pCap->fd, &pData[iOff], iLen - iOff);
+         if (i < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+         }
+         iOff += i;
+      }
+   }
+   if (pCap->pBuf != NULL) {
+      i = iLen;
+      if (pCap->iBufLen + i > pCap->iBufSize)
+         i = pCap->iBufSize - pCap->iBufLen; // keep what fits
+      memcpy(&pCap->pBuf[pCap->iBufLen], pData, i);
+      pCap->iBufLen += i;
+   }
+   pCap->llBytes += iLen;
+   pCap->llWrites++;
+   if (pCap->iMinWrite == 0 || iLen < pCap->iMinWrite) pCap->iMinWrite = iLen;
+   if (iLen > pCap->iMaxWrite) pCap->iMaxWrite = iLen;
+   for (i=0; i<8 && iLen > iHistLimits[i]; i++) {};
+   pCap->iHistogram[i]++;
+   if (pCap->iSimBufferSize > 0 && pCap->iSimDrainRate > 0)
+      CaptureSimulate(pCap, pData, iLen);
+   if (bDrop) {
+      pCap->bDropped = 1;
+      if (pCap->iDrops < 64)
+         pCap->iDropAt[pCap->iDrops] = pCap->iBufLen;
+      pCap->iDrops++;
+      return -1;
+   }
+   return iLen;
+} /* CaptureWrite() */
+
+static int CaptureReconnect(void *pUser)
+{
+TP_CAPTURE *pCap = (TP_CAPTURE *)pUser;
+
+   pCap->bDropped = 0;
+   pCap->llDropNext = pCap->llBytes + pCap->iDropEvery;
+   return 1;
+} /* CaptureReconnect() */
+
+void tpCaptureSetDrop(TP_CAPTURE *pCap, int iBytes)
+{
+   pCap->iDropEvery = (iBytes < 0) ? 0 : iBytes;
+   pCap->llDropNext = pCap->llBytes + pCap->iDropEvery;
+   pCap->bDropped = 0;
+   pCap->iDrops = 0;
+} /* tpCaptureSetDrop() */
+
+static void CaptureFlush(void *pUser)
+{
+TP_CAPTURE *pCap = (TP_CAPTURE *)pUser;
+
+   pCap->llFlushes++;
+   if (pCap->fd >= 0)
+      fsync(pCap->fd); // fails harmlessly on pipes
+} /* CaptureFlush() */
+
+static int CaptureGetMTU(void *pUser)
+{
+   return ((TP_CAPTURE *)pUser)->iMTU;
+} /* CaptureGetMTU() */
+
+void tpCaptureReset(TP_CAPTURE *pCap)
+{
+   pCap->iBufLen = 0;
+   pCap->llBytes = pCap->llWrites = pCap->llFlushes = 0;
+   pCap->iMinWrite = pCap->iMaxWrite = 0;
+   memset(pCap->iHistogram, 0, sizeof(pCap->iHistogram));
+   pCap->dSimFill = 0.0;
+   pCap->llSimLast = pCap->llSimOverflow = pCap->llSimIdle = 0;
+   pCap->iSimPeak = 0;
+   pCap->llAcks = 0;
+   pCap->llSimXOff = pCap->llSimStatus = 0;
+   pCap->iDrops = 0;
+   pCap->llDropNext = pCap->iDropEvery;
+} /* tpCaptureReset() */
+
+void tpCaptureSetAckLatency(TP_CAPTURE *pCap, int iMicros)
+{
+   if (pCap->bAckRun) { // stop the old thread
+      pthread_mutex_lock(&pCap->ackMutex);
+      pCap->bAckRun = 0;
+      pthread_cond_signal(&pCap->ackCond);
+      pthread_mutex_unlock(&pCap->ackMutex);
+      pthread_join(pCap->ackThread, NULL);
+   }
+   pCap->iAckLatency = iMicros;
+   pCap->iAckHead = pCap->iAckTail = 0;
+   pCap->transport.iFlags &= ~TP_TRANSPORT_ASYNC_ACK;
+   if (iMicros > 0) {
+      pCap->transport.iFlags |= TP_TRANSPORT_ASYNC_ACK;
+      if (pCap->pClock == NULL) { // the virtual clock delivers them as events
+         pCap->bAckRun = 1;
+         pthread_create(&pCap->ackThread, NULL, CaptureAckThread, pCap);
+      }
+   }
+} /* tpCaptureSetAckLatency() */
+
+void tpCaptureSetDrain(TP_CAPTURE *pCap, int iBufferSize, int iDrainRate)
+{
+   pCap->iSimBufferSize = iBufferSize;
+   pCap->iSimDrainRate = iDrainRate;
+   tpCaptureReset(pCap);
+} /* tpCaptureSetDrain() */
+
+void tpCaptureSetFlowControl(TP_CAPTURE *pCap, int bEnable)
+{
+   pCap->bSimFlow = bEnable;
+   pCap->bSimXOff = 0;
+} /* tpCaptureSetFlowControl() */
+
+void tpCaptureSetClock(TP_CAPTURE *pCap, TP_VCLOCK *pClock)
+{
+   pCap->pClock = pClock;
+   pCap->llSimLast = 0; // the old time doesn't apply
+} /* tpCaptureSetClock() */
+
+void tpCaptureSetStatus(TP_CAPTURE *pCap, int bEnable)
+{
+   pCap->bSimStatus = bEnable;
+} /* tpCaptureSetStatus() */
+
+void tpCaptureInit(TP_CAPTURE *pCap, int fd, uint8_t *pBuf, int iBufSize)
+{
+   memset(pCap, 0, sizeof(TP_CAPTURE));
+   pCap->fd = fd;
+   pCap->pBuf = pBuf;
+   pCap->iBufSize = (pBuf != NULL) ? iBufSize : 0;
+   pCap->transport.pfnWrite = CaptureWrite;
+   pCap->transport.pfnFlush = CaptureFlush;
+   pCap->transport.pfnGetMTU = CaptureGetMTU;
+   pCap->transport.pfnReconnect = CaptureReconnect;
+   pCap->transport.pUser = (void *)pCap;
+   pthread_mutex_init(&pCap->ackMutex, NULL);
+   pthread_cond_init(&pCap->ackCond, NULL);
+} /* tpCaptureInit() */
+
+void tpCapturePrintStats(TP_CAPTURE *pCap, const char *szLabel)
+{
+int i;
+
+   printf("%s: %lld bytes in %lld writes (min %d, max %d, avg %.1f), %lld acked, %lld flushes\n", szLabel,
+          pCap->llBytes, pCap->llWrites, pCap->iMinWrite, pCap->iMaxWrite,
+          pCap->llWrites ? (double)pCap->llBytes / (double)pCap->llWrites : 0.0, pCap->llAcks, pCap->llFlushes);
+   printf("  write sizes:");
+   for (i=0; i<9; i++) {
+      if (i < 8)
+         printf(" <=%d:%d", iHistLimits[i], pCap->iHistogram[i]);
+      else
+         printf(" >512:%d", pCap->iHistogram[i]);
+   }
+   printf("\n");
+   if (pCap->iSimBufferSize > 0 && pCap->iSimDrainRate > 0)
+      printf("  printer: buffer %d, peak %d, overflow %lld bytes, head idle %.1f ms, %lld XOffs, %lld status replies\n",
+             pCap->iSimBufferSize, pCap->iSimPeak, pCap->llSimOverflow, pCap->llSimIdle / 1000.0, pCap->llSimXOff, pCap->llSimStatus);
+} /* tpCapturePrintStats() */
@@ -0,0 +1,122 @@
+//
+// Capture transport for the Linux host build
+// Records the printer byte stream to a file descriptor (file or pipe)
+// and/or a memory buffer and keeps statistics about the writes
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_CAPTURE_H__
+#define __TP_CAPTURE_H__
+
+#include <pthread.h>
+#include "Thermal_Printer.h"
+#include "tp_vclock.h"
+
+typedef struct tagTP_CAPTURE
+{
+  TP_TRANSPORT transport; // pass &capture.transport to tpSetTransport()
+  int fd;          // file or pipe to copy the data to (-1 = none)
+  uint8_t *pBuf;   // memory buffer to copy the data to (NULL = none)
+  int iBufSize;
+  int iBufLen;     // bytes stored in pBuf so far
+  int iMTU;        // value reported to the library (0 = unknown)
+  long long llBytes;   // total bytes written
+  long long llWrites;  // total write calls
+  long long llFlushes;
+  int iMinWrite, iMaxWrite; // smallest and largest write seen
+  int iHistogram[9];  // writes by size: <=20, <=32, <=64, <=128, <=182, <=244, <=256, <=512, larger
+  // optional simulated printer buffer which drains at a fixed rate
+  int iSimBufferSize;  // bytes (0 = no simulation)
+  int iSimDrainRate;   // bytes per second
+  double dSimFill;     // bytes currently in the buffer
+  long long llSimLast; // time of the last write (us)
+  long long llSimOverflow; // bytes which didn't fit
+  long long llSimIdle;     // time (us) the print head was starved
+  int iSimPeak;        // highest buffer fill
+  int bSimFlow;        // send cat printer XOff/XOn to the library
+  volatile int bSimXOff; // XOff has been sent
+  long long llSimXOff; // number of XOffs sent
+  int bSimStatus;      // answer ESC/POS status queries (GS r 1)
+  long long llSimStatus; // number of status replies
+  // optional acknowledgements of writes with response after a delay
+  int iAckLatency;     // microseconds (0 = synchronous)
+  pthread_t ackThread;
+  pthread_mutex_t ackMutex;
+  pthread_cond_t ackCond;
+  long long llAckDue[256]; // due times of the pending acks
+  int iAckHead, iAckTail;
+  int bAckRun;
+  long long llAcks;    // writes with response seen
+  // optional link which drops every iDropEvery bytes (the write which
+  // crosses the limit is cut short) until the library reconnects
+  int iDropEvery;
+  long long llDropNext; // byte count where the link drops next
+  int bDropped;
+  int iDrops;
+  int iDropAt[64];     // offsets in pBuf where the link dropped
+  TP_VCLOCK *pClock;   // virtual clock for the simulation (NULL = real time)
+} TP_CAPTURE;
+
+//
+// Prepare a capture transport
+// fd = file/pipe to receive the data or -1
+// pBuf/iBufSize = memory buffer to receive the data or NULL/0
+//
+void tpCaptureInit(TP_CAPTURE *pCap, int fd, uint8_t *pBuf, int iBufSize);
+//
+// Simulate a printer with an input buffer of iBufferSize bytes
+// which it consumes at iDrainRate bytes per second
+//
+void tpCaptureSetDrain(TP_CAPTURE *pCap, int iBufferSize, int iDrainRate);
+//
+// Make the simulated printer send XOff (through tpNotify) when its buffer
+// is 3/4 full and XOn once it has drained to 1/4 (cat printer protocol)
+//
+void tpCaptureSetFlowControl(TP_CAPTURE *pCap, int bEnable);
+//
+// Make the simulated printer answer ESC/POS status queries (GS r 1)
+// once it has printed everything sent before the query
+//
+void tpCaptureSetStatus(TP_CAPTURE *pCap, int bEnable);
+//
+// Acknowledge writes with response asynchronously after iMicros
+// (0 = acknowledge synchronously)
+// Call before tpSetTransport()
+//
+void tpCaptureSetAckLatency(TP_CAPTURE *pCap, int iMicros);
+//
+// Drop the link after every iBytes bytes (0 = never)
+// The library gets it back through the transport's pfnReconnect
+//
+void tpCaptureSetDrop(TP_CAPTURE *pCap, int iBytes);
+//
+// Run the simulated printer on a virtual clock (NULL = real time)
+// The replies (XOn, status, acks) become clock events instead of threads
+// Call before tpCaptureSetAckLatency()
+//
+void tpCaptureSetClock(TP_CAPTURE *pCap, TP_VCLOCK *pClock);
+//
+// Clear the statistics and the memory buffer
+//
+void tpCaptureReset(TP_CAPTURE *pCap);
+//
+// Print the statistics to stdout
+//
+void tpCapturePrintStats(TP_CAPTURE *pCap, const char *szLabel);
+
+#endif // __TP_CAPTURE_H__
@@ -0,0 +1,353 @@
+//
+// Event loop which drives many network (port 9100) printers from one
+// thread with epoll
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "tp_loop.h"
+
+static long long LoopTime(void)
+{
+struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+} /* LoopTime() */
+//
+// Change what epoll watches for (if it changed)
+//
+static void LoopWatch(TP_LOOP *pLoop, TP_LOOP_PRINTER *pP, uint32_t u32Events)
+{
+struct epoll_event ev;
+
+   if (pP->fd < 0 || pP->u32Events == u32Events)
+      return;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = u32Events;
+   ev.data.ptr = (void *)pP;
+   epoll_ctl(pLoop->epfd, EPOLL_CTL_MOD, pP->fd, &ev);
+   pP->u32Events = u32Events;
+} /* LoopWatch() */
+
+static void LoopFreeJobs(TP_LOOP_PRINTER *pP)
+{
+TP_LOOP_JOB *pJob;
+
+   while (pP->pHead != NULL) {
+      pJob = pP->pHead;
+      pP->pHead = pJob->pNext;
+      free(pJob);
+   }
+   pP->pTail = NULL;
+} /* LoopFreeJobs() */
+
+static void LoopFail(TP_LOOP *pLoop, TP_LOOP_PRINTER *pP, int iError)
+{
+   if (pP->fd >= 0) {
+      epoll_ctl(pLoop->epfd, EPOLL_CTL_DEL, pP->fd, NULL);
+      close(pP->fd);
+   }
+   pP->fd = -1;
+   pP->u32Events = 0;
+   pP->llDue = 0;
+   pP->iState = TP_LOOP_FAILED;
+   pP->iError = iError;
+} /* LoopFail() */
+//
+// Send the next chunk of the job at the front of the queue
+//
+static void LoopSend(TP_LOOP *pLoop, TP_LOOP_PRINTER *pP, long long llNow)
+{
+TP_LOOP_JOB *pJob = pP->pHead;
+long long llWait;
+int i, iChunk;
+
+   if (pJob == NULL) { // nothing to send; just listen
+      LoopWatch(pLoop, pP, EPOLLIN);
+      return;
+   }
+   iChunk = pJob->iLen - pJob->iSent;
+   if (iChunk > TP_LOOP_CHUNK)
+      iChunk = TP_LOOP_CHUNK;
+   if (pP->iRate > 0) {
+      if (iChunk > pP->iBurst)
+         iChunk = pP->iBurst;
+      if (pP->llTAT < llNow) // the bucket is full
+         pP->llTAT = llNow;
+      llWait = pP->llTAT + (((long long)iChunk * 1000000) / pP->iRate)
+             - (((long long)pP->iBurst * 1000000) / pP->iRate) - llNow;
+      if (llWait > 0) { // stop watching for writes until it's due
+         pLoop->llPaced++;
+         pP->llDue = llNow + llWait;
+         LoopWatch(pLoop, pP, EPOLLIN);
+         return;
+      }
+   }
+   pP->llDue = 0;
+   i = (int)send(pP->fd, &pJob->ucData[pJob->iSent], iChunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+   pLoop->llSends++;
+   if (i < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+         pLoop->llBlocked++;
+         LoopWatch(pLoop, pP, EPOLLIN | EPOLLOUT);
+      } else if (errno != EINTR) {
+         LoopFail(pLoop, pP, errno);
+      }
+      return;
+   }
+   pJob->iSent += i;
+   pP->llSent += i;
+   if (pP->iRate > 0)
+      pP->llTAT += ((long long)i * 1000000) / pP->iRate;
+   if (pJob->iSent == pJob->iLen) { // this one is done
+      pP->pHead = pJob->pNext;
+      if (pP->pHead == NULL)
+         pP->pTail = NULL;
+      pP->iJobsDone++;
+      pP->llLastJob = llNow;
+      if (pP->pfnJobDone)
+         (*pP->pfnJobDone)(pP, pJob->pUser);
+      free(pJob);
+   }
+   LoopWatch(pLoop, pP, (pP->pHead != NULL) ? (EPOLLIN | EPOLLOUT) : EPOLLIN);
+} /* LoopSend() */
+//
+// Read (and count) what the printer sent us
+//
+static void LoopReceive(TP_LOOP *pLoop, TP_LOOP_PRINTER *pP)
+{
+uint8_t ucTemp[256];
+int i;
+
+   while ((i = (int)recv(pP->fd, ucTemp, sizeof(ucTemp), MSG_DONTWAIT)) > 0)
+      pP->llReceived += i;
+   if (i == 0) // the printer hung up
+      LoopFail(pLoop, pP, ECONNRESET);
+   else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      LoopFail(pLoop, pP, errno);
+} /* LoopReceive() */
+
+static void LoopEvent(TP_LOOP *pLoop, TP_LOOP_PRINTER *pP, uint32_t u32Events, long long llNow)
+{
+socklen_t len;
+int i, iErr;
+
+   if (pP->iState == TP_LOOP_CONNECTING) {
+      iErr = 0;
+      len = sizeof(iErr);
+      if (getsockopt(pP->fd, SOL_SOCKET, SO_ERROR, &iErr, &len) < 0)
+         iErr = errno;
+      if (iErr != 0) {
+         LoopFail(pLoop, pP, iErr);
+         return;
+      }
+      pP->iState = TP_LOOP_READY;
+      i = 1;
+      setsockopt(pP->fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+   }
+   if (u32Events & EPOLLIN) {
+      LoopReceive(pLoop, pP);
+      if (pP->iState != TP_LOOP_READY)
+         return;
+   }
+   if (u32Events & (EPOLLERR | EPOLLHUP)) {
+      iErr = 0;
+      len = sizeof(iErr);
+      getsockopt(pP->fd, SOL_SOCKET, SO_ERROR, &iErr, &len);
+      LoopFail(pLoop, pP, iErr ? iErr : ECONNRESET);
+      return;
+   }
+   if (u32Events & EPOLLOUT)
+      LoopSend(pLoop, pP, llNow);
+} /* LoopEvent() */
+
+int tpLoopInit(TP_LOOP *pLoop)
+{
+   memset(pLoop, 0, sizeof(TP_LOOP));
+   pLoop->epfd = epoll_create1(EPOLL_CLOEXEC);
+   return (pLoop->epfd >= 0);
+} /* tpLoopInit() */
+
+void tpLoopFree(TP_LOOP *pLoop)
+{
+   while (pLoop->iCount > 0)
+      tpLoopClosePrinter(pLoop, pLoop->pPrinters[pLoop->iCount-1]);
+   if (pLoop->epfd >= 0)
+      close(pLoop->epfd);
+   pLoop->epfd = -1;
+} /* tpLoopFree() */
+
+int tpLoopAddPrinter(TP_LOOP *pLoop, TP_LOOP_PRINTER *pPrinter, const char *szHost, int iPort)
+{
+struct addrinfo hints, *pList;
+struct epoll_event ev;
+char szPort[16];
+int fd, i;
+
+   if (szHost == NULL || pLoop->iCount >= TP_LOOP_MAX)
+      return 0;
+   memset(pPrinter, 0, sizeof(TP_LOOP_PRINTER));
+   pPrinter->fd = -1;
+   strncpy(pPrinter->szHost, szHost, sizeof(pPrinter->szHost)-1);
+   pPrinter->iPort = (iPort > 0) ? iPort : 9100;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   sprintf(szPort, "%d", pPrinter->iPort);
+   if (getaddrinfo(pPrinter->szHost, szPort, &hints, &pList) != 0)
+      return 0;
+   fd = socket(pList->ai_family, pList->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, pList->ai_protocol);
+   if (fd < 0) {
+      freeaddrinfo(pList);
+      return 0;
+   }
+   i = connect(fd, pList->ai_addr, pList->ai_addrlen);
+   freeaddrinfo(pList);
+   if (i < 0 && errno != EINPROGRESS) {
+      close(fd);
+      return 0;
+   }
+   // the first writable event finishes the connection
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN | EPOLLOUT;
+   ev.data.ptr = (void *)pPrinter;
+   if (epoll_ctl(pLoop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      return 0;
+   }
+   pPrinter->fd = fd;
+   pPrinter->u32Events = ev.events;
+   pPrinter->iState = TP_LOOP_CONNECTING;
+   pLoop->pPrinters[pLoop->iCount++] = pPrinter;
+   return 1;
+} /* tpLoopAddPrinter() */
+
+void tpLoopClosePrinter(TP_LOOP *pLoop, TP_LOOP_PRINTER *pPrinter)
+{
+int i;
+
+   for (i=0; i<pLoop->iCount; i++) {
+      if (pLoop->pPrinters[i] == pPrinter) {
+         pLoop->pPrinters[i] = pLoop->pPrinters[--pLoop->iCount];
+         break;
+      }
+   }
+   if (pPrinter->fd >= 0) {
+      epoll_ctl(pLoop->epfd, EPOLL_CTL_DEL, pPrinter->fd, NULL);
+      close(pPrinter->fd);
+   }
+   pPrinter->fd = -1;
+   pPrinter->u32Events = 0;
+   pPrinter->iState = TP_LOOP_CLOSED;
+   LoopFreeJobs(pPrinter);
+} /* tpLoopClosePrinter() */
+
+void tpLoopSetPacing(TP_LOOP_PRINTER *pPrinter, int iBytesPerSec, int iBurst)
+{
+   pPrinter->iRate = (iBytesPerSec > 0) ? iBytesPerSec : 0;
+   pPrinter->iBurst = (iBurst > 0) ? iBurst : 1024;
+   pPrinter->llTAT = 0;
+} /* tpLoopSetPacing() */
+
+int tpLoopQueue(TP_LOOP *pLoop, TP_LOOP_PRINTER *pPrinter, const uint8_t *pData, int iLen, void *pJobUser)
+{
+TP_LOOP_JOB *pJob;
+
+   if (pData == NULL || iLen <= 0 || pPrinter->iState == TP_LOOP_FAILED || pPrinter->iState == TP_LOOP_CLOSED)
+      return 0;
+   pJob = (TP_LOOP_JOB *)malloc(sizeof(TP_LOOP_JOB) + iLen);
+   if (pJob == NULL)
+      return 0;
+   pJob->pNext = NULL;
+   pJob->pUser = pJobUser;
+   pJob->iLen = iLen;
+   pJob->iSent = 0;
+   memcpy(pJob->ucData, pData, iLen);
+   if (pPrinter->pTail)
+      pPrinter->pTail->pNext = pJob;
+   else
+      pPrinter->pHead = pJob;
+   pPrinter->pTail = pJob;
+   pPrinter->iJobs++;
+   pPrinter->llQueued += iLen;
+   if (pPrinter->iState == TP_LOOP_READY && pPrinter->llDue == 0)
+      LoopWatch(pLoop, pPrinter, EPOLLIN | EPOLLOUT);
+   return 1;
+} /* tpLoopQueue() */
+
+int tpLoopRun(TP_LOOP *pLoop, int iTimeout)
+{
+struct epoll_event events[64];
+TP_LOOP_PRINTER *pP;
+long long llNow, llNext = 0;
+int i, iCount, iBusy = 0;
+
+   // sleep no later than the next paced printer is due
+   llNow = LoopTime();
+   for (i=0; i<pLoop->iCount; i++) {
+      pP = pLoop->pPrinters[i];
+      if (pP->llDue != 0 && (llNext == 0 || pP->llDue < llNext))
+         llNext = pP->llDue;
+   }
+   if (llNext != 0) {
+      llNext = (llNext - llNow + 999) / 1000;
+      if (llNext < iTimeout || iTimeout < 0)
+         iTimeout = (int)llNext;
+   }
+   iCount = epoll_wait(pLoop->epfd, events, 64, iTimeout);
+   pLoop->llWakeups++;
+   llNow = LoopTime();
+   for (i=0; i<iCount; i++)
+      LoopEvent(pLoop, (TP_LOOP_PRINTER *)events[i].data.ptr, events[i].events, llNow);
+   for (i=0; i<pLoop->iCount; i++) {
+      pP = pLoop->pPrinters[i];
+      if (pP->llDue != 0 && pP->llDue <= llNow && pP->iState == TP_LOOP_READY)
+         LoopSend(pLoop, pP, llNow);
+      if (pP->pHead != NULL && (pP->iState == TP_LOOP_READY || pP->iState == TP_LOOP_CONNECTING))
+         iBusy++;
+   }
+   return iBusy;
+} /* tpLoopRun() */
+
+int tpLoopProgress(TP_LOOP_PRINTER *pPrinter)
+{
+   if (pPrinter->llQueued == 0)
+      return 100;
+   return (int)((pPrinter->llSent * 100) / pPrinter->llQueued);
+} /* tpLoopProgress() */
+
+void tpLoopPrintStats(TP_LOOP *pLoop, const char *szLabel)
+{
+int i, iFailed = 0;
+
+   for (i=0; i<pLoop->iCount; i++) {
+      if (pLoop->pPrinters[i]->iState == TP_LOOP_FAILED)
+         iFailed++;
+   }
+   printf("%s: %d printers (%d failed), %lld wakeups, %lld sends, socket full %lld times, paced %lld times\n",
+          szLabel, pLoop->iCount, iFailed, pLoop->llWakeups, pLoop->llSends, pLoop->llBlocked, pLoop->llPaced);
+} /* tpLoopPrintStats() */
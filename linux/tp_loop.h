@@ -0,0 +1,132 @@
+//
+// Event loop which drives many network (port 9100) printers from one
+// thread with epoll
+// The library encodes for one printer at a time, so the jobs are
+// encoded ahead of time (e.g. into a tp_capture buffer) and queued here
+// as bytes. Each printer has its own queue of jobs, its own pacing
+// (a byte rate with a burst allowance) and its own progress counters;
+// the sockets are non-blocking and a printer which can't take more
+// data (or whose pacing says wait) doesn't hold up the others.
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_LOOP_H__
+#define __TP_LOOP_H__
+
+#include <stdint.h>
+
+#define TP_LOOP_MAX 1024   // printers per loop
+#define TP_LOOP_CHUNK 16384 // most bytes sent to one printer per turn
+
+enum {
+  TP_LOOP_CLOSED=0,
+  TP_LOOP_CONNECTING,
+  TP_LOOP_READY,
+  TP_LOOP_FAILED
+};
+
+typedef struct tagTP_LOOP_JOB
+{
+  struct tagTP_LOOP_JOB *pNext;
+  void *pUser;
+  int iLen, iSent;
+  uint8_t ucData[1]; // iLen bytes
+} TP_LOOP_JOB;
+
+typedef struct tagTP_LOOP_PRINTER
+{
+  int fd;
+  int iState;        // TP_LOOP_xxx
+  int iError;        // errno of the failure
+  char szHost[64];
+  int iPort;
+  uint32_t u32Events; // what epoll is watching for
+  TP_LOOP_JOB *pHead, *pTail;
+  // pacing (iRate 0 = as fast as the socket takes it)
+  int iRate;         // bytes per second
+  int iBurst;        // bytes which can go out at once
+  long long llTAT;   // theoretical arrival time (us)
+  long long llDue;   // when a paced printer can send again (0 = not waiting)
+  // progress
+  long long llQueued;  // bytes queued since it was added
+  long long llSent;    // bytes sent
+  long long llReceived; // bytes from the printer
+  int iJobs, iJobsDone;
+  long long llLastJob; // when the last job finished sending (us)
+  // called when a job has been sent (it's freed after the call returns)
+  void (*pfnJobDone)(struct tagTP_LOOP_PRINTER *pPrinter, void *pJobUser);
+  void *pUser;
+} TP_LOOP_PRINTER;
+
+typedef struct tagTP_LOOP
+{
+  int epfd;
+  int iCount;
+  TP_LOOP_PRINTER *pPrinters[TP_LOOP_MAX];
+  // statistics
+  long long llWakeups; // epoll_wait() returns
+  long long llSends;   // send() calls
+  long long llBlocked; // sends which found the socket full
+  long long llPaced;   // times a printer had to wait for its pacing
+} TP_LOOP;
+
+//
+// Prepare a loop
+// returns 1 if successful, 0 on failure
+//
+int tpLoopInit(TP_LOOP *pLoop);
+//
+// Close every printer (dropping any unsent jobs) and the loop
+//
+void tpLoopFree(TP_LOOP *pLoop);
+//
+// Start connecting to a printer (host name or address, port 9100 if
+// iPort is 0); the connection completes in tpLoopRun() and jobs can be
+// queued right away. The printer structure belongs to the caller and
+// must stay put until it's closed.
+// returns 1 if successful, 0 on failure
+//
+int tpLoopAddPrinter(TP_LOOP *pLoop, TP_LOOP_PRINTER *pPrinter, const char *szHost, int iPort);
+//
+// Close a printer and remove it from the loop, dropping any unsent jobs
+//
+void tpLoopClosePrinter(TP_LOOP *pLoop, TP_LOOP_PRINTER *pPrinter);
+//
+// Limit how fast a printer is sent data (0 = no limit)
+//
+void tpLoopSetPacing(TP_LOOP_PRINTER *pPrinter, int iBytesPerSec, int iBurst);
+//
+// Queue a copy of an encoded job for a printer
+// returns 1 if successful, 0 on failure
+//
+int tpLoopQueue(TP_LOOP *pLoop, TP_LOOP_PRINTER *pPrinter, const uint8_t *pData, int iLen, void *pJobUser);
+//
+// Wait up to iTimeout ms for something to do and do it
+// returns the number of printers which still have data to send
+//
+int tpLoopRun(TP_LOOP *pLoop, int iTimeout);
+//
+// Percent of the queued bytes which have been sent
+//
+int tpLoopProgress(TP_LOOP_PRINTER *pPrinter);
+//
+// Print the statistics to stdout
+//
+void tpLoopPrintStats(TP_LOOP *pLoop, const char *szLabel);
+
+#endif // __TP_LOOP_H__
@@ -0,0 +1,219 @@
+//
+// Serial (tty / USB-CDC) transport for wired ESC/POS printers
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "tp_serial.h"
+
+static const struct { int iBaud; speed_t speed; } serialSpeeds[] = {
+   {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+   {115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600},
+   {0, B0}};
+
+static long long SerialTime(void)
+{
+struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+} /* SerialTime() */
+
+int tpSerialPoll(TP_SERIAL *pSerial)
+{
+uint8_t ucTemp[64];
+int i, iTotal = 0;
+
+   if (pSerial->fd < 0)
+      return 0;
+   while ((i = (int)read(pSerial->fd, ucTemp, sizeof(ucTemp))) > 0) {
+      pSerial->llReceived += i;
+      iTotal += i;
+      tpNotify(ucTemp, i);
+   }
+   return iTotal;
+} /* tpSerialPoll() */
+//
+// Wait until the port can take more data
+// (the printer may be holding it with CTS or XOFF)
+// returns 0 if it timed out or failed
+//
+static int SerialWaitWritable(TP_SERIAL *pSerial)
+{
+struct pollfd pfd;
+long long llStart = SerialTime();
+int i;
+
+   pSerial->llBlocked++;
+   pfd.fd = pSerial->fd;
+   pfd.events = POLLOUT | POLLIN;
+   while (1) {
+      i = poll(&pfd, 1, pSerial->iTimeout);
+      if (i < 0 && errno == EINTR)
+         continue;
+      if (i > 0 && (pfd.revents & POLLIN)) { // the printer said something
+         tpSerialPoll(pSerial);
+         if (!(pfd.revents & POLLOUT))
+            continue;
+      }
+      break;
+   }
+   pSerial->llBlockedTime += SerialTime() - llStart;
+   return (i > 0 && !(pfd.revents & (POLLERR | POLLHUP)));
+} /* SerialWaitWritable() */
+
+static int SerialWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse)
+{
+TP_SERIAL *pSerial = (TP_SERIAL *)pUser;
+int i, iOff = 0;
+
+   (void)bWithResponse; // no acknowledgements on a serial line
+   if (pSerial->fd < 0)
+      return -1;
+   while (iOff < iLen) {
+      i = (int)write(pSerial->fd, &pData[iOff], iLen - iOff);
+      if (i > 0) {
+         iOff += i;
+         pSerial->llWrites++;
+         pSerial->llBytes += i;
+      } else if (i < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         if (!SerialWaitWritable(pSerial))
+            return -1;
+      } else if (i < 0 && errno == EINTR) {
+         continue;
+      } else {
+         return -1;
+      }
+   }
+   tpSerialPoll(pSerial);
+   return iLen;
+} /* SerialWrite() */
+//
+// Wait (up to the timeout) for the output buffer to empty
+// tcdrain() would wait forever if the printer holds the line
+//
+static void SerialFlush(void *pUser)
+{
+TP_SERIAL *pSerial = (TP_SERIAL *)pUser;
+int iQueued, iWaited = 0;
+
+   while (pSerial->fd >= 0 && ioctl(pSerial->fd, TIOCOUTQ, &iQueued) == 0 && iQueued > 0) {
+      if (iWaited >= pSerial->iTimeout * 1000)
+         break;
+      tpSerialPoll(pSerial);
+      usleep(500);
+      iWaited += 500;
+   }
+   tpSerialPoll(pSerial);
+} /* SerialFlush() */
+
+static int SerialConnect(TP_SERIAL *pSerial)
+{
+struct termios tio;
+speed_t speed = B0;
+int i, fd;
+
+   for (i=0; serialSpeeds[i].iBaud != 0; i++) {
+      if (serialSpeeds[i].iBaud == pSerial->iBaud)
+         speed = serialSpeeds[i].speed;
+   }
+   if (speed == B0)
+      return 0; // unsupported rate
+   fd = open(pSerial->szDevice, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+   if (fd < 0)
+      return 0;
+   if (tcgetattr(fd, &tio) < 0) {
+      close(fd);
+      return 0;
+   }
+   cfmakeraw(&tio); // 8N1, no translation of the binary data
+   cfsetispeed(&tio, speed);
+   cfsetospeed(&tio, speed);
+   tio.c_cflag |= CLOCAL | CREAD;
+   tio.c_cflag &= ~CRTSCTS;
+   tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+   if (pSerial->iFlow == TP_SERIAL_FLOW_RTSCTS)
+      tio.c_cflag |= CRTSCTS;
+   else if (pSerial->iFlow == TP_SERIAL_FLOW_XONXOFF)
+      tio.c_iflag |= IXON; // the printer stops us with XOFF (0x13) and restarts us with XON (0x11)
+   tio.c_cc[VMIN] = 0;
+   tio.c_cc[VTIME] = 0;
+   if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+      close(fd);
+      return 0;
+   }
+   tcflush(fd, TCIOFLUSH); // nothing left over from before
+   pSerial->fd = fd;
+   pSerial->transport.iFlags = (pSerial->iFlow != TP_SERIAL_FLOW_NONE) ? TP_TRANSPORT_NO_PACING : 0;
+   return 1;
+} /* SerialConnect() */
+
+static int SerialReconnect(void *pUser)
+{
+TP_SERIAL *pSerial = (TP_SERIAL *)pUser;
+
+   if (pSerial->fd >= 0)
+      close(pSerial->fd);
+   pSerial->fd = -1;
+   return SerialConnect(pSerial);
+} /* SerialReconnect() */
+
+void tpSerialInit(TP_SERIAL *pSerial)
+{
+   memset(pSerial, 0, sizeof(TP_SERIAL));
+   pSerial->fd = -1;
+   pSerial->iTimeout = 5000;
+   pSerial->transport.pfnWrite = SerialWrite;
+   pSerial->transport.pfnFlush = SerialFlush;
+   pSerial->transport.pfnReconnect = SerialReconnect;
+   pSerial->transport.pUser = (void *)pSerial;
+} /* tpSerialInit() */
+
+int tpSerialOpen(TP_SERIAL *pSerial, const char *szDevice, int iBaud, int iFlow)
+{
+   if (szDevice == NULL || iFlow < TP_SERIAL_FLOW_NONE || iFlow > TP_SERIAL_FLOW_XONXOFF)
+      return 0;
+   tpSerialClose(pSerial);
+   strncpy(pSerial->szDevice, szDevice, sizeof(pSerial->szDevice)-1);
+   pSerial->szDevice[sizeof(pSerial->szDevice)-1] = 0;
+   pSerial->iBaud = iBaud;
+   pSerial->iFlow = iFlow;
+   return SerialConnect(pSerial);
+} /* tpSerialOpen() */
+
+void tpSerialClose(TP_SERIAL *pSerial)
+{
+   if (pSerial->fd < 0)
+      return;
+   SerialFlush(pSerial);
+   close(pSerial->fd);
+   pSerial->fd = -1;
+} /* tpSerialClose() */
+
+void tpSerialPrintStats(TP_SERIAL *pSerial, const char *szLabel)
+{
+   printf("%s: %lld bytes in %lld writes, held by the printer %lld times (%.1f ms), %lld bytes received\n",
+          szLabel, pSerial->llBytes, pSerial->llWrites, pSerial->llBlocked,
+          pSerial->llBlockedTime / 1000.0, pSerial->llReceived);
+} /* tpSerialPrintStats() */
@@ -0,0 +1,81 @@
+//
+// Serial (tty / USB-CDC) transport for wired ESC/POS printers
+// The port is set to raw mode at the given baud rate with hardware
+// (RTS/CTS) or software (XON/XOFF) flow control. The flow control
+// keeps the printer's buffer from overflowing, so the data isn't paced
+// (TP_TRANSPORT_NO_PACING); with no flow control the library paces
+// it for the printer model as it does over BLE.
+// Bytes the printer sends back (e.g. status replies) are passed to
+// tpNotify() whenever the transport writes or flushes, or when you call
+// tpSerialPoll()
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_SERIAL_H__
+#define __TP_SERIAL_H__
+
+#include "Thermal_Printer.h"
+
+enum {
+  TP_SERIAL_FLOW_NONE=0,
+  TP_SERIAL_FLOW_RTSCTS,
+  TP_SERIAL_FLOW_XONXOFF
+};
+
+typedef struct tagTP_SERIAL
+{
+  TP_TRANSPORT transport; // pass &serial.transport to tpSetTransport()
+  int fd;
+  char szDevice[64];
+  int iBaud;
+  int iFlow;       // TP_SERIAL_FLOW_xxx
+  int iTimeout;    // ms to wait for the port before failing a write
+  // statistics
+  long long llBytes;   // bytes written
+  long long llWrites;  // write() calls
+  long long llBlocked; // times the output buffer was full (or stopped)
+  long long llBlockedTime; // us
+  long long llReceived; // bytes from the printer
+} TP_SERIAL;
+
+//
+// Prepare a serial transport (5 second timeout)
+//
+void tpSerialInit(TP_SERIAL *pSerial);
+//
+// Open the port (e.g. /dev/ttyUSB0 or /dev/ttyACM0)
+// iBaud = 9600, 19200, 38400, 57600, 115200, 230400, 460800 or 921600
+// iFlow = TP_SERIAL_FLOW_xxx
+// returns 1 if successful, 0 on failure
+//
+int tpSerialOpen(TP_SERIAL *pSerial, const char *szDevice, int iBaud, int iFlow);
+//
+// Wait for the data to go out and close the port
+//
+void tpSerialClose(TP_SERIAL *pSerial);
+//
+// Pass any bytes received from the printer to tpNotify()
+// returns the number of bytes read
+//
+int tpSerialPoll(TP_SERIAL *pSerial);
+//
+// Print the statistics to stdout
+//
+void tpSerialPrintStats(TP_SERIAL *pSerial, const char *szLabel);
+
+#endif // __TP_SERIAL_H__
@@ -0,0 +1,329 @@
+//
+// Shared memory raster submission for the Linux host build
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "Thermal_Printer.h"
+#include "tp_shm.h"
+
+static size_t ShmRowOffset(void)
+{
+   return (sizeof(TP_SHM_RING) + 63) & ~(size_t)63;
+} /* ShmRowOffset() */
+//
+// Sleep until *pWatch changes from u32Old (or the ring is closed)
+// The flag tells the other side to write to the eventfd; it's set before
+// looking at *pWatch again so that a change made in between can't be missed
+//
+static void ShmWait(TP_SHM *pShm, uint32_t *pWatch, uint32_t u32Old, volatile int32_t *pFlag, int fd)
+{
+uint64_t u64;
+
+   pShm->llWaits++;
+   __atomic_store_n(pFlag, 1, __ATOMIC_SEQ_CST);
+   while (__atomic_load_n(pWatch, __ATOMIC_SEQ_CST) == u32Old && !pShm->pRing->bClosed) {
+      if (read(fd, &u64, sizeof(u64)) < 0 && errno != EINTR)
+         break;
+   }
+   __atomic_store_n(pFlag, 0, __ATOMIC_RELAXED);
+} /* ShmWait() */
+
+static void ShmWake(TP_SHM *pShm, volatile int32_t *pFlag, int fd)
+{
+uint64_t u64 = 1;
+
+   if (__atomic_load_n(pFlag, __ATOMIC_SEQ_CST)) {
+      pShm->llWakes++;
+      if (write(fd, &u64, sizeof(u64)) < 0) { }
+   }
+} /* ShmWake() */
+
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+static int ShmMap(TP_SHM *pShm)
+{
+TP_SHM_RING *pR;
+struct stat st;
+int iSeals;
+
+   // an unsealed memfd could be truncated under us (SIGBUS)
+   iSeals = fcntl(pShm->fdMem, F_GET_SEALS);
+   if (iSeals < 0 || (iSeals & SHM_SEALS) != SHM_SEALS)
+      return 0;
+   if (fstat(pShm->fdMem, &st) != 0 || st.st_size < (off_t)ShmRowOffset())
+      return 0;
+   pShm->size = (size_t)st.st_size;
+   pR = (TP_SHM_RING *)mmap(NULL, pShm->size, PROT_READ | PROT_WRITE, MAP_SHARED, pShm->fdMem, 0);
+   if (pR == MAP_FAILED)
+      return 0;
+   pShm->pRing = pR;
+   // don't trust the other process with our address space; check one
+   // copy of the geometry and use only that from now on
+   pShm->iWidth = __atomic_load_n(&pR->iWidth, __ATOMIC_RELAXED);
+   pShm->iHeight = __atomic_load_n(&pR->iHeight, __ATOMIC_RELAXED);
+   pShm->iPitch = __atomic_load_n(&pR->iPitch, __ATOMIC_RELAXED);
+   pShm->iSlots = __atomic_load_n(&pR->iSlots, __ATOMIC_RELAXED);
+   if (pR->u32Magic != TP_SHM_MAGIC || pShm->iWidth < 1 || pShm->iHeight < 1 || pShm->iSlots < 1 ||
+       pShm->iPitch != (pShm->iWidth + 7) >> 3 || pR->iRowOffset != (int)ShmRowOffset() ||
+       ShmRowOffset() + (size_t)pShm->iSlots * pShm->iPitch > pShm->size) {
+      munmap(pR, pShm->size);
+      pShm->pRing = NULL;
+      return 0;
+   }
+   pShm->pRows = (uint8_t *)pR + ShmRowOffset();
+   return 1;
+} /* ShmMap() */
+
+int tpShmCreate(TP_SHM *pShm, int iWidth, int iHeight, int iSlots)
+{
+TP_SHM_RING *pR;
+size_t size;
+int iPitch = (iWidth + 7) >> 3;
+
+   memset(pShm, 0, sizeof(TP_SHM));
+   pShm->fdMem = pShm->fdData = pShm->fdSpace = -1;
+   if (iWidth < 1 || iHeight < 1 || iSlots < 1)
+      return 0;
+   size = ShmRowOffset() + (size_t)iSlots * iPitch;
+   pShm->fdMem = memfd_create("tpshm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   pShm->fdData = eventfd(0, EFD_CLOEXEC);
+   pShm->fdSpace = eventfd(0, EFD_CLOEXEC);
+   if (pShm->fdMem < 0 || pShm->fdData < 0 || pShm->fdSpace < 0 || ftruncate(pShm->fdMem, (off_t)size) != 0 ||
+       fcntl(pShm->fdMem, F_ADD_SEALS, SHM_SEALS) != 0) {
+      tpShmClose(pShm);
+      return 0;
+   }
+   pR = (TP_SHM_RING *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pShm->fdMem, 0);
+   if (pR == MAP_FAILED) {
+      tpShmClose(pShm);
+      return 0;
+   }
+   // the memfd starts out zeroed
+   pR->iWidth = iWidth;
+   pR->iHeight = iHeight;
+   pR->iPitch = iPitch;
+   pR->iSlots = iSlots;
+   pR->iRowOffset = (int)ShmRowOffset();
+   __atomic_store_n(&pR->u32Magic, TP_SHM_MAGIC, __ATOMIC_RELEASE);
+   pShm->size = size;
+   pShm->pRing = pR;
+   pShm->pRows = (uint8_t *)pR + pR->iRowOffset;
+   pShm->iWidth = iWidth;
+   pShm->iHeight = iHeight;
+   pShm->iPitch = iPitch;
+   pShm->iSlots = iSlots;
+   return 1;
+} /* tpShmCreate() */
+
+int tpShmAttach(TP_SHM *pShm, int fdMem, int fdData, int fdSpace)
+{
+   memset(pShm, 0, sizeof(TP_SHM));
+   pShm->fdMem = fdMem;
+   pShm->fdData = fdData;
+   pShm->fdSpace = fdSpace;
+   if (!ShmMap(pShm)) {
+      tpShmClose(pShm);
+      return 0;
+   }
+   return 1;
+} /* tpShmAttach() */
+
+int tpShmSend(TP_SHM *pShm, int fdSocket)
+{
+struct msghdr msg;
+struct iovec iov;
+struct cmsghdr *pCmsg;
+char cBuf[CMSG_SPACE(3 * sizeof(int))];
+int fds[3] = {pShm->fdMem, pShm->fdData, pShm->fdSpace};
+char c = 'R';
+
+   memset(&msg, 0, sizeof(msg));
+   memset(cBuf, 0, sizeof(cBuf));
+   iov.iov_base = &c;
+   iov.iov_len = 1;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cBuf;
+   msg.msg_controllen = sizeof(cBuf);
+   pCmsg = CMSG_FIRSTHDR(&msg);
+   pCmsg->cmsg_level = SOL_SOCKET;
+   pCmsg->cmsg_type = SCM_RIGHTS;
+   pCmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   memcpy(CMSG_DATA(pCmsg), fds, sizeof(fds));
+   return (sendmsg(fdSocket, &msg, MSG_NOSIGNAL) == 1);
+} /* tpShmSend() */
+
+int tpShmReceive(TP_SHM *pShm, int fdSocket)
+{
+struct msghdr msg;
+struct iovec iov;
+struct cmsghdr *pCmsg;
+char cBuf[CMSG_SPACE(3 * sizeof(int))];
+int i, fds[3];
+char c;
+
+   memset(pShm, 0, sizeof(TP_SHM));
+   pShm->fdMem = pShm->fdData = pShm->fdSpace = -1;
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = &c;
+   iov.iov_len = 1;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cBuf;
+   msg.msg_controllen = sizeof(cBuf);
+   if (recvmsg(fdSocket, &msg, MSG_CMSG_CLOEXEC) != 1)
+      return 0;
+   pCmsg = CMSG_FIRSTHDR(&msg);
+   if (pCmsg == NULL || pCmsg->cmsg_level != SOL_SOCKET || pCmsg->cmsg_type != SCM_RIGHTS)
+      return 0;
+   i = (int)((pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+   if (i > 3) i = 3;
+   memcpy(fds, CMSG_DATA(pCmsg), i * sizeof(int));
+   if (i != 3 || (msg.msg_flags & MSG_CTRUNC)) {
+      while (i > 0)
+         close(fds[--i]);
+      return 0;
+   }
+   return tpShmAttach(pShm, fds[0], fds[1], fds[2]);
+} /* tpShmReceive() */
+
+void tpShmClose(TP_SHM *pShm)
+{
+   if (pShm->pRing != NULL)
+      munmap(pShm->pRing, pShm->size);
+   if (pShm->fdMem >= 0) close(pShm->fdMem);
+   if (pShm->fdData >= 0) close(pShm->fdData);
+   if (pShm->fdSpace >= 0) close(pShm->fdSpace);
+   pShm->pRing = NULL;
+   pShm->pRows = NULL;
+   pShm->fdMem = pShm->fdData = pShm->fdSpace = -1;
+} /* tpShmClose() */
+
+void tpShmAbort(TP_SHM *pShm)
+{
+uint64_t u64 = 1;
+
+   if (pShm->pRing == NULL)
+      return;
+   pShm->pRing->bClosed = 1;
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (write(pShm->fdData, &u64, sizeof(u64)) < 0) { }
+   if (write(pShm->fdSpace, &u64, sizeof(u64)) < 0) { }
+} /* tpShmAbort() */
+
+uint8_t * tpShmGetRows(TP_SHM *pShm, int *piCount)
+{
+TP_SHM_RING *pR = pShm->pRing;
+uint32_t u32Head = pR->u32Head, u32Tail, u32Slot, u32Free;
+
+   while (1) {
+      if (pR->bClosed || u32Head >= (uint32_t)pShm->iHeight)
+         return NULL;
+      u32Tail = __atomic_load_n(&pR->u32Tail, __ATOMIC_ACQUIRE);
+      if (u32Head - u32Tail < (uint32_t)pShm->iSlots)
+         break;
+      ShmWait(pShm, &pR->u32Tail, u32Tail, &pR->bSpaceWait, pShm->fdSpace);
+   }
+   u32Slot = u32Head % (uint32_t)pShm->iSlots;
+   u32Free = (uint32_t)pShm->iSlots - (u32Head - u32Tail);
+   if (u32Free > (uint32_t)pShm->iSlots - u32Slot) u32Free = (uint32_t)pShm->iSlots - u32Slot;
+   if (u32Free > (uint32_t)pShm->iHeight - u32Head) u32Free = (uint32_t)pShm->iHeight - u32Head;
+   *piCount = (int)u32Free;
+   return &pShm->pRows[(size_t)u32Slot * pShm->iPitch];
+} /* tpShmGetRows() */
+
+void tpShmCommit(TP_SHM *pShm, int iCount)
+{
+TP_SHM_RING *pR = pShm->pRing;
+
+   pShm->llRows += iCount;
+   __atomic_store_n(&pR->u32Head, pR->u32Head + (uint32_t)iCount, __ATOMIC_SEQ_CST);
+   ShmWake(pShm, &pR->bDataWait, pShm->fdData);
+} /* tpShmCommit() */
+
+uint8_t * tpShmPeekRows(TP_SHM *pShm, int *piCount)
+{
+TP_SHM_RING *pR = pShm->pRing;
+uint32_t u32Tail = pR->u32Tail, u32Head, u32Slot, u32Ready;
+
+   while (1) {
+      if (pR->bClosed || u32Tail >= (uint32_t)pShm->iHeight)
+         return NULL;
+      u32Head = __atomic_load_n(&pR->u32Head, __ATOMIC_ACQUIRE);
+      if (u32Head != u32Tail)
+         break;
+      ShmWait(pShm, &pR->u32Head, u32Tail, &pR->bDataWait, pShm->fdData);
+   }
+   u32Ready = u32Head - u32Tail;
+   if (u32Ready > (uint32_t)pShm->iSlots) // the producer is confused
+      return NULL;
+   u32Slot = u32Tail % (uint32_t)pShm->iSlots;
+   if (u32Ready > (uint32_t)pShm->iSlots - u32Slot) u32Ready = (uint32_t)pShm->iSlots - u32Slot;
+   if (u32Ready > (uint32_t)pShm->iHeight - u32Tail) u32Ready = (uint32_t)pShm->iHeight - u32Tail;
+   *piCount = (int)u32Ready;
+   return &pShm->pRows[(size_t)u32Slot * pShm->iPitch];
+} /* tpShmPeekRows() */
+
+void tpShmRelease(TP_SHM *pShm, int iCount)
+{
+TP_SHM_RING *pR = pShm->pRing;
+
+   pShm->llRows += iCount;
+   __atomic_store_n(&pR->u32Tail, pR->u32Tail + (uint32_t)iCount, __ATOMIC_SEQ_CST);
+   ShmWake(pShm, &pR->bSpaceWait, pShm->fdSpace);
+} /* tpShmRelease() */
+
+int tpShmPrint(TP_SHM *pShm)
+{
+TP_SHM_RING *pR = pShm->pRing;
+uint8_t *pRows;
+int iCount, iBatch;
+
+   if (!tpRasterBegin(pShm->iWidth, pShm->iHeight)) {
+      tpShmAbort(pShm);
+      return 0;
+   }
+   // give the rows back a quarter of the ring at a time so that the
+   // producer can refill it while we encode
+   iBatch = (pShm->iSlots + 3) / 4;
+   while ((pRows = tpShmPeekRows(pShm, &iCount)) != NULL) {
+      if (iCount > iBatch)
+         iCount = iBatch;
+      if (!tpRasterLines(pRows, iCount)) {
+         tpShmAbort(pShm);
+         break;
+      }
+      tpShmRelease(pShm, iCount);
+   }
+   tpRasterEnd(); // blank rows for any the producer didn't send
+   return (!pR->bClosed && pR->u32Tail == (uint32_t)pShm->iHeight);
+} /* tpShmPrint() */
+
+void tpShmPrintStats(TP_SHM *pShm, const char *szLabel)
+{
+   printf("%s: %lld rows, slept %lld times, woke the other side %lld times\n",
+          szLabel, pShm->llRows, pShm->llWaits, pShm->llWakes);
+} /* tpShmPrintStats() */
@@ -0,0 +1,132 @@
+//
+// Shared memory raster submission for the Linux host build
+// A program which already has (or renders) a large 1-bpp image hands it
+// to the printing process a few rows at a time through a ring of
+// scanlines in shared memory (memfd) instead of copying it through a
+// socket. The printing side encodes the rows straight out of the ring
+// with tpRasterLines(), so the image is never copied between the
+// processes. The two sides only use eventfds to wake each other, and
+// only when the other side is actually waiting.
+//
+// The ring starts with a TP_SHM_RING header; the rows follow it.
+// u32Head counts the rows written, u32Tail the rows printed (both only
+// grow; row n is in slot n % iSlots). The memfd is sealed against
+// resizing, and the printing side copies the geometry when it attaches,
+// so the producer can't change either afterwards.
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_SHM_H__
+#define __TP_SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TP_SHM_MAGIC 0x4d485354 // "TSHM"
+
+typedef struct tagTP_SHM_RING
+{
+  uint32_t u32Magic;
+  int32_t iWidth, iHeight; // the raster (pixels, scanlines)
+  int32_t iPitch;          // bytes per row in the ring
+  int32_t iSlots;          // rows the ring holds
+  int32_t iRowOffset;      // where the rows start
+  volatile int32_t bClosed; // one side gave up (the printer went away)
+  uint32_t u32Pad0[9];
+  uint32_t u32Head;        // written by the producer (own cache line)
+  volatile int32_t bSpaceWait; // the producer is waiting for room
+  uint32_t u32Pad1[14];
+  uint32_t u32Tail;        // written by the printer
+  volatile int32_t bDataWait; // the printer is waiting for rows
+  uint32_t u32Pad2[14];
+} TP_SHM_RING;
+
+typedef struct tagTP_SHM
+{
+  int fdMem;       // memfd with the ring
+  int fdData;      // eventfd: rows were written
+  int fdSpace;     // eventfd: rows were printed
+  size_t size;
+  TP_SHM_RING *pRing;
+  uint8_t *pRows;
+  int iWidth, iHeight, iPitch, iSlots; // the ring's geometry, once checked
+  // statistics (this side only)
+  long long llRows;   // rows committed or released
+  long long llWaits;  // times this side had to sleep
+  long long llWakes;  // eventfd writes to wake the other side
+} TP_SHM;
+
+//
+// Create a ring of iSlots rows for a iWidth x iHeight raster
+// returns 1 if successful, 0 on failure
+//
+int tpShmCreate(TP_SHM *pShm, int iWidth, int iHeight, int iSlots);
+//
+// Map a ring created by another process from its 3 descriptors
+// (the memfd, then the data and space eventfds)
+// returns 1 if successful, 0 on failure
+//
+int tpShmAttach(TP_SHM *pShm, int fdMem, int fdData, int fdSpace);
+//
+// Pass the ring's descriptors over a Unix domain socket, and attach to
+// a ring received that way
+// return 1 if successful, 0 on failure
+//
+int tpShmSend(TP_SHM *pShm, int fdSocket);
+int tpShmReceive(TP_SHM *pShm, int fdSocket);
+//
+// Unmap the ring and close the descriptors
+//
+void tpShmClose(TP_SHM *pShm);
+//
+// Mark the ring closed and wake the other side (e.g. the printer is gone
+// or the producer can't finish the image)
+//
+void tpShmAbort(TP_SHM *pShm);
+//
+// Producer: wait for room and return where the next rows go; *piCount
+// is set to the number of contiguous rows which can be written there
+// returns NULL if the image is complete or the ring was closed
+//
+uint8_t * tpShmGetRows(TP_SHM *pShm, int *piCount);
+//
+// Producer: make the next iCount rows visible to the printer
+//
+void tpShmCommit(TP_SHM *pShm, int iCount);
+//
+// Printer: wait for rows and return the next one; *piCount is set to the
+// number of contiguous rows ready there
+// returns NULL once every row has been printed or the ring was closed
+//
+uint8_t * tpShmPeekRows(TP_SHM *pShm, int *piCount);
+//
+// Printer: give iCount rows back to the producer
+//
+void tpShmRelease(TP_SHM *pShm, int iCount);
+//
+// Print the raster in the ring on the connected printer as the rows
+// arrive (tpRasterBegin/Lines/End)
+// returns 1 if every row was printed, 0 on failure
+//
+int tpShmPrint(TP_SHM *pShm);
+//
+// Print the statistics to stdout
+//
+void tpShmPrintStats(TP_SHM *pShm, const char *szLabel);
+
+#endif // __TP_SHM_H__
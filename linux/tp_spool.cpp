@@ -0,0 +1,725 @@
+//
+// Print spooler for the Linux host build
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "tp_spool.h"
+
+#define SPOOL_BAND 256 // scanlines of a PBM image printed at a time
+
+static const char *szJobTypes[TP_SPOOL_TYPES] = {"pbm", "text", "qr", "barcode"};
+static const struct { const char *szName; int iType; } spoolBarcodes[] = {
+   {"upca", BARCODE_UPCA}, {"upce", BARCODE_UPCE}, {"ean13", BARCODE_EAN13},
+   {"ean8", BARCODE_EAN8}, {"code39", BARCODE_CODE39}, {"itf", BARCODE_ITF},
+   {"codabar", BARCODE_CODABAR}, {"code93", BARCODE_CODE93}, {"code128", BARCODE_CODE128},
+   {NULL, 0}};
+static uint8_t ucSpoolBand[72 * SPOOL_BAND]; // 576 pixels wide
+
+int tpSpoolJobType(const char *szName)
+{
+int i;
+
+   for (i=0; i<TP_SPOOL_TYPES; i++) {
+      if (strcmp(szName, szJobTypes[i]) == 0)
+         return i;
+   }
+   return -1;
+} /* tpSpoolJobType() */
+//
+// The file which holds a job, or (bTemp) the one a client's job is
+// written to first; u32Job is then the client's slot
+//
+static void SpoolPath(TP_SPOOL *pSpool, int iPrinter, uint32_t u32Job, int iJobType, int bTemp, char *szPath)
+{
+   if (bTemp)
+      snprintf(szPath, 512, "%s/%s/.client%u.tmp", pSpool->szDir, pSpool->printers[iPrinter].szName, u32Job);
+   else
+      snprintf(szPath, 512, "%s/%s/%010u.%s", pSpool->szDir, pSpool->printers[iPrinter].szName, u32Job, szJobTypes[iJobType]);
+} /* SpoolPath() */
+//
+// Parse the next number in a PBM header (skipping white space and comments)
+//
+static int SpoolPBMNumber(uint8_t *pData, int iLen, int *pOff)
+{
+int i = *pOff, iValue = 0;
+
+   while (i < iLen && (pData[i] <= ' ' || pData[i] == '#')) {
+      if (pData[i] == '#') {
+         while (i < iLen && pData[i] != '\n') i++;
+      } else {
+         i++;
+      }
+   }
+   if (i >= iLen || pData[i] < '0' || pData[i] > '9')
+      return -1;
+   while (i < iLen && pData[i] >= '0' && pData[i] <= '9' && iValue < 100000)
+      iValue = (iValue * 10) + (pData[i++] - '0');
+   *pOff = i + 1; // a single white space character ends the header
+   return iValue;
+} /* SpoolPBMNumber() */
+//
+// PBM uses the back buffer's layout (1 = black, MSB on the left),
+// so the rows are copied a band at a time and clipped to the printer
+//
+static int SpoolPrintPBM(uint8_t *pData, int iLen)
+{
+int i, y, cx, cy, iOff = 2, iSrcPitch, iPitch, iCopy, iWidth, iRows;
+uint8_t ucMask;
+
+   if (iLen < 2 || pData[0] != 'P' || pData[1] != '4')
+      return 0;
+   cx = SpoolPBMNumber(pData, iLen, &iOff);
+   cy = SpoolPBMNumber(pData, iLen, &iOff);
+   if (cx <= 0 || cy <= 0)
+      return 0;
+   iSrcPitch = (cx + 7) >> 3;
+   if (iOff + (iSrcPitch * cy) > iLen)
+      return 0;
+   iWidth = tpGetWidth();
+   if (iWidth <= 0 || iWidth > 576)
+      return 0;
+   iPitch = (iWidth + 7) >> 3;
+   iCopy = (cx < iWidth) ? iSrcPitch : iPitch;
+   ucMask = (cx < iWidth && (cx & 7)) ? (uint8_t)(0xff << (8 - (cx & 7))) : 0xff;
+   for (y=0; y<cy; y += iRows) {
+      iRows = (cy - y < SPOOL_BAND) ? cy - y : SPOOL_BAND;
+      memset(ucSpoolBand, 0, iPitch * iRows);
+      for (i=0; i<iRows; i++) {
+         memcpy(&ucSpoolBand[i * iPitch], &pData[iOff + ((y + i) * iSrcPitch)], iCopy);
+         ucSpoolBand[(i * iPitch) + iCopy - 1] &= ucMask; // the padding bits
+      }
+      tpSetBackBuffer(ucSpoolBand, iWidth, iRows);
+      tpPrintBuffer();
+   }
+   return 1;
+} /* SpoolPrintPBM() */
+
+static int SpoolPrintText(uint8_t *pData, int iLen)
+{
+char szLine[129];
+int i, j = 0;
+
+   tpSetFont(FONT_9x17, 0, 0, 0, 0);
+   tpAlign(ALIGN_LEFT);
+   for (i=0; i<=iLen; i++) {
+      if (i == iLen || pData[i] == '\n' || j == (int)sizeof(szLine)-1) {
+         if (i == iLen && j == 0)
+            break; // no partial last line
+         szLine[j] = 0;
+         tpPrintLine(szLine);
+         j = 0;
+         if (i < iLen && pData[i] != '\n')
+            szLine[j++] = (char)pData[i]; // a long line wraps
+      } else if (pData[i] != '\r') {
+         szLine[j++] = (char)pData[i];
+      }
+   }
+   return 1;
+} /* SpoolPrintText() */
+
+int tpSpoolPrintJob(int iJobType, uint8_t *pData, int iLen)
+{
+char szText[256], *szData;
+int i;
+
+   if (pData == NULL || iLen <= 0)
+      return 0;
+   switch (iJobType) {
+      case TP_SPOOL_PBM:
+         return SpoolPrintPBM(pData, iLen);
+      case TP_SPOOL_TEXT:
+         return SpoolPrintText(pData, iLen);
+      case TP_SPOOL_QR:
+      case TP_SPOOL_BARCODE:
+         if (iLen >= (int)sizeof(szText))
+            return 0;
+         memcpy(szText, pData, iLen);
+         szText[iLen] = 0;
+         while (iLen > 0 && szText[iLen-1] <= ' ') // no trailing new line
+            szText[--iLen] = 0;
+         tpAlign(ALIGN_CENTER);
+         if (iJobType == TP_SPOOL_QR) {
+            tpQRCode(szText);
+         } else {
+            szData = strchr(szText, ' ');
+            if (szData == NULL || strlen(szData+1) > 100)
+               return 0;
+            *szData++ = 0;
+            for (i=0; spoolBarcodes[i].szName != NULL; i++) {
+               if (strcmp(szText, spoolBarcodes[i].szName) == 0)
+                  break;
+            }
+            if (spoolBarcodes[i].szName == NULL)
+               return 0;
+            tp1DBarcode(spoolBarcodes[i].iType, 64, szData, BARCODE_TEXT_BELOW);
+         }
+         tpAlign(ALIGN_LEFT);
+         return 1;
+   }
+   return 0;
+} /* tpSpoolPrintJob() */
+//
+// Print a spooled job
+// returns 1 if it was printed, 0 if the data was bad (it's dropped)
+// or -1 if the printer couldn't take it (it's tried again later)
+//
+static int SpoolPrint(TP_SPOOL *pSpool, int iPrinter, uint32_t u32Job, int iJobType)
+{
+TP_SPOOL_PRINTER *pP = &pSpool->printers[iPrinter];
+char szPath[512];
+uint8_t *pData;
+struct stat st;
+int fd, iLen, iResult;
+
+   SpoolPath(pSpool, iPrinter, u32Job, iJobType, 0, szPath);
+   fd = open(szPath, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return 0;
+   if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > TP_SPOOL_MAX_JOB) {
+      close(fd);
+      return 0;
+   }
+   iLen = (int)st.st_size;
+   pData = (uint8_t *)malloc(iLen);
+   if (pData == NULL || read(fd, pData, iLen) != iLen) {
+      close(fd);
+      free(pData);
+      return -1;
+   }
+   close(fd);
+   if (!tpSetTransport(pP->pTransport, pP->iType, pP->szName)) {
+      free(pData);
+      return -1;
+   }
+   iResult = tpSpoolPrintJob(iJobType, pData, iLen);
+   tpFlush();
+   if (!tpIsConnected()) { // the link dropped; open it again for the next try
+      if (pP->pTransport->pfnReconnect)
+         (*pP->pTransport->pfnReconnect)(pP->pTransport->pUser);
+      iResult = -1;
+   }
+   tpDisconnect();
+   free(pData);
+   return iResult;
+} /* SpoolPrint() */
+
+static void SpoolWake(TP_SPOOL *pSpool)
+{
+uint64_t u64 = 1;
+
+   if (write(pSpool->fdWake, &u64, sizeof(u64)) != sizeof(u64)) {
+      // the counter is already non-zero; the client loop will wake up
+   }
+} /* SpoolWake() */
+//
+// The worker owns the library; it prints the queued jobs, taking the
+// printers in turn so a long queue doesn't starve the others
+//
+static void * SpoolWorker(void *pArg)
+{
+TP_SPOOL *pSpool = (TP_SPOOL *)pArg;
+TP_SPOOL_PRINTER *pP;
+char szPath[512];
+uint32_t u32Job;
+int i, j = 0, iJobType, iResult;
+
+   pthread_mutex_lock(&pSpool->mutex);
+   while (pSpool->bRun) {
+      for (i=0; i<pSpool->iPrinters; i++) {
+         j = (pSpool->iNext + i) % pSpool->iPrinters;
+         if (pSpool->printers[j].iCount > 0)
+            break;
+      }
+      if (i == pSpool->iPrinters) { // nothing to do
+         pSpool->bBusy = 0;
+         SpoolWake(pSpool);
+         pthread_cond_wait(&pSpool->cond, &pSpool->mutex);
+         continue;
+      }
+      pP = &pSpool->printers[j];
+      pSpool->iNext = j + 1;
+      pSpool->bBusy = 1;
+      u32Job = pP->u32Jobs[pP->iHead];
+      iJobType = pP->ucJobTypes[pP->iHead];
+      pthread_mutex_unlock(&pSpool->mutex);
+      iResult = SpoolPrint(pSpool, j, u32Job, iJobType);
+      if (iResult >= 0) {
+         SpoolPath(pSpool, j, u32Job, iJobType, 0, szPath);
+         unlink(szPath);
+      } else {
+         usleep(250000); // give the printer a moment
+      }
+      pthread_mutex_lock(&pSpool->mutex);
+      if (iResult > 0)
+         pP->llPrinted++;
+      else
+         pP->llFailed++;
+      if (iResult >= 0) {
+         pP->iHead = (pP->iHead + 1) % TP_SPOOL_QUEUE;
+         pP->iCount--;
+      }
+   }
+   pSpool->bBusy = 0;
+   pthread_mutex_unlock(&pSpool->mutex);
+   return NULL;
+} /* SpoolWorker() */
+
+static void SpoolReply(TP_SPOOL_CLIENT *pC, const char *szReply)
+{
+   if (send(pC->fd, szReply, strlen(szReply), MSG_NOSIGNAL) < 0) {
+      // the client is gone; the next read finds out
+   }
+} /* SpoolReply() */
+
+static void SpoolCloseClient(TP_SPOOL *pSpool, TP_SPOOL_CLIENT *pC)
+{
+char szPath[512];
+
+   if (pC->fdJob >= 0) { // the client left in the middle of a job
+      close(pC->fdJob);
+      SpoolPath(pSpool, pC->iPrinter, (uint32_t)(pC - pSpool->clients), 0, 1, szPath);
+      unlink(szPath);
+      pSpool->llAborted++;
+   }
+   close(pC->fd);
+   pC->fd = pC->fdJob = -1;
+} /* SpoolCloseClient() */
+//
+// All of the data is in the spool file; queue the job and answer
+// (the id is given out now so the ids are in the order of the queue)
+//
+static void SpoolFinishJob(TP_SPOOL *pSpool, TP_SPOOL_CLIENT *pC)
+{
+TP_SPOOL_PRINTER *pP = &pSpool->printers[pC->iPrinter];
+char szTemp[512], szPath[512];
+
+   if (pSpool->bSync)
+      fsync(pC->fdJob);
+   close(pC->fdJob);
+   pC->fdJob = -1;
+   pC->u32Job = pSpool->u32NextJob++;
+   SpoolPath(pSpool, pC->iPrinter, (uint32_t)(pC - pSpool->clients), 0, 1, szTemp);
+   SpoolPath(pSpool, pC->iPrinter, pC->u32Job, pC->iJobType, 0, szPath);
+   if (rename(szTemp, szPath) < 0) {
+      unlink(szTemp);
+      pSpool->llRejected++;
+      SpoolReply(pC, "ERR spool\n");
+      return;
+   }
+   pthread_mutex_lock(&pSpool->mutex);
+   pP->u32Jobs[(pP->iHead + pP->iCount) % TP_SPOOL_QUEUE] = pC->u32Job;
+   pP->ucJobTypes[(pP->iHead + pP->iCount) % TP_SPOOL_QUEUE] = (uint8_t)pC->iJobType;
+   pP->iCount++;
+   pSpool->llSubmitted++;
+   pthread_cond_signal(&pSpool->cond);
+   pthread_mutex_unlock(&pSpool->mutex);
+   sprintf(szTemp, "OK %u\n", pC->u32Job);
+   SpoolReply(pC, szTemp);
+} /* SpoolFinishJob() */
+
+static void SpoolRequest(TP_SPOOL *pSpool, TP_SPOOL_CLIENT *pC)
+{
+char szPrinter[64], szType[16], szPath[512], szReply[64 * TP_SPOOL_PRINTERS];
+int i, iLen, iCount;
+
+   if (sscanf(pC->szLine, "JOB %63s %15s %d", szPrinter, szType, &iLen) == 3) {
+      for (i=0; i<pSpool->iPrinters; i++) {
+         if (strcmp(szPrinter, pSpool->printers[i].szName) == 0)
+            break;
+      }
+      pC->iJobType = tpSpoolJobType(szType);
+      pthread_mutex_lock(&pSpool->mutex);
+      iCount = (i < pSpool->iPrinters) ? pSpool->printers[i].iCount : 0;
+      pthread_mutex_unlock(&pSpool->mutex);
+      if (i == pSpool->iPrinters)
+         SpoolReply(pC, "ERR unknown printer\n");
+      else if (pC->iJobType < 0)
+         SpoolReply(pC, "ERR unknown type\n");
+      else if (iLen <= 0 || iLen > TP_SPOOL_MAX_JOB)
+         SpoolReply(pC, "ERR bad length\n");
+      else if (iCount >= TP_SPOOL_QUEUE)
+         SpoolReply(pC, "ERR queue full\n");
+      else {
+         pC->iPrinter = i;
+         pC->iRemaining = iLen;
+         SpoolPath(pSpool, i, (uint32_t)(pC - pSpool->clients), 0, 1, szPath);
+         pC->fdJob = open(szPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+         if (pC->fdJob >= 0)
+            return;
+         SpoolReply(pC, "ERR spool\n");
+      }
+      pSpool->llRejected++;
+      SpoolCloseClient(pSpool, pC); // don't take the data (the reply can still be read)
+   } else if (strcmp(pC->szLine, "STATUS") == 0) {
+      iLen = 0;
+      pthread_mutex_lock(&pSpool->mutex);
+      for (i=0; i<pSpool->iPrinters; i++) {
+         iLen += sprintf(&szReply[iLen], "%s %d %lld %lld\n", pSpool->printers[i].szName,
+                         pSpool->printers[i].iCount, pSpool->printers[i].llPrinted, pSpool->printers[i].llFailed);
+      }
+      pthread_mutex_unlock(&pSpool->mutex);
+      strcpy(&szReply[iLen], ".\n");
+      SpoolReply(pC, szReply);
+   } else if (strcmp(pC->szLine, "WAIT") == 0) {
+      pC->bWaiting = 1; // answered by the client loop
+   } else if (strcmp(pC->szLine, "SHUTDOWN") == 0) {
+      SpoolReply(pC, "OK\n");
+      pSpool->bRun = 0;
+   } else {
+      SpoolReply(pC, "ERR bad request\n");
+   }
+} /* SpoolRequest() */
+//
+// Read what a client sent; the request line, then the job's data
+// which goes straight to the spool file
+//
+static void SpoolRead(TP_SPOOL *pSpool, TP_SPOOL_CLIENT *pC)
+{
+uint8_t ucTemp[16384];
+int i, n, iChunk;
+
+   n = (int)read(pC->fd, ucTemp, sizeof(ucTemp));
+   if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+   if (n <= 0) {
+      SpoolCloseClient(pSpool, pC);
+      return;
+   }
+   for (i=0; i<n && pC->fd >= 0; ) {
+      if (pC->fdJob < 0) {
+         if (ucTemp[i] == '\n') {
+            pC->szLine[pC->iLineLen] = 0;
+            pC->iLineLen = 0;
+            SpoolRequest(pSpool, pC);
+         } else if (pC->iLineLen < (int)sizeof(pC->szLine)-1) {
+            pC->szLine[pC->iLineLen++] = (char)ucTemp[i];
+         }
+         i++;
+      } else {
+         iChunk = (n - i < pC->iRemaining) ? n - i : pC->iRemaining;
+         if (write(pC->fdJob, &ucTemp[i], iChunk) != iChunk) {
+            SpoolReply(pC, "ERR spool\n");
+            pSpool->llRejected++;
+            SpoolCloseClient(pSpool, pC);
+            return;
+         }
+         i += iChunk;
+         pC->iRemaining -= iChunk;
+         if (pC->iRemaining == 0)
+            SpoolFinishJob(pSpool, pC);
+      }
+   }
+} /* SpoolRead() */
+//
+// Queue the jobs left in a printer's spool directory (in order) and
+// remove the ones which were never finished
+//
+static int SpoolCompare(const void *p1, const void *p2)
+{
+uint64_t u1 = *(const uint64_t *)p1, u2 = *(const uint64_t *)p2;
+   return (u1 < u2) ? -1 : (u1 > u2);
+} /* SpoolCompare() */
+
+static void SpoolRecover(TP_SPOOL *pSpool, int iPrinter, const char *szDir)
+{
+TP_SPOOL_PRINTER *pP = &pSpool->printers[iPrinter];
+static uint64_t u64Jobs[TP_SPOOL_QUEUE]; // id << 8 | type
+struct dirent *pEnt;
+char szPath[1024], szType[16];
+uint32_t u32Job;
+int i, iCount = 0, iJobType;
+DIR *pDir;
+
+   pDir = opendir(szDir);
+   if (pDir == NULL)
+      return;
+   while ((pEnt = readdir(pDir)) != NULL) {
+      if (pEnt->d_name[0] == '.') {
+         if (strstr(pEnt->d_name, ".tmp") != NULL) {
+            snprintf(szPath, sizeof(szPath), "%s/%s", szDir, pEnt->d_name);
+            unlink(szPath);
+         }
+         continue;
+      }
+      if (sscanf(pEnt->d_name, "%u.%15s", &u32Job, szType) != 2 || (iJobType = tpSpoolJobType(szType)) < 0)
+         continue;
+      if (iCount < TP_SPOOL_QUEUE)
+         u64Jobs[iCount++] = ((uint64_t)u32Job << 8) | iJobType;
+   }
+   closedir(pDir);
+   qsort(u64Jobs, iCount, sizeof(uint64_t), SpoolCompare);
+   for (i=0; i<iCount; i++) {
+      u32Job = (uint32_t)(u64Jobs[i] >> 8);
+      pP->u32Jobs[pP->iCount] = u32Job;
+      pP->ucJobTypes[pP->iCount++] = (uint8_t)(u64Jobs[i] & 0xff);
+      if (u32Job >= pSpool->u32NextJob)
+         pSpool->u32NextJob = u32Job + 1;
+   }
+} /* SpoolRecover() */
+
+int tpSpoolInit(TP_SPOOL *pSpool, const char *szSocket, const char *szDir)
+{
+int i;
+
+   if (szSocket == NULL || szDir == NULL || strlen(szSocket) >= sizeof(pSpool->szSocket) ||
+       strlen(szDir) >= sizeof(pSpool->szDir) - 40)
+      return 0;
+   memset(pSpool, 0, sizeof(TP_SPOOL));
+   strcpy(pSpool->szSocket, szSocket);
+   strcpy(pSpool->szDir, szDir);
+   pSpool->fdListen = pSpool->fdWake = -1;
+   pSpool->u32NextJob = 1;
+   for (i=0; i<TP_SPOOL_CLIENTS; i++)
+      pSpool->clients[i].fd = pSpool->clients[i].fdJob = -1;
+   if (mkdir(szDir, 0700) < 0 && errno != EEXIST)
+      return 0;
+   pthread_mutex_init(&pSpool->mutex, NULL);
+   pthread_cond_init(&pSpool->cond, NULL);
+   return 1;
+} /* tpSpoolInit() */
+
+int tpSpoolAddPrinter(TP_SPOOL *pSpool, const char *szName, int iType, TP_TRANSPORT *pTransport)
+{
+TP_SPOOL_PRINTER *pP;
+char szPath[512];
+int i;
+
+   if (szName == NULL || pTransport == NULL || pSpool->iPrinters >= TP_SPOOL_PRINTERS ||
+       iType < 0 || iType >= PRINTER_COUNT || strlen(szName) >= sizeof(pP->szName) ||
+       szName[0] == 0 || szName[0] == '.' || strchr(szName, '/') != NULL || strchr(szName, ' ') != NULL)
+      return 0;
+   for (i=0; i<pSpool->iPrinters; i++) {
+      if (strcmp(szName, pSpool->printers[i].szName) == 0)
+         return 0;
+   }
+   snprintf(szPath, sizeof(szPath), "%s/%s", pSpool->szDir, szName);
+   if (mkdir(szPath, 0700) < 0 && errno != EEXIST)
+      return 0;
+   pP = &pSpool->printers[pSpool->iPrinters];
+   memset(pP, 0, sizeof(TP_SPOOL_PRINTER));
+   strcpy(pP->szName, szName);
+   pP->iType = iType;
+   pP->pTransport = pTransport;
+   SpoolRecover(pSpool, pSpool->iPrinters, szPath);
+   pSpool->iPrinters++;
+   return 1;
+} /* tpSpoolAddPrinter() */
+
+void tpSpoolStop(TP_SPOOL *pSpool)
+{
+   pSpool->bRun = 0;
+} /* tpSpoolStop() */
+
+void tpSpoolRun(TP_SPOOL *pSpool)
+{
+struct pollfd pfds[TP_SPOOL_CLIENTS + 2];
+TP_SPOOL_CLIENT *pMap[TP_SPOOL_CLIENTS + 2];
+struct sockaddr_un addr;
+uint64_t u64;
+int i, n, fd, bIdle;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, pSpool->szSocket);
+   unlink(pSpool->szSocket); // left by a spooler which didn't exit cleanly
+   pSpool->fdListen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   pSpool->fdWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (pSpool->fdListen < 0 || pSpool->fdWake < 0 ||
+       bind(pSpool->fdListen, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(pSpool->fdListen, TP_SPOOL_CLIENTS) < 0) {
+      if (pSpool->fdListen >= 0) close(pSpool->fdListen);
+      if (pSpool->fdWake >= 0) close(pSpool->fdWake);
+      pSpool->fdListen = pSpool->fdWake = -1;
+      return;
+   }
+   pSpool->bRun = 1;
+   pthread_create(&pSpool->worker, NULL, SpoolWorker, pSpool);
+   while (pSpool->bRun) {
+      for (i=0; i<TP_SPOOL_CLIENTS; i++) {
+         if (pSpool->clients[i].fd < 0)
+            break;
+      }
+      pfds[0].fd = pSpool->fdListen;
+      pfds[0].events = (i < TP_SPOOL_CLIENTS) ? POLLIN : 0; // the rest wait in the backlog
+      pfds[1].fd = pSpool->fdWake;
+      pfds[1].events = POLLIN;
+      n = 2;
+      for (i=0; i<TP_SPOOL_CLIENTS; i++) {
+         if (pSpool->clients[i].fd >= 0) {
+            pfds[n].fd = pSpool->clients[i].fd;
+            pfds[n].events = POLLIN;
+            pMap[n++] = &pSpool->clients[i];
+         }
+      }
+      if (poll(pfds, n, 200) < 0 && errno != EINTR)
+         break;
+      if (pfds[0].revents & POLLIN) {
+         for (i=0; i<TP_SPOOL_CLIENTS; i++) {
+            if (pSpool->clients[i].fd >= 0)
+               continue;
+            fd = accept4(pSpool->fdListen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+               break;
+            memset(&pSpool->clients[i], 0, sizeof(TP_SPOOL_CLIENT));
+            pSpool->clients[i].fd = fd;
+            pSpool->clients[i].fdJob = -1;
+         }
+      }
+      if (pfds[1].revents & POLLIN) {
+         if (read(pSpool->fdWake, &u64, sizeof(u64)) < 0) {
+            // already read
+         }
+      }
+      for (i=2; i<n; i++) {
+         if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            SpoolRead(pSpool, pMap[i]);
+      }
+      // answer WAIT once everything has been printed
+      pthread_mutex_lock(&pSpool->mutex);
+      bIdle = !pSpool->bBusy;
+      for (i=0; i<pSpool->iPrinters && bIdle; i++) {
+         if (pSpool->printers[i].iCount > 0)
+            bIdle = 0;
+      }
+      pthread_mutex_unlock(&pSpool->mutex);
+      for (i=0; i<TP_SPOOL_CLIENTS && bIdle; i++) {
+         if (pSpool->clients[i].fd >= 0 && pSpool->clients[i].bWaiting) {
+            pSpool->clients[i].bWaiting = 0;
+            SpoolReply(&pSpool->clients[i], "OK\n");
+         }
+      }
+   }
+   pthread_mutex_lock(&pSpool->mutex);
+   pSpool->bRun = 0;
+   pthread_cond_signal(&pSpool->cond);
+   pthread_mutex_unlock(&pSpool->mutex);
+   pthread_join(pSpool->worker, NULL);
+   for (i=0; i<TP_SPOOL_CLIENTS; i++) {
+      if (pSpool->clients[i].fd >= 0)
+         SpoolCloseClient(pSpool, &pSpool->clients[i]);
+   }
+   close(pSpool->fdListen);
+   close(pSpool->fdWake);
+   pSpool->fdListen = pSpool->fdWake = -1;
+   unlink(pSpool->szSocket);
+} /* tpSpoolRun() */
+//
+// Client side
+//
+static int SpoolConnect(const char *szSocket)
+{
+struct sockaddr_un addr;
+int fd;
+
+   if (strlen(szSocket) >= sizeof(addr.sun_path))
+      return -1;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, szSocket);
+   fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+   }
+   return fd;
+} /* SpoolConnect() */
+
+static int SpoolSendAll(int fd, const uint8_t *pData, int iLen)
+{
+int i;
+
+   while (iLen > 0) {
+      i = (int)send(fd, pData, iLen, MSG_NOSIGNAL);
+      if (i < 0 && errno == EINTR)
+         continue;
+      if (i <= 0)
+         return 0;
+      pData += i;
+      iLen -= i;
+   }
+   return 1;
+} /* SpoolSendAll() */
+//
+// Read a reply which ends with szEnd
+//
+static int SpoolReadReply(int fd, char *szReply, int iSize, const char *szEnd)
+{
+int i, iLen = 0, iEnd = (int)strlen(szEnd);
+
+   while (iLen < iSize-1) {
+      i = (int)read(fd, &szReply[iLen], iSize - 1 - iLen);
+      if (i < 0 && errno == EINTR)
+         continue;
+      if (i <= 0)
+         break;
+      iLen += i;
+      szReply[iLen] = 0;
+      if (iLen >= iEnd && strcmp(&szReply[iLen - iEnd], szEnd) == 0)
+         return 1;
+   }
+   szReply[iLen] = 0;
+   return 0;
+} /* SpoolReadReply() */
+
+int tpSpoolSubmit(const char *szSocket, const char *szPrinter, const char *szJobType, const uint8_t *pData, int iLen)
+{
+char szTemp[160];
+unsigned int uJob;
+int fd, iJob = -1;
+
+   if (szPrinter == NULL || szJobType == NULL || pData == NULL || iLen <= 0 ||
+       strlen(szPrinter) + strlen(szJobType) > 100)
+      return -1;
+   fd = SpoolConnect(szSocket);
+   if (fd < 0)
+      return -1;
+   sprintf(szTemp, "JOB %s %s %d\n", szPrinter, szJobType, iLen);
+   if (SpoolSendAll(fd, (const uint8_t *)szTemp, (int)strlen(szTemp)) && SpoolSendAll(fd, pData, iLen) &&
+       SpoolReadReply(fd, szTemp, sizeof(szTemp), "\n") && sscanf(szTemp, "OK %u", &uJob) == 1)
+      iJob = (int)uJob;
+   close(fd);
+   return iJob;
+} /* tpSpoolSubmit() */
+
+int tpSpoolCommand(const char *szSocket, const char *szCommand, char *szReply, int iReplySize)
+{
+char szTemp[32];
+int fd, iResult;
+
+   if (szCommand == NULL || szReply == NULL || iReplySize < 4 || strlen(szCommand) > 16)
+      return 0;
+   fd = SpoolConnect(szSocket);
+   if (fd < 0)
+      return 0;
+   sprintf(szTemp, "%s\n", szCommand);
+   iResult = SpoolSendAll(fd, (const uint8_t *)szTemp, (int)strlen(szTemp)) &&
+             SpoolReadReply(fd, szReply, iReplySize, (strcmp(szCommand, "STATUS") == 0) ? ".\n" : "\n");
+   close(fd);
+   return iResult;
+} /* tpSpoolCommand() */
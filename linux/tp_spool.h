@@ -0,0 +1,142 @@
+//
+// Print spooler for the Linux host build
+// Programs submit jobs over a Unix domain socket instead of linking
+// the library and fighting over its single connection. Each job is
+// written to the spool directory before the client gets its reply, so
+// a client can exit right away and a job survives the spooler being
+// restarted. One worker thread owns the library and prints the queued
+// jobs, taking the printers in turn.
+//
+// The protocol is a line of text, then (for a job) the data:
+//   JOB <printer> <type> <length>\n<length bytes>  -> OK <job id> | ERR <reason>
+//   STATUS\n   -> a line per printer: <name> <queued> <printed> <failed>, then "."
+//   WAIT\n     -> OK once every queue is empty
+//   SHUTDOWN\n -> OK; the job being printed is finished, the rest stay spooled
+// Job types:
+//   pbm     - a binary (P4) PBM image, printed from the left edge
+//   text    - lines of plain text
+//   qr      - the text to put in a QR code
+//   barcode - "<symbology> <data>" (upca, upce, ean13, ean8, code39, itf,
+//             codabar, code93 or code128)
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_SPOOL_H__
+#define __TP_SPOOL_H__
+
+#include <pthread.h>
+#include "Thermal_Printer.h"
+
+#define TP_SPOOL_PRINTERS 16   // printers per spooler
+#define TP_SPOOL_QUEUE 1024    // jobs waiting per printer
+#define TP_SPOOL_CLIENTS 64    // clients connected at once
+#define TP_SPOOL_MAX_JOB (16 * 1024 * 1024)
+
+enum {
+  TP_SPOOL_PBM=0,
+  TP_SPOOL_TEXT,
+  TP_SPOOL_QR,
+  TP_SPOOL_BARCODE,
+  TP_SPOOL_TYPES
+};
+
+typedef struct tagTP_SPOOL_PRINTER
+{
+  char szName[32];
+  int iType;       // PRINTER_xxx
+  TP_TRANSPORT *pTransport;
+  uint32_t u32Jobs[TP_SPOOL_QUEUE]; // ids of the spooled jobs (a ring)
+  uint8_t ucJobTypes[TP_SPOOL_QUEUE];
+  int iHead, iCount;
+  long long llPrinted, llFailed;
+} TP_SPOOL_PRINTER;
+
+typedef struct tagTP_SPOOL_CLIENT
+{
+  int fd;          // -1 = free
+  char szLine[160]; // the request line
+  int iLineLen;
+  int fdJob;       // spool file being written (-1 = reading the request)
+  int iPrinter, iJobType, iRemaining;
+  uint32_t u32Job;
+  int bWaiting;    // waiting for the queues to empty
+} TP_SPOOL_CLIENT;
+
+typedef struct tagTP_SPOOL
+{
+  char szSocket[108];
+  char szDir[256];
+  int fdListen;
+  int fdWake;      // eventfd the worker uses to wake up the client loop
+  int bSync;       // fsync() each job before answering
+  int iPrinters;
+  TP_SPOOL_PRINTER printers[TP_SPOOL_PRINTERS];
+  TP_SPOOL_CLIENT clients[TP_SPOOL_CLIENTS];
+  uint32_t u32NextJob;
+  int iNext;       // printer the worker looks at first
+  int bBusy;       // the worker is printing a job
+  volatile int bRun;
+  pthread_t worker;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // statistics
+  long long llSubmitted, llRejected, llAborted;
+} TP_SPOOL;
+
+//
+// Prepare a spooler which listens on szSocket and keeps the jobs in
+// subdirectories of szDir (created if needed)
+// returns 1 if successful, 0 on failure
+//
+int tpSpoolInit(TP_SPOOL *pSpool, const char *szSocket, const char *szDir);
+//
+// Add a printer (PRINTER_xxx) reached through a transport
+// Jobs left in its spool directory are queued again
+// returns 1 if successful, 0 on failure
+//
+int tpSpoolAddPrinter(TP_SPOOL *pSpool, const char *szName, int iType, TP_TRANSPORT *pTransport);
+//
+// Serve the clients and print the jobs until SHUTDOWN or tpSpoolStop()
+//
+void tpSpoolRun(TP_SPOOL *pSpool);
+//
+// Make tpSpoolRun() return (safe from a signal handler)
+//
+void tpSpoolStop(TP_SPOOL *pSpool);
+//
+// Print one job on the connected printer (what the worker does)
+// returns 1 if successful, 0 if the data is bad
+//
+int tpSpoolPrintJob(int iJobType, uint8_t *pData, int iLen);
+//
+// Job type from its name (pbm, text, qr, barcode); -1 if unknown
+//
+int tpSpoolJobType(const char *szName);
+//
+// Client side: submit a job
+// returns the job id or -1 if it was refused
+//
+int tpSpoolSubmit(const char *szSocket, const char *szPrinter, const char *szJobType, const uint8_t *pData, int iLen);
+//
+// Client side: send a command (STATUS, WAIT or SHUTDOWN) and read the
+// reply into szReply
+// returns 1 if successful, 0 on failure
+//
+int tpSpoolCommand(const char *szSocket, const char *szCommand, char *szReply, int iReplySize);
+
+#endif // __TP_SPOOL_H__
@@ -0,0 +1,267 @@
+//
+// Raw TCP transport (port 9100) for network ESC/POS printers
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include "tp_tcp.h"
+
+//
+// Wait until the socket can take more data
+// returns 0 if it timed out or failed
+//
+static int TcpWaitWritable(TP_TCP *pTcp)
+{
+struct pollfd pfd;
+int i;
+
+   pfd.fd = pTcp->fd;
+   pfd.events = POLLOUT;
+   while (1) {
+      i = poll(&pfd, 1, pTcp->iTimeout);
+      if (i < 0 && errno == EINTR)
+         continue;
+      return (i > 0 && !(pfd.revents & (POLLERR | POLLHUP)));
+   }
+} /* TcpWaitWritable() */
+//
+// Returns the bytes which fit in the send window right now,
+// waiting for the printer to acknowledge some if it's full
+//
+static int TcpWindowRoom(TP_TCP *pTcp)
+{
+int iQueued, iWaited = 0;
+
+   while (1) {
+      if (ioctl(pTcp->fd, SIOCOUTQ, &iQueued) < 0)
+         return pTcp->iWindow; // can't tell; don't hold up the data
+      if (iQueued < pTcp->iWindow)
+         return pTcp->iWindow - iQueued;
+      if (iWaited == 0)
+         pTcp->llWindowWaits++;
+      if (iWaited >= pTcp->iTimeout * 1000)
+         return 0;
+      usleep(200); // acks don't wake up poll()
+      iWaited += 200;
+   }
+} /* TcpWindowRoom() */
+//
+// Send all of the data
+// returns 0 if the connection failed or timed out
+//
+static int TcpSend(TP_TCP *pTcp, uint8_t *pData, int iLen)
+{
+int i, iOff = 0, iChunk;
+
+   while (iOff < iLen) {
+      iChunk = iLen - iOff;
+      if (pTcp->iWindow > 0) {
+         i = TcpWindowRoom(pTcp);
+         if (i <= 0)
+            return 0;
+         if (iChunk > i)
+            iChunk = i;
+      }
+      i = (int)send(pTcp->fd, &pData[iOff], iChunk, MSG_NOSIGNAL);
+      if (i > 0) {
+         iOff += i;
+         pTcp->llSends++;
+         pTcp->llBytes += i;
+      } else if (i < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         pTcp->llBlocked++;
+         if (!TcpWaitWritable(pTcp))
+            return 0;
+      } else if (i < 0 && errno == EINTR) {
+         continue;
+      } else {
+         return 0;
+      }
+   }
+   return 1;
+} /* TcpSend() */
+
+static int TcpWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse)
+{
+TP_TCP *pTcp = (TP_TCP *)pUser;
+int iCount;
+
+   (void)bWithResponse; // TCP acknowledges everything
+   if (pTcp->fd < 0 || pTcp->bError)
+      return -1;
+   if (!pTcp->bNoDelay) // the kernel batches (Nagle)
+      return TcpSend(pTcp, pData, iLen) ? iLen : -1;
+   iCount = iLen;
+   while (iCount > 0) {
+      int iChunk = pTcp->iBatchSize - pTcp->iBatchLen;
+      if (iChunk > iCount)
+         iChunk = iCount;
+      memcpy(&pTcp->ucBatch[pTcp->iBatchLen], pData, iChunk);
+      pTcp->iBatchLen += iChunk;
+      pData += iChunk;
+      iCount -= iChunk;
+      if (pTcp->iBatchLen == pTcp->iBatchSize) { // full segments
+         pTcp->iBatchLen = 0;
+         if (!TcpSend(pTcp, pTcp->ucBatch, pTcp->iBatchSize))
+            return -1;
+      }
+   }
+   return iLen;
+} /* TcpWrite() */
+
+static void TcpFlush(void *pUser)
+{
+TP_TCP *pTcp = (TP_TCP *)pUser;
+int i;
+
+   if (pTcp->fd < 0)
+      return;
+   pTcp->llFlushes++;
+   if (pTcp->iBatchLen > 0) {
+      i = pTcp->iBatchLen;
+      pTcp->iBatchLen = 0;
+      if (!TcpSend(pTcp, pTcp->ucBatch, i))
+         pTcp->bError = 1;
+   }
+   if (!pTcp->bNoDelay) { // push out the partial segment Nagle is holding
+      i = 1;
+      setsockopt(pTcp->fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+      i = 0;
+      setsockopt(pTcp->fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+   }
+} /* TcpFlush() */
+
+static int TcpConnect(TP_TCP *pTcp)
+{
+struct addrinfo hints, *pList, *p;
+struct pollfd pfd;
+char szPort[16];
+socklen_t len;
+int fd = -1, i, iErr;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   sprintf(szPort, "%d", pTcp->iPort);
+   if (getaddrinfo(pTcp->szHost, szPort, &hints, &pList) != 0)
+      return 0;
+   for (p = pList; p != NULL; p = p->ai_next) {
+      fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+      if (fd < 0)
+         continue;
+      i = connect(fd, p->ai_addr, p->ai_addrlen);
+      if (i < 0 && errno == EINPROGRESS) { // wait for it
+         pfd.fd = fd;
+         pfd.events = POLLOUT;
+         iErr = -1;
+         len = sizeof(iErr);
+         if (poll(&pfd, 1, pTcp->iTimeout) == 1)
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &iErr, &len);
+         i = (iErr == 0) ? 0 : -1;
+      }
+      if (i == 0)
+         break;
+      close(fd);
+      fd = -1;
+   }
+   freeaddrinfo(pList);
+   if (fd < 0)
+      return 0;
+   i = pTcp->bNoDelay;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+   len = sizeof(i);
+   if (getsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &i, &len) < 0 || i <= 0)
+      i = 1460;
+   pTcp->iMSS = i;
+   pTcp->iBatchSize = (TP_TCP_BATCH / i) * i; // whole segments
+   if (pTcp->iBatchSize == 0)
+      pTcp->iBatchSize = TP_TCP_BATCH;
+   pTcp->iBatchLen = 0;
+   pTcp->bError = 0;
+   pTcp->fd = fd;
+   return 1;
+} /* TcpConnect() */
+
+static int TcpReconnect(void *pUser)
+{
+TP_TCP *pTcp = (TP_TCP *)pUser;
+
+   if (pTcp->fd >= 0)
+      close(pTcp->fd);
+   pTcp->fd = -1;
+   return TcpConnect(pTcp);
+} /* TcpReconnect() */
+
+void tpTcpInit(TP_TCP *pTcp)
+{
+   memset(pTcp, 0, sizeof(TP_TCP));
+   pTcp->fd = -1;
+   pTcp->bNoDelay = 1;
+   pTcp->iTimeout = 5000;
+   pTcp->transport.pfnWrite = TcpWrite;
+   pTcp->transport.pfnFlush = TcpFlush;
+   pTcp->transport.pfnReconnect = TcpReconnect;
+   pTcp->transport.pUser = (void *)pTcp;
+   pTcp->transport.iFlags = TP_TRANSPORT_NO_PACING; // TCP has its own flow control
+} /* tpTcpInit() */
+
+void tpTcpSetNoDelay(TP_TCP *pTcp, int bNoDelay)
+{
+   pTcp->bNoDelay = bNoDelay;
+} /* tpTcpSetNoDelay() */
+
+void tpTcpSetWindow(TP_TCP *pTcp, int iBytes)
+{
+   pTcp->iWindow = (iBytes < 0) ? 0 : iBytes;
+} /* tpTcpSetWindow() */
+
+int tpTcpOpen(TP_TCP *pTcp, const char *szHost, int iPort)
+{
+   if (szHost == NULL)
+      return 0;
+   tpTcpClose(pTcp);
+   strncpy(pTcp->szHost, szHost, sizeof(pTcp->szHost)-1);
+   pTcp->szHost[sizeof(pTcp->szHost)-1] = 0;
+   pTcp->iPort = (iPort > 0) ? iPort : TP_TCP_PORT;
+   return TcpConnect(pTcp);
+} /* tpTcpOpen() */
+
+void tpTcpClose(TP_TCP *pTcp)
+{
+   if (pTcp->fd < 0)
+      return;
+   TcpFlush(pTcp);
+   close(pTcp->fd);
+   pTcp->fd = -1;
+} /* tpTcpClose() */
+
+void tpTcpPrintStats(TP_TCP *pTcp, const char *szLabel)
+{
+   printf("%s: %lld bytes in %lld sends (avg %.1f, MSS %d), %lld flushes, socket full %lld times, window full %lld times\n",
+          szLabel, pTcp->llBytes, pTcp->llSends, pTcp->llSends ? (double)pTcp->llBytes / (double)pTcp->llSends : 0.0,
+          pTcp->iMSS, pTcp->llFlushes, pTcp->llBlocked, pTcp->llWindowWaits);
+} /* tpTcpPrintStats() */
@@ -0,0 +1,84 @@
+//
+// Raw TCP transport (port 9100) for network ESC/POS printers
+// The socket is non-blocking; a write which can't go out right away
+// waits (up to a timeout) for the socket instead of blocking forever.
+// With TCP_NODELAY (the default) the small writes of the library are
+// collected into segment sized sends and pushed by tpFlush(). With
+// Nagle's algorithm on, the kernel does the batching and a flush
+// pushes out the last partial segment.
+// The send window limits the bytes sent but not yet acknowledged by
+// the printer, so the data doesn't pile up in the socket buffers
+// (0 = limited only by the socket buffer size)
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_TCP_H__
+#define __TP_TCP_H__
+
+#include "Thermal_Printer.h"
+
+#define TP_TCP_PORT 9100
+#define TP_TCP_BATCH 8192 // largest batched send
+
+typedef struct tagTP_TCP
+{
+  TP_TRANSPORT transport; // pass &tcp.transport to tpSetTransport()
+  int fd;
+  char szHost[64];
+  int iPort;
+  int bNoDelay;    // batch in user space and send with TCP_NODELAY
+  int iWindow;     // most unacknowledged bytes (0 = no limit)
+  int iTimeout;    // ms to wait for the socket before failing a write
+  int bError;      // a flush failed; the next write fails too
+  int iMSS;        // maximum segment size of the connection
+  int iBatchSize;  // bytes collected before a send (whole segments)
+  uint8_t ucBatch[TP_TCP_BATCH];
+  int iBatchLen;
+  // statistics
+  long long llBytes;   // bytes sent
+  long long llSends;   // send() calls
+  long long llBlocked; // times the socket buffer was full
+  long long llWindowWaits; // times the send window was full
+  long long llFlushes;
+} TP_TCP;
+
+//
+// Prepare a TCP transport (TCP_NODELAY, no window limit, 5 second timeout)
+//
+void tpTcpInit(TP_TCP *pTcp);
+//
+// Set the batching mode and the send window; call before tpTcpOpen()
+//
+void tpTcpSetNoDelay(TP_TCP *pTcp, int bNoDelay);
+void tpTcpSetWindow(TP_TCP *pTcp, int iBytes);
+//
+// Connect to a printer (host name or address, port 9100 if iPort is 0)
+// returns 1 if successful, 0 on failure
+// The transport reconnects to the same printer for tpSetAutoReconnect()
+//
+int tpTcpOpen(TP_TCP *pTcp, const char *szHost, int iPort);
+//
+// Send what's left and close the connection
+//
+void tpTcpClose(TP_TCP *pTcp);
+//
+// Print the statistics to stdout
+//
+void tpTcpPrintStats(TP_TCP *pTcp, const char *szLabel);
+
+#endif // __TP_TCP_H__
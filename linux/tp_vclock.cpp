@@ -0,0 +1,95 @@
+//
+// Virtual clock for the Linux host build
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <string.h>
+#include <stdint.h>
+#include "tp_vclock.h"
+
+static unsigned long VClockMillis(void *pUser)
+{
+   return (unsigned long)(((TP_VCLOCK *)pUser)->llNow / 1000);
+} /* VClockMillis() */
+
+static unsigned long VClockMicros(void *pUser)
+{
+   return (unsigned long)((TP_VCLOCK *)pUser)->llNow;
+} /* VClockMicros() */
+
+static void VClockDelayMicros(void *pUser, unsigned long ulMicros)
+{
+TP_VCLOCK *pClock = (TP_VCLOCK *)pUser;
+
+   pClock->llWaits++;
+   pClock->llWaited += ulMicros;
+   tpVClockAdvance(pClock, (long long)ulMicros);
+} /* VClockDelayMicros() */
+
+void tpVClockInit(TP_VCLOCK *pClock)
+{
+   memset(pClock, 0, sizeof(TP_VCLOCK));
+   pClock->llNow = 1000000LL;
+   pClock->clock.pfnMillis = VClockMillis;
+   pClock->clock.pfnMicros = VClockMicros;
+   pClock->clock.pfnDelayMicros = VClockDelayMicros;
+   pClock->clock.pUser = (void *)pClock;
+} /* tpVClockInit() */
+
+long long tpVClockNow(TP_VCLOCK *pClock)
+{
+   return pClock->llNow;
+} /* tpVClockNow() */
+
+int tpVClockSchedule(TP_VCLOCK *pClock, long long llDue, TP_VCLOCK_EVENT *pfnEvent, void *pArg)
+{
+int i = pClock->iEvents;
+
+   if (i >= TP_VCLOCK_EVENTS)
+      return 0;
+   pClock->events[i].llDue = llDue;
+   pClock->events[i].pfnEvent = pfnEvent;
+   pClock->events[i].pArg = pArg;
+   pClock->iEvents++;
+   return 1;
+} /* tpVClockSchedule() */
+
+void tpVClockAdvance(TP_VCLOCK *pClock, long long llMicros)
+{
+long long llEnd = pClock->llNow + llMicros;
+TP_VCLOCK_EVENT *pfnEvent;
+void *pArg;
+int i, iNext;
+
+   while (1) { // fire the earliest due event until none are left before llEnd
+      iNext = -1;
+      for (i=0; i<pClock->iEvents; i++) {
+         if (pClock->events[i].llDue <= llEnd && (iNext < 0 || pClock->events[i].llDue < pClock->events[iNext].llDue))
+            iNext = i;
+      }
+      if (iNext < 0)
+         break;
+      if (pClock->events[iNext].llDue > pClock->llNow)
+         pClock->llNow = pClock->events[iNext].llDue;
+      pfnEvent = pClock->events[iNext].pfnEvent;
+      pArg = pClock->events[iNext].pArg;
+      pClock->iEvents--;
+      memmove(&pClock->events[iNext], &pClock->events[iNext+1], (pClock->iEvents - iNext) * sizeof(pClock->events[0]));
+      (*pfnEvent)(pArg); // can schedule more events
+   }
+   pClock->llNow = llEnd;
+} /* tpVClockAdvance() */
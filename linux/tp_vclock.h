@@ -0,0 +1,68 @@
+//
+// Virtual clock for the Linux host build
+// Time only moves when the library waits, and it moves instantly,
+// so a job which would keep a printer busy for minutes runs in
+// milliseconds while the clock still shows how long it would take.
+// Simulated devices schedule their replies (XOn, status, acks) as
+// events which fire when the virtual time passes them.
+// The clock is not thread safe; use it from a single thread
+// (no job queue task, transmit ring or ack thread)
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __TP_VCLOCK_H__
+#define __TP_VCLOCK_H__
+
+#include "Thermal_Printer.h"
+
+#define TP_VCLOCK_EVENTS 256
+typedef void (TP_VCLOCK_EVENT)(void *pArg);
+
+typedef struct tagTP_VCLOCK
+{
+  TP_CLOCK clock;    // pass &vclock.clock to tpSetClock()
+  long long llNow;   // virtual time (us)
+  long long llWaits; // number of waits
+  long long llWaited; // total time waited (us)
+  int iEvents;       // events scheduled
+  struct {
+    long long llDue;
+    TP_VCLOCK_EVENT *pfnEvent;
+    void *pArg;
+  } events[TP_VCLOCK_EVENTS];
+} TP_VCLOCK;
+
+//
+// Prepare a virtual clock starting at 1 second
+//
+void tpVClockInit(TP_VCLOCK *pClock);
+//
+// Returns the virtual time in microseconds
+//
+long long tpVClockNow(TP_VCLOCK *pClock);
+//
+// Call pfnEvent(pArg) once the virtual time reaches llDue
+// returns 0 if too many events are waiting
+//
+int tpVClockSchedule(TP_VCLOCK *pClock, long long llDue, TP_VCLOCK_EVENT *pfnEvent, void *pArg);
+//
+// Move the time forward, firing the events which fall due in order
+//
+void tpVClockAdvance(TP_VCLOCK *pClock, long long llMicros);
+
+#endif // __TP_VCLOCK_H__
@@ -0,0 +1,169 @@
+//
+// Thermal_Printer print spooler daemon
+// Accepts jobs on a Unix domain socket (see tp_spool.h) and prints them
+// on the printers given on the command line
+//
+// Copyright (c) 2020 BitBank Software, Inc.
+// Written by Larry Bank (bitbank@pobox.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "tp_spool.h"
+#include "tp_capture.h"
+#include "tp_tcp.h"
+#include "tp_serial.h"
+
+static const char *szTypes[PRINTER_COUNT] = {"MTP2", "MTP3", "CAT", "PERIPAGEPLUS", "PERIPAGE", "FOMEMO"};
+static TP_SPOOL spool;
+static TP_CAPTURE captures[TP_SPOOL_PRINTERS];
+static TP_TCP tcps[TP_SPOOL_PRINTERS];
+static TP_SERIAL serials[TP_SPOOL_PRINTERS];
+
+static void ShowHelp(void)
+{
+   printf("tpspoold - Thermal_Printer print spooler\n"
+          "usage: tpspoold [-s <socket>] [-d <spool dir>] [-f] -P <printer> [-P <printer>...]\n");
+   printf("  -s the socket the jobs are submitted to (default /tmp/tpspool.sock)\n");
+   printf("  -d where the jobs are kept until they're printed (default /tmp/tpspool)\n");
+   printf("  -f fsync each job before answering the client\n");
+   printf("  -P <name>:<type>:<connection> where type is MTP2, MTP3, CAT, PERIPAGEPLUS,\n");
+   printf("     PERIPAGE or FOMEMO and the connection is one of\n");
+   printf("       file:<path>                     append the printer data to a file\n");
+   printf("       tcp:<host>[:<port>]             a network printer (port 9100)\n");
+   printf("       serial:<device>[:<baud>[:rtscts|xonxoff]]\n");
+   printf("  e.g. tpspoold -P front:MTP2:tcp:192.168.1.50 -P test:MTP3:file:/tmp/test.bin\n");
+} /* ShowHelp() */
+
+static void Stop(int iSignal)
+{
+   (void)iSignal;
+   tpSpoolStop(&spool);
+} /* Stop() */
+//
+// Open the connection described by a -P option and add the printer
+//
+static int AddPrinter(char *szSpec)
+{
+char *szName, *szType, *szKind, *szTarget, *szOpt;
+int i, iType, iIndex = spool.iPrinters, iBaud, iFlow, fd;
+TP_TRANSPORT *pTransport = NULL;
+
+   szName = szSpec;
+   szType = strchr(szName, ':');
+   if (szType == NULL) return 0;
+   *szType++ = 0;
+   szKind = strchr(szType, ':');
+   if (szKind == NULL) return 0;
+   *szKind++ = 0;
+   szTarget = strchr(szKind, ':');
+   if (szTarget == NULL) return 0;
+   *szTarget++ = 0;
+   for (iType=0; iType<PRINTER_COUNT; iType++) {
+      if (strcasecmp(szType, szTypes[iType]) == 0)
+         break;
+   }
+   if (iType == PRINTER_COUNT || iIndex >= TP_SPOOL_PRINTERS)
+      return 0;
+   if (strcmp(szKind, "file") == 0) {
+      fd = open(szTarget, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd < 0)
+         return 0;
+      tpCaptureInit(&captures[iIndex], fd, NULL, 0);
+      pTransport = &captures[iIndex].transport;
+   } else if (strcmp(szKind, "tcp") == 0) {
+      szOpt = strrchr(szTarget, ':');
+      i = 0;
+      if (szOpt != NULL) {
+         *szOpt++ = 0;
+         i = atoi(szOpt);
+      }
+      tpTcpInit(&tcps[iIndex]);
+      if (!tpTcpOpen(&tcps[iIndex], szTarget, i))
+         return 0;
+      pTransport = &tcps[iIndex].transport;
+   } else if (strcmp(szKind, "serial") == 0) {
+      iBaud = 115200;
+      iFlow = TP_SERIAL_FLOW_NONE;
+      szOpt = strchr(szTarget, ':');
+      if (szOpt != NULL) {
+         *szOpt++ = 0;
+         iBaud = atoi(szOpt);
+         szOpt = strchr(szOpt, ':');
+         if (szOpt != NULL)
+            iFlow = (strcmp(szOpt+1, "rtscts") == 0) ? TP_SERIAL_FLOW_RTSCTS :
+                    (strcmp(szOpt+1, "xonxoff") == 0) ? TP_SERIAL_FLOW_XONXOFF : TP_SERIAL_FLOW_NONE;
+      }
+      tpSerialInit(&serials[iIndex]);
+      if (!tpSerialOpen(&serials[iIndex], szTarget, iBaud, iFlow))
+         return 0;
+      pTransport = &serials[iIndex].transport;
+   }
+   if (pTransport == NULL)
+      return 0;
+   tpSetAutoReconnect(3);
+   return tpSpoolAddPrinter(&spool, szName, iType, pTransport);
+} /* AddPrinter() */
+
+int main(int argc, char *argv[])
+{
+const char *szSocket = "/tmp/tpspool.sock", *szDir = "/tmp/tpspool";
+int i, bSync = 0;
+
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+         szSocket = argv[++i];
+      } else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+         szDir = argv[++i];
+      } else if (strcmp(argv[i], "-f") == 0) {
+         bSync = 1;
+      } else if (strcmp(argv[i], "-P") != 0 || i+1 >= argc) {
+         ShowHelp();
+         return 0;
+      } else {
+         i++;
+      }
+   }
+   if (!tpSpoolInit(&spool, szSocket, szDir)) {
+      printf("Error creating the spool directory %s\n", szDir);
+      return -1;
+   }
+   spool.bSync = bSync;
+   for (i=1; i<argc; i++) {
+      if (strcmp(argv[i], "-P") == 0) {
+         i++;
+         if (!AddPrinter(argv[i])) {
+            printf("Error adding the printer %s\n", argv[i]);
+            return -1;
+         }
+      }
+   }
+   if (spool.iPrinters == 0) {
+      ShowHelp();
+      return 0;
+   }
+   signal(SIGINT, Stop);
+   signal(SIGTERM, Stop);
+   signal(SIGPIPE, SIG_IGN);
+   printf("Spooling for %d printer(s) on %s\n", spool.iPrinters, szSocket);
+   tpSpoolRun(&spool);
+   printf("%lld jobs spooled, %lld refused, %lld abandoned by their clients\n",
+          spool.llSubmitted, spool.llRejected, spool.llAborted);
+   return 0;
+} /* main() */
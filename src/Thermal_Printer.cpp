@@ -18,7 +18,44 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
+#ifdef ARDUINO
 #include <Arduino.h>
+#else
+// Linux host build (no BLE stack); the printer data goes to
+// whatever transport is set with tpSetTransport()
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#define PROGMEM
+#define memcpy_P memcpy
+#define pgm_read_byte(a) (*(uint8_t *)(a))
+static unsigned long millis(void)
+{
+struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)((ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000));
+} /* millis() */
+static unsigned long micros(void)
+{
+struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)((ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000));
+} /* micros() */
+static void delay(unsigned long ulMillis)
+{
+   usleep(ulMillis * 1000);
+} /* delay() */
+static void delayMicroseconds(unsigned int uiMicros)
+{
+   usleep(uiMicros);
+} /* delayMicroseconds() */
+#endif // !ARDUINO
 // uncomment this line to see debug info on the serial monitor
 //#define DEBUG_OUTPUT
 
@@ -48,9 +85,132 @@ static int bb_width, bb_height; // back buffer width and height in pixels
 static int tp_wrap, bb_pitch;
 static int16_t iCursorX = 0, iCursorY = 0;
 static uint8_t bWithResponse = 0; // default to not wait for a response
+static int iWriteWindow = 4; // acknowledged writes allowed in flight (MODE_WINDOWED)
+static volatile int iInFlight = 0; // writes waiting for an acknowledgement
 static uint8_t *pBackBuffer = NULL;
 static uint8_t bConnected = 0;
+static volatile uint8_t bConnecting = 0; // a background connection hasn't been finished (tpConnectAsync)
+static uint8_t bPending = 0; // the data goes into the pending buffer until the link is up
+static int iPacketSize = 20; // largest single write to the transport
+static int iMaxPacketOverride = 0; // user limit on the packet size (0 = TP_PRINTER_PACKET)
+#ifndef TP_MAX_PACKET
+#define TP_MAX_PACKET 512
+#endif
+// Largest write sent to any supported printer, however large the MTU
+// (none of them is known to need less; tpSetMaxPacketSize() lowers it
+// for one which corrupts large writes)
+#ifndef TP_PRINTER_PACKET
+#define TP_PRINTER_PACKET 180
+#endif
+#define TP_TX_SLACK 128 // room to finish a scanline while a step is paused by XOff
+#define TP_REC_HEADER 16 // recordings (tpRecordBegin)
+#define TP_REC_LONG 0x00
+#define TP_REC_SHORT 0x80
+#define TP_REC_PACE 0x80
+#define TP_REC_MAX_PACE 0x7e
+#define TP_REC_FLUSH 0xff
+static uint8_t ucTxBuf[TP_MAX_PACKET + TP_TX_SLACK]; // small writes are coalesced here
+static int iTxLen = 0;
+static uint8_t bStepActive = 0; // a job is being sent by tpPrintStep()
+// ring of encoded bytes between the encoder and the transmit task (tpStartRing)
+static uint8_t *pRing = NULL;
+static uint32_t u32RingSize;
+static volatile uint32_t u32RingHead = 0, u32RingTail = 0; // written by the encoder / the transmitter only
+static volatile uint32_t u32RingFlush = 0; // head position of the last flush request
+static void tpRingPush(uint8_t *pData, int iLen);
+static void tpRingDrain(void);
+// bytes handed to tpWriteData / accepted by the transport (for resuming jobs)
+static uint32_t u32TxIn = 0;
+static volatile uint32_t u32TxOut = 0;
+static uint32_t u32BandEnd = 0; // u32TxIn at the end of the raster band (or cat command) being sent
+static int iReconnectTries = 0; // 0 = don't reconnect
+static uint8_t bAutoFlush = 1; // send the data at the end of each printing function
+// recording of the data sent to the printer (tpRecordBegin)
+static uint8_t *pRecord = NULL;
+static int iRecordSize, iRecordLen;
+static int iRecordRun; // offset of the open data run (-1 = none)
+static uint32_t u32RecordLines;
+static uint8_t bRecordFull = 0;
+static void tpRecordData(uint8_t *pData, int iLen);
+static void tpRecordMark(int iTag);
 static void tpWriteData(uint8_t *pData, int iLen);
+static void tpUpdatePacketSize(void);
+static void tpLinkUp(void);
+static void tpWaitXOn(void);
+static void tpPaceLines(int iLines);
+static void tpPaceExtra(int iBytes);
+static int tpStatusEnabled(void);
+static void tpFlushTx(void);
+static void tpAutoFlush(void);
+static int tpBLEWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse);
+static int tpBLEGetMTU(void *pUser);
+static int tpBLEReconnect(void *pUser);
+// The built-in BLE stack is the default transport
+static TP_TRANSPORT tpBLETransport = {tpBLEWrite, NULL, tpBLEGetMTU, NULL, 0, tpBLEReconnect};
+static TP_TRANSPORT *pTransport = &tpBLETransport;
+static int tpBLEScanStart(void *pUser);
+static int tpBLEScanNext(void *pUser, TP_ADVERT *pAdvert, int iWait);
+static void tpBLEScanStop(void *pUser);
+// The built-in BLE stack is the default discovery backend (tpScanAll)
+static TP_DISCOVERY tpBLEDiscovery = {tpBLEScanStart, tpBLEScanNext, tpBLEScanStop, NULL};
+static TP_DISCOVERY *pDiscovery = &tpBLEDiscovery;
+// advertisements passed from the BLE callbacks to tpScanAll (one writer, one reader)
+static TP_ADVERT tpAdverts[TP_ADVERT_QUEUE];
+static int iAdvertHead = 0, iAdvertTail = 0;
+static volatile uint8_t bScanAll = 0; // the callbacks feed tpAdverts instead of tpScan
+static TP_SCAN_STATS tpScanStats = {0, 0, -1, -1, -1, -1};
+static void tpNoteHeap(int bConnect);
+#if defined( HAL_ESP32_HAL_H_ ) || defined( _ARDUINO_BLE_H_ )
+static int tpParseAddress(const char *szAddress, uint8_t *pAddress);
+#endif
+static void tpFormatAddress(const uint8_t *pAddress, char *szAddress);
+#ifdef ARDUINO
+//
+// Returns the next free advertisement slot (NULL if full)
+//
+static TP_ADVERT *tpAdvertSlot(void)
+{
+int iHead = __atomic_load_n(&iAdvertHead, __ATOMIC_RELAXED);
+
+   if (((iHead + 1) % TP_ADVERT_QUEUE) == __atomic_load_n(&iAdvertTail, __ATOMIC_ACQUIRE))
+      return NULL; // tpScanAll is behind; drop it (the printer advertises again)
+   return &tpAdverts[iHead];
+} /* tpAdvertSlot() */
+
+static void tpAdvertCommit(void)
+{
+   __atomic_store_n(&iAdvertHead, (iAdvertHead + 1) % TP_ADVERT_QUEUE, __ATOMIC_RELEASE);
+} /* tpAdvertCommit() */
+#endif // ARDUINO
+// The clock for timestamps and for waiting on the printer (tpSetClock)
+// Waits between our own threads (queue, ring) use the system clock
+static TP_CLOCK *pClock = NULL;
+static unsigned long tpMillis(void)
+{
+    if (pClock)
+       return pClock->pfnMillis(pClock->pUser);
+    return millis();
+} /* tpMillis() */
+static unsigned long tpMicros(void)
+{
+    if (pClock)
+       return pClock->pfnMicros(pClock->pUser);
+    return micros();
+} /* tpMicros() */
+static void tpDelayMicros(unsigned long ulMicros)
+{
+    if (pClock)
+       pClock->pfnDelayMicros(pClock->pUser, ulMicros);
+    else
+       delayMicroseconds((unsigned int)ulMicros);
+} /* tpDelayMicros() */
+static void tpDelay(unsigned long ulMillis)
+{
+    if (pClock)
+       pClock->pfnDelayMicros(pClock->pUser, ulMillis * 1000UL);
+    else
+       delay(ulMillis);
+} /* tpDelay() */
 extern "C" {
 extern unsigned char ucFont[], ucBigFont[];
 };
@@ -58,6 +218,7 @@ static uint8_t tpFindPrinterName(char *szName);
 static void tpPreGraphics(int iWidth, int iHeight);
 static void tpPostGraphics(void);
 static void tpSendScanline(uint8_t *pSrc, int iLen);
+static void tpFeedLines(int iLines);
 
 struct PRINTERID
 {
@@ -87,9 +248,77 @@ const PRINTERID szPrinterIDs[] PROGMEM = {
 	{NULL, 0}		// terminator
 };
 const int iPrinterWidth[] = {384, 576, 384, 576, 384, 384};
+// How fast each printer model consumes data (bytes/sec, scanlines/sec)
+// and the size of its input buffer. This drives the pacing of the writes
+// so that we keep the printer fed without overflowing its buffer
+const TP_PACING tpPrinterPacing[] = {
+  {20000, 400, 4096}, // MTP2
+  {24000, 300, 4096}, // MTP3
+  {8000, 120, 1024},  // CAT
+  {16000, 200, 2048}, // PERIPAGEPLUS
+  {10000, 200, 2048}, // PERIPAGE
+  {10000, 200, 2048}  // FOMEMO
+};
+static TP_PACING tpPacing; // active pacing values
+static uint8_t bPacingOverride = 0; // user supplied pacing
+// The pacing is a token bucket for bytes and one for scanlines. They are
+// kept as the time (micros) when each bucket will be full again (GCRA)
+static unsigned long ulByteTAT, ulLineTAT;
+static int iPaceExtra = 0; // header bytes not yet charged as a scanline
+#define TP_PACE_HEADER 20 // largest raster header (PeriPage)
+// Cat printers tell us (by notification) when their buffer is full (XOff)
+// and when they can take more data (XOn)
+static volatile uint8_t bXOff = 0;
+static uint8_t bFlowControl = 0; // the printer has sent XOff/XOn or status on this connection
+// ESC/POS status query flow control (see tpSetStatusFlowControl)
+static int iStatusBandLines = 0; // 0 = disabled
+static volatile int iStatusPending = 0; // queries waiting for a reply
+static volatile int iLastStatus = -1;
+static uint8_t bStatusUnsupported = 0; // the printer didn't answer
+static int iStatusMisses = 0;
+// current raster (graphics) session
+static int iRasterWidth, iRasterLines; // width in pixels, scanlines left to send
+static int iBandLeft = 0; // scanlines left in the current raster header
+static int bRasterStream = 0; // a tpRasterBegin() raster is being sent
+static int iStreamLeft; // its scanlines still to come from the caller
+static int iRasterBand = TP_RESUME_BAND; // scanlines per header without status flow control (0 = all)
+static volatile uint8_t bCancel = 0; // tpCancel() was called
+static int iCancelCount = 0;
+static uint8_t bPreemptable = 0; // the job is sent in bands so that it can give way
+static volatile uint8_t bPreempt = 0; // a job with a higher priority is waiting
+static uint8_t bStepPreempted = 0; // the job stopped at a band to let it go first
+static int iPreemptCount = 0;
+#define TP_MAX_BAND 65535 // the raster header's height is 16 bits
+// a print job (see tpPrintStep and the job queue)
+enum {
+  TP_JOB_BUFFER=0,
+  TP_JOB_TEXT,
+  TP_JOB_FEED,
+  TP_JOB_DATA
+};
+typedef struct tagTP_JOB
+{
+  int iType;  // TP_JOB_xxx
+  int iID;
+  uint8_t *pData; // bitmap or raw data
+  int iWidth, iHeight; // bitmap size (or data length in iWidth, feed lines in iHeight)
+  GFXfont *pFont;
+  int x; // text start
+  char *pText; // text being printed
+  char szText[TP_MAX_JOB_TEXT]; // copy of the text for queued jobs
+  TP_JOB_CALLBACK *pfnDone;
+  void *pUser;
+  int iPriority; // TP_PRIORITY_xxx
+  int iStart; // first unit to send (where a preempted job continues)
+  uint32_t u32Seq; // queue order
+} TP_JOB;
+static int tpStartJob(TP_JOB *pJob);
+static void tpRunSteps(void);
 const uint8_t PeriPrefix[] = {0x10,0xff,0xfe,0x01};
 const char *szServiceNames[] = {(char *)"18f0", (char *)"18f0", (char *)"ae30", (char *)"ff00",(char *)"ff00", (char *)"ff00"}; // 16-bit UUID of the printer services we want
 const char *szCharNames[] = {(char *)"2af1", (char *)"2af1", (char *)"ae01",(char *)"ff02", (char *)"ff02", (char *)"ff02"}; // 16-bit UUID of printer data characteristics we want
+const char *szNotifyNames[] = {(char *)"2af0", (char *)"2af0", (char *)"ae02",(char *)"ff01", (char *)"ff01", (char *)"ff01"}; // 16-bit UUID of the characteristics the printer replies on
+const uint16_t usNotifyUUIDs[] = {0x2af0, 0x2af0, 0xae02, 0xff01, 0xff01, 0xff01};
 
 // Command sequences for the 'cat' printer
 // for more details see https://github.com/fulda1/Thermal_Printer/wiki/Cat-printer-protocol
@@ -165,10 +394,12 @@ const unsigned char ucMirror[256] PROGMEM =
 static ble_gap_evt_adv_report_t the_report;
 static uint16_t the_conn_handle;
 static int bNRFFound;
+static int bNRFBegun = 0;
 //BLEClientCharacteristic myDataChar(myDataUUID);
 //BLEClientService myService(myServiceUUID);
 BLEClientService myService; //(0x18f0);
 BLEClientCharacteristic myDataChar; //(0x2af1);
+BLEClientCharacteristic myNotifyChar; // printer replies (flow control/status)
 
 /**
  * Callback invoked when an connection is established
@@ -202,6 +433,8 @@ static void connect_callback(uint16_t conn_handle)
     Bluefruit.disconnect(conn_handle);
     return;
   }
+  if (myNotifyChar.discover())
+    myNotifyChar.enableNotify(); // XOff/XOn or status replies
     bConnected = 1; // success!
 } /* connect_callback() */
 /**
@@ -240,6 +473,19 @@ static void scan_callback(ble_gap_evt_adv_report_t* report)
 char szTemp[32];
 
    ParseDeviceName(report->data.p_data, szTemp);
+   if (bScanAll) { // tpScanAll() wants all of them
+      TP_ADVERT *pAdvert = tpAdvertSlot();
+      if (pAdvert != NULL) {
+         for (int i=0; i<6; i++) // the SoftDevice keeps it least significant first
+            pAdvert->ucAddress[i] = report->peer_addr.addr[5-i];
+         pAdvert->bRandom = (report->peer_addr.addr_type != BLE_GAP_ADDR_TYPE_PUBLIC);
+         pAdvert->cRSSI = report->rssi;
+         strcpy(pAdvert->szName, szTemp);
+         tpAdvertCommit();
+      }
+      Bluefruit.Scanner.resume();
+      return;
+   }
 
 //    Serial.printf("found something %s\n", report->data.p_data);
 //  if (Bluefruit.Scanner.checkReportForUuid(report, myServiceUUID))
@@ -275,7 +521,57 @@ char szTemp[32];
 
 static void notify_callback(BLEClientCharacteristic* chr, uint8_t* data, uint16_t len)
 {
+  (void) chr;
+  tpNotify(data, (int)len);
 } /* notify_callback() */
+//
+// Start the BLE stack (once)
+//
+static void tpNRFBegin(void)
+{
+  if (bNRFBegun)
+    return;
+  bNRFBegun = 1;
+  // Initialize Bluefruit with maximum connections as Peripheral = 0, Central = 1
+  // SRAM usage required by SoftDevice will increase dramatically with number of connections
+  Bluefruit.begin(0, 1);
+  /* Set the device name */
+  Bluefruit.setName("Bluefruit52");
+  /* Set the LED interval for blinky pattern on BLUE LED */
+  Bluefruit.setConnLedInterval(250);
+//  Bluefruit.setTxPower(4);    // Check bluefruit.h for supported values
+//  Bluefruit.configCentralBandwidth(BANDWIDTH_MAX);
+} /* tpNRFBegin() */
+//
+// Set up the client service and characteristics of the printer type
+//
+static void tpNRFClients(void)
+{
+  if (ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3) {
+    myService = BLEClientService(0x18f0);
+    myDataChar = BLEClientCharacteristic(0x2af1);
+  } else if (ucPrinterType == PRINTER_CAT) {
+    myService = BLEClientService(0xae30);
+    myDataChar = BLEClientCharacteristic(0xae01);
+  } else if (ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS) {
+    myService = BLEClientService(0xff00);
+    myDataChar = BLEClientCharacteristic(0xff02);
+  }
+
+    myService.begin(); // start my client service
+    // Initialize client characteristics
+    // Note: Client Chars will be added to the last service that is begin()ed.
+    myDataChar.setNotifyCallback(notify_callback);
+    myDataChar.begin();
+    if (ucPrinterType < PRINTER_COUNT) {
+      myNotifyChar = BLEClientCharacteristic(usNotifyUUIDs[ucPrinterType]);
+      myNotifyChar.setNotifyCallback(notify_callback);
+      myNotifyChar.begin();
+    }
+    // Callbacks for Central
+    Bluefruit.Central.setConnectCallback(connect_callback);
+    Bluefruit.Central.setDisconnectCallback(disconnect_callback);
+} /* tpNRFClients() */
 
 #endif // Adafruit nrf52
 
@@ -285,6 +581,7 @@ static void ESP_notify_callback(
   uint8_t* pData,
   size_t length,
   bool isNotify) {
+#ifdef DEBUG_OUTPUT
     Serial.print("Notify callback for characteristic ");
     Serial.print(pBLERemoteCharacteristic->getUUID().toString().c_str());
     Serial.print(" of data length ");
@@ -296,12 +593,15 @@ static void ESP_notify_callback(
       Serial.print(" ");
     }
     Serial.println(" ");
+#endif
+    tpNotify(pData, (int)length);
 }
 #endif // ESP callback
 
 #ifdef HAL_ESP32_HAL_H_
 static BLEUUID SERVICE_UUID0("49535343-FE7D-4AE5-8FA9-9FAFD205E455");
 static BLEUUID CHAR_UUID_DATA0 ("49535343-8841-43F4-A8D4-ECBE34729BB3");
+static BLEUUID CHAR_UUID_NOTIFY0 ("49535343-1E4D-4BD9-BA61-23C647249616");
 //static BLEUUID SERVICE_UUID1("0000AE30-0000-1000-8000-00805F9B34FB"); //Service
 //static BLEUUID CHAR_UUID_DATA1("0000AE01-0000-1000-8000-00805F9B34FB"); // data characteristic
 static BLEUUID SERVICE_UUID1(BLEUUID ((uint16_t)0xae30));
@@ -309,27 +609,134 @@ static BLEUUID CHAR_UUID_DATA1(BLEUUID((uint16_t)0xae01));
 static BLEUUID CHAR_UUID_NOTIFY1(BLEUUID((uint16_t)0xae02));
 static BLEUUID SERVICE_UUID2(BLEUUID ((uint16_t)0xff00));
 static BLEUUID CHAR_UUID_DATA2(BLEUUID((uint16_t)0xff02));
+static BLEUUID CHAR_UUID_NOTIFY2(BLEUUID((uint16_t)0xff01));
 
-static String Scanned_BLE_Address;
-static BLEScanResults foundDevices;
-static BLEAddress *Server_BLE_Address;
+// Nothing here is allocated per scan or connection; a kiosk reconnects
+// for months without fragmenting the heap
+static uint8_t ucServerAddress[6]; // the printer to connect to (most significant byte first)
+static uint8_t bServerAddress = 0; // ucServerAddress is valid
+static uint8_t bServerRandom = 0; // it's a random address
+static uint8_t ucClientAddress[6]; // the printer pClient last connected to
 static BLERemoteCharacteristic* pRemoteCharacteristicData;
 static BLERemoteCharacteristic* pRemoteCharacteristicNotify;
 static BLEScan *pBLEScan;
-static BLEClient* pClient;
+static BLEClient* pClient; // created once and reused
 static char Scanned_BLE_Name[32];
+static int bESPBegun = 0;
+//
+// Copy the bytes of a BLE address without going through a string
+// (NimBLE keeps them least significant first)
+//
+static void tpESPGetAddress(BLEAddress addr, uint8_t *pAddress)
+{
+#ifdef NIMBLE_SUPPORT
+    const uint8_t *s = addr.getNative();
+    for (int i=0; i<6; i++)
+       pAddress[i] = s[5-i];
+#else
+    memcpy(pAddress, *addr.getNative(), 6);
+#endif
+} /* tpESPGetAddress() */
+
+static BLEAddress tpESPAddress(const uint8_t *pAddress, int bRandom)
+{
+#ifdef NIMBLE_SUPPORT
+    return BLEAddress(pAddress, bRandom ? BLE_ADDR_RANDOM : BLE_ADDR_PUBLIC); // takes them most significant first
+#else
+    (void)bRandom; // Bluedroid takes the type when connecting
+    esp_bd_addr_t addr;
+    memcpy(addr, pAddress, 6);
+    return BLEAddress(addr);
+#endif
+} /* tpESPAddress() */
+//
+// Start the BLE stack (once)
+//
+static void tpESPBegin(void)
+{
+    if (bESPBegun)
+       return;
+    bESPBegun = 1;
+    BLEDevice::init("ESP32");
+    BLEDevice::setMTU(517); // ask for the largest MTU; the printer may negotiate it down
+} /* tpESPBegin() */
 #endif
 
 #ifdef _ARDUINO_BLE_H_
 static BLEDevice peripheral;
 static BLEService prtService;
 static BLECharacteristic pRemoteCharacteristicData;
+static BLECharacteristic pRemoteCharacteristicNotify;
+//
+// ArduinoBLE doesn't have notification callbacks; poll for them
+//
+static void tpPollNotify(void)
+{
+    if (!pRemoteCharacteristicNotify)
+       return;
+    BLE.poll();
+    if (pRemoteCharacteristicNotify.valueUpdated())
+       tpNotify((uint8_t *)pRemoteCharacteristicNotify.value(), pRemoteCharacteristicNotify.valueLength());
+} /* tpPollNotify() */
 #endif
 
 void tpSetWriteMode(uint8_t bWriteMode)
 {
+   if (bWriteMode > MODE_WINDOWED)
+      return; // invalid
+   tpFlush(); // finish any acknowledged writes of the old mode
    bWithResponse = bWriteMode;
 } /* tpSetWriteMode() */
+//
+// Set the number of acknowledged writes which can be
+// in flight at once in MODE_WINDOWED
+//
+void tpSetWriteWindow(int iWindow)
+{
+   if (iWindow < 1)
+      iWindow = 1;
+   iWriteWindow = iWindow;
+} /* tpSetWriteWindow() */
+
+int tpGetWriteWindow(void)
+{
+   return iWriteWindow;
+} /* tpGetWriteWindow() */
+//
+// Number of writes still waiting to be acknowledged
+//
+int tpGetInFlight(void)
+{
+   return iInFlight;
+} /* tpGetInFlight() */
+//
+// Called by transports with TP_TRANSPORT_ASYNC_ACK
+// when the printer has acknowledged iCount writes
+//
+void tpWriteAck(int iCount)
+{
+   if (__atomic_sub_fetch(&iInFlight, iCount, __ATOMIC_SEQ_CST) < 0)
+      __atomic_store_n(&iInFlight, 0, __ATOMIC_SEQ_CST); // stray acknowledgement
+} /* tpWriteAck() */
+//
+// Wait until fewer than iWindow writes are waiting to be acknowledged
+// If the acks stop coming (lost packets), give up after a few seconds
+//
+static void tpWaitWindow(int iWindow)
+{
+unsigned long ulTime = tpMillis();
+
+   while (__atomic_load_n(&iInFlight, __ATOMIC_SEQ_CST) >= iWindow) {
+      if ((tpMillis() - ulTime) > 3000UL) {
+#ifdef DEBUG_OUTPUT
+         Serial.println("Timed out waiting for write acks");
+#endif
+         iInFlight = 0;
+         break;
+      }
+      tpDelayMicros(100);
+   }
+} /* tpWaitWindow() */
 
 #ifdef HAL_ESP32_HAL_H_
 
@@ -349,40 +756,56 @@ class tpAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks
       auto advertisedDevice = &genAdvertisedDevice;
 #endif
       int iLen = strlen(szPrinterName);
+      char szName[32], szTemp[32];
 #ifdef DEBUG_OUTPUT
       Serial.printf("Scan Result: %s \n", advertisedDevice->toString().c_str());
 #endif
-      if (iLen > 0 && memcmp(advertisedDevice->getName().c_str(), szPrinterName, iLen) == 0)
+      { // copy the name once (printer names are short enough to stay out of the heap)
+        auto name = advertisedDevice->getName();
+        strncpy(szName, name.c_str(), sizeof(szName)-1);
+        szName[sizeof(szName)-1] = 0;
+      }
+      if (bScanAll) { // tpScanAll() wants all of them
+        TP_ADVERT *pAdvert = tpAdvertSlot();
+        if (pAdvert != NULL) {
+          tpESPGetAddress(advertisedDevice->getAddress(), pAdvert->ucAddress);
+          pAdvert->bRandom = (advertisedDevice->getAddressType() != 0); // public = 0 on both stacks
+          pAdvert->cRSSI = (int8_t)advertisedDevice->getRSSI();
+          strcpy(pAdvert->szName, szName);
+          tpAdvertCommit();
+        }
+        return;
+      }
+      if (iLen > 0 && memcmp(szName, szPrinterName, iLen) == 0)
       { // this is what we want
-        Server_BLE_Address = new BLEAddress(advertisedDevice->getAddress());
-        Scanned_BLE_Address = Server_BLE_Address->toString().c_str();
-        strcpy(Scanned_BLE_Name, advertisedDevice->getName().c_str());
+        tpESPGetAddress(advertisedDevice->getAddress(), ucServerAddress);
+        bServerAddress = 1;
+        bServerRandom = (advertisedDevice->getAddressType() != 0);
+        strcpy(Scanned_BLE_Name, szName);
 #ifdef DEBUG_OUTPUT
         Serial.println("A match!");
-        Serial.println((char *)Scanned_BLE_Address.c_str());
         Serial.println(Scanned_BLE_Name);
 #endif
       } else if (iLen == 0) { // check for supported printers
-        char szName[32];
         uint8_t ucType;
-        strcpy(szName, advertisedDevice->getName().c_str());
-        ucType = tpFindPrinterName(szName);
+        strcpy(szTemp, szName);
+        ucType = tpFindPrinterName(szTemp);
         if (ucType < PRINTER_COUNT) { // found a valid one!
-            Server_BLE_Address = new BLEAddress(advertisedDevice->getAddress());
-            Scanned_BLE_Address = Server_BLE_Address->toString().c_str();
+            tpESPGetAddress(advertisedDevice->getAddress(), ucServerAddress);
+            bServerAddress = 1;
+            bServerRandom = (advertisedDevice->getAddressType() != 0);
             ucPrinterType = ucType;
-            strcpy(Scanned_BLE_Name, advertisedDevice->getName().c_str());
+            strcpy(Scanned_BLE_Name, szName);
             strcpy(szPrinterName, Scanned_BLE_Name); // allow user to query this
 #ifdef DEBUG_OUTPUT
             Serial.print("A match! - ");
-            Serial.print((char *)Scanned_BLE_Address.c_str());
-            Serial.print(" - ");
             Serial.println(Scanned_BLE_Name);
 #endif
         }
       } // if auto-detecting printers
     }
 }; // class tpAdvertisedDeviceCallbacks
+static tpAdvertisedDeviceCallbacks tpScanCallbacks; // one for every scan
 #endif
 
 // Provide a back buffer for your printer graphics
@@ -522,35 +945,19 @@ GFXglyph glyph, *pGlyph;
    return 0;
 } /* tpDrawCustomText() */
 //
-// Print a string of characters in a custom font to the connected printer
+// Render scanline y (relative to the baseline) of a string
+// in a custom font into a 1-bpp line buffer
 //
-int tpPrintCustomText(GFXfont *pFont, int startx, char *szMsg)
+static void tpRenderTextLine(GFXfont *pFont, int startx, char *szMsg, int y, uint8_t *ucTemp, int iPrintWidth)
 {
-int i, x, y, end_y, dx, dy, tx, ty, c, iBitOff;
-int maxy, miny, height;
-uint8_t *s, *d, bits, ucMask, ucClr, uc;
+int i, x, end_y, dx, dy, tx, ty, c, iBitOff;
+uint8_t *s, bits, ucMask, uc;
 GFXglyph glyph, *pGlyph;
-uint8_t ucTemp[80]; // max width of 1 scan line (576 pixels)
-int iPrintWidth = iPrinterWidth[ucPrinterType];
-
-   if (!bConnected)
-      return -1;
-   if (pFont == NULL || x < 0)
-      return -1;
-   pGlyph = &glyph;
 
-   // Get the size of the rectangle enclosing the text
-//   tpGetStringBox(pFont, szMsg, &tx, &miny, &maxy);
-//   height = (maxy - miny) + 1;
-
-   tpPreGraphics(iPrintWidth, pFont->yAdvance);
-   miny = 0 - (pFont->yAdvance * 2)/3; // 2/3 of char is above the baseline
-   maxy = pFont->yAdvance + miny;
-   for (y=miny; y<=maxy; y++)
-   {
+     pGlyph = &glyph;
      i = 0;
      x = startx;
-     memset(ucTemp, 0, sizeof(ucTemp));
+     memset(ucTemp, 0, (iPrintWidth+7)/8);
      while (szMsg[i] && x < iPrintWidth)
      {
        c = szMsg[i++];
@@ -585,7 +992,7 @@ int iPrintWidth = iPrinterWidth[ucPrinterType];
                   }
                }
             } // if we ran out of bits
-            if (uc & 0x80 && ty == y) { // set pixel if we're drawing this line
+            if (uc & 0x80 && ty == y && dx+tx >= 0 && dx+tx < iPrintWidth) { // set pixel if we're drawing this line
                ucMask = 0x80 >> ((dx+tx) & 7);
                ucTemp[(dx+tx)>>3] |= ucMask;
             }
@@ -595,10 +1002,27 @@ int iPrintWidth = iPrinterWidth[ucPrinterType];
       } // for ty
       x += pGlyph->xAdvance; // width of this character
     } // while drawing characters
-    tpSendScanline(ucTemp, (iPrintWidth+7)/8); // send to printer 
-  } // for each line of output
-  tpPostGraphics();
-  return 0;
+} /* tpRenderTextLine() */
+//
+// Print a string of characters in a custom font to the connected printer
+//
+int tpPrintCustomText(GFXfont *pFont, int startx, char *szMsg)
+{
+TP_JOB job;
+
+   if (!bConnected)
+      return -1;
+   if (pFont == NULL || szMsg == NULL || startx < 0)
+      return -1;
+   memset(&job, 0, sizeof(job));
+   job.iType = TP_JOB_TEXT;
+   job.pFont = pFont;
+   job.x = startx;
+   job.pText = szMsg;
+   if (!tpStartJob(&job))
+      return -1;
+   tpRunSteps();
+   return 0;
 } /* tpPrintCustomText() */
 //
 // Draw text into the graphics buffer
@@ -768,7 +1192,9 @@ uint8_t bFlipped = false;
 //
 int tpIsConnected(void)
 {
-  if (bConnected == 1) {
+  if (bConnected == 1 && !bPending) {
+     if (pTransport != &tpBLETransport)
+        return 1; // custom transports report failure through their write function
      // we are/were connected, check...
 #ifdef HAL_ESP32_HAL_H_
      if (pClient && pClient->isConnected())
@@ -788,29 +1214,34 @@ int tpConnect(void)
    return tpConnect(NULL);
 } /* tpConnect() */
 
+#ifdef HAL_ESP32_HAL_H_
 //
-// After a successful scan, connect to the printer
+// Open the BLE link to ucServerAddress and find the characteristics of
+// printer type iType; the printer model and the connection state are
+// left to the caller (the background connection doesn't own them)
 // returns 1 if successful, 0 for failure
 //
-int tpConnect(const char *szMacAddress)
+static int tpESPConnect(int iType)
 {
-#ifdef HAL_ESP32_HAL_H_
-    pClient  = BLEDevice::createClient();
-    if (szMacAddress != NULL) {
-       if (Server_BLE_Address != NULL) {
-          delete Server_BLE_Address;
-       }
-       Server_BLE_Address = new BLEAddress(String(szMacAddress));
-#ifdef DEBUG_OUTPUT
-       Serial.printf(" - Created client, connecting to %s\n", szMacAddress);
-#endif
-    } else {
+    if (!bServerAddress)
+       return 0; // scan didn't succeed or wasn't run
+    if (pClient == NULL)
+       pClient = BLEDevice::createClient(); // kept for every connection after this one
 #ifdef DEBUG_OUTPUT
-       Serial.printf(" - Created client, connecting to %s\n", Scanned_BLE_Address.c_str());
-#endif
+    {
+       char szAddress[18];
+       tpFormatAddress(ucServerAddress, szAddress);
+       Serial.printf(" - Connecting to %s\n", szAddress);
     }
+#endif
     // Connect to the BLE Server.
-    pClient->connect(*Server_BLE_Address);
+#ifdef NIMBLE_SUPPORT
+    // the same printer again keeps the services it discovered last time
+    pClient->connect(tpESPAddress(ucServerAddress, bServerRandom), memcmp(ucClientAddress, ucServerAddress, 6) != 0);
+#else
+    pClient->connect(tpESPAddress(ucServerAddress, bServerRandom), bServerRandom ? BLE_ADDR_TYPE_RANDOM : BLE_ADDR_TYPE_PUBLIC);
+#endif
+    memcpy(ucClientAddress, ucServerAddress, 6);
 #ifdef DEBUG_OUTPUT
     Serial.println("Came back from connect");
 #endif
@@ -821,11 +1252,11 @@ int tpConnect(const char *szMacAddress)
     }
     // Obtain a reference to the service we are after in the remote BLE server.
     BLERemoteService* pRemoteService = NULL;
-    if (ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3)
+    if (iType == PRINTER_MTP2 || iType == PRINTER_MTP3)
        pRemoteService = pClient->getService(SERVICE_UUID0);
-    else if (ucPrinterType == PRINTER_CAT)
+    else if (iType == PRINTER_CAT)
        pRemoteService = pClient->getService(SERVICE_UUID1);
-    else if (ucPrinterType == PRINTER_FOMEMO || ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS)
+    else if (iType == PRINTER_FOMEMO || iType == PRINTER_PERIPAGE || iType == PRINTER_PERIPAGEPLUS)
        pRemoteService = pClient->getService(SERVICE_UUID2);
     if (pRemoteService != NULL)
     {
@@ -835,15 +1266,22 @@ int tpConnect(const char *szMacAddress)
       if (pClient->isConnected())
       {
         pRemoteCharacteristicData = NULL;
-        if (ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3)
-          pRemoteCharacteristicData = pRemoteService->getCharacteristic(CHAR_UUID_DATA0);
-        else if (ucPrinterType == PRINTER_CAT)
+        pRemoteCharacteristicNotify = NULL;
+        if (iType == PRINTER_MTP2 || iType == PRINTER_MTP3)
+          {
+            pRemoteCharacteristicData = pRemoteService->getCharacteristic(CHAR_UUID_DATA0);
+            pRemoteCharacteristicNotify = pRemoteService->getCharacteristic(CHAR_UUID_NOTIFY0);
+          }
+        else if (iType == PRINTER_CAT)
           {
             pRemoteCharacteristicData = pRemoteService->getCharacteristic(CHAR_UUID_DATA1);
             pRemoteCharacteristicNotify = pRemoteService->getCharacteristic(CHAR_UUID_NOTIFY1);
           }
-        else if (ucPrinterType == PRINTER_FOMEMO || ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS)
-          pRemoteCharacteristicData = pRemoteService->getCharacteristic(CHAR_UUID_DATA2);
+        else if (iType == PRINTER_FOMEMO || iType == PRINTER_PERIPAGE || iType == PRINTER_PERIPAGEPLUS)
+          {
+            pRemoteCharacteristicData = pRemoteService->getCharacteristic(CHAR_UUID_DATA2);
+            pRemoteCharacteristicNotify = pRemoteService->getCharacteristic(CHAR_UUID_NOTIFY2);
+          }
         if (pRemoteCharacteristicData != NULL)
         {
 #ifdef DEBUG_OUTPUT
@@ -853,19 +1291,38 @@ int tpConnect(const char *szMacAddress)
             if(pRemoteCharacteristicNotify->canNotify())
               pRemoteCharacteristicNotify->registerForNotify(ESP_notify_callback);
 
-          bConnected = 1;
           return 1;
         }
       } // if connected
     } // if service found
-    else
-    {
-        bConnected = 0;
 #ifdef DEBUG_OUTPUT
+    else
         Serial.println("Data service not found");
 #endif
-    }
   return 0;
+} /* tpESPConnect() */
+#endif // ESP32
+
+//
+// After a successful scan, connect to the printer
+// returns 1 if successful, 0 for failure
+//
+int tpConnect(const char *szMacAddress)
+{
+#ifdef HAL_ESP32_HAL_H_
+    if (szMacAddress != NULL) {
+       if (!tpParseAddress(szMacAddress, ucServerAddress))
+          return 0;
+       bServerAddress = 1;
+       bServerRandom = 0; // a printer's address is normally public
+    }
+    if (!tpESPConnect(ucPrinterType)) {
+       bConnected = 0;
+       return 0;
+    }
+    bConnected = 1;
+    tpLinkUp();
+    return 1;
 #endif
 #ifdef _ARDUINO_BLE_H_ // Arduino BLE
     if (!peripheral)
@@ -910,12 +1367,17 @@ int tpConnect(const char *szMacAddress)
             Serial.println("Got the service");
 #endif
             pRemoteCharacteristicData = prtService.characteristic(szCharNames[ucPrinterType]);
+            // printer replies (XOff/XOn or status)
+            pRemoteCharacteristicNotify = prtService.characteristic(szNotifyNames[ucPrinterType]);
+            if (pRemoteCharacteristicNotify && !pRemoteCharacteristicNotify.subscribe())
+                pRemoteCharacteristicNotify = BLECharacteristic();
             if (pRemoteCharacteristicData)
             {
 #ifdef DEBUG_OUTPUT
                 Serial.println("Got the characteristic");
 #endif
                 bConnected = 1;
+                tpLinkUp();
                 return 1;
             }
         }
@@ -933,18 +1395,29 @@ int tpConnect(const char *szMacAddress)
 #endif // NANO33
 #ifdef ARDUINO_NRF52_ADAFRUIT
     Bluefruit.Central.connect(&the_report);
-    long ulTime = millis();
-    while (!bConnected && (millis() - ulTime) < 4000) // allow 4 seconds for the connection to occur
+    long ulTime = tpMillis();
+    while (!bConnected && (tpMillis() - ulTime) < 4000) // allow 4 seconds for the connection to occur
     {
-        delay(20);
+        tpDelay(20);
     }
+    if (bConnected)
+        tpLinkUp();
     return bConnected;
 #endif // ADAFRUIT
+#ifndef ARDUINO
+    (void)szMacAddress;
+    return 0; // no BLE on the host build; use tpSetTransport()
+#endif
 } /* tpConnect() */
 
 void tpDisconnect(void)
 {
-  if (!bConnected) return; // nothing to do
+  if (!bConnected || bPending) return; // nothing to do (or no link yet)
+  tpFlush();
+  if (pTransport != &tpBLETransport) {
+     bConnected = 0;
+     return;
+  }
 #ifdef HAL_ESP32_HAL_H_
    if (pClient != NULL)
    {
@@ -1019,21 +1492,23 @@ int iLen = strlen(szName);
 #ifdef HAL_ESP32_HAL_H_
     Scanned_BLE_Name[0] = 0;
     ucPrinterType = 255;
-    BLEDevice::init("ESP32");
+    tpESPBegin();
     pBLEScan = BLEDevice::getScan(); //create new scan
     if (pBLEScan != NULL)
     {
-      pBLEScan->setAdvertisedDeviceCallbacks(new tpAdvertisedDeviceCallbacks()); //Call the class that is defined above
+      pBLEScan->setAdvertisedDeviceCallbacks(&tpScanCallbacks); //Call the class that is defined above
       pBLEScan->setActiveScan(true); //active scan uses more power, but get results faster
+#ifdef NIMBLE_SUPPORT
+      pBLEScan->setMaxResults(0); // the callback has what we need; don't keep a list
+#endif
       bConnected = false;
-      Server_BLE_Address = NULL;
-      pBLEScan->start(iSeconds); //Scan for N seconds
+      bServerAddress = 0;
+      pBLEScan->start(iSeconds, NULL, false); //Scan for N seconds in the background
     }
-    ulTime = millis();
-    while (!bFound && (millis() - ulTime) < iSeconds*1000L)
+    ulTime = tpMillis();
+    while (pBLEScan != NULL && !bFound && (tpMillis() - ulTime) < iSeconds*1000L)
     {
        if (iLen == 0 && ucPrinterType < PRINTER_COUNT) { // found a supported printer
-          pBLEScan->stop();
           bFound = 1;
 #ifdef DEBUG_OUTPUT
           Serial.print("Found a compatible device - ");
@@ -1044,15 +1519,18 @@ int iLen = strlen(szName);
 #ifdef DEBUG_OUTPUT
            Serial.println("Found Device :-)");
 #endif
-           pBLEScan->stop(); // stop scanning
            bFound = 1;
            ucPrinterType = tpFindPrinterName(Scanned_BLE_Name);
        }
        else
        {
-          delay(10); // if you don't add this, the ESP32 will reset due to watchdog timeout
+          tpDelay(10); // if you don't add this, the ESP32 will reset due to watchdog timeout
        }
     }
+    if (pBLEScan != NULL) {
+       pBLEScan->stop();
+       pBLEScan->clearResults(); // give back what the stack kept of the scan
+    }
 #endif
 #ifdef _ARDUINO_BLE_H_ // Arduino API
     // initialize the BLE hardware
@@ -1067,8 +1545,8 @@ int iLen = strlen(szName);
        Serial.println("Scanning without a specific name");
        BLE.scan(true);
     }
-    ulTime = millis();
-    while (!bFound && (millis() - ulTime) < (unsigned)iSeconds*1000UL)
+    ulTime = tpMillis();
+    while (!bFound && (tpMillis() - ulTime) < (unsigned)iSeconds*1000UL)
     {
     // check if a peripheral has been discovered
         peripheral = BLE.available();
@@ -1106,21 +1584,13 @@ int iLen = strlen(szName);
         } // if peripheral located
         else
         {
-            delay(50); // give time for scanner to find something
+            tpDelay(50); // give time for scanner to find something
         }
     } // while scanning
 #endif
 #ifdef ARDUINO_NRF52_ADAFRUIT
     bConnected = 0;
-    // Initialize Bluefruit with maximum connections as Peripheral = 0, Central = 1
-    // SRAM usage required by SoftDevice will increase dramatically with number of connections
-    Bluefruit.begin(0, 1);
-    /* Set the device name */
-    Bluefruit.setName("Bluefruit52");
-    /* Set the LED interval for blinky pattern on BLUE LED */
-    Bluefruit.setConnLedInterval(250);
-//    Bluefruit.setTxPower(4);    // Check bluefruit.h for supported values
-//    Bluefruit.configCentralBandwidth(BANDWIDTH_MAX);
+    tpNRFBegin();
     /* Start Central Scanning
      * - Enable auto scan if disconnected
      * - Filter out packet with a min rssi
@@ -1137,102 +1607,1104 @@ int iLen = strlen(szName);
     Bluefruit.Scanner.useActiveScan(true);        // Request scan response data
     Bluefruit.Scanner.start(0);                   // 0 = Don't stop
     // allow the timeout for the scan
-    ulTime = millis();
-    while (!bNRFFound && (millis() - ulTime) < (unsigned)iSeconds*1000UL)
+    ulTime = tpMillis();
+    while (!bNRFFound && (tpMillis() - ulTime) < (unsigned)iSeconds*1000UL)
     {
-        delay(10);
+        tpDelay(10);
     }
     Bluefruit.Scanner.stop();
 #ifdef DEBUG_OUTPUT
     Serial.println("Stopping the scan");
 #endif
-  if (ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3) {
-    myService = BLEClientService(0x18f0);
-    myDataChar = BLEClientCharacteristic(0x2af1);
-  } else if (ucPrinterType == PRINTER_CAT) {
-    myService = BLEClientService(0xae30);
-    myDataChar = BLEClientCharacteristic(0xae01);
-  } else if (ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS) {
-    myService = BLEClientService(0xff00);
-    myDataChar = BLEClientCharacteristic(0xff02);
-  }
-
-    myService.begin(); // start my client service
-    // Initialize client characteristics
-    // Note: Client Chars will be added to the last service that is begin()ed.
-    myDataChar.setNotifyCallback(notify_callback);
-    myDataChar.begin();
-    // Callbacks for Central
-    Bluefruit.Central.setConnectCallback(connect_callback);
-    Bluefruit.Central.setDisconnectCallback(disconnect_callback);
+    tpNRFClients();
     bFound = bNRFFound;
 #endif // ADAFRUIT
+#ifndef ARDUINO
+    (void)ulTime; (void)iLen; // no BLE on the host build
+#endif
+    tpNoteHeap(0);
     return bFound;
 } /* tpScan() */
+#if defined( HAL_ESP32_HAL_H_ ) || defined( _ARDUINO_BLE_H_ )
 //
-// Write data to the printer over BLE
+// Parse a BLE address ("aa:bb:cc:dd:ee:ff") into 6 bytes, most significant first
+// returns 1 if successful, 0 if it's not an address
 //
-static void tpWriteData(uint8_t *pData, int iLen)
+static int tpParseAddress(const char *szAddress, uint8_t *pAddress)
 {
-    if (!bConnected) // || !pRemoteCharacteristicData)
-        return;
-    // Write BLE data without response, otherwise the printer
-    // stutters and takes much longer to print
-#ifdef HAL_ESP32_HAL_H_
-    // For some reason the ESP32 sends some corrupt data if we ask it
-    // to write more than 20 bytes at a time (used to be 48)
-    while (iLen > 20) {
-       pRemoteCharacteristicData->writeValue(pData, 20, bWithResponse);
-       if (!bWithResponse) delay(4);
-       pData += 20;
-       iLen -= 20;
+int i, j, c, iByte;
+
+   if (szAddress == NULL)
+      return 0;
+   for (i=0; i<6; i++) {
+      iByte = 0;
+      for (j=0; j<2; j++) {
+         c = *szAddress++;
+         if (c >= '0' && c <= '9') c -= '0';
+         else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+         else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+         else return 0;
+         iByte = (iByte << 4) | c;
+      }
+      pAddress[i] = (uint8_t)iByte;
+      if (i < 5 && *szAddress++ != ':')
+         return 0;
+   }
+   return (*szAddress == 0);
+} /* tpParseAddress() */
+#endif
+//
+// Format 6 address bytes (most significant first) as "aa:bb:cc:dd:ee:ff"
+// szAddress must hold 18 characters
+//
+static void tpFormatAddress(const uint8_t *pAddress, char *szAddress)
+{
+int i;
+
+   for (i=0; i<6; i++) {
+      szAddress[i*3] = "0123456789abcdef"[pAddress[i] >> 4];
+      szAddress[i*3+1] = "0123456789abcdef"[pAddress[i] & 15];
+      szAddress[i*3+2] = (i < 5) ? ':' : 0;
+   }
+} /* tpFormatAddress() */
+//
+// The identity's checksum (a sum of its other bytes)
+//
+static uint8_t tpIdentityCheck(const TP_IDENTITY *pID)
+{
+const uint8_t *s = (const uint8_t *)pID;
+uint8_t ucSum = 0x5a;
+int i;
+
+   for (i=0; i<(int)sizeof(TP_IDENTITY); i++)
+      ucSum += s[i];
+   return ucSum - pID->ucCheck;
+} /* tpIdentityCheck() */
+//
+// Describe the printer found by tpScan() or connected now so that
+// tpConnectIdentity() can reach it next time without scanning
+// returns 1 if successful, 0 if there's no printer to describe
+//
+int tpGetIdentity(TP_IDENTITY *pID)
+{
+    memset(pID, 0, sizeof(TP_IDENTITY));
+    if (ucPrinterType >= PRINTER_COUNT)
+       return 0;
+    pID->ucVersion = TP_IDENTITY_VERSION;
+    pID->ucType = ucPrinterType;
+    memcpy(pID->szName, szPrinterName, sizeof(pID->szName)-1); // the last byte stays 0
+    if (pTransport != &tpBLETransport) {
+       if (!bConnected)
+          return 0;
+       pID->ucCheck = tpIdentityCheck(pID);
+       return 1; // a custom transport; the type and name are all there is
     }
-    if (iLen) {
-      pRemoteCharacteristicData->writeValue(pData, iLen, bWithResponse);
+#ifdef HAL_ESP32_HAL_H_
+    if (bServerAddress) {
+       memcpy(pID->ucAddress, ucServerAddress, 6);
+       pID->ucFlags |= TP_IDENTITY_ADDRESS;
+       if (bServerRandom)
+          pID->ucFlags |= TP_IDENTITY_RANDOM;
     }
 #endif
 #ifdef _ARDUINO_BLE_H_
-    pRemoteCharacteristicData.writeValue(pData, iLen, bWithResponse);
+    if (peripheral && tpParseAddress(peripheral.address().c_str(), pID->ucAddress))
+       pID->ucFlags |= TP_IDENTITY_ADDRESS;
 #endif
 #ifdef ARDUINO_NRF52_ADAFRUIT
-    myDataChar.write((const void *)pData, (uint16_t)iLen);
+    if (bNRFFound) {
+       for (int i=0; i<6; i++) // the SoftDevice keeps it least significant first
+          pID->ucAddress[i] = the_report.peer_addr.addr[5-i];
+       pID->ucFlags |= TP_IDENTITY_ADDRESS;
+       if (the_report.peer_addr.addr_type != BLE_GAP_ADDR_TYPE_PUBLIC)
+          pID->ucFlags |= TP_IDENTITY_RANDOM;
+    }
 #endif
-} /* tpWriteData() */
-
-void tpWriteRawData(uint8_t *pData, int iLen) {
-   tpWriteData(pData,iLen);
-}
-
+    pID->ucCheck = tpIdentityCheck(pID);
+    return (pID->ucFlags & TP_IDENTITY_ADDRESS) != 0;
+} /* tpGetIdentity() */
 //
-// Checksum
+// Connect to the printer described by tpGetIdentity() without scanning
+// returns 1 if successful, 0 for failure (e.g. the identity is damaged
+// or from another version; scan instead)
 //
-static uint8_t CheckSum(uint8_t *pData, int iLen)
+int tpConnectIdentity(const TP_IDENTITY *pID)
 {
-int i;
-uint8_t cs = 0;
-
-    for (i=0; i<iLen; i++)
-        cs = cChecksumTable[(cs ^ pData[i])];
-    return cs;
-} /* CheckSum() */
-
-// Compose command for cat printer
-// 0x51 0x78 -> prefix (STX)
-// CC -> command
-// 00 -> from PC to printer
-// 01 -> one byte of data
-// 00 -> upper byte for one byte
-// DD -> data
-// CRC -> checksum of data
-// 0xFF -> suffix (ETX)
+char szName[sizeof(pID->szName)];
+char szAddress[18];
 
-// call for one byte data
-void tpWriteCatCommandD8(uint8_t command, uint8_t data)
+    if (pID == NULL || pID->ucVersion != TP_IDENTITY_VERSION || pID->ucType >= PRINTER_COUNT ||
+        pID->ucCheck != tpIdentityCheck(pID))
+       return 0;
+    memcpy(szName, pID->szName, sizeof(szName));
+    szName[sizeof(szName)-1] = 0;
+    if (pTransport != &tpBLETransport) // the transport is already open; just set the printer model
+       return tpSetTransport(pTransport, pID->ucType, szName);
+    if (!(pID->ucFlags & TP_IDENTITY_ADDRESS))
+       return 0;
+    ucPrinterType = pID->ucType;
+    strcpy(szPrinterName, szName);
+    tpFormatAddress(pID->ucAddress, szAddress);
+#ifdef HAL_ESP32_HAL_H_
+    tpESPBegin();
+    strcpy(Scanned_BLE_Name, szName);
+    memcpy(ucServerAddress, pID->ucAddress, 6);
+    bServerAddress = 1;
+    bServerRandom = (pID->ucFlags & TP_IDENTITY_RANDOM) != 0;
+    return tpConnect();
+#endif
+#ifdef _ARDUINO_BLE_H_
+    // ArduinoBLE can only connect to a device it has seen; a scan for one
+    // address ends as soon as the printer advertises (and the device it
+    // reports carries the address type, random or public)
+    unsigned long ulTime;
+    BLE.begin();
+    BLE.scanForAddress(szAddress, true);
+    ulTime = tpMillis();
+    do {
+       peripheral = BLE.available();
+       if (!peripheral)
+          tpDelay(10);
+    } while (!peripheral && (tpMillis() - ulTime) < TP_IDENTITY_WAIT);
+    BLE.stopScan();
+    return tpConnect();
+#endif
+#ifdef ARDUINO_NRF52_ADAFRUIT
+    tpNRFBegin();
+    memset(&the_report, 0, sizeof(the_report));
+    the_report.peer_addr.addr_type = (pID->ucFlags & TP_IDENTITY_RANDOM) ? BLE_GAP_ADDR_TYPE_RANDOM_STATIC : BLE_GAP_ADDR_TYPE_PUBLIC;
+    for (int i=0; i<6; i++)
+       the_report.peer_addr.addr[5-i] = pID->ucAddress[i];
+    bNRFFound = 1;
+    tpNRFClients();
+    return tpConnect();
+#endif
+#ifndef ARDUINO
+    (void)szAddress;
+    return 0; // no BLE on the host build; use tpSetTransport()
+#endif
+} /* tpConnectIdentity() */
+//
+// Built-in discovery backend: listen with the board's BLE stack
+//
+static int tpBLEScanStart(void *pUser)
 {
-// prepare blank command:
-uint8_t ucTemp[9] = {0x51, 0x78, 0xCC, 0x00, 0x01, 0x00, 0xDD, 0xC0, 0xFF};
-                   // prefix      cmd   dir    length    data  crc   suffix
-    ucTemp[2] = command;				// add requested command
+    (void)pUser;
+    iAdvertHead = iAdvertTail = 0;
+#ifdef HAL_ESP32_HAL_H_
+    tpESPBegin();
+    pBLEScan = BLEDevice::getScan();
+    if (pBLEScan == NULL)
+       return 0;
+    bScanAll = 1;
+    // every advertisement, not just the first of each device: tpScanAll()
+    // keeps the strongest RSSI and counts them (the ring copes)
+    pBLEScan->setAdvertisedDeviceCallbacks(&tpScanCallbacks, true);
+    pBLEScan->setActiveScan(true); // the name is often in the scan response
+#ifdef NIMBLE_SUPPORT
+    pBLEScan->setDuplicateFilter(false); // or the controller drops the repeats
+    pBLEScan->setMaxResults(0); // everything goes through tpAdverts
+#endif
+    return pBLEScan->start(0, NULL, false); // until tpBLEScanStop()
+#endif
+#ifdef _ARDUINO_BLE_H_
+    if (!BLE.begin())
+       return 0;
+    return BLE.scan(true); // with duplicates, so the RSSI keeps coming
+#endif
+#ifdef ARDUINO_NRF52_ADAFRUIT
+    tpNRFBegin();
+    bScanAll = 1;
+    Bluefruit.Scanner.setRxCallback(scan_callback);
+    Bluefruit.Scanner.setInterval(160, 80); // in units of 0.625 ms
+    Bluefruit.Scanner.useActiveScan(true);
+    return Bluefruit.Scanner.start(0);
+#endif
+#ifndef ARDUINO
+    return 0; // no BLE on the host build; use tpSetDiscovery()
+#endif
+} /* tpBLEScanStart() */
+
+static int tpBLEScanNext(void *pUser, TP_ADVERT *pAdvert, int iWait)
+{
+    (void)pUser;
+#ifdef _ARDUINO_BLE_H_
+    BLEDevice device = BLE.available();
+    if (!device) {
+       tpDelay((iWait < 10) ? iWait : 10);
+       return 0;
+    }
+    if (!tpParseAddress(device.address().c_str(), pAdvert->ucAddress))
+       return 0;
+    pAdvert->bRandom = 0; // ArduinoBLE doesn't say; it reconnects by scanning for the address anyway
+    pAdvert->cRSSI = (int8_t)device.rssi();
+    strncpy(pAdvert->szName, device.localName().c_str(), sizeof(pAdvert->szName)-1);
+    pAdvert->szName[sizeof(pAdvert->szName)-1] = 0;
+    return 1;
+#else
+    if (__atomic_load_n(&iAdvertHead, __ATOMIC_ACQUIRE) == iAdvertTail) {
+       tpDelay((iWait < 10) ? iWait : 10);
+       return 0;
+    }
+    memcpy(pAdvert, &tpAdverts[iAdvertTail], sizeof(TP_ADVERT));
+    __atomic_store_n(&iAdvertTail, (iAdvertTail + 1) % TP_ADVERT_QUEUE, __ATOMIC_RELEASE);
+    return 1;
+#endif
+} /* tpBLEScanNext() */
+
+static void tpBLEScanStop(void *pUser)
+{
+    (void)pUser;
+#ifdef HAL_ESP32_HAL_H_
+    pBLEScan->stop();
+    pBLEScan->clearResults();
+#endif
+#ifdef _ARDUINO_BLE_H_
+    BLE.stopScan();
+#endif
+#ifdef ARDUINO_NRF52_ADAFRUIT
+    Bluefruit.Scanner.stop();
+#endif
+    bScanAll = 0;
+} /* tpBLEScanStop() */
+
+void tpSetDiscovery(TP_DISCOVERY *pNewDiscovery)
+{
+    pDiscovery = (pNewDiscovery != NULL) ? pNewDiscovery : &tpBLEDiscovery;
+} /* tpSetDiscovery() */
+//
+// Count a scan or a connection and see how much heap is left after it
+//
+static void tpNoteHeap(int bConnect)
+{
+    if (bConnect)
+       tpScanStats.iConnects++;
+    else
+       tpScanStats.iScans++;
+#ifdef HAL_ESP32_HAL_H_
+    tpScanStats.lHeapNow = (long)ESP.getFreeHeap();
+    tpScanStats.lLargestBlock = (long)ESP.getMaxAllocHeap();
+    if (tpScanStats.lHeapStart < 0)
+       tpScanStats.lHeapStart = tpScanStats.lHeapNow;
+    if (tpScanStats.lHeapLow < 0 || tpScanStats.lHeapNow < tpScanStats.lHeapLow)
+       tpScanStats.lHeapLow = tpScanStats.lHeapNow;
+#endif
+} /* tpNoteHeap() */
+
+void tpGetScanStats(TP_SCAN_STATS *pStats)
+{
+    if (pStats != NULL)
+       memcpy(pStats, &tpScanStats, sizeof(TP_SCAN_STATS));
+} /* tpGetScanStats() */
+//
+// Does printer a come before printer b in the tpScanAll() results?
+//
+static int tpFoundBefore(const TP_FOUND *a, const TP_FOUND *b)
+{
+    if (a->bListed != b->bListed)
+       return a->bListed;
+    if (a->cRSSI != b->cRSSI)
+       return a->cRSSI > b->cRSSI;
+    return a->usSeen > b->usSeen;
+} /* tpFoundBefore() */
+//
+// Listen for all of the supported printers (see Thermal_Printer.h)
+//
+int tpScanAll(TP_FOUND *pFound, int iMax, int iMillis, const uint8_t *pList, int iListed)
+{
+TP_ADVERT advert;
+TP_FOUND found;
+char szTemp[32];
+unsigned long ulTime;
+int i, iCount = 0, iLeft, bDone = 0;
+uint8_t ucType;
+
+    if (pFound == NULL || iMax < 1 || !(*pDiscovery->pfnStart)(pDiscovery->pUser))
+       return 0;
+    ulTime = tpMillis();
+    while (!bDone && (iLeft = iMillis - (int)(tpMillis() - ulTime)) > 0) {
+       if (!(*pDiscovery->pfnNext)(pDiscovery->pUser, &advert, iLeft))
+          continue;
+       for (i=0; i<iCount; i++) { // heard it before?
+          if (memcmp(pFound[i].ucAddress, advert.ucAddress, 6) == 0)
+             break;
+       }
+       if (i < iCount) {
+          if (advert.cRSSI > pFound[i].cRSSI)
+             pFound[i].cRSSI = advert.cRSSI;
+          if (pFound[i].usSeen < 0xffff)
+             pFound[i].usSeen++;
+       } else {
+          memcpy(szTemp, advert.szName, sizeof(szTemp));
+          szTemp[sizeof(szTemp)-1] = 0;
+          ucType = tpFindPrinterName(szTemp);
+          if (ucType >= PRINTER_COUNT)
+             continue; // not a printer we support
+          memset(&found, 0, sizeof(found));
+          memcpy(found.ucAddress, advert.ucAddress, 6);
+          found.bRandom = advert.bRandom;
+          found.ucType = ucType;
+          found.cRSSI = advert.cRSSI;
+          found.usSeen = 1;
+          memcpy(found.szName, advert.szName, sizeof(found.szName));
+          found.szName[sizeof(found.szName)-1] = 0;
+          for (i=0; i<iListed && pList != NULL; i++) {
+             if (memcmp(&pList[i*6], found.ucAddress, 6) == 0)
+                found.bListed = 1;
+          }
+          if (iCount < iMax) {
+             i = iCount++;
+          } else { // full; replace the last one if this one ranks higher
+             i = iMax - 1;
+             if (!tpFoundBefore(&found, &pFound[i]))
+                continue;
+          }
+          memcpy(&pFound[i], &found, sizeof(found));
+          bDone = found.bListed;
+       }
+       // keep the list in order (only entry i moved)
+       while (i > 0 && tpFoundBefore(&pFound[i], &pFound[i-1])) {
+          memcpy(&found, &pFound[i-1], sizeof(found));
+          memcpy(&pFound[i-1], &pFound[i], sizeof(found));
+          memcpy(&pFound[i], &found, sizeof(found));
+          i--;
+       }
+    }
+    (*pDiscovery->pfnStop)(pDiscovery->pUser);
+    tpNoteHeap(0);
+    return iCount;
+} /* tpScanAll() */
+//
+// The identity of a printer found by tpScanAll()
+//
+static void tpFoundIdentity(const TP_FOUND *pFound, TP_IDENTITY *pID)
+{
+    memset(pID, 0, sizeof(TP_IDENTITY));
+    pID->ucVersion = TP_IDENTITY_VERSION;
+    pID->ucType = pFound->ucType;
+    pID->ucFlags = TP_IDENTITY_ADDRESS | (pFound->bRandom ? TP_IDENTITY_RANDOM : 0);
+    memcpy(pID->ucAddress, pFound->ucAddress, 6);
+    memcpy(pID->szName, pFound->szName, sizeof(pID->szName)-1);
+    pID->ucCheck = tpIdentityCheck(pID);
+} /* tpFoundIdentity() */
+//
+// Connect to a printer from the tpScanAll() results
+//
+int tpConnectFound(const TP_FOUND *pFound)
+{
+TP_IDENTITY id;
+
+    tpFoundIdentity(pFound, &id);
+    return tpConnectIdentity(&id);
+} /* tpConnectFound() */
+//
+// Write data to the printer over BLE
+// This is the BLE stack implementation of the transport interface
+//
+static int tpBLEWrite(void *pUser, uint8_t *pData, int iLen, int bWithResponse)
+{
+int iTotal = iLen;
+
+    (void)pUser;
+    // Write BLE data without response, otherwise the printer
+    // stutters and takes much longer to print
+#ifdef HAL_ESP32_HAL_H_
+    if (pClient == NULL || !pClient->isConnected())
+       return -1; // the link has dropped
+    // tpWriteData() never asks for more than MTU-3 bytes at a time;
+    // larger writes used to come out corrupted
+    pRemoteCharacteristicData->writeValue(pData, iLen, bWithResponse);
+    return iTotal;
+#endif
+#ifdef _ARDUINO_BLE_H_
+    if (!peripheral.connected())
+       return -1;
+    pRemoteCharacteristicData.writeValue(pData, iLen, bWithResponse);
+    return iTotal;
+#endif
+#ifdef ARDUINO_NRF52_ADAFRUIT
+    (void)bWithResponse;
+    if (!bConnected || myDataChar.write((const void *)pData, (uint16_t)iLen) == 0)
+       return -1;
+    return iTotal;
+#endif
+    (void)pData; (void)iTotal; (void)bWithResponse;
+    return -1; // no BLE stack on this target
+} /* tpBLEWrite() */
+//
+// Return the ATT MTU of the BLE connection (0 = unknown)
+//
+static int tpBLEGetMTU(void *pUser)
+{
+    (void)pUser;
+#ifdef HAL_ESP32_HAL_H_
+    if (pClient != NULL)
+       return (int)pClient->getMTU();
+    return 23; // default ATT MTU
+#endif
+#ifdef ARDUINO_NRF52_ADAFRUIT
+    BLEConnection *pConn = Bluefruit.Connection(the_conn_handle);
+    if (pConn != NULL)
+       return (int)pConn->getMtu();
+#endif
+    return 0; // ArduinoBLE doesn't tell us
+} /* tpBLEGetMTU() */
+//
+// Connect again to the printer we were connected to
+// (the address saved by tpScan or tpConnect)
+//
+static int tpBLEReconnect(void *pUser)
+{
+    (void)pUser;
+#ifdef HAL_ESP32_HAL_H_
+    if (!bServerAddress)
+       return 0;
+    if (pClient != NULL && pClient->isConnected())
+       pClient->disconnect(); // the client itself is reused
+#endif
+    return tpConnect();
+} /* tpBLEReconnect() */
+//
+// Work out the largest write to send based on the link MTU
+// and the limit of the printer model
+//
+static void tpUpdatePacketSize(void)
+{
+int iMTU, iMax;
+
+    iMax = (iMaxPacketOverride > 0) ? iMaxPacketOverride : TP_PRINTER_PACKET;
+    iMTU = 0;
+    if (pTransport->pfnGetMTU != NULL)
+       iMTU = (*pTransport->pfnGetMTU)(pTransport->pUser);
+    if (iMTU > 3 && iMTU - 3 < iMax) // ATT header takes 3 bytes
+       iMax = iMTU - 3;
+    if (iMax > TP_MAX_PACKET)
+       iMax = TP_MAX_PACKET;
+    if (iMax < 1)
+       iMax = 1;
+    tpFlushTx(); // don't leave more than the new size waiting
+    iPacketSize = iMax;
+#ifdef DEBUG_OUTPUT
+    Serial.print("MTU = ");
+    Serial.print(iMTU, DEC);
+    Serial.print(", packet size = ");
+    Serial.println(iPacketSize, DEC);
+#endif
+} /* tpUpdatePacketSize() */
+//
+// Reset the link state for a new connection
+//
+static void tpLinkUp(void)
+{
+    iTxLen = 0; // nothing left over from an old connection
+    tpUpdatePacketSize();
+    if (!bPacingOverride) // new printer, new pacing
+       tpPacing = tpPrinterPacing[ucPrinterType];
+    ulByteTAT = ulLineTAT = tpMicros();
+    iInFlight = 0;
+    bXOff = bFlowControl = 0;
+    iStatusPending = iStatusMisses = 0;
+    bStatusUnsupported = 0;
+    iLastStatus = -1;
+    tpNoteHeap(1);
+} /* tpLinkUp() */
+//
+// Limit the size of each write to the printer
+// 0 = use the default (TP_PRINTER_PACKET)
+// The negotiated MTU still limits the packet size
+//
+void tpSetMaxPacketSize(int iSize)
+{
+    iMaxPacketOverride = (iSize < 0) ? 0 : iSize;
+    if (bConnected)
+       tpUpdatePacketSize();
+} /* tpSetMaxPacketSize() */
+//
+// Returns the current size of each write to the printer
+//
+int tpGetPacketSize(void)
+{
+    return iPacketSize;
+} /* tpGetPacketSize() */
+//
+// Returns the time (in microseconds) before the printer can take
+// iCount more units. Each bucket refills at iRate units/sec up to
+// iBurst units
+//
+static long tpPaceDue(unsigned long *pTAT, int iCount, int iRate, int iBurst)
+{
+unsigned long ulNow, ulCost, ulTau;
+long lWait;
+
+    if (iRate <= 0 || iCount <= 0 || bWithResponse != MODE_WITHOUT_RESPONSE)
+       return 0; // no pacing needed (the acks keep us in step)
+    if (bFlowControl || (pTransport->iFlags & TP_TRANSPORT_NO_PACING))
+       return 0; // the printer (or the link) tells us when to wait
+    ulCost = (unsigned long)(((uint64_t)iCount * 1000000 + iRate - 1) / iRate); // round up so it can't drift ahead
+    ulTau = (unsigned long)(((uint64_t)iBurst * 1000000) / iRate);
+    ulNow = tpMicros();
+    if ((long)(*pTAT - ulNow) < 0) // the bucket is full
+       *pTAT = ulNow;
+    lWait = (long)(*pTAT + ulCost - ulTau - ulNow);
+    return (lWait > 0) ? lWait : 0;
+} /* tpPaceDue() */
+//
+// Wait (if needed) until the printer can take iCount more units
+//
+static void tpPaceWait(unsigned long *pTAT, int iCount, int iRate, int iBurst)
+{
+long lWait;
+
+    if (iRate <= 0 || iCount <= 0 || bWithResponse != MODE_WITHOUT_RESPONSE)
+       return; // no pacing needed (the acks keep us in step)
+    if (bPending)
+       return; // nothing goes out until the link is up
+    if (bFlowControl || (pTransport->iFlags & TP_TRANSPORT_NO_PACING))
+       return; // the printer (or the link) tells us when to wait
+    lWait = tpPaceDue(pTAT, iCount, iRate, iBurst);
+    if (lWait > 0) {
+       if (lWait >= 1000)
+          tpDelay(lWait / 1000);
+       tpDelayMicros(lWait % 1000);
+    }
+    *pTAT += (unsigned long)(((uint64_t)iCount * 1000000 + iRate - 1) / iRate);
+} /* tpPaceWait() */
+//
+// Bytes per scanline on the wire
+//
+static int tpLineBytes(void)
+{
+int iLineBytes;
+
+    iLineBytes = (iPrinterWidth[ucPrinterType]+7)>>3;
+    if (ucPrinterType == PRINTER_CAT)
+       iLineBytes += 8; // each line is wrapped in a command
+    return iLineBytes;
+} /* tpLineBytes() */
+//
+// Burst size (bytes) of the pacing buckets. Part of the printer's
+// buffer is kept free for a raster header and a packet which may
+// already be on its way when the bucket runs dry
+//
+static int tpPaceBurst(void)
+{
+int iBurst = tpPacing.iBufferBytes - TP_PACE_HEADER - iPacketSize;
+
+    if (iBurst < tpPacing.iBufferBytes / 2)
+       iBurst = tpPacing.iBufferBytes / 2; // tiny buffers (or huge packets)
+    return iBurst;
+} /* tpPaceBurst() */
+//
+// Pace the printer for the given number of scanlines
+//
+static void tpPaceLines(int iLines)
+{
+int iBurst = tpPaceBurst() / tpLineBytes();
+
+    if (pRecord != NULL) {
+       u32RecordLines += (uint32_t)iLines;
+       for (int i=iLines; i>0; i-=TP_REC_MAX_PACE)
+          tpRecordMark(TP_REC_PACE | ((i > TP_REC_MAX_PACE) ? TP_REC_MAX_PACE : i));
+    }
+    if (tpPaceDue(&ulLineTAT, iLines, tpPacing.iLinesPerSec, iBurst) > 0)
+       tpFlushTx(); // give the printer what we have before waiting
+    tpPaceWait(&ulLineTAT, iLines, tpPacing.iLinesPerSec, iBurst);
+} /* tpPaceLines() */
+//
+// The printer also takes time to read the commands around the scanlines
+// (raster headers, mode changes); charge them as scanlines as they add up
+//
+static void tpPaceExtra(int iBytes)
+{
+int iLines;
+
+    iPaceExtra += iBytes;
+    iLines = iPaceExtra / tpLineBytes();
+    if (iLines > 0) {
+       iPaceExtra -= iLines * tpLineBytes();
+       tpPaceLines(iLines);
+    }
+} /* tpPaceExtra() */
+//
+// Set the pacing of the data sent to the printer
+// Pass NULL to use the defaults for the connected printer model
+// A value of 0 for a rate means unlimited (e.g. for wired printers)
+//
+void tpSetPacing(const TP_PACING *pPacing)
+{
+    if (pPacing == NULL) {
+       bPacingOverride = 0;
+       if (ucPrinterType < PRINTER_COUNT)
+          tpPacing = tpPrinterPacing[ucPrinterType];
+    } else {
+       bPacingOverride = 1;
+       tpPacing = *pPacing;
+    }
+    ulByteTAT = ulLineTAT = tpMicros();
+} /* tpSetPacing() */
+//
+// Get the current pacing values
+//
+void tpGetPacing(TP_PACING *pPacing)
+{
+    if (pPacing != NULL)
+       *pPacing = tpPacing;
+} /* tpGetPacing() */
+//
+// Set the transport used to deliver the printer data
+// Pass NULL to go back to the built-in BLE stack
+// A custom transport is treated as 'connected' immediately
+// to a printer of the given type (PRINTER_MTP2, PRINTER_CAT, etc)
+//
+int tpSetTransport(TP_TRANSPORT *pNewTransport, int iPrinterType, const char *szName)
+{
+    if (pNewTransport == NULL) {
+       if (pTransport != &tpBLETransport) {
+          tpFlush();
+          bConnected = 0;
+       }
+       pTransport = &tpBLETransport;
+       return 1;
+    }
+    if (pNewTransport->pfnWrite == NULL || iPrinterType < 0 || iPrinterType >= PRINTER_COUNT)
+       return 0; // invalid
+    tpDisconnect(); // drop any BLE connection we might have
+    pTransport = pNewTransport;
+    ucPrinterType = (uint8_t)iPrinterType;
+    szPrinterName[0] = 0;
+    if (szName != NULL) {
+       strncpy(szPrinterName, szName, sizeof(szPrinterName)-1);
+       szPrinterName[sizeof(szPrinterName)-1] = 0;
+    }
+    bConnected = 1;
+    tpLinkUp();
+    return 1;
+} /* tpSetTransport() */
+//
+// Set the clock used for timestamps and for waiting on the printer
+// Pass NULL to go back to the system clock
+//
+void tpSetClock(TP_CLOCK *pNewClock)
+{
+    if (pNewClock != NULL && (pNewClock->pfnMillis == NULL || pNewClock->pfnMicros == NULL || pNewClock->pfnDelayMicros == NULL))
+       return; // invalid
+    pClock = pNewClock;
+    ulByteTAT = ulLineTAT = tpMicros(); // the old times don't apply
+} /* tpSetClock() */
+//
+// Flush any data buffered in the transport
+//
+void tpFlush(void)
+{
+    if (pRecord != NULL)
+       tpRecordMark(TP_REC_FLUSH);
+    tpFlushTx();
+    if (pRing != NULL)
+       tpRingDrain();
+    if (bConnected && !bPending && pTransport->pfnFlush != NULL)
+       (*pTransport->pfnFlush)(pTransport->pUser);
+    if (bConnected && !bPending && (pTransport->iFlags & TP_TRANSPORT_ASYNC_ACK))
+       tpWaitWindow(1); // wait for all of the acks
+    iInFlight = 0;
+} /* tpFlush() */
+//
+// Data received from the printer (e.g. BLE notifications)
+// Transports call this to pass it up to the library
+//
+void tpNotify(uint8_t *pData, int iLen)
+{
+int i, iDataLen;
+
+#ifdef DEBUG_OUTPUT
+    Serial.print("Notify data length ");
+    Serial.println(iLen);
+#endif
+    if (pData == NULL || iLen <= 0)
+       return;
+    if (ucPrinterType != PRINTER_CAT) {
+       // ESC/POS printers send a status byte per query; anything else
+       // (e.g. a notification we didn't ask for) isn't a reply
+       if (!tpStatusEnabled() || __atomic_load_n(&iStatusPending, __ATOMIC_SEQ_CST) <= 0)
+          return;
+       iLastStatus = pData[iLen-1];
+       bFlowControl = 1; // the printer answers status queries
+       if (__atomic_sub_fetch(&iStatusPending, iLen, __ATOMIC_SEQ_CST) < 0)
+          __atomic_store_n(&iStatusPending, 0, __ATOMIC_SEQ_CST); // more replies than queries
+       return;
+    }
+    // Cat printer replies use the same framing as the commands
+    // 0x51 0x78 cmd 0x01 lenLow lenHigh data... crc 0xFF
+    // XOff = 51 78 AE 01 01 00 10 70 FF
+    // XOn  = 51 78 AE 01 01 00 00 00 FF
+    i = 0;
+    while (i + 8 <= iLen) {
+       if (pData[i] != 0x51 || pData[i+1] != 0x78) {
+          i++; // look for the start of a reply
+          continue;
+       }
+       iDataLen = pData[i+4] | (pData[i+5] << 8);
+       if (pData[i+2] == 0xAE && iDataLen >= 1 && i + 6 < iLen) {
+          bFlowControl = 1;
+          bXOff = (pData[i+6] & 0x10) ? 1 : 0;
+#ifdef DEBUG_OUTPUT
+          Serial.println(bXOff ? "XOff" : "XOn");
+#endif
+       }
+       i += 8 + iDataLen;
+    }
+} /* tpNotify() */
+//
+// Returns true if the printer has asked us to stop sending (XOff)
+//
+int tpIsPaused(void)
+{
+    return bXOff;
+} /* tpIsPaused() */
+//
+// Wait for the printer to send XOn
+// If it doesn't come within a few seconds, carry on anyway
+//
+static void tpWaitXOn(void)
+{
+unsigned long ulTime;
+
+#ifdef _ARDUINO_BLE_H_
+    tpPollNotify();
+#endif
+    if (!bXOff)
+       return;
+    ulTime = tpMillis();
+    while (bXOff && bConnected) {
+       if ((tpMillis() - ulTime) > 5000UL) {
+#ifdef DEBUG_OUTPUT
+          Serial.println("Timed out waiting for XOn");
+#endif
+          bXOff = 0;
+          break;
+       }
+       tpDelay(1);
+#ifdef _ARDUINO_BLE_H_
+       tpPollNotify();
+#endif
+    }
+} /* tpWaitXOn() */
+//
+// Send one packet to the printer through the current transport
+//
+// In MODE_WINDOWED, up to iWriteWindow acknowledged writes are kept
+// in flight. Transports which can't report acks asynchronously (the
+// BLE stacks) send the packets without response and make every Nth
+// one a write with response, which can't complete until the ones
+// before it have been delivered.
+//
+static void tpSendPacket(uint8_t *pData, int iLen)
+{
+int bAck;
+
+    tpWaitXOn();
+    tpPaceWait(&ulByteTAT, iLen, tpPacing.iBytesPerSec, tpPaceBurst());
+    bAck = (bWithResponse != MODE_WITHOUT_RESPONSE);
+    if (bAck && (pTransport->iFlags & TP_TRANSPORT_ASYNC_ACK)) {
+        tpWaitWindow((bWithResponse == MODE_WINDOWED) ? iWriteWindow : 1);
+        __atomic_add_fetch(&iInFlight, 1, __ATOMIC_SEQ_CST);
+    } else if (bWithResponse == MODE_WINDOWED) {
+        bAck = (++iInFlight >= iWriteWindow);
+    }
+    if ((*pTransport->pfnWrite)(pTransport->pUser, pData, iLen, bAck) < 0) {
+        bConnected = 0; // the transport has failed
+        iInFlight = 0;
+        return;
+    }
+    __atomic_add_fetch(&u32TxOut, (uint32_t)iLen, __ATOMIC_RELEASE);
+    if (bAck && !(pTransport->iFlags & TP_TRANSPORT_ASYNC_ACK)) {
+        iInFlight = 0; // a synchronous ack covers everything sent before it
+    }
+} /* tpSendPacket() */
+//
+// Send whatever is waiting in the coalescing buffer
+//
+static void tpFlushTx(void)
+{
+int iLen = iTxLen, iOff = 0, iSize;
+
+    if (pRing != NULL) { // ask the transmit task to send what it has
+        __atomic_store_n(&u32RingFlush, u32RingHead, __ATOMIC_RELEASE);
+        return;
+    }
+
+    iTxLen = 0; // empty it first; sending the packet can call back here
+    while (iOff < iLen && bConnected) { // more than 1 packet if a step held it back
+        iSize = iLen - iOff;
+        if (iSize > iPacketSize)
+            iSize = iPacketSize;
+        tpSendPacket(&ucTxBuf[iOff], iSize);
+        iOff += iSize;
+    }
+} /* tpFlushTx() */
+//
+// Called at the end of each printing function
+//
+static void tpAutoFlush(void)
+{
+    if (bAutoFlush) {
+        if (pRecord != NULL)
+           tpRecordMark(TP_REC_FLUSH);
+        tpFlushTx();
+    }
+} /* tpAutoFlush() */
+//
+// Write data to the printer through the current transport
+// Small writes are packed together into full sized packets (MTU-3)
+// and large ones are split. The packet goes out when it's full, when
+// we are about to wait for the printer, on tpFlush() and (unless
+// disabled with tpSetAutoFlush) at the end of each printing function
+//
+static void tpWriteData(uint8_t *pData, int iLen)
+{
+int iSize, bHold;
+
+    if (!bConnected)
+        return;
+    if (pRecord != NULL)
+        tpRecordData(pData, iLen);
+    if (bPending)
+        return; // it's in the pending buffer (tpConnectAsync)
+    u32TxIn += (uint32_t)iLen;
+    if (pRing != NULL) { // the transmit task packetizes it
+        tpRingPush(pData, iLen);
+        return;
+    }
+    while (bConnected && iLen > 0) {
+        // when the printer sends XOff during a step, keep the rest of
+        // the scanline here instead of waiting; tpPrintStep returns after it
+        bHold = (bStepActive && bXOff);
+        iSize = (bHold ? (int)sizeof(ucTxBuf) : iPacketSize) - iTxLen;
+        if (iSize <= 0) {
+            tpFlushTx();
+            continue;
+        }
+        if (iSize > iLen)
+            iSize = iLen;
+        memcpy(&ucTxBuf[iTxLen], pData, iSize);
+        iTxLen += iSize;
+        pData += iSize;
+        iLen -= iSize;
+        if (iTxLen >= iPacketSize && !bHold)
+            tpFlushTx();
+    }
+} /* tpWriteData() */
+//
+// Control whether each printing function sends its data right away
+// (the default) or leaves a partial packet to be filled by the next
+// one. With it off, call tpFlush() when you want the data sent
+//
+void tpSetAutoFlush(int bAuto)
+{
+    bAutoFlush = (uint8_t)bAuto;
+    if (bAuto)
+        tpFlushTx();
+} /* tpSetAutoFlush() */
+
+void tpWriteRawData(uint8_t *pData, int iLen) {
+   tpWriteData(pData,iLen);
+   tpAutoFlush();
+}
+//
+// Recording and replay
+// A recording is a 16 byte header followed by tags:
+//   0x01-0x7f      that many bytes of printer data follow
+//   0x00 lenL lenH a longer run of printer data follows
+//   0x80 | n       pace n scanlines (n = 1 to 0x7e)
+//   0xff           flush (send the partial packet)
+// The header is "TPRC", a version (1), the printer type, the width
+// (16 bits), the length of the tags and the scanlines paced (32 bits),
+// all little endian
+//
+//
+// Close the open data run; a short one gets its length as the tag
+//
+static void tpRecordClose(void)
+{
+int iLen;
+
+  if (iRecordRun < 0)
+    return;
+  iLen = iRecordLen - iRecordRun - 3;
+  if (iLen < TP_REC_SHORT) {
+    memmove(&pRecord[iRecordRun+1], &pRecord[iRecordRun+3], iLen);
+    pRecord[iRecordRun] = (uint8_t)iLen;
+    iRecordLen -= 2;
+  } else {
+    pRecord[iRecordRun] = TP_REC_LONG;
+    pRecord[iRecordRun+1] = (uint8_t)iLen;
+    pRecord[iRecordRun+2] = (uint8_t)(iLen >> 8);
+  }
+  iRecordRun = -1;
+} /* tpRecordClose() */
+
+static void tpRecordData(uint8_t *pData, int iLen)
+{
+int iSize;
+
+  while (iLen > 0 && !bRecordFull) {
+    if (iRecordRun < 0 || iRecordLen - iRecordRun - 3 >= 0xffff) { // start a run
+      tpRecordClose();
+      if (iRecordLen + 4 > iRecordSize) {
+        bRecordFull = 1;
+        break;
+      }
+      iRecordRun = iRecordLen;
+      iRecordLen += 3; // room for the long header
+    }
+    iSize = 0xffff - (iRecordLen - iRecordRun - 3);
+    if (iSize > iRecordSize - iRecordLen) iSize = iRecordSize - iRecordLen;
+    if (iSize > iLen) iSize = iLen;
+    if (iSize == 0) {
+      bRecordFull = 1;
+      break;
+    }
+    memcpy(&pRecord[iRecordLen], pData, iSize);
+    iRecordLen += iSize;
+    pData += iSize;
+    iLen -= iSize;
+  }
+} /* tpRecordData() */
+
+static void tpRecordMark(int iTag)
+{
+  tpRecordClose();
+  if (iRecordLen >= iRecordSize)
+    bRecordFull = 1;
+  else if (!bRecordFull)
+    pRecord[iRecordLen++] = (uint8_t)iTag;
+} /* tpRecordMark() */
+
+//
+// Start recording into pBuffer, connected or not (the pending buffer of
+// tpConnectAsync() is recorded before there's a link)
+//
+static int tpRecordStart(uint8_t *pBuffer, int iSize)
+{
+  if (pBuffer == NULL || iSize <= TP_REC_HEADER || pRecord != NULL)
+    return 0;
+  pRecord = pBuffer;
+  iRecordSize = iSize;
+  iRecordLen = TP_REC_HEADER;
+  iRecordRun = -1;
+  u32RecordLines = 0;
+  bRecordFull = 0;
+  return 1;
+} /* tpRecordStart() */
+
+int tpRecordBegin(uint8_t *pBuffer, int iSize)
+{
+  if (!bConnected)
+    return 0;
+  return tpRecordStart(pBuffer, iSize);
+} /* tpRecordBegin() */
+
+int tpRecordEnd(void)
+{
+uint32_t u32Len;
+int iWidth = iPrinterWidth[ucPrinterType];
+
+  if (pRecord == NULL)
+    return -1;
+  tpRecordClose();
+  u32Len = (uint32_t)(iRecordLen - TP_REC_HEADER);
+  memcpy(pRecord, "TPRC", 4);
+  pRecord[4] = 1; // version
+  pRecord[5] = ucPrinterType;
+  pRecord[6] = (uint8_t)iWidth; pRecord[7] = (uint8_t)(iWidth >> 8);
+  for (int i=0; i<4; i++) {
+    pRecord[8+i] = (uint8_t)(u32Len >> (i*8));
+    pRecord[12+i] = (uint8_t)(u32RecordLines >> (i*8));
+  }
+  pRecord = NULL;
+  return bRecordFull ? -1 : iRecordLen;
+} /* tpRecordEnd() */
+//
+// Walk the tags of a recording, sending them if bSend is set
+// returns 1 if the recording is complete and well formed
+//
+static int tpReplayTags(uint8_t *pData, int iLen, int bSend)
+{
+int i = TP_REC_HEADER, iRun;
+uint8_t uc;
+
+  while (i < iLen) {
+    uc = pData[i++];
+    if (uc == TP_REC_FLUSH) {
+      if (bSend) tpFlushTx();
+    } else if (uc & TP_REC_PACE) {
+      if (bSend) tpPaceLines(uc & ~TP_REC_PACE);
+    } else {
+      iRun = uc;
+      if (uc == TP_REC_LONG) {
+        if (i + 2 > iLen)
+          return 0;
+        iRun = pData[i] | (pData[i+1] << 8);
+        i += 2;
+      }
+      if (i + iRun > iLen)
+        return 0;
+      if (bSend) tpWriteData(&pData[i], iRun);
+      i += iRun;
+    }
+    if (bSend && !bConnected)
+      return 0;
+  }
+  return 1;
+} /* tpReplayTags() */
+
+int tpReplay(uint8_t *pData, int iLen)
+{
+uint32_t u32Len;
+
+  if (!bConnected || bStepActive || bRasterStream || pData == NULL || iLen < TP_REC_HEADER)
+    return 0;
+  u32Len = pData[8] | (pData[9] << 8) | (pData[10] << 16) | ((uint32_t)pData[11] << 24);
+  if (memcmp(pData, "TPRC", 4) != 0 || pData[4] != 1 || pData[5] != ucPrinterType ||
+      (pData[6] | (pData[7] << 8)) != iPrinterWidth[ucPrinterType] ||
+      u32Len > (uint32_t)(iLen - TP_REC_HEADER))
+    return 0; // not a recording for this printer
+  iLen = TP_REC_HEADER + (int)u32Len;
+  if (!tpReplayTags(pData, iLen, 0) || !tpReplayTags(pData, iLen, 1))
+    return 0;
+  tpFlushTx();
+  return 1;
+} /* tpReplay() */
+
+//
+// Checksum
+//
+static uint8_t CheckSum(uint8_t *pData, int iLen)
+{
+int i;
+uint8_t cs = 0;
+
+    for (i=0; i<iLen; i++)
+        cs = cChecksumTable[(cs ^ pData[i])];
+    return cs;
+} /* CheckSum() */
+
+// Compose command for cat printer
+// 0x51 0x78 -> prefix (STX)
+// CC -> command
+// 00 -> from PC to printer
+// 01 -> one byte of data
+// 00 -> upper byte for one byte
+// DD -> data
+// CRC -> checksum of data
+// 0xFF -> suffix (ETX)
+
+// call for one byte data
+void tpWriteCatCommandD8(uint8_t command, uint8_t data)
+{
+// prepare blank command:
+uint8_t ucTemp[9] = {0x51, 0x78, 0xCC, 0x00, 0x01, 0x00, 0xDD, 0xC0, 0xFF};
+                   // prefix      cmd   dir    length    data  crc   suffix
+    ucTemp[2] = command;				// add requested command
     ucTemp[6] = data;					// add requested data
     ucTemp[7] = cChecksumTable[data];	// add CRC
    tpWriteData(ucTemp,9);
@@ -1280,6 +2752,7 @@ int i;
      if (iEmphasized)
         ucTemp[i] |= 0x8;
      tpWriteData(ucTemp, i+1);
+     tpAutoFlush();
   }
 } /* tpSetFont() */
 //
@@ -1296,7 +2769,7 @@ uint8_t ucTemp[4];
     ucTemp[1] = 'a';
     ucTemp[2] = ucAlign;
     tpWriteData(ucTemp, 3);
-
+    tpAutoFlush();
 } /* tpAlign() */
 
 //
@@ -1349,8 +2822,9 @@ uint8_t store_pH = (uint8_t)(store_len / 256);
     tpWriteData(sizeQR, sizeof(sizeQR));
     tpWriteData(errorQR, sizeof(errorQR));
     tpWriteData(storeQR, sizeof(storeQR));
-    tpWriteData((uint8_t *)szText, store_len);
+    tpWriteData((uint8_t *)szText, store_len - 3); // pL/pH include cn, fn and m
     tpWriteData(printQR, sizeof(printQR));
+    tpAutoFlush();
 
 } /* tpQRCode() */
 //
@@ -1371,6 +2845,7 @@ int i=0;
    ucTemp[i++] = len;
    memcpy(&ucTemp[i], szData, len);
    tpWriteData(ucTemp, len + i);
+   tpAutoFlush();
 } /* tp1DBarcode() */
 
 // print one line on cat printer
@@ -1395,6 +2870,7 @@ void tpPrintCatTextLine()
         ucTemp[6+i] = ucMirror[ucFont[((CatStr[i]-32)*8)+j]];
       ucTemp[6 + CatStrLen] = CheckSum(&ucTemp[6], CatStrLen);
       ucTemp[6 + CatStrLen + 1] = 0xFF;
+      tpPaceLines(1);
       tpWriteData(ucTemp, 8 + CatStrLen);
      }
     //tpWriteData((uint8_t *)latticeEnd, sizeof(latticeEnd));
@@ -1434,6 +2910,7 @@ int iLen;
              if (CatStrLen==48) tpPrintCatTextLine();	// check for line wrap;
          }
      }
+     tpAutoFlush();
      return 1;
   }
   if (ucPrinterType == PRINTER_FOMEMO || ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3 || ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS)
@@ -1446,6 +2923,7 @@ int iLen;
         tpWriteData(ucTemp, 4);
     }
     tpWriteData((uint8_t*)pString, iLen);
+    tpAutoFlush();
     return 1;
   }
   return 0;
@@ -1494,8 +2972,6 @@ int tpGetWidth(void)
 //
 void tpFeed(int iLines)
 {
-uint8_t ucTemp[16];
-
   if (bConnected && iLines < 0 && iLines > -256 && ucPrinterType == PRINTER_CAT) {
     // some cat printers support retrack. Not all :(
     if (strcmp(szPrinterName, "MX10") == 0) {
@@ -1506,7 +2982,18 @@ uint8_t ucTemp[16];
   }
   if (!bConnected || iLines < 0 || iLines > 255)
     return;
+  tpFeedLines(iLines);
+  tpAutoFlush();
+} /* tpFeed() */
+//
+// Send the paper feed commands for iLines scanlines
+//
+static void tpFeedLines(int iLines)
+{
+uint8_t ucTemp[16];
+
   if (ucPrinterType == PRINTER_CAT) {
+    tpPaceLines(iLines);
     if (strcmp(szPrinterName, "MX10") == 0) {
       tpWriteCatCommandD16(paperFeed,iLines);
     } else {
@@ -1522,26 +3009,163 @@ uint8_t ucTemp[16];
      ucTemp[4] = 1; ucTemp[5] = 0; // width = 1 byte
      ucTemp[6] = 1; ucTemp[7] = 0; // height = 1 line
      ucTemp[8] = 0; // 8 blank pixels
+     tpPaceLines(1);
      tpWriteData(ucTemp, 9);
-     delay(5);
    }
   }
-} /* tpFeed() */
+} /* tpFeedLines() */
 //
 // tpSetEnergy Set Energy - switch between eco and nice images :) 
 //
 void tpSetEnergy(int iEnergy)
 {
   if (bConnected && ucPrinterType == PRINTER_CAT)
+  {
      tpWriteCatCommandD16(setEnergy,iEnergy);
+     tpAutoFlush();
+  }
 } /* tpSetEnergy */
 //
+// Send the ESC/POS raster header for iLines scanlines
+//
+static void tpSendRasterHeader(int iWidth, int iLines)
+{
+uint8_t ucTemp[24];
+int i = 0;
+int bPeriPage = (ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS);
+
+  if (bPeriPage) {
+    ucTemp[i++] = 0x10; ucTemp[i++] = 0xff;
+    ucTemp[i++] = 0xfe; ucTemp[i++] = 0x01; // start of command
+    memset(&ucTemp[i], 0, 12); // 12 0's (not sure why)
+    i += 12;
+  }
+  // The printer command for graphics is laid out like this:
+  // 0x1d 'v' '0' '0' xLow xHigh yLow yHigh <x/8 * y data bytes>
+  ucTemp[i++] = 0x1d; ucTemp[i++] = 'v';
+  ucTemp[i++] = '0'; ucTemp[i++] = bPeriPage ? 0 : '0'; // mode (normal)
+  ucTemp[i++] = (uint8_t)((iWidth+7)>>3); ucTemp[i++] = 0; // width in bytes
+  ucTemp[i++] = (uint8_t)iLines; ucTemp[i++] = (uint8_t)(iLines >> 8); // height (little endian)
+  tpPaceExtra(i);
+  tpWriteData(ucTemp, i);
+  u32BandEnd = u32TxIn + (uint32_t)(iLines * ((iWidth+7)>>3));
+} /* tpSendRasterHeader() */
+//
+// Status query flow control for ESC/POS printers
+// The raster is sent in bands, each with its own header. After each band
+// we ask for the paper sensor status (GS r 1). Unlike the real-time
+// status commands (DLE EOT), GS r is processed in order, so the reply
+// tells us the printer has consumed everything sent before it. We allow
+// one band to be queued in the printer while the next one is sent.
+// If the printer never answers, we fall back to pacing.
+//
+static int tpStatusEnabled(void)
+{
+  return (iStatusBandLines > 0 && !bStatusUnsupported && !bPending && ucPrinterType != PRINTER_CAT);
+} /* tpStatusEnabled() */
+
+//
+// How long to wait for a status reply (ms); allow time for
+// the queued band to print plus some slack
+//
+static int tpStatusTimeout(void)
+{
+int iTimeout = 1000;
+
+  if (tpPrinterPacing[ucPrinterType].iLinesPerSec > 0)
+    iTimeout += (iStatusBandLines * 2000) / tpPrinterPacing[ucPrinterType].iLinesPerSec;
+  return iTimeout;
+} /* tpStatusTimeout() */
+//
+// The printer didn't answer in time
+//
+static void tpStatusMissed(void)
+{
+  __atomic_store_n(&iStatusPending, 0, __ATOMIC_SEQ_CST);
+  if (!bFlowControl && ++iStatusMisses >= 2) {
+#ifdef DEBUG_OUTPUT
+    Serial.println("Printer doesn't answer status queries; using pacing");
+#endif
+    bStatusUnsupported = 1;
+  }
+} /* tpStatusMissed() */
+
+static void tpStatusWait(int iMaxPending)
+{
+unsigned long ulTime;
+int iTimeout = tpStatusTimeout();
+
+  if (__atomic_load_n(&iStatusPending, __ATOMIC_SEQ_CST) <= iMaxPending)
+    return;
+  tpFlushTx(); // make sure the query has gone out
+  ulTime = tpMillis();
+  while (__atomic_load_n(&iStatusPending, __ATOMIC_SEQ_CST) > iMaxPending && bConnected) {
+    if ((long)(tpMillis() - ulTime) > iTimeout) {
+      tpStatusMissed();
+      break;
+    }
+    tpDelay(1);
+#ifdef _ARDUINO_BLE_H_
+    tpPollNotify();
+#endif
+  }
+} /* tpStatusWait() */
+
+static void tpStatusQuery(void)
+{
+uint8_t ucTemp[8];
+int i = 0;
+
+  if (ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS) {
+    ucTemp[i++] = 0x10; ucTemp[i++] = 0xff;
+    ucTemp[i++] = 0xfe; ucTemp[i++] = 0x01;
+  }
+  ucTemp[i++] = 0x1d; ucTemp[i++] = 'r'; ucTemp[i++] = 1; // GS r 1 (paper sensor status)
+  __atomic_add_fetch(&iStatusPending, 1, __ATOMIC_SEQ_CST);
+  tpWriteData(ucTemp, i);
+} /* tpStatusQuery() */
+//
+// Enable status query flow control for ESC/POS printers
+// iBandLines = scanlines sent between status queries (0 = disabled)
+// Keep a band smaller than half of the printer's buffer
+//
+void tpSetStatusFlowControl(int iBandLines)
+{
+  iStatusBandLines = (iBandLines < 0) ? 0 : iBandLines;
+  bStatusUnsupported = 0;
+  iStatusMisses = 0;
+} /* tpSetStatusFlowControl() */
+//
+// Returns the last status byte the printer sent
+// or -1 if there hasn't been one
+//
+int tpGetStatus(void)
+{
+  return iLastStatus;
+} /* tpGetStatus() */
+//
+// Scanlines per raster header
+//
+static int tpBandLines(void)
+{
+  if (tpStatusEnabled())
+    return iStatusBandLines;
+  if (iReconnectTries > 0) // a resumed job starts with a new header
+    return TP_RESUME_BAND;
+  if (bPreemptable && (iRasterBand <= 0 || iRasterBand > TP_RESUME_BAND))
+    return TP_RESUME_BAND; // a low priority job gives way at the end of a band
+  if (iRasterBand > 0)
+    return iRasterBand;
+  return TP_MAX_BAND;
+} /* tpBandLines() */
+//
 // Send the preamble for transmitting graphics
 //
 static void tpPreGraphics(int iWidth, int iHeight)
 {
-uint8_t *s, ucTemp[16];
-
+  iRasterWidth = iWidth;
+  iRasterLines = iHeight;
+  iBandLeft = 0;
   if (ucPrinterType == PRINTER_CAT) {
 //    tpWriteCatCommandD8(getDevState, 0);		// check for stte (paper, heat etc)
 //    tpWriteCatCommandD8(setQuality,0x33);		// probably 200 DPI?
@@ -1549,34 +3173,24 @@ uint8_t *s, ucTemp[16];
 //    tpWriteCatCommandD8(getDevInfo,0);		// not so useful
 
 //    tpWriteCatCommandD16(setEnergy,12000);
+    tpPaceExtra(9);
     tpWriteCatCommandD8(setDrawingMode, 0);		// drawing mode 0 for image
     //tpWriteCatCommandD8(paperFeed,4);		// is good to start with some feed to wake up printer
     //tpWriteCatCommandD8(paperFeed,4);		// is good to start with some feed to wake up printer
-  } else if (ucPrinterType == PRINTER_FOMEMO || ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3) {
-  // The printer command for graphics is laid out like this:
-  // 0x1d 'v' '0' '0' xLow xHigh yLow yHigh <x/8 * y data bytes>
-    ucTemp[0] = 0x1d; ucTemp[1] = 'v';
-    ucTemp[2] = '0'; ucTemp[3] = '0';
-    ucTemp[4] = (iWidth+7)>>3; ucTemp[5] = 0;
-    ucTemp[6] = (uint8_t)iHeight; ucTemp[7] = (uint8_t)(iHeight >> 8);
-    tpWriteData(ucTemp, 8);
-  } else if (ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS) {
-    ucTemp[0] = 0x10; ucTemp[1] = 0xff;
-    ucTemp[2] = 0xfe; ucTemp[3] = 0x01; // start of command
-    tpWriteData(ucTemp, 4);
-    memset(ucTemp, 0, 12);
-    tpWriteData(ucTemp, 12); // 12 0's (not sure why)
-    ucTemp[0] = 0x1d; ucTemp[1] = 0x76;
-    ucTemp[2] = 0x30; ucTemp[3] = 0x00;
-    ucTemp[4] = (uint8_t)((iWidth+7)>>3); ucTemp[5] = 0x00; // width in bytes
-    ucTemp[6] = (uint8_t)iHeight; ucTemp[7] = (uint8_t)(iHeight>>8); // height (little endian)
-    tpWriteData(ucTemp, 8);
+  } else if (tpStatusEnabled()) {
+    // the header is sent at the start of each band (tpSendScanline)
+  } else if (ucPrinterType < PRINTER_COUNT) {
+    iBandLeft = tpBandLines();
+    if (iBandLeft > iHeight)
+      iBandLeft = iHeight;
+    tpSendRasterHeader(iWidth, iBandLeft);
   }
-
 } /* tpPreGraphics() */
 
 static void tpPostGraphics(void)
 {
+   iRasterLines = 0;
+   tpAutoFlush();
    if (ucPrinterType == PRINTER_CAT) {
 //      tpWriteCatCommandD8(paperFeed,0x1E);
 //      tpWriteCatCommandD8(paperFeed,0x1E);
@@ -1590,6 +3204,14 @@ static void tpPostGraphics(void)
 
 static void tpSendScanline(uint8_t *s, int iLen)
 {
+  // NB: To reliably send lots of data over BLE, you either use WRITE with
+  // response (which waits for each packet to be acknowledged), or you
+  // pace the data to give the printer time to physically print it.
+  // Sending faster than the print head can go will overflow the printer's
+  // buffer; data will be lost and you may leave the printer stuck
+  // waiting for a graphics command to finish. The pacing is based on
+  // the speed of each printer model (see tpPrinterPacing)
+  tpPaceLines(1);
   if (ucPrinterType == PRINTER_CAT) {
       uint8_t ucTemp[64+8];
       ucTemp[0] = 0x51;
@@ -1604,74 +3226,581 @@ static void tpSendScanline(uint8_t *s, int iLen)
       ucTemp[6 + iLen] = 0;
       ucTemp[6 + iLen + 1] = 0xff;
       ucTemp[6 + iLen] = CheckSum(&ucTemp[6], iLen);
+      u32BandEnd = u32TxIn + 8 + iLen;
       tpWriteData(ucTemp, 8 + iLen);
   } else if (ucPrinterType == PRINTER_FOMEMO || ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3 || ucPrinterType == PRINTER_PERIPAGE || ucPrinterType == PRINTER_PERIPAGEPLUS) {
+      if (iBandLeft == 0 && iRasterLines > 0) { // start a new band
+         int iBand = tpBandLines();
+         tpStatusWait(1); // only one band may be waiting in the printer
+         iBandLeft = (iRasterLines < iBand) ? iRasterLines : iBand;
+         tpSendRasterHeader(iRasterWidth, iBandLeft);
+      }
       tpWriteData(s, iLen);
+      if (iBandLeft > 0) {
+         iRasterLines--;
+         if (--iBandLeft == 0 && tpStatusEnabled())
+            tpStatusQuery();
+      }
   }
-    // NB: To reliably send lots of data over BLE, you either use WRITE with
-    // response (which waits for each packet to be acknowledged), or you add your
-    // own delays to give it time to physically print the data.
-    // In my testing, the forced delays actually goes faster since you don't
-    // have to wait for each packet to be acknowledged and the extra delays
-    // BLE adds between sending and receiving.
-    // Without this delay, data will be lost and you may leave the printer
-    // stuck waiting for a graphics command to finish.
-    // For the ESP32, we break up the packets and add the delays in tpWriteData()
-#ifndef HAL_ESP32_HAL_H_
-    if (!bWithResponse) {
-      delay(1+(bb_pitch/8));
-    }
-#endif
 } /* tpSendScanline() */
+//
+// Close the raster session at the end of a band (the job may continue
+// later with a new header)
+//
+static void tpEndGraphics(void)
+{
+  if (ucPrinterType == PRINTER_CAT) {
+    tpPaceExtra(sizeof(latticeEnd) + 9);
+    tpWriteData((uint8_t *)latticeEnd, sizeof(latticeEnd));
+    tpWriteCatCommandD8(setDrawingMode, 1); // back to text
+  }
+  iRasterLines = 0; // no more bands
+} /* tpEndGraphics() */
+//
+// A job was cancelled between two scanlines; give the printer what it
+// still expects so that it's ready for the next job
+//
+static void tpCancelGraphics(void)
+{
+uint8_t ucTemp[80] = {0};
+int iPitch = (iRasterWidth + 7) >> 3;
+
+  while (iBandLeft > 0 && bConnected && ucPrinterType != PRINTER_CAT) { // blank rows for the rest of the band
+    tpPaceLines(1);
+    tpWriteData(ucTemp, iPitch);
+    iBandLeft--;
+  }
+  tpEndGraphics();
+  iCancelCount++;
+} /* tpCancelGraphics() */
+//
+// Stop the job in progress at the next scanline
+//
+int tpCancel(void)
+{
+  if (!bStepActive && !bRasterStream && iRasterLines == 0)
+    return 0;
+  bCancel = 1;
+  return 1;
+} /* tpCancel() */
+
+int tpGetCancelCount(void)
+{
+  return iCancelCount;
+} /* tpGetCancelCount() */
+//
+// Send each header with at most iLines scanlines (0 = the whole image)
+// A cancelled job has to finish the band it's in, so shorter bands
+// free the printer sooner
+//
+void tpSetRasterBand(int iLines)
+{
+  iRasterBand = (iLines < 0) ? 0 : iLines;
+} /* tpSetRasterBand() */
 
 //
 // Send the graphics to the printer (must be connected over BLE first)
 //
 void tpPrintBuffer(void)
 {
-uint8_t *s, ucTemp[8];
-int y;
-int i;
+  if (tpPrintBegin())
+    tpRunSteps();
+} /* tpPrintBuffer() */
+
+void tpPrintBufferSide(void)
+{
+uint8_t *s;
+int x, y;
+uint8_t line[bb_pitch] = {0};
 
   if (!bConnected)
     return;
 
-  tpPreGraphics(bb_width, bb_height);
-
+  bCancel = 0;
+  tpPreGraphics(bb_height, bb_width);
   // Print the graphics
   s = pBackBuffer;
-  for (y=0; y<bb_height; y++) {
-    tpSendScanline(s, bb_pitch);
-    s += bb_pitch;
+  for (y=0; y<bb_width; y++) {
+    if (bCancel) {
+      tpCancelGraphics();
+      break;
+    }
+    for (x=0; x<bb_height; x++)
+    {
+      line[x/8] = (line[x/8] << 1) | (((*(s+((x+1)*bb_width-1-y)/8)) >> (y%8))&1);
+    }
+    tpSendScanline(line, bb_pitch);
   } // for y
   
   tpPostGraphics();
 
-} /* tpPrintBuffer() */
+} /* tpPrintBufferSide() */
+//
+// Print a raster which the caller supplies a few rows at a time
+// (e.g. straight out of shared memory) without a back buffer
+//
+int tpRasterBegin(int iWidth, int iHeight)
+{
+  if (!bConnected || bStepActive || bRasterStream || iWidth < 1 || iWidth > iPrinterWidth[ucPrinterType] || iHeight < 1)
+    return 0;
+  bCancel = 0;
+  tpPreGraphics(iWidth, iHeight);
+  iStreamLeft = iHeight;
+  bRasterStream = 1;
+  return 1;
+} /* tpRasterBegin() */
 
-void tpPrintBufferSide(void)
+int tpRasterLines(uint8_t *pRows, int iCount)
 {
-uint8_t *s;
-int x, y;
-uint8_t line[bb_pitch] = {0};
+int iPitch = (iRasterWidth + 7) >> 3;
+
+  if (!bRasterStream || !bConnected)
+    return 0;
+  if (iCount > iStreamLeft)
+    iCount = iStreamLeft;
+  iStreamLeft -= iCount;
+  while (iCount-- > 0) {
+    if (bCancel) {
+      tpCancelGraphics();
+      iStreamLeft = 0;
+      return 0;
+    }
+    tpSendScanline(pRows, iPitch);
+    pRows += iPitch;
+  }
+  return (bConnected && !bCancel);
+} /* tpRasterLines() */
+
+void tpRasterEnd(void)
+{
+uint8_t ucTemp[80] = {0};
+
+  if (!bRasterStream)
+    return;
+  bRasterStream = 0;
+  // the printer is still waiting for the rest of the raster
+  while (iStreamLeft > 0 && bConnected && ucPrinterType != PRINTER_CAT) {
+    tpSendScanline(ucTemp, (iRasterWidth + 7) >> 3);
+    iStreamLeft--;
+  }
+  if (bConnected)
+    tpPostGraphics();
+  iRasterLines = 0;
+} /* tpRasterEnd() */
+
+//
+// Step-wise printing
+// A job (back buffer, custom text, paper feed or raw data) is sent a
+// unit at a time (a scanline, a few lines of feed) by tpPrintStep().
+// Before each unit we check whether the printer is ready for it
+// (pacing, XOff, status replies); if it would mean waiting longer than
+// the time left in the budget, we return and pick up where we left off
+// on the next call. The blocking functions run the same steps to the end.
+//
+#define TP_FEED_STEP 16 // cat printers feed in steps of this many lines
+static TP_JOB tpStepJob; // job being sent
+static int iStepUnit, iStepUnits; // next unit to send, total units
+static int iStepY; // first text scanline (relative to the baseline)
+static int iStepFirst; // first unit sent by this run of the job
+static unsigned long ulStepStall = 0; // when we started waiting on the printer (ms, 0 = not waiting)
+//
+// Resuming after the link drops
+// At the start of each band we note the unit and the byte count. If the
+// link drops, the job continues from the last band whose bytes before it
+// had all been accepted by the transport, with a new raster header.
+// The band is the status query band or TP_RESUME_BAND scanlines.
+// The printer may still be in the middle of the band it was getting
+// when the link dropped, so that one is finished with blank bytes first
+// (any extra zeros are ignored as NUL commands).
+//
+#define TP_CHECKPOINTS 8
+typedef struct tagTP_CHECKPOINT
+{
+  int iUnit;        // first unit of the band
+  uint32_t u32Bytes; // u32TxIn before the band
+} TP_CHECKPOINT;
+static TP_CHECKPOINT tpCheckpoints[TP_CHECKPOINTS];
+static int iCheckpoint = 0; // next slot
+static int iResumeCount = 0;
+static int iResumeUnit, iResumeSame; // to give up if the link keeps dropping in the same band
+
+static void tpCheckpoint(void)
+{
+int iBand = tpStatusEnabled() ? iStatusBandLines : TP_RESUME_BAND;
+
+  if (iStepUnit % iBand == 0 || iStepUnit == iStepFirst) {
+    tpCheckpoints[iCheckpoint].iUnit = iStepUnit;
+    tpCheckpoints[iCheckpoint].u32Bytes = u32TxIn;
+    iCheckpoint = (iCheckpoint + 1) % TP_CHECKPOINTS;
+  }
+} /* tpCheckpoint() */
+//
+// Give the printer the rest of the band (or cat command) it was
+// getting when the link dropped; it has at least u32Out bytes
+//
+static void tpResumePad(uint32_t u32Out)
+{
+uint8_t ucTemp[80] = {0};
+int iLen = (int32_t)(u32BandEnd - u32Out), iSize = tpLineBytes();
+
+  while (iLen > 0 && bConnected) {
+    if (iSize > iLen)
+      iSize = iLen;
+    tpPaceLines(1);
+    tpWriteData(ucTemp, iSize);
+    iLen -= iSize;
+  }
+} /* tpResumePad() */
+//
+// The link dropped during a job; reconnect and rewind to the last
+// complete band
+// returns 1 if the job can continue
+//
+static int tpResumeJob(void)
+{
+int i, j, iUnit = iStepFirst;
+uint32_t u32Out;
+
+  if (pRing != NULL)
+    tpRingDrain(); // the transmitter discards what's left
+  u32Out = __atomic_load_n(&u32TxOut, __ATOMIC_ACQUIRE);
+  // newest checkpoint which the transport got all of the bytes before
+  for (i=1; i<=TP_CHECKPOINTS; i++) {
+    j = (iCheckpoint + TP_CHECKPOINTS - i) % TP_CHECKPOINTS;
+    if (tpCheckpoints[j].iUnit >= 0 && (int32_t)(u32Out - tpCheckpoints[j].u32Bytes) >= 0) {
+      iUnit = tpCheckpoints[j].iUnit;
+      break;
+    }
+  }
+  for (i=0; i<iReconnectTries && !bConnected; i++) {
+#ifdef DEBUG_OUTPUT
+    Serial.println("Link dropped, reconnecting");
+#endif
+    if (pTransport->pfnReconnect != NULL && (*pTransport->pfnReconnect)(pTransport->pUser)) {
+      bConnected = 1;
+      tpLinkUp();
+    } else {
+      tpDelay(TP_RECONNECT_DELAY);
+    }
+  }
+  if (!bConnected)
+    return 0;
+  if (iUnit == iResumeUnit && ++iResumeSame > iReconnectTries) {
+    bConnected = 0; // no progress; give up on this job
+    return 0;
+  } else if (iUnit != iResumeUnit) {
+    iResumeUnit = iUnit;
+    iResumeSame = 0;
+  }
+  iResumeCount++;
+  u32TxIn = __atomic_load_n(&u32TxOut, __ATOMIC_ACQUIRE); // nothing outstanding on the new link
+  for (i=0; i<TP_CHECKPOINTS; i++)
+    tpCheckpoints[i].iUnit = -1;
+  iStepUnit = iUnit;
+  ulStepStall = 0;
+  tpResumePad(u32Out);
+  if (tpStepJob.iType == TP_JOB_BUFFER)
+    tpPreGraphics(tpStepJob.iWidth, iStepUnits - iUnit);
+  else if (tpStepJob.iType == TP_JOB_TEXT)
+    tpPreGraphics(iPrinterWidth[ucPrinterType], iStepUnits - iUnit);
+  return 1;
+} /* tpResumeJob() */
+
+//
+// Set up a job to be sent by tpPrintStep()
+// returns 1 if successful, 0 if not connected or another job is in progress
+//
+static int tpStartJob(TP_JOB *pJob)
+{
+  if (!bConnected || bStepActive || bRasterStream)
+    return 0;
+  memcpy(&tpStepJob, pJob, sizeof(TP_JOB));
+  iStepUnit = iStepFirst = pJob->iStart;
+  ulStepStall = 0;
+  bStepPreempted = 0;
+  bPreemptable = (pJob->iPriority < TP_PRIORITY_NORMAL);
+  for (iCheckpoint=0; iCheckpoint<TP_CHECKPOINTS; iCheckpoint++)
+    tpCheckpoints[iCheckpoint].iUnit = -1;
+  iCheckpoint = 0;
+  bCancel = 0;
+  tpCheckpoint(); // the start of the job (before the header)
+  iResumeUnit = -1;
+  switch (pJob->iType) {
+    case TP_JOB_BUFFER:
+      iStepUnits = pJob->iHeight;
+      tpPreGraphics(pJob->iWidth, iStepUnits - iStepUnit);
+      break;
+    case TP_JOB_TEXT:
+      iStepUnits = pJob->pFont->yAdvance;
+      iStepY = 0 - (pJob->pFont->yAdvance * 2)/3; // 2/3 of char is above the baseline
+      tpPreGraphics(iPrinterWidth[ucPrinterType], iStepUnits - iStepUnit);
+      break;
+    case TP_JOB_FEED:
+      if (ucPrinterType == PRINTER_CAT)
+        iStepUnits = (pJob->iHeight + TP_FEED_STEP - 1) / TP_FEED_STEP;
+      else if (ucPrinterType == PRINTER_FOMEMO || ucPrinterType == PRINTER_MTP2 || ucPrinterType == PRINTER_MTP3)
+        iStepUnits = pJob->iHeight;
+      else
+        iStepUnits = 0; // no feed command
+      break;
+    case TP_JOB_DATA:
+      iStepUnits = 1;
+      break;
+    default:
+      return 0;
+  }
+  bStepActive = 1;
+  return 1;
+} /* tpStartJob() */
+//
+// Returns the lines and bytes the next unit will send
+//
+static void tpStepCost(int *pLines, int *pBytes)
+{
+  *pLines = 1;
+  *pBytes = tpLineBytes();
+  if (tpStepJob.iType == TP_JOB_FEED && ucPrinterType == PRINTER_CAT) {
+    *pLines = tpStepJob.iHeight - iStepUnit * TP_FEED_STEP;
+    if (*pLines > TP_FEED_STEP) *pLines = TP_FEED_STEP;
+    *pBytes = 10;
+  } else if (tpStepJob.iType == TP_JOB_FEED) {
+    *pBytes = 9;
+  } else if (tpStepJob.iType == TP_JOB_DATA) {
+    *pLines = 0;
+    *pBytes = tpStepJob.iWidth;
+  }
+} /* tpStepCost() */
+//
+// Returns how many microseconds before the next unit can be sent
+// or -1 if we're waiting on the printer (XOff or a status reply)
+//
+static long tpStepWait(void)
+{
+long lWait, l;
+int iLines, iBytes, iBurst;
+
+#ifdef _ARDUINO_BLE_H_
+  tpPollNotify();
+#endif
+  if (bXOff || (tpStatusEnabled() && iBandLeft == 0 && iRasterLines > 0 && __atomic_load_n(&iStatusPending, __ATOMIC_SEQ_CST) > 1)) {
+    if (ulStepStall == 0)
+      ulStepStall = tpMillis() | 1;
+    if ((long)(tpMillis() - ulStepStall) < (bXOff ? 5000 : tpStatusTimeout()))
+      return -1;
+    // the printer didn't answer; carry on anyway
+    if (bXOff)
+      bXOff = 0;
+    else
+      tpStatusMissed();
+  }
+  ulStepStall = 0;
+  tpStepCost(&iLines, &iBytes);
+  // a unit larger than the printer's buffer can only be sent when it's empty
+  iBurst = tpPaceBurst();
+  if (iLines * tpLineBytes() > iBurst)
+    iLines = iBurst / tpLineBytes();
+  if (iBytes > iBurst)
+    iBytes = iBurst;
+  lWait = tpPaceDue(&ulLineTAT, iLines, tpPacing.iLinesPerSec, iBurst / tpLineBytes());
+  if (pRing != NULL) { // the transmit task paces the bytes; we only need room in the ring
+    l = iBytes - (long)(u32RingSize - (u32RingHead - __atomic_load_n(&u32RingTail, __ATOMIC_ACQUIRE)));
+    if (l > 0)
+      l = (tpPacing.iBytesPerSec > 0) ? (long)(((uint64_t)l * 1000000) / tpPacing.iBytesPerSec) : 1000;
+  } else {
+    l = tpPaceDue(&ulByteTAT, iBytes + iTxLen, tpPacing.iBytesPerSec, iBurst);
+  }
+  return (l > lWait) ? l : lWait;
+} /* tpStepWait() */
+//
+// Send the next unit of the current job
+//
+static void tpStepUnit(void)
+{
+uint8_t ucTemp[80]; // max width of 1 scan line (576 pixels)
+int iPitch, iLines;
+
+  if (iStepUnit > 0)
+    tpCheckpoint();
+  switch (tpStepJob.iType) {
+    case TP_JOB_BUFFER:
+      iPitch = (tpStepJob.iWidth + 7) >> 3;
+      tpSendScanline(&tpStepJob.pData[iStepUnit * iPitch], iPitch);
+      break;
+    case TP_JOB_TEXT:
+      tpRenderTextLine(tpStepJob.pFont, tpStepJob.x, tpStepJob.pText, iStepY + iStepUnit, ucTemp, iPrinterWidth[ucPrinterType]);
+      tpSendScanline(ucTemp, (iPrinterWidth[ucPrinterType]+7)/8); // send to printer
+      break;
+    case TP_JOB_FEED:
+      if (ucPrinterType == PRINTER_CAT) {
+        tpStepCost(&iLines, &iPitch);
+        tpFeedLines(iLines);
+      } else {
+        tpFeedLines(1);
+      }
+      break;
+    case TP_JOB_DATA:
+      tpWriteData(tpStepJob.pData, tpStepJob.iWidth);
+      break;
+  }
+  iStepUnit++;
+} /* tpStepUnit() */
+
+static void tpFinishJob(void)
+{
+  if (bConnected && (tpStepJob.iType == TP_JOB_BUFFER || tpStepJob.iType == TP_JOB_TEXT))
+    tpPostGraphics();
+  iRasterLines = 0;
+  bStepActive = 0;
+  bPreemptable = 0;
+  tpAutoFlush();
+} /* tpFinishJob() */
+//
+// Can the current job stop here and continue later with a new header?
+// (bitmaps and text, at the end of a band, after sending something)
+//
+static int tpStepBoundary(void)
+{
+  if ((tpStepJob.iType != TP_JOB_BUFFER && tpStepJob.iType != TP_JOB_TEXT) ||
+      iStepUnit <= iStepFirst || iStepUnit >= iStepUnits)
+    return 0;
+  if (ucPrinterType == PRINTER_CAT)
+    return (iStepUnit % TP_RESUME_BAND) == 0;
+  return (iBandLeft == 0);
+} /* tpStepBoundary() */
+//
+// Start printing the back buffer
+//
+int tpPrintBegin(void)
+{
+TP_JOB job;
+
+  if (pBackBuffer == NULL)
+    return 0;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_BUFFER;
+  job.pData = pBackBuffer;
+  job.iWidth = bb_width; job.iHeight = bb_height;
+  return tpStartJob(&job);
+} /* tpPrintBegin() */
+//
+// Start printing a line of text in a custom font
+//
+int tpPrintBegin(GFXfont *pFont, int x, char *szMsg)
+{
+TP_JOB job;
+
+  if (pFont == NULL || szMsg == NULL || x < 0)
+    return 0;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_TEXT;
+  job.pFont = pFont;
+  job.x = x;
+  job.pText = szMsg;
+  return tpStartJob(&job);
+} /* tpPrintBegin() */
+//
+// Start feeding the paper
+//
+int tpPrintBeginFeed(int iLines)
+{
+TP_JOB job;
 
-  if (!bConnected)
-    return;
+  if (iLines < 0 || iLines > 255)
+    return 0;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_FEED;
+  job.iHeight = iLines;
+  return tpStartJob(&job);
+} /* tpPrintBeginFeed() */
+//
+// Send as much of the current job as fits in lBudget microseconds
+// (-1 = no limit; only stop when waiting on the printer)
+// returns 1 when the job is done
+//
+static int tpStepRun(long lBudget)
+{
+unsigned long ulStart = tpMicros();
+long lWait, lTxWait;
 
-  tpPreGraphics(bb_height, bb_width);
-  // Print the graphics
-  s = pBackBuffer;
-  for (y=0; y<bb_width; y++) {
-    for (x=0; x<bb_height; x++)
-    {
-      line[x/8] = (line[x/8] << 1) | (((*(s+((x+1)*bb_width-1-y)/8)) >> (y%8))&1);
+  if (!bStepActive)
+    return 1;
+  while (1) {
+    if (!bConnected && iReconnectTries > 0 && iStepUnit < iStepUnits && tpResumeJob())
+      continue;
+    // time needed to send the partial packet (pacing)
+    lTxWait = tpPaceDue(&ulByteTAT, iTxLen, tpPacing.iBytesPerSec, tpPaceBurst());
+    if (bCancel && bConnected && iStepUnit < iStepUnits) { // stop at this scanline
+      if (tpStepJob.iType == TP_JOB_BUFFER || tpStepJob.iType == TP_JOB_TEXT)
+        tpCancelGraphics();
+      else
+        iCancelCount++;
+      iStepUnit = iStepUnits;
     }
-    tpSendScanline(line, bb_pitch);
-  } // for y
-  
-  tpPostGraphics();
+    if (bPreempt && bConnected && tpStepBoundary()) { // let the waiting job go first
+      tpEndGraphics();
+      bStepPreempted = 1;
+      iPreemptCount++;
+      iStepUnits = iStepUnit; // it continues from here
+    }
+    if (!bConnected || iStepUnit >= iStepUnits) {
+      if (bConnected && iTxLen > 0) { // finish the job on a later call
+        if (bXOff && tpStepWait() < 0)
+          return 0;
+        if (bAutoFlush && lBudget >= 0 && lTxWait > lBudget - (long)(tpMicros() - ulStart))
+          return 0;
+      }
+      tpFinishJob();
+      return 1;
+    }
+    lWait = tpStepWait();
+    if (lWait < 0) {
+      if (!bXOff)
+        tpFlushTx(); // the printer needs the status query
+      return 0;
+    }
+    if (lBudget >= 0 && lWait > lBudget - (long)(tpMicros() - ulStart))
+      break; // come back later
+    tpStepUnit();
+    if (lBudget >= 0 && (long)(tpMicros() - ulStart) >= lBudget)
+      break;
+  }
+  // don't hold back what we have unless it would have to wait
+  lTxWait = tpPaceDue(&ulByteTAT, iTxLen, tpPacing.iBytesPerSec, tpPaceBurst());
+  if (!bXOff && lTxWait <= lBudget - (long)(tpMicros() - ulStart))
+    tpAutoFlush();
+  return 0;
+} /* tpStepRun() */
 
-} /* tpPrintBufferSide() */
+int tpPrintStep(long lBudget)
+{
+  return tpStepRun((lBudget < 0) ? 0 : lBudget);
+} /* tpPrintStep() */
+
+int tpPrintIsDone(void)
+{
+  return !bStepActive;
+} /* tpPrintIsDone() */
+//
+// Reconnect and resume the current job if the link drops
+// iRetries = connection attempts (0 = disabled)
+//
+void tpSetAutoReconnect(int iRetries)
+{
+  iReconnectTries = (iRetries < 0) ? 0 : iRetries;
+} /* tpSetAutoReconnect() */
+
+int tpGetResumeCount(void)
+{
+  return iResumeCount;
+} /* tpGetResumeCount() */
+//
+// Run the current job to the end
+//
+static void tpRunSteps(void)
+{
+  while (!tpStepRun(-1))
+    tpDelay(1); // waiting on the printer (XOff or status)
+} /* tpRunSteps() */
 
 //
 // Draw a line between 2 points
@@ -1786,3 +3915,820 @@ void tpDrawLine(int x1, int y1, int x2, int y2, uint8_t ucColor)
     } // for y
   } // y major case
 } /* tpDrawLine() */
+//
+// Print job queue
+// Jobs are kept in a fixed ring of TP_MAX_JOBS slots (no heap use) and
+// sent by a background task: a FreeRTOS task on ESP32, a std::thread on
+// the host build. Other boards drain the queue with tpServiceQueue().
+// Buffers and raw data belong to the caller until the job's callback.
+//
+static TP_JOB tpJobs[TP_MAX_JOBS];
+static uint8_t bJobUsed[TP_MAX_JOBS]; // 0 = free, 1 = waiting, 2 = in the pending buffer
+static int iJobCount = 0; // jobs not yet completed
+static int iPendingSlots[TP_MAX_JOBS]; // jobs in the pending buffer, in the order they were encoded
+static int iPendingJobs = 0;
+static uint8_t bPendingFull = 0; // a job didn't fit in the pending buffer; the rest wait for the link
+static int iConnectState = 0; // the connect task's result: 0 = none yet, 1 = linked, -1 = failed
+static int tpConnectDone(void) { return __atomic_load_n(&iConnectState, __ATOMIC_ACQUIRE) != 0; }
+static void tpEndConnect(void);
+static int iJobBusy = -1; // slot of the job being sent
+static uint32_t u32JobSeq = 0;
+static int iNextJobID = 1;
+static volatile uint8_t bQueueRunning = 0, bQueueStop = 0;
+
+#ifdef HAL_ESP32_HAL_H_
+#define TP_QUEUE_THREAD
+static SemaphoreHandle_t hJobLock = NULL, hJobSignal = NULL, hJobExit = NULL;
+static SemaphoreHandle_t hConnectStart = NULL, hConnectExit = NULL; // tpConnectAsync()
+static StaticSemaphore_t tpJobSems[5]; // no heap use for the queue either
+static portMUX_TYPE tpJobMux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t bJobInit = 0;
+//
+// Create the semaphores the first time any queue function needs them;
+// jobs can be queued (or drained by tpServiceQueue) without tpStartQueue()
+//
+static void tpJobInit(void)
+{
+  if (__atomic_load_n(&bJobInit, __ATOMIC_ACQUIRE))
+    return;
+  taskENTER_CRITICAL(&tpJobMux);
+  if (!bJobInit) {
+    hJobLock = xSemaphoreCreateMutexStatic(&tpJobSems[0]);
+    hJobSignal = xSemaphoreCreateBinaryStatic(&tpJobSems[1]);
+    hJobExit = xSemaphoreCreateBinaryStatic(&tpJobSems[2]);
+    hConnectStart = xSemaphoreCreateBinaryStatic(&tpJobSems[3]);
+    hConnectExit = xSemaphoreCreateBinaryStatic(&tpJobSems[4]);
+    __atomic_store_n(&bJobInit, 1, __ATOMIC_RELEASE);
+  }
+  taskEXIT_CRITICAL(&tpJobMux);
+} /* tpJobInit() */
+static void tpJobLock(void) { tpJobInit(); xSemaphoreTake(hJobLock, portMAX_DELAY); }
+static void tpJobUnlock(void) { xSemaphoreGive(hJobLock); }
+static void tpJobSignal(void) { tpJobInit(); xSemaphoreGive(hJobSignal); }
+#elif !defined( ARDUINO )
+#define TP_QUEUE_THREAD
+static std::thread *pJobThread = NULL;
+static std::mutex jobLock;
+static std::condition_variable jobSignal;
+static void tpJobLock(void) { jobLock.lock(); }
+static void tpJobUnlock(void) { jobLock.unlock(); }
+static void tpJobSignal(void) { jobSignal.notify_one(); }
+#else
+// no threads; the queue is drained from loop() with tpServiceQueue()
+static void tpJobLock(void) {}
+static void tpJobUnlock(void) {}
+static void tpJobSignal(void) {}
+#endif
+//
+// Is there a job for tpNextJob() to take? (with the lock held)
+//
+static int tpJobReady(void)
+{
+  if (bConnecting && (!bPending || bPendingFull))
+    return 0; // they wait for the link
+  return (iJobBusy < 0 && iJobCount > iPendingJobs);
+} /* tpJobReady() */
+
+//
+// Add a job to the queue
+// returns the job ID or -1 if the queue is full
+//
+static int tpQueueJob(TP_JOB *pJob)
+{
+int i, iID;
+
+  tpJobLock();
+  if (iJobCount >= TP_MAX_JOBS) {
+    tpJobUnlock();
+    return -1;
+  }
+  iID = pJob->iID = iNextJobID++;
+  if (iNextJobID < 0) iNextJobID = 1;
+  pJob->u32Seq = u32JobSeq++;
+  for (i=0; bJobUsed[i]; i++) {};
+  memcpy(&tpJobs[i], pJob, sizeof(TP_JOB));
+  bJobUsed[i] = 1;
+  iJobCount++;
+  if (iJobBusy >= 0 && pJob->iPriority > tpJobs[iJobBusy].iPriority)
+    bPreempt = 1; // the job being sent gives way at the end of its band
+  tpJobUnlock();
+  tpJobSignal();
+  return iID;
+} /* tpQueueJob() */
+
+int tpQueueBuffer(uint8_t *pBuffer, int iWidth, int iHeight, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority)
+{
+TP_JOB job;
+
+  if (pBuffer == NULL || iWidth <= 0 || iHeight <= 0)
+    return -1;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_BUFFER;
+  job.pData = pBuffer;
+  job.iWidth = iWidth; job.iHeight = iHeight;
+  job.pfnDone = pfnDone; job.pUser = pUser;
+  job.iPriority = iPriority;
+  return tpQueueJob(&job);
+} /* tpQueueBuffer() */
+
+int tpQueueCustomText(GFXfont *pFont, int x, const char *szMsg, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority)
+{
+TP_JOB job;
+
+  if (pFont == NULL || szMsg == NULL || x < 0 || strlen(szMsg) >= TP_MAX_JOB_TEXT)
+    return -1;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_TEXT;
+  job.pFont = pFont;
+  job.x = x;
+  strcpy(job.szText, szMsg); // the caller's string can be reused right away
+  job.pfnDone = pfnDone; job.pUser = pUser;
+  job.iPriority = iPriority;
+  return tpQueueJob(&job);
+} /* tpQueueCustomText() */
+
+int tpQueueFeed(int iLines, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority)
+{
+TP_JOB job;
+
+  if (iLines < 0 || iLines > 255) // same range as tpFeed()
+    return -1;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_FEED;
+  job.iHeight = iLines;
+  job.pfnDone = pfnDone; job.pUser = pUser;
+  job.iPriority = iPriority;
+  return tpQueueJob(&job);
+} /* tpQueueFeed() */
+
+int tpQueueData(uint8_t *pData, int iLen, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority)
+{
+TP_JOB job;
+
+  if (pData == NULL || iLen <= 0)
+    return -1;
+  memset(&job, 0, sizeof(job));
+  job.iType = TP_JOB_DATA;
+  job.pData = pData;
+  job.iWidth = iLen;
+  job.pfnDone = pfnDone; job.pUser = pUser;
+  job.iPriority = iPriority;
+  return tpQueueJob(&job);
+} /* tpQueueData() */
+//
+// Send one job to the printer and wait until it has left the transport
+// returns 0 for success, -1 if the printer isn't connected
+// or 1 if it stopped to let a job with a higher priority go first
+//
+static int tpRunJob(TP_JOB *pJob)
+{
+  pJob->pText = pJob->szText; // our copy lives until the job completes
+  if (!tpStartJob(pJob))
+    return -1;
+  tpRunSteps();
+  tpFlush();
+  if (bStepPreempted && bConnected) {
+    pJob->iStart = iStepUnit;
+    return 1;
+  }
+  return bConnected ? 0 : -1;
+} /* tpRunJob() */
+//
+// Finish the job being sent and tell the owner
+//
+static void tpCompleteJob(TP_JOB *pJob, int iResult)
+{
+  tpJobLock();
+  bJobUsed[iJobBusy] = 0;
+  iJobCount--;
+  iJobBusy = -1;
+  tpJobUnlock();
+  if (pJob->pfnDone)
+    (*pJob->pfnDone)(pJob->iID, iResult, pJob->pUser);
+} /* tpCompleteJob() */
+//
+// Take the next job off the queue: the highest priority, then the
+// oldest (it stays counted until completed)
+// returns 1 if there was one
+//
+static int tpNextJob(TP_JOB *pJob)
+{
+int i, iBest = -1;
+
+  tpJobLock();
+  for (i=0; i<TP_MAX_JOBS && tpJobReady(); i++) {
+    if (bJobUsed[i] == 1 && (iBest < 0 || tpJobs[i].iPriority > tpJobs[iBest].iPriority ||
+        (tpJobs[i].iPriority == tpJobs[iBest].iPriority && (int32_t)(tpJobs[i].u32Seq - tpJobs[iBest].u32Seq) < 0)))
+      iBest = i;
+  }
+  if (iBest >= 0) {
+    memcpy(pJob, &tpJobs[iBest], sizeof(TP_JOB));
+    iJobBusy = iBest;
+    bPreempt = 0;
+  }
+  tpJobUnlock();
+  return (iBest >= 0);
+} /* tpNextJob() */
+//
+// Send the job taken by tpNextJob(); a preempted job goes back in the
+// queue and continues where it stopped, the others are completed
+//
+static void tpSendJob(TP_JOB *pJob)
+{
+int iResult, iRecordStart = 0;
+uint32_t u32Lines = 0;
+
+  if (bPending) { // where the job starts in the pending buffer
+    tpRecordClose();
+    iRecordStart = iRecordLen;
+    u32Lines = u32RecordLines;
+  }
+  iResult = tpRunJob(pJob);
+  if (bPending && bRecordFull) { // it didn't fit; take it out again and let it wait for the link
+    iRecordLen = iRecordStart;
+    u32RecordLines = u32Lines;
+    iRecordRun = -1;
+    bRecordFull = 0;
+    tpJobLock();
+    bPendingFull = 1;
+    iJobBusy = -1;
+    tpJobUnlock();
+  } else if (iResult > 0) {
+    tpJobLock();
+    tpJobs[iJobBusy].iStart = pJob->iStart;
+    iJobBusy = -1;
+    tpJobUnlock();
+  } else if (iResult == 0 && bPending) { // completed once the pending data is sent
+    tpJobLock();
+    bJobUsed[iJobBusy] = 2;
+    iPendingSlots[iPendingJobs++] = iJobBusy;
+    iJobBusy = -1;
+    tpJobUnlock();
+  } else {
+    tpCompleteJob(pJob, iResult);
+  }
+} /* tpSendJob() */
+
+int tpGetPreemptCount(void)
+{
+  return iPreemptCount;
+} /* tpGetPreemptCount() */
+//
+// Send the next queued job (boards without a background task)
+// returns 1 if a job was sent, 0 if the queue is empty
+//
+int tpServiceQueue(void)
+{
+TP_JOB job;
+
+  if (bQueueRunning)
+    return 0;
+  if (tpConnectDone()) {
+    tpEndConnect();
+    return 1;
+  }
+  if (!tpNextJob(&job))
+    return 0;
+  tpSendJob(&job);
+  return 1;
+} /* tpServiceQueue() */
+
+#ifdef TP_QUEUE_THREAD
+static void tpQueueTask(void *pArg)
+{
+TP_JOB job;
+
+  (void)pArg;
+  while (!bQueueStop) {
+    if (tpConnectDone()) {
+      tpEndConnect();
+      continue;
+    }
+    if (tpNextJob(&job)) {
+      tpSendJob(&job);
+      continue;
+    }
+#ifdef HAL_ESP32_HAL_H_
+    xSemaphoreTake(hJobSignal, pdMS_TO_TICKS(100));
+#else
+    std::unique_lock<std::mutex> lock(jobLock);
+    if (!tpJobReady() && !tpConnectDone() && !bQueueStop)
+      jobSignal.wait_for(lock, std::chrono::milliseconds(100));
+#endif
+  }
+#ifdef HAL_ESP32_HAL_H_
+  xSemaphoreGive(hJobExit);
+  vTaskDelete(NULL);
+#endif
+} /* tpQueueTask() */
+#endif // TP_QUEUE_THREAD
+
+int tpStartQueue(void)
+{
+#ifdef TP_QUEUE_THREAD
+  if (bQueueRunning)
+    return 1;
+  bQueueStop = 0;
+#ifdef HAL_ESP32_HAL_H_
+  tpJobInit();
+  if (xTaskCreate(tpQueueTask, "tpQueue", TP_QUEUE_STACK, NULL, 1, NULL) != pdPASS)
+    return 0;
+#else
+  pJobThread = new std::thread(tpQueueTask, (void *)NULL);
+#endif
+  bQueueRunning = 1;
+  return 1;
+#else
+  return 0;
+#endif // TP_QUEUE_THREAD
+} /* tpStartQueue() */
+
+void tpStopQueue(void)
+{
+TP_JOB job;
+
+#ifdef TP_QUEUE_THREAD
+  if (bQueueRunning) {
+    tpJobLock();
+    bQueueStop = 1;
+    tpJobUnlock();
+    tpJobSignal();
+#ifdef HAL_ESP32_HAL_H_
+    xSemaphoreTake(hJobExit, portMAX_DELAY);
+#else
+    pJobThread->join();
+    delete pJobThread;
+    pJobThread = NULL;
+#endif
+    bQueueRunning = 0;
+  }
+#endif // TP_QUEUE_THREAD
+  // jobs which were never sent complete with an error
+  while (tpNextJob(&job))
+    tpCompleteJob(&job, -1);
+} /* tpStopQueue() */
+
+int tpGetQueueDepth(void)
+{
+int iCount;
+
+  tpJobLock();
+  iCount = iJobCount;
+  tpJobUnlock();
+  return iCount;
+} /* tpGetQueueDepth() */
+
+int tpWaitQueue(int iTimeout)
+{
+unsigned long ulTime = millis();
+
+  while (tpGetQueueDepth() > 0) {
+    if (!bQueueRunning && tpServiceQueue())
+      continue;
+    if (iTimeout >= 0 && (long)(millis() - ulTime) > iTimeout)
+      return 0;
+    delay(1); // the queue task is busy or the jobs wait for the link
+  }
+  return 1;
+} /* tpWaitQueue() */
+//
+// Background connection (tpConnectAsync)
+// A task connects while the queue task (or tpServiceQueue) encodes the
+// jobs into the pending buffer for the printer model expected. The
+// connecting side only opens the link, with its own copies of the model
+// and name, and publishes the result in iConnectState; the encoder's side
+// then sends the pending data and marks the printer connected, so the
+// library state is only ever changed from one side.
+//
+static uint8_t *pPendingBuf = NULL;
+static int iPendingSize = 0;
+static TP_IDENTITY tpConnectID;
+static uint8_t bConnectID = 0, bConnectScan = 0, ucConnectType;
+static int iConnectMillis;
+static char szConnectName[32]; // what to scan for, then the name of the printer
+static TP_CONNECT_CALLBACK *pfnConnectDone = NULL;
+static void *pConnectUser;
+#ifdef HAL_ESP32_HAL_H_
+static StackType_t tpConnectStack[TP_CONNECT_STACK]; // no heap use for each connection
+static StaticTask_t tpConnectTCB;
+static TaskHandle_t hConnectTask = NULL;
+#elif defined( TP_QUEUE_THREAD )
+static std::thread *pConnectThread = NULL;
+#endif
+
+void tpSetPendingBuffer(uint8_t *pBuffer, int iSize)
+{
+  pPendingBuf = (iSize > TP_REC_HEADER) ? pBuffer : NULL;
+  iPendingSize = iSize;
+} /* tpSetPendingBuffer() */
+
+int tpIsConnecting(void)
+{
+  return bConnecting;
+} /* tpIsConnecting() */
+
+#ifdef TP_QUEUE_THREAD
+//
+// Listen (through the discovery backend) for the first printer of the
+// type expected whose name starts with szConnectName, like tpScan()
+// returns 1 if one was heard
+//
+static int tpScanFirst(TP_FOUND *pFound)
+{
+TP_ADVERT advert;
+char szTemp[32];
+unsigned long ulTime;
+int iLeft, bFound = 0, iLen = strlen(szConnectName);
+
+  if (!(*pDiscovery->pfnStart)(pDiscovery->pUser))
+    return 0;
+  ulTime = tpMillis();
+  while (!bFound && (iLeft = iConnectMillis - (int)(tpMillis() - ulTime)) > 0) {
+    if (!(*pDiscovery->pfnNext)(pDiscovery->pUser, &advert, iLeft))
+      continue;
+    memcpy(szTemp, advert.szName, sizeof(szTemp));
+    szTemp[sizeof(szTemp)-1] = 0;
+    if (tpFindPrinterName(szTemp) != ucConnectType || strncmp(advert.szName, szConnectName, iLen) != 0)
+      continue;
+    memset(pFound, 0, sizeof(TP_FOUND));
+    memcpy(pFound->ucAddress, advert.ucAddress, 6);
+    pFound->bRandom = advert.bRandom;
+    pFound->ucType = ucConnectType;
+    pFound->cRSSI = advert.cRSSI;
+    pFound->usSeen = 1;
+    memcpy(pFound->szName, advert.szName, sizeof(pFound->szName));
+    pFound->szName[sizeof(pFound->szName)-1] = 0;
+    bFound = 1;
+  }
+  (*pDiscovery->pfnStop)(pDiscovery->pUser);
+  tpNoteHeap(0);
+  return bFound;
+} /* tpScanFirst() */
+//
+// Open the link (scanning first for tpScanAsync) without touching the
+// encoder's state
+// returns 1 if successful
+//
+static int tpConnectLink(void)
+{
+TP_FOUND found;
+
+  if (bConnectScan) {
+    if (!tpScanFirst(&found))
+      return 0;
+    tpFoundIdentity(&found, &tpConnectID);
+    bConnectID = 1;
+  }
+  if (bConnectID) {
+    memcpy(szConnectName, tpConnectID.szName, sizeof(tpConnectID.szName));
+    szConnectName[sizeof(tpConnectID.szName)-1] = 0;
+  } else {
+    szConnectName[0] = 0;
+  }
+  if (pTransport != &tpBLETransport) // reopen the custom transport
+    return (pTransport->pfnReconnect == NULL || (*pTransport->pfnReconnect)(pTransport->pUser));
+#ifdef HAL_ESP32_HAL_H_
+  if (bConnectID) { // like tpConnectIdentity(), but the model and name wait for tpEndConnect()
+    if (!(tpConnectID.ucFlags & TP_IDENTITY_ADDRESS))
+      return 0;
+    tpESPBegin();
+    memcpy(ucServerAddress, tpConnectID.ucAddress, 6);
+    bServerAddress = 1;
+    bServerRandom = (tpConnectID.ucFlags & TP_IDENTITY_RANDOM) != 0;
+  }
+  return tpESPConnect(ucConnectType);
+#else
+  return 0; // no BLE on the host build; use tpSetTransport()
+#endif
+} /* tpConnectLink() */
+
+static void tpConnectTask(void *pArg)
+{
+int iState;
+
+  (void)pArg;
+  iState = tpConnectLink() ? 1 : -1;
+  __atomic_store_n(&iConnectState, iState, __ATOMIC_RELEASE); // szConnectName is ready too
+  tpJobSignal(); // the queue task finishes it
+} /* tpConnectTask() */
+#ifdef HAL_ESP32_HAL_H_
+//
+// The ESP32 connect task is created once and runs each connection in
+// turn; a task which deleted itself could still be using the static
+// stack and TCB when a callback of tpEndConnect() starts the next one
+//
+static void tpConnectLoop(void *pArg)
+{
+  (void)pArg;
+  for (;;) {
+    xSemaphoreTake(hConnectStart, portMAX_DELAY);
+    tpConnectTask(NULL);
+    xSemaphoreGive(hConnectExit); // tpEndConnect() waits for this
+  }
+} /* tpConnectLoop() */
+#endif // ESP32
+#endif // TP_QUEUE_THREAD
+//
+// Start the background connection to pID (or the last printer) or to
+// the first printer heard whose name starts with szName; the jobs are
+// encoded for iType
+//
+static int tpStartConnect(const TP_IDENTITY *pID, const char *szName, int iSeconds, int iType, TP_CONNECT_CALLBACK *pfnDone, void *pUser)
+{
+#ifdef TP_QUEUE_THREAD
+  tpJobLock();
+  if (bConnecting || tpIsConnected()) { // only one caller can start it
+    tpJobUnlock();
+    return 0;
+  }
+  bConnectScan = (szName != NULL);
+  bConnectID = (pID != NULL);
+  if (pID != NULL)
+    memcpy(&tpConnectID, pID, sizeof(TP_IDENTITY));
+  if (szName != NULL) {
+    strncpy(szConnectName, szName, sizeof(szConnectName)-1);
+    szConnectName[sizeof(szConnectName)-1] = 0;
+    iConnectMillis = iSeconds * 1000;
+  }
+  ucPrinterType = ucConnectType = (uint8_t)iType;
+  pfnConnectDone = pfnDone;
+  pConnectUser = pUser;
+  __atomic_store_n(&iConnectState, 0, __ATOMIC_RELEASE);
+  bPendingFull = 0;
+  bConnecting = 1;
+  if (pPendingBuf != NULL && tpRecordStart(pPendingBuf, iPendingSize)) {
+    // the encoder runs as if connected; tpWriteData() keeps what it
+    // writes until tpEndConnect() sends it on the new link
+    bPending = 1;
+    bConnected = 1;
+  }
+  tpJobUnlock();
+#ifdef HAL_ESP32_HAL_H_
+  if (hConnectTask == NULL)
+    hConnectTask = xTaskCreateStatic(tpConnectLoop, "tpConnect", TP_CONNECT_STACK, NULL, 1, tpConnectStack, &tpConnectTCB);
+  if (hConnectTask != NULL)
+    xSemaphoreGive(hConnectStart);
+  else
+    __atomic_store_n(&iConnectState, -1, __ATOMIC_RELEASE);
+#else
+  pConnectThread = new std::thread(tpConnectTask, (void *)NULL);
+#endif
+  tpJobSignal();
+  return 1;
+#else
+  (void)pID; (void)szName; (void)iSeconds; (void)iType; (void)pfnDone; (void)pUser;
+  return 0; // no background task on this board
+#endif // TP_QUEUE_THREAD
+} /* tpStartConnect() */
+
+int tpConnectAsync(const TP_IDENTITY *pID, TP_CONNECT_CALLBACK *pfnDone, void *pUser)
+{
+  if (pID != NULL && (pID->ucVersion != TP_IDENTITY_VERSION || pID->ucType >= PRINTER_COUNT ||
+      pID->ucCheck != tpIdentityCheck(pID)))
+    return 0;
+  if (pID == NULL && ucPrinterType >= PRINTER_COUNT)
+    return 0; // there's no last printer
+  return tpStartConnect(pID, NULL, 0, (pID != NULL) ? pID->ucType : ucPrinterType, pfnDone, pUser);
+} /* tpConnectAsync() */
+
+int tpScanAsync(const char *szName, int iSeconds, int iPrinterType, TP_CONNECT_CALLBACK *pfnDone, void *pUser)
+{
+  if (szName == NULL || iSeconds < 1 || iPrinterType < 0 || iPrinterType >= PRINTER_COUNT)
+    return 0;
+  return tpStartConnect(NULL, szName, iSeconds, iPrinterType, pfnDone, pUser);
+} /* tpScanAsync() */
+//
+// The background connection has finished: send the pending data on the
+// new link, then complete the jobs which were in it
+//
+static void tpEndConnect(void)
+{
+TP_JOB job;
+int i, iLen = 0, iResult = (__atomic_load_n(&iConnectState, __ATOMIC_ACQUIRE) > 0) ? 0 : -1;
+
+#ifdef HAL_ESP32_HAL_H_
+  if (hConnectTask != NULL) // the task is done with the connection's state
+    xSemaphoreTake(hConnectExit, portMAX_DELAY);
+#elif defined( TP_QUEUE_THREAD )
+  if (pConnectThread != NULL) {
+    pConnectThread->join();
+    delete pConnectThread;
+    pConnectThread = NULL;
+  }
+#endif
+  if (bPending) {
+    iLen = tpRecordEnd();
+    bPending = 0;
+  }
+  if (iResult == 0) {
+    if (szConnectName[0]) {
+      strcpy(szPrinterName, szConnectName);
+#ifdef HAL_ESP32_HAL_H_
+      strcpy(Scanned_BLE_Name, szConnectName);
+#endif
+    }
+    bConnected = 1;
+    tpLinkUp();
+    if (iLen > TP_REC_HEADER && !tpReplay(pPendingBuf, iLen))
+      iResult = -1; // the link dropped while sending it
+  } else {
+    bConnected = 0;
+  }
+  tpJobLock();
+  bConnecting = 0;
+  __atomic_store_n(&iConnectState, 0, __ATOMIC_RELEASE);
+  bPendingFull = 0;
+  tpJobUnlock();
+  for (i=0; i<iPendingJobs; i++) {
+    tpJobLock();
+    memcpy(&job, &tpJobs[iPendingSlots[i]], sizeof(TP_JOB));
+    bJobUsed[iPendingSlots[i]] = 0;
+    iJobCount--;
+    tpJobUnlock();
+    if (job.pfnDone)
+      (*job.pfnDone)(job.iID, iResult, job.pUser);
+  }
+  iPendingJobs = 0;
+  if (pfnConnectDone != NULL)
+    (*pfnConnectDone)(iResult, pConnectUser);
+} /* tpEndConnect() */
+//
+// Ring of encoded bytes between the encoder and the transmitter
+// The encoder (the caller of the printing functions) is the only writer
+// of the head and the transmit task is the only writer of the tail, so
+// neither side takes a lock. On ESP32 the transmit task runs on the other
+// core (the one the BLE stack uses) so encoding overlaps the radio time.
+// The transmitter sends full packets, or what it has after a flush request.
+//
+static volatile uint8_t bRingRun = 0, bRingBusy = 0, bRingExit = 0;
+static TP_RING_STATS tpRingStats;
+#ifndef HAL_ESP32_HAL_H_
+#ifndef ARDUINO
+static std::thread *pRingThread = NULL;
+#endif
+#endif
+
+//
+// Wait a little for the other side; spin briefly before sleeping
+//
+static void tpRingYield(int *pSpins)
+{
+#ifdef HAL_ESP32_HAL_H_
+  (void)pSpins;
+  vTaskDelay(1);
+#else
+  if (++(*pSpins) < 256)
+    std::this_thread::yield();
+  else
+    delayMicroseconds(50);
+#endif
+} /* tpRingYield() */
+//
+// Add encoded bytes to the ring (encoder side)
+// waits for room if the ring is full
+//
+static void tpRingPush(uint8_t *pData, int iLen)
+{
+uint32_t u32Head = u32RingHead, u32Used, u32Off;
+int iSize, iFirst, bStalled = 0, iSpins = 0;
+
+  while (iLen > 0 && bConnected) {
+    u32Used = u32Head - __atomic_load_n(&u32RingTail, __ATOMIC_ACQUIRE);
+    iSize = (int)(u32RingSize - u32Used);
+    if (iSize == 0) {
+      if (!bStalled) {
+        tpRingStats.iFullStalls++;
+        bStalled = 1;
+      }
+      tpRingYield(&iSpins);
+      continue;
+    }
+    iSpins = 0;
+    if (iSize > iLen)
+      iSize = iLen;
+    u32Off = u32Head & (u32RingSize - 1);
+    iFirst = (int)(u32RingSize - u32Off);
+    if (iFirst > iSize)
+      iFirst = iSize;
+    memcpy(&pRing[u32Off], pData, iFirst);
+    memcpy(pRing, &pData[iFirst], iSize - iFirst);
+    u32Head += iSize;
+    __atomic_store_n(&u32RingHead, u32Head, __ATOMIC_RELEASE);
+    if ((int)(u32Used + iSize) > tpRingStats.iHighWater)
+      tpRingStats.iHighWater = (int)(u32Used + iSize);
+    pData += iSize;
+    iLen -= iSize;
+  }
+} /* tpRingPush() */
+//
+// Wait until the transmitter has sent everything in the ring
+//
+static void tpRingDrain(void)
+{
+int iSpins = 0;
+
+  while (bRingRun && (u32RingHead != __atomic_load_n(&u32RingTail, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&bRingBusy, __ATOMIC_SEQ_CST)))
+    tpRingYield(&iSpins);
+} /* tpRingDrain() */
+//
+// Transmit task; takes packets off the ring and sends them
+//
+static void tpRingTask(void *pArg)
+{
+uint8_t ucPacket[TP_MAX_PACKET];
+uint32_t u32Tail = u32RingTail, u32Avail, u32Off;
+int iSize, iFirst, bSent = 0, iSpins = 0;
+
+  (void)pArg;
+  while (__atomic_load_n(&bRingRun, __ATOMIC_ACQUIRE)) {
+    u32Avail = __atomic_load_n(&u32RingHead, __ATOMIC_ACQUIRE) - u32Tail;
+    if (u32Avail == 0 || ((int)u32Avail < iPacketSize &&
+        (int32_t)(__atomic_load_n(&u32RingFlush, __ATOMIC_ACQUIRE) - u32Tail) <= 0)) {
+      if (u32Avail == 0 && bSent) // the radio is waiting on the encoder
+        tpRingStats.iEmptyStalls++;
+      bSent = 0;
+      tpRingYield(&iSpins);
+      continue;
+    }
+    iSpins = 0;
+    iSize = (int)u32Avail;
+    if (iSize > iPacketSize)
+      iSize = iPacketSize;
+    u32Off = u32Tail & (u32RingSize - 1);
+    iFirst = (int)(u32RingSize - u32Off);
+    if (iFirst > iSize)
+      iFirst = iSize;
+    memcpy(ucPacket, &pRing[u32Off], iFirst);
+    memcpy(&ucPacket[iFirst], pRing, iSize - iFirst);
+    __atomic_store_n(&bRingBusy, 1, __ATOMIC_SEQ_CST); // set before the space is given back
+    u32Tail += iSize;
+    __atomic_store_n(&u32RingTail, u32Tail, __ATOMIC_RELEASE);
+    if (bConnected)
+      tpSendPacket(ucPacket, iSize);
+    __atomic_store_n(&bRingBusy, 0, __ATOMIC_SEQ_CST);
+    bSent = 1;
+  }
+  __atomic_store_n(&bRingExit, 1, __ATOMIC_RELEASE);
+#ifdef HAL_ESP32_HAL_H_
+  vTaskDelete(NULL);
+#endif
+} /* tpRingTask() */
+
+int tpStartRing(uint8_t *pBuffer, int iSize)
+{
+#ifdef TP_QUEUE_THREAD
+  if (pRing != NULL || pBuffer == NULL || iSize < TP_MAX_PACKET || (iSize & (iSize - 1)) != 0)
+    return 0;
+  tpFlushTx(); // nothing left behind in the write buffer
+  u32RingSize = (uint32_t)iSize;
+  u32RingHead = u32RingTail = u32RingFlush = 0;
+  memset(&tpRingStats, 0, sizeof(tpRingStats));
+  tpRingStats.iSize = iSize;
+  bRingBusy = bRingExit = 0;
+  bRingRun = 1;
+#ifdef HAL_ESP32_HAL_H_
+  // run next to the BLE stack on core 0; the Arduino loop runs on core 1
+  if (xTaskCreatePinnedToCore(tpRingTask, "tpRing", TP_QUEUE_STACK, NULL, 2, NULL, 0) != pdPASS) {
+    bRingRun = 0;
+    return 0;
+  }
+#else
+  pRingThread = new std::thread(tpRingTask, (void *)NULL);
+#endif
+  pRing = pBuffer;
+  return 1;
+#else
+  (void)pBuffer; (void)iSize;
+  return 0;
+#endif // TP_QUEUE_THREAD
+} /* tpStartRing() */
+
+void tpStopRing(void)
+{
+  if (pRing == NULL)
+    return;
+  tpFlushTx();
+  tpRingDrain();
+  __atomic_store_n(&bRingRun, 0, __ATOMIC_RELEASE);
+#ifdef HAL_ESP32_HAL_H_
+  while (!__atomic_load_n(&bRingExit, __ATOMIC_ACQUIRE))
+    delay(1);
+#elif !defined( ARDUINO )
+  pRingThread->join();
+  delete pRingThread;
+  pRingThread = NULL;
+#endif
+  pRing = NULL;
+} /* tpStopRing() */
+
+void tpGetRingStats(TP_RING_STATS *pStats, int bReset)
+{
+  if (pStats == NULL)
+    return;
+  memcpy(pStats, &tpRingStats, sizeof(TP_RING_STATS));
+  if (bReset) {
+    tpRingStats.iHighWater = 0;
+    tpRingStats.iFullStalls = tpRingStats.iEmptyStalls = 0;
+  }
+} /* tpGetRingStats() */
@@ -20,6 +20,10 @@
 #ifndef __THERMAL_PRINTER_H__
 #define __THERMAL_PRINTER_H__
 
+#ifndef ARDUINO
+#include <stdint.h>
+#endif
+
 #define FONT_SMALL 0
 #define FONT_LARGE 1
 #define FONT_12x24 0
@@ -88,6 +92,245 @@ typedef struct {
   uint8_t yAdvance; ///< Newline distance (y axis)
 } GFXfont;
 #endif // _ADAFRUIT_GFX_H
+
+//
+// Transport interface
+// The library encodes the printer commands and graphics and hands
+// the bytes to a transport for delivery. The BLE stack of the board
+// (ESP32/NimBLE, ArduinoBLE or Bluefruit) is the default transport.
+// pfnWrite returns the number of bytes written or < 0 on failure
+// pfnFlush and pfnGetMTU are optional (NULL). pfnGetMTU returns
+// the ATT MTU of the link or 0 if unknown.
+// Data coming back from the printer should be passed to tpNotify()
+// A transport with the TP_TRANSPORT_ASYNC_ACK flag returns from a
+// write with response right away and calls tpWriteAck() later
+// when the printer acknowledges it
+// pfnReconnect (optional) opens the link again after a write failed
+// and returns 1 if successful (see tpSetAutoReconnect)
+// A transport with the TP_TRANSPORT_NO_PACING flag has its own flow
+// control (e.g. RTS/CTS or TCP); the data isn't paced for the printer
+//
+#define TP_TRANSPORT_ASYNC_ACK 1
+#define TP_TRANSPORT_NO_PACING 2
+typedef struct tagTP_TRANSPORT
+{
+  int (*pfnWrite)(void *pUser, uint8_t *pData, int iLen, int bWithResponse);
+  void (*pfnFlush)(void *pUser);
+  int (*pfnGetMTU)(void *pUser);
+  void *pUser; // passed to each function
+  int iFlags;  // TP_TRANSPORT_xxx
+  int (*pfnReconnect)(void *pUser);
+} TP_TRANSPORT;
+//
+// Use a custom transport instead of BLE
+// The printer is treated as connected until tpDisconnect()
+// or until the transport write fails
+// Pass NULL to go back to the built-in BLE stack
+// returns 1 if successful, 0 for invalid parameters
+//
+int tpSetTransport(TP_TRANSPORT *pTransport, int iPrinterType, const char *szName);
+//
+// Clock interface
+// Every timestamp and every wait on the printer (pacing, flow control,
+// acknowledgements, timeouts) goes through these functions, so a
+// simulation can run on a virtual clock which advances instantly.
+// All three functions are required; pfnDelayMicros waits (or advances
+// the virtual time) by the given number of microseconds
+//
+typedef struct tagTP_CLOCK
+{
+  unsigned long (*pfnMillis)(void *pUser);
+  unsigned long (*pfnMicros)(void *pUser);
+  void (*pfnDelayMicros)(void *pUser, unsigned long ulMicros);
+  void *pUser;
+} TP_CLOCK;
+//
+// Use a custom clock (NULL = the system clock)
+//
+void tpSetClock(TP_CLOCK *pClock);
+//
+// Limit the size of each write to the printer
+// 0 = use the default of 180 bytes (TP_PRINTER_PACKET); e.g. 20 for a
+// printer which corrupts larger writes
+// The MTU negotiated on connection also limits the size (MTU-3)
+//
+void tpSetMaxPacketSize(int iSize);
+//
+// Returns the size of each write sent to the printer
+// (valid once connected)
+//
+int tpGetPacketSize(void);
+//
+// Pacing of the data sent to the printer
+// The library sends data just fast enough to keep the printer's
+// input buffer fed without overflowing it. Each printer model has
+// default values; a rate of 0 means unlimited
+//
+typedef struct tagTP_PACING
+{
+  int iBytesPerSec;  // how fast the printer accepts data
+  int iLinesPerSec;  // how fast the print head prints scanlines
+  int iBufferBytes;  // size of the printer's input buffer
+} TP_PACING;
+//
+// Set the pacing values
+// Pass NULL to use the defaults for the connected printer model
+//
+void tpSetPacing(const TP_PACING *pPacing);
+//
+// Get the current pacing values
+//
+void tpGetPacing(TP_PACING *pPacing);
+//
+// Send any data waiting in the library's write buffer and
+// flush the transport (waits for outstanding acknowledgements)
+//
+void tpFlush(void);
+//
+// Small writes are packed together into full sized packets.
+// By default each printing function (tpPrint, tpAlign, tpFeed...)
+// sends its data before returning. Pass 0 to let consecutive
+// calls share packets; the data then goes out when a packet is full
+// or when you call tpFlush()
+//
+void tpSetAutoFlush(int bAuto);
+//
+// Pass data received from the printer (e.g. BLE notifications)
+// to the library
+//
+void tpNotify(uint8_t *pData, int iLen);
+//
+// Returns true while the printer has asked us to stop sending (XOff)
+// Cat printers send XOff/XOn notifications; once they do, the data
+// is streamed at the speed the printer asks for instead of being paced
+//
+int tpIsPaused(void);
+//
+// Status query flow control for ESC/POS printers (MTP-2/3, PeriPage, Fomemo)
+// Graphics are sent in bands of iBandLines scanlines (each with its own
+// header) and after each band the printer is asked for its status (GS r 1).
+// The next band waits until the printer has consumed the one before it.
+// If the printer doesn't answer, the normal pacing is used instead
+// iBandLines = 0 disables it (the default)
+//
+void tpSetStatusFlowControl(int iBandLines);
+//
+// Without status flow control, send the graphics in bands of at most
+// iLines scanlines, each with its own header (0 = one header per image).
+// A cancelled job has to finish its band, so short bands free the
+// printer sooner; the default is TP_RESUME_BAND
+//
+#ifndef TP_RESUME_BAND
+#define TP_RESUME_BAND 32 // scanlines per band by default and when a job can be resumed or preempted
+#endif
+void tpSetRasterBand(int iLines);
+//
+// Returns the last status byte received from the printer or -1
+//
+int tpGetStatus(void);
+//
+// Acknowledge iCount writes (transports with TP_TRANSPORT_ASYNC_ACK)
+// safe to call from another thread or a callback
+//
+void tpWriteAck(int iCount);
+//
+// Print job queue
+// Jobs are queued and the call returns right away; a background task
+// (FreeRTOS on ESP32, a thread on Linux) sends them to the printer in
+// order. The memory is fixed: up to TP_MAX_JOBS jobs can wait at once.
+// A waiting job with a higher priority goes before the others. A low
+// priority bitmap or text job is sent in bands of at most TP_RESUME_BAND
+// lines and gives way at the end of a band: the raster is closed, the
+// new job is printed and the rest follows with a new header (even when
+// tpSetRasterBand() asks for larger bands or one header per image).
+// Bitmaps and raw data are not copied; keep them unchanged until the
+// job's callback runs (e.g. render the next receipt into a second buffer).
+// Text is copied (up to TP_MAX_JOB_TEXT-1 characters).
+// While the queue is in use, send everything to the printer through it.
+//
+#ifndef TP_MAX_JOBS
+#define TP_MAX_JOBS 8
+#endif
+#ifndef TP_MAX_JOB_TEXT
+#define TP_MAX_JOB_TEXT 64
+#endif
+#ifndef TP_QUEUE_STACK
+#define TP_QUEUE_STACK 4096
+#endif
+enum {
+  TP_PRIORITY_LOW = -1, // e.g. photos and long logs
+  TP_PRIORITY_NORMAL = 0,
+  TP_PRIORITY_HIGH = 1  // e.g. tickets and receipts someone is waiting for
+};
+//
+// Called from the queue task when a job has been sent
+// iResult = 0 for success, -1 if the printer wasn't connected
+// or the queue was stopped before sending it
+//
+typedef void (TP_JOB_CALLBACK)(int iJob, int iResult, void *pUser);
+//
+// Start/stop the background task
+// tpStartQueue returns 0 if the board has no threads; call
+// tpServiceQueue() from loop() instead. Stopping the queue
+// finishes the current job and fails the rest
+//
+int tpStartQueue(void);
+void tpStopQueue(void);
+//
+// Queue a bitmap (same layout as the back buffer), a line of
+// custom font text, a paper feed or raw printer data
+// pfnDone can be NULL; iPriority is one of TP_PRIORITY_xxx
+// returns the job ID or -1 if the queue is full or the job is invalid
+// (e.g. a feed outside of 0-255 scanlines)
+//
+int tpQueueBuffer(uint8_t *pBuffer, int iWidth, int iHeight, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority = TP_PRIORITY_NORMAL);
+int tpQueueCustomText(GFXfont *pFont, int x, const char *szMsg, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority = TP_PRIORITY_NORMAL);
+int tpQueueFeed(int iLines, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority = TP_PRIORITY_NORMAL);
+int tpQueueData(uint8_t *pData, int iLen, TP_JOB_CALLBACK *pfnDone, void *pUser, int iPriority = TP_PRIORITY_NORMAL);
+//
+// Returns how many times a job stopped at a band to let one with a
+// higher priority go first
+//
+int tpGetPreemptCount(void);
+//
+// Returns the number of jobs which haven't finished (including the one being sent)
+//
+int tpGetQueueDepth(void);
+//
+// Send the next queued job when there is no background task
+// returns 1 if a job was sent, 0 if the queue was empty
+//
+int tpServiceQueue(void);
+//
+// Wait up to iTimeout milliseconds (-1 = forever) for the queue to empty
+// returns 1 if it's empty
+//
+int tpWaitQueue(int iTimeout);
+//
+// Transmit ring (ESP32 and Linux)
+// The encoded printer data goes into a lock-free ring and a separate
+// task (on the other core on ESP32) packetizes and sends it, so the
+// encoding of the next scanlines overlaps the time spent on the radio.
+// The buffer is supplied by the caller; its size must be a power of 2
+// and at least 512 bytes. Returns 1 if successful, 0 if not
+// supported on this board or the parameters are invalid
+//
+typedef struct tagTP_RING_STATS
+{
+  int iSize;        // ring size in bytes
+  int iHighWater;   // most bytes waiting in the ring at once
+  int iFullStalls;  // times the encoder had to wait for room
+  int iEmptyStalls; // times the transmitter ran out of data to send
+} TP_RING_STATS;
+int tpStartRing(uint8_t *pBuffer, int iSize);
+//
+// Send what's left in the ring and go back to sending directly
+//
+void tpStopRing(void);
+//
+// Get (and optionally reset) the ring counters
+//
+void tpGetRingStats(TP_RING_STATS *pStats, int bReset);
 //
 // Return the printer width in pixels
 // The printer needs to be connected to get this info
@@ -125,6 +368,21 @@ int tpPrintCustomText(GFXfont *pFont, int x, char *szMsg);
 // Send raw data to printer
 //
 void tpWriteRawData(uint8_t *pData, int iLen);
+//
+// Record the data sent to the printer (e.g. for reprints)
+// Everything sent between Begin and End is kept in pBuffer along with
+// where it was paced, behind a header with the printer type and width.
+// End returns the length of the recording, or -1 if it didn't fit
+//
+int tpRecordBegin(uint8_t *pBuffer, int iSize);
+int tpRecordEnd(void);
+//
+// Send a recording to the printer again, paced like the original
+// (nothing is rendered or encoded)
+// returns 1 if successful, 0 if it was made for a different printer
+// type, is damaged or the printer isn't connected
+//
+int tpReplay(uint8_t *pData, int iLen);
 
 // Select one of 2 available text fonts along with attributes
 // FONT_12x24 or FONT_9x17
@@ -162,14 +420,27 @@ int tpPrintLine(char *pString);
 
 #define MODE_WITH_RESPONSE 1
 #define MODE_WITHOUT_RESPONSE 0
+#define MODE_WINDOWED 2
 //
 // Set the BLE write mode
 // MODE_WITH_RESPONSE asks the receiver to ack each packet
 // it will be slower, but might be necessary to successfully transmit
 // every packet. The default is to wait for a response for each write
+// MODE_WINDOWED keeps several acknowledged writes in flight and
+// only waits when the window is full (see tpSetWriteWindow)
 //
 void tpSetWriteMode(uint8_t bWriteMode);
 //
+// Set/get the number of acknowledged writes allowed
+// in flight at once in MODE_WINDOWED (default 4)
+//
+void tpSetWriteWindow(int iWindow);
+int tpGetWriteWindow(void);
+//
+// Returns the number of writes waiting to be acknowledged
+//
+int tpGetInFlight(void);
+//
 // Draw text into the graphics buffer
 //
 int tpDrawText(int x, int y, char *pString, int iFontSize, int bInvert);
@@ -198,6 +469,62 @@ void tpPrintBuffer(void);
 //
 void tpPrintBufferSide(void);
 //
+// Print a raster without a back buffer: the rows come straight from the
+// caller's memory, (iWidth+7)/8 bytes each, MSB = leftmost pixel, 1 = black.
+// Begin with the size, send the rows in as many tpRasterLines() calls as
+// needed (each waits on the printer like tpPrintBuffer), then End; rows
+// which weren't sent are printed blank.
+// Begin returns 1 if successful, 0 if not connected, a job is in progress
+// or the raster is wider than the printer; Lines returns 0 if the link dropped
+// or the raster was cancelled (tpCancel)
+//
+int tpRasterBegin(int iWidth, int iHeight);
+int tpRasterLines(uint8_t *pRows, int iCount);
+void tpRasterEnd(void);
+//
+// Step-wise printing for single threaded programs (e.g. loop())
+// Begin a job, then call tpPrintStep() regularly until it returns 1.
+// Each call sends as many scanlines as the printer can take within
+// the time budget (in microseconds) and returns instead of waiting.
+// The buffer or string must stay unchanged until the job is done.
+// The Begin functions return 1 if successful, 0 if not connected
+// or a job is already in progress
+//
+int tpPrintBegin(void); // the back buffer
+int tpPrintBegin(GFXfont *pFont, int x, char *szMsg); // a line of custom font text
+int tpPrintBeginFeed(int iLines); // paper feed
+int tpPrintStep(long lBudget);
+int tpPrintIsDone(void);
+//
+// Cancel the job being printed (from another thread, a signal handler or
+// between steps). It stops at the next scanline and leaves the printer
+// ready for the next job: the rest of the current band is sent blank
+// (ESC/POS) or the image is ended and text mode restored (cat printers).
+// Returns 1 if a job was in progress; tpGetCancelCount() counts the jobs
+// which were cut short
+//
+int tpCancel(void);
+int tpGetCancelCount(void);
+//
+// Reconnect automatically if the link drops in the middle of a job
+// (tpPrintBuffer, tpPrintCustomText, tpFeed, queued and step-wise jobs).
+// The printer address saved by tpScan/tpConnect is used. The job
+// continues from the start of the band which was being sent, with a
+// new graphics header for the remaining height, so at most one band
+// (TP_RESUME_BAND or the status band) is printed twice. A printer which
+// was in the middle of a band gets blank rows to finish it first.
+// While reconnecting is on, every bitmap and text job is sent in bands.
+// iRetries = connection attempts before giving up (0 = off, the default)
+//
+#ifndef TP_RECONNECT_DELAY
+#define TP_RECONNECT_DELAY 500 // ms between connection attempts
+#endif
+void tpSetAutoReconnect(int iRetries);
+//
+// Returns the number of times a job was resumed after the link dropped
+//
+int tpGetResumeCount(void);
+//
 // Draw a line between 2 points
 //
 void tpDrawLine(int x1, int y1, int x2, int y2, uint8_t ucColor);
@@ -245,4 +572,170 @@ int tpScan(void);
 int tpConnect(void);
 void tpDisconnect(void);
 int tpIsConnected(void);
+//
+// Printer identity
+// Scanning takes seconds; a printer which has been found once can be
+// reached straight from its identity (e.g. kept in flash or NVS between
+// power cycles). The record is 30 plain bytes, so it can be
+// stored and read back as is on any board. It holds the printer type,
+// name and BLE address (and whether it's a random one). The Arduino BLE
+// libraries only give access to a characteristic they have discovered
+// themselves, so the one service of the model is still looked up by
+// UUID once connected; that takes a fraction of a second.
+// ArduinoBLE can't connect to a device it hasn't seen, so it scans for
+// that one address, which ends as soon as the printer advertises.
+// With a custom transport the identity just sets the printer model.
+//
+#define TP_IDENTITY_VERSION 2
+#ifndef TP_IDENTITY_WAIT
+#define TP_IDENTITY_WAIT 3000 // ms to wait for the printer to advertise (ArduinoBLE)
+#endif
+enum {
+  TP_IDENTITY_ADDRESS = 1, // ucAddress is valid
+  TP_IDENTITY_RANDOM = 2   // it's a random (static) address
+};
+typedef struct tagTP_IDENTITY
+{
+  uint8_t ucVersion;  // TP_IDENTITY_VERSION
+  uint8_t ucType;     // PRINTER_xxx
+  uint8_t ucFlags;    // TP_IDENTITY_xxx
+  uint8_t ucCheck;    // checksum of the record
+  uint8_t ucAddress[6]; // most significant byte first (as written "aa:bb:...")
+  char szName[20];    // the BLE name
+} TP_IDENTITY;
+//
+// Fill in the identity of the printer found by tpScan() or connected
+// returns 1 if there is one, 0 if not
+//
+int tpGetIdentity(TP_IDENTITY *pID);
+//
+// Connect to a printer from its identity without scanning
+// returns 1 if successful, 0 for failure (a damaged or old record, or
+// the printer can't be reached; scan for it instead)
+//
+int tpConnectIdentity(const TP_IDENTITY *pID);
+//
+// Discovery
+// tpScanAll() listens for the whole time budget and collects every
+// supported printer it hears (address, name, type and the strongest
+// RSSI), ranked so that the nearest one comes first. It can stop early
+// when a printer on a list of known addresses is heard.
+// The advertisements come from a discovery backend: the board's BLE
+// stack by default, or one supplied with tpSetDiscovery() (e.g. a
+// simulated room full of devices to test the matching and ranking).
+//
+#ifndef TP_ADVERT_QUEUE
+#define TP_ADVERT_QUEUE 16 // advertisements the BLE callbacks can hold for tpScanAll
+#endif
+typedef struct tagTP_ADVERT
+{
+  uint8_t ucAddress[6]; // most significant byte first
+  uint8_t bRandom;      // a random (static) address
+  int8_t cRSSI;         // signal strength (dBm)
+  char szName[32];      // the advertised name ("" if none)
+} TP_ADVERT;
+
+typedef struct tagTP_DISCOVERY
+{
+  // start listening; returns 1 if successful
+  int (*pfnStart)(void *pUser);
+  // wait up to iWait ms for the next advertisement
+  // returns 1 if *pAdvert was filled in, 0 if nothing was heard
+  int (*pfnNext)(void *pUser, TP_ADVERT *pAdvert, int iWait);
+  void (*pfnStop)(void *pUser);
+  void *pUser; // passed to each function
+} TP_DISCOVERY;
+//
+// Use a custom discovery backend (NULL = the built-in BLE stack)
+//
+void tpSetDiscovery(TP_DISCOVERY *pDiscovery);
+
+typedef struct tagTP_FOUND
+{
+  uint8_t ucAddress[6]; // most significant byte first
+  uint8_t bRandom;      // a random (static) address
+  uint8_t ucType;       // PRINTER_xxx
+  int8_t cRSSI;         // the strongest signal heard (dBm)
+  uint8_t bListed;      // the address is on the list passed to tpScanAll
+  uint16_t usSeen;      // advertisements heard
+  char szName[32];
+} TP_FOUND;
+//
+// Listen for up to iMillis ms and fill pFound with up to iMax supported
+// printers, known (listed) ones first, then the strongest signal first.
+// If more are heard, the weakest are left out. pList holds iListed
+// addresses (6 bytes each, e.g. from TP_IDENTITY); hearing one of them
+// ends the scan (pList can be NULL)
+// returns the number of printers found
+//
+int tpScanAll(TP_FOUND *pFound, int iMax, int iMillis, const uint8_t *pList, int iListed);
+//
+// Connect to a printer found by tpScanAll()
+// returns 1 if successful, 0 for failure
+//
+int tpConnectFound(const TP_FOUND *pFound);
+//
+// Scan and connection statistics
+// Scanning and connecting don't allocate memory in the library (the
+// ESP32 client and scan callbacks are created once and reused), so the
+// free heap should stay flat however many times a kiosk rescans and
+// reconnects. The heap figures are -1 where the board can't report them.
+//
+typedef struct tagTP_SCAN_STATS
+{
+  int iScans;         // tpScan() and tpScanAll() calls
+  int iConnects;      // connections made (any transport)
+  long lHeapStart;    // free heap after the first scan or connection
+  long lHeapNow;      // free heap after the last one
+  long lHeapLow;      // the least free heap seen after one
+  long lLargestBlock; // the largest free block after the last one
+} TP_SCAN_STATS;
+void tpGetScanStats(TP_SCAN_STATS *pStats);
+//
+// Connecting in the background
+// A BLE connection takes seconds. tpConnectAsync() and tpScanAsync()
+// return right away and connect on a background task (ESP32 and the
+// host build) while the program renders. With a pending buffer
+// (tpSetPendingBuffer), queued jobs are encoded into it meanwhile for
+// the printer model given (e.g. the one in a saved identity), and it is
+// sent as soon as the link is up, ahead of the rest of the queue, so
+// the first line prints without waiting for the rendering. Without
+// one, the jobs wait for the link.
+// The pending data goes out from the queue task, or from
+// tpServiceQueue() on boards without one; the callback is called
+// there afterwards with iResult = 0, or -1 if the printer couldn't be
+// reached (the jobs encoded for it then fail too). The jobs' own
+// callbacks are called once their data has been sent.
+// Use the queue for everything until the callback has been called; the
+// callback itself may start another connection (e.g. to retry).
+//
+#ifndef TP_CONNECT_STACK
+#define TP_CONNECT_STACK 6144 // ESP32 connect task (the BLE stack calls use a lot)
+#endif
+typedef void (TP_CONNECT_CALLBACK)(int iResult, void *pUser);
+//
+// Keep the data encoded while connecting in pBuffer (NULL = don't)
+// The header and pacing marks of a recording (tpRecordBegin) take a
+// few percent; a job which doesn't fit waits for the link
+//
+void tpSetPendingBuffer(uint8_t *pBuffer, int iSize);
+//
+// Connect to the printer from its identity (NULL = reconnect to the
+// last one). With a custom transport its pfnReconnect opens the link.
+// returns 1 if the connection was started, 0 if one is already in
+// progress, the printer is connected or the board has no background task
+//
+int tpConnectAsync(const TP_IDENTITY *pID, TP_CONNECT_CALLBACK *pfnDone, void *pUser);
+//
+// Scan for up to iSeconds for a printer of the given type (PRINTER_xxx)
+// whose name starts with szName ("" = any) and connect to the first one
+// heard (the advertisements come from the discovery backend, see
+// tpSetDiscovery). The jobs are encoded for that type meanwhile
+// returns 1 if the scan was started (see tpConnectAsync)
+//
+int tpScanAsync(const char *szName, int iSeconds, int iPrinterType, TP_CONNECT_CALLBACK *pfnDone, void *pUser);
+//
+// Returns 1 while a background connection hasn't been finished
+//
+int tpIsConnecting(void);
 #endif // __THERMAL_PRINTER_H__